@@ -4,17 +4,95 @@
  * Este archivo implementa un broker TCP simple que permite que clientes se
  * conecten como publishers o subscribers. Los publishers envían mensajes en
  * el formato "topic|message". Los subscribers envían el comando
- * "SUBSCRIBE <topic>" después de conectarse y el broker reenvía los mensajes
- * coincidentes.
+ * "SUBSCRIBE <filtro>" (tantas veces como quieran, por la misma conexión) y
+ * "UNSUBSCRIBE <filtro>", y el broker les reenvía los mensajes coincidentes.
+ * Los topics son jerárquicos ("liga/partido1/goles") y los filtros admiten
+ * los comodines '+' (un nivel) y '#' (el resto de niveles), resueltos con un
+ * árbol de suscripciones (common/topic_trie.h). Cada
+ * comando viaja en una trama con prefijo de longitud (ver common/frame.h),
+ * así que un mismo read() puede traer muchos mensajes.
+ *
+ * El broker puede repartirse en varios hilos (opción -t). Cada hilo es un
+ * "shard" con su propio bucle epoll, su propio socket de escucha (todos
+ * comparten el puerto gracias a SO_REUSEPORT, y el kernel reparte las
+ * conexiones entre ellos) y sus propias conexiones y suscripciones. Cuando un
+ * shard recibe una publicación la entrega a sus suscriptores y la pasa al
+ * resto de shards por colas SPSC sin bloqueos (common/spsc_queue.h).
+ *
+ * Cada publicación se copia una sola vez a un MsgBuf con contador de
+ * referencias (common/msgbuf.h). Las colas de salida de todos los
+ * suscriptores y los demás shards comparten ese mismo buffer, y los envíos
+ * salen directamente de él con send()/writev(), sin más copias.
+ *
+ * Los MsgBuf, las conexiones y las suscripciones salen de pools propios de
+ * cada shard (common/slab.h): en régimen estable publicar, suscribirse o
+ * reconectar no llama a malloc()/free(). Un MsgBuf que suelta por última vez
+ * otro shard vuelve al pool de su dueño. "reservas_heap" en STATS cuenta las
+ * veces que los pools tuvieron que pedir memoria al sistema.
+ *
+ * Con -L cada publicación se añade antes al log de su topic
+ * (TCP/topic_log.h), y "SUBSCRIBE <topic> FROM <offset>" reenvía la historia
+ * guardada con sendfile() antes de pasar a los mensajes en vivo.
+ *
+ * Con -V cada shard recuerda la última publicación de cada topic y un
+ * SUBSCRIBE nuevo recibe en el acto el valor actual de los topics que casan
+ * con su filtro. Un suscriptor que envía "CONFLATE" pasa a recibir sólo lo
+ * más reciente: si su cola todavía guarda una trama de un topic cuando
+ * llega otra del mismo, la nueva ocupa su lugar (TCP/out_queue.h), así que
+ * un lector lento no acumula versiones viejas.
+ *
+ * Con -E uring cada shard usa io_uring (TCP/uring.h) en lugar de epoll: un
+ * accept y un recv "multishot" por conexión que el núcleo mantiene activos,
+ * buffers de recepción proporcionados por un anillo compartido y, al final
+ * de cada lote, un sendmsg por suscriptor con todas sus tramas pendientes.
+ * Todo lo del lote (peticiones nuevas y espera de resultados) cuesta una
+ * sola io_uring_enter(). Si el núcleo no lo admite, se usa epoll.
+ * "llamadas_sistema" en STATS permite comparar ambos motores.
+ *
+ * Con -U los clientes de la misma máquina pueden conectarse por un socket
+ * Unix y, desde ahí, hablar con el broker por dos anillos en memoria
+ * compartida (TCP/shm_ring.h) en lugar de por la pila TCP. Por los anillos
+ * viajan las mismas tramas, así que comparten las suscripciones, el
+ * enrutado y la federación con los clientes TCP; con -B el shard mira los
+ * anillos en bucle un tiempo antes de dormir.
+ *
+ * Los mensajes informativos (conexiones, suscripciones y, con el nivel
+ * debug, cada publicación) no se escriben desde los shards: pasan como
+ * registros binarios por un anillo de cada shard a un hilo que los formatea
+ * y los escribe por lotes (common/async_log.h). Una salida estándar lenta no
+ * frena el reparto; si el anillo se llena se descartan registros y se
+ * cuentan en "log_descartados". El nivel (-v) y el muestreo de las
+ * publicaciones (-n) se cambian en marcha con "LOG <nivel> [N]".
+ *
+ * La lectura es por turnos: cada conexión procesa como mucho -b KB por
+ * vuelta del bucle y, si le queda entrada, espera en un turno rotatorio a
+ * que las demás tengan el suyo, así que un publicador que inunda el broker
+ * no retrasa a los que publican poco. Con -l (por publicador) y -T (por
+ * topic) un cubo de tokens (TCP/rate_limit.h) limita además el ritmo: quien
+ * lo supera deja de leerse hasta que el cubo se rellena y el control de
+ * flujo de TCP lo frena, sin descartar nada. "lecturas_aplazadas" y
+ * "pausas_por_ritmo" en STATS cuentan ambas cosas. Los límites de ritmo no
+ * se aplican a los clientes locales (-U) ni a los peers de la federación.
  *
  * Encabezados no estándar usados y su papel (detalles abajo):
- * - <arpa/inet.h>  : funciones para conversión de direcciones IP
- *                    (inet_pton) y la estructura sockaddr_in usada para
- *                    especificar direcciones IPv4.
- * - <sys/socket.h> : API de sockets (socket, bind, listen, accept, send, recv).
- * - <sys/select.h> : select() y macros fd_set para multiplexar E/S entre sockets.
- * - <unistd.h>     : close(), read(), write() y llamadas POSIX varias.
- * - <errno.h>      : constantes errno usadas en el manejo de errores de select().
+ * - <arpa/inet.h>     : funciones para conversión de direcciones IP
+ *                       (inet_pton) y la estructura sockaddr_in usada para
+ *                       especificar direcciones IPv4.
+ * - <sys/socket.h>    : API de sockets (socket, bind, listen, accept, send, recv).
+ * - <sys/epoll.h>     : epoll_create1(), epoll_ctl() y epoll_wait() para
+ *                       multiplexar E/S sin el límite de FD_SETSIZE.
+ * - <sys/eventfd.h>   : eventfd() para despertar a un shard cuando otro le
+ *                       deja mensajes en su cola.
+ * - <pthread.h>       : un hilo por shard (compilar con -pthread).
+ * - <sys/resource.h>  : setrlimit() para subir el límite de descriptores.
+ * - <fcntl.h>         : fcntl() para poner los sockets en modo no bloqueante.
+ * - <sys/signalfd.h>  : signalfd() para atender SIGUSR1 dentro del bucle epoll.
+ * - <sys/timerfd.h>   : timerfd_create() para el barrido periódico de la
+ *                       retención por antigüedad del log (-A).
+ * - <poll.h>          : POLLIN/POLLOUT para las esperas de io_uring.
+ * - <sys/un.h>        : sockaddr_un del socket Unix de los clientes locales (-U).
+ * - <unistd.h>        : close(), read(), write() y llamadas POSIX varias.
+ * - <errno.h>         : constantes errno (EAGAIN, EINTR) usadas en el bucle.
  *
  * Contrato (entradas/salidas):
  * - Entradas: conexiones TCP de publishers y subscribers en PORT.
@@ -30,177 +108,2890 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <poll.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+
+#include "../common/async_log.h"
+#include "../common/frame.h"
+#include "../common/msgbuf.h"
+#include "../common/spsc_queue.h"
+#include "../common/stats.h"
+#include "../common/topic_trie.h"
+#include "federation.h"
+#include "out_queue.h"
+#include "rate_limit.h"
+#include "shm_ring.h"
+#include "topic_log.h"
+#include "uring.h"
 
 #define PORT 8080
-#define MAX_CLIENTS 20
-#define BUFFER_SIZE 1024
+#define MAX_EVENTS 256       /* eventos procesados por cada epoll_wait() */
+#define INITIAL_CAPACITY 64  /* capacidad inicial de las tablas dinámicas */
+#define READ_CHUNK 65536     /* bytes pedidos en cada read() */
+#define DEFAULT_READ_BUDGET (64 * 1024) /* bytes de entrada por conexión y vuelta del bucle (-b) */
+#define DEFAULT_QUEUE_LIMIT 1024 /* tramas pendientes por suscriptor */
+#define MAX_SHARDS 64
+#define LINK_CAPACITY 4096   /* mensajes en vuelo entre cada par de shards */
+#define STATS_REPLY_MAX (256 * 1024) /* bytes como máximo de la respuesta a STATS */
+#define REPLAY_CHUNK (256 * 1024)    /* bytes del log por cada sendfile() de reenvío */
+#define URING_ENTRIES 4096   /* peticiones por io_uring_enter() (-E uring) */
+#define URING_BUF_COUNT 64   /* buffers de recepción: acotan lo leído en cada vuelta */
+#define URING_BUF_SIZE 16384 /* bytes de cada buffer de recepción */
+#define URING_SEND_IOV 256   /* tramas por cada sendmsg */
+#define URING_BUF_GROUP 0
+#define URING_IN_BACKLOG (256 * 1024) /* entrada aplazada de una conexión antes de parar su recv */
+#define FED_TICK_MS 250      /* conexiones pendientes con peers y SYNC (federación) */
+#define FED_RETRY_MS 1000    /* espera antes de reconectar con un peer de -P */
+#define FED_QUEUE_LIMIT 65536 /* tramas pendientes hacia un peer antes de cortar el enlace */
+#define SHM_RING_SIZE (1u << 20) /* bytes de cada anillo de un cliente local (-U) */
+#define CONFLATE_SNDBUF (32 * 1024) /* buffer de envío de un suscriptor con CONFLATE */
+
+typedef struct Connection Connection;
 
 /*
- * Estructura Subscriber
- * - socket: descriptor de fichero del cliente TCP conectado (suscriptor).
- * - topic:  cadena terminada en nulo que identifica el topic al que el cliente
- *          se suscribió.
- *
- * Nota: Esta implementación asume una suscripción por conexión.
+ * Estructura Subscription
+ * - Una suscripción de una conexión a un filtro. Está enlazada a la vez en
+ *   dos listas intrusivas: la del nodo del árbol donde termina el filtro
+ *   (ver common/topic_trie.h), que se recorre al publicar, y la de su
+ *   conexión, que se recorre al darse de baja o desconectarse. Así cerrar
+ *   una conexión cuesta lo mismo que sus propias suscripciones, sin tocar
+ *   las de nadie más.
+ */
+typedef struct Subscription {
+    TrieSub link;                    /* enlace en el nodo; debe ir primero */
+    Connection *conn;
+    struct Subscription *conn_prev;  /* lista de suscripciones de la conexión */
+    struct Subscription *conn_next;
+
+    /* Sólo en "SUBSCRIBE <topic> FROM <offset>" (ver replay_pump()) */
+    TopicLog *log;
+    uint64_t replay_next;            /* siguiente offset a reenviar desde el log */
+    uint64_t replay_end;             /* los mensajes en vivo anteriores ya se reenviaron */
+    MsgBuf *replay_chunk;            /* tramo del log en la cola de salida */
+    int replaying;                   /* todavía poniéndose al día */
+} Subscription;
+
+/*
+ * Estructura Connection
+ * - fd: descriptor del cliente. La tabla de conexiones se indexa por fd, de
+ *       modo que encontrar la conexión de un evento de epoll es O(1).
+ * - in: bytes de una trama que llegó incompleta y espera al siguiente read().
+ * - out: tramas que el socket todavía no aceptó (ver out_queue.h).
+ * - subs: suscripciones de la conexión (ver Subscription).
+ * - closing: la conexión se cerrará al terminar el lote de eventos actual;
+ *            mientras tanto no se lee ni se escribe en ella.
+ * - gen: número de la conexión en el shard. Con io_uring los resultados
+ *        llevan fd y gen, así que los que llegan de una conexión ya cerrada
+ *        (aunque su fd se haya reutilizado) se reconocen y se ignoran.
+ */
+struct Connection {
+    int fd;
+    int closing;
+    uint32_t gen;
+    int send_listed;    /* en Shard.send_list, a la espera del envío del lote (io_uring) */
+    int sending;        /* con un sendmsg de io_uring en curso */
+    int poll_out;       /* esperando a que el socket acepte datos (io_uring) */
+    FrameBuffer in;
+    OutQueue out;
+    uint64_t delivered; /* tramas entregadas al socket */
+    uint64_t last_publish; /* última publicación entregada (ver Shard.publish_seq) */
+    Subscription *subs;
+    size_t sub_count;
+    size_t replays;     /* suscripciones que todavía se reenvían desde el log */
+    int conflate;       /* pidió CONFLATE: en su cola, una trama nueva sustituye a la de su topic */
+    size_t budget;      /* bytes de entrada que aún puede procesar en esta vuelta (ver conn_turn()) */
+    uint64_t turn;      /* vuelta del shard en la que se repuso 'budget' */
+    int readable;       /* epoll: puede quedar algo en el socket, se dejó de leer antes de EAGAIN */
+    int recv;           /* io_uring: RECV_ARMED, RECV_CANCELLING o RECV_STOPPED */
+    int eof;            /* io_uring: el cliente cerró con entrada aplazada; se cierra al procesarla */
+    int sched;          /* lista del shard en la que está: SCHED_NONE, SCHED_READY o SCHED_PAUSED */
+    Connection *sched_prev, *sched_next;
+    uint64_t tat;       /* cubo de tokens del publicador (-l, ver TCP/rate_limit.h) */
+    uint64_t resume_ns; /* pausada por -l/-T: no se lee nada suyo hasta este instante; 0 si no */
+    FedPeer *peer;      /* otro broker de la federación (ver TCP/federation.h), NULL si es un cliente */
+    ShmLink *shm;       /* cliente local por memoria compartida (-U), NULL si no */
+};
+
+/*
+ * ShardLink
+ * - Canal de un shard origen hacia un shard destino. Transporta referencias
+ *   a MsgBuf: el destino entrega el mensaje y suelta su referencia. Si la
+ *   cola SPSC está
+ *   llena, el origen guarda los mensajes en 'backlog' (memoria propia, sin
+ *   compartir) y los reintenta en la siguiente vuelta del bucle; así el
+ *   productor nunca espera al consumidor y se conserva el orden.
+ */
+typedef struct {
+    SpscQueue queue;
+    MsgBuf **backlog;
+    size_t backlog_head;
+    size_t backlog_count;
+    size_t backlog_capacity;
+    int wake; /* hay que despertar al destino al acabar el lote */
+} ShardLink;
+
+/*
+ * Shard
+ * - Todo el estado de un hilo del broker. Ningún otro hilo lo modifica: la
+ *   única comunicación entre shards son los ShardLink y el eventfd.
+ */
+typedef struct {
+    int id;
+    pthread_t thread;
+    int epoll_fd;
+    int listen_fd;
+    int event_fd;            /* lo escriben otros shards para despertar a éste */
+    int signal_fd;           /* sólo el shard 0; -1 en el resto */
+    int timer_fd;            /* sólo el shard 0 con -A o federación: tareas periódicas; -1 si no */
+    int peer_fd;             /* sólo el shard 0 con -F: escucha de otros brokers; -1 si no */
+    atomic_int dump_requested;
+
+    TopicTrie topics;        // árbol de filtros, cada nodo con su lista de suscriptores
+    size_t sub_count;        // número de suscripciones activas
+    uint64_t publish_seq;    // número de la publicación en curso, para no entregar dos veces
+
+    Connection **connections; // tabla de conexiones indexada por descriptor
+    size_t conn_capacity;     // longitud de 'connections'
+    size_t conn_count;        // conexiones abiertas
+
+    int *pending_close;      // conexiones marcadas para cerrar en este lote
+    size_t pending_close_count;
+    size_t pending_close_capacity;
+
+    uint64_t rx_ns;          // instante del último read(), marca de los mensajes leídos
+    uint64_t turn;           // vueltas del bucle, para reponer el presupuesto de lectura (-b)
+    Connection *ready_head;  // conexiones con entrada pendiente, por turno rotatorio
+    Connection *ready_tail;
+    Connection *paused;      // conexiones pausadas por -l/-T, sin orden
+    BrokerStats stats;       // contadores de este shard (sólo los escribe él)
+    TopicTable log_cache;    // topic -> TopicLog ya resueltos por este shard
+    TopicTable last_values;  // topic -> última publicación vista por este shard (-V)
+    TopicTable rate_cache;   // topic -> cubo de -T ya resuelto por este shard
+
+    MsgPool msgs;            // MsgBuf de las publicaciones leídas por este shard
+    SlabPool conn_pool;      // Connection de este shard
+    SlabPool sub_pool;       // Subscription de este shard
+
+    /* Sólo con el motor io_uring (ver shard_run_uring()) */
+    int uring;               // este shard usa io_uring en lugar de epoll
+    Uring ring;
+    UringBufRing bufs;       // buffers de recepción del recv multishot
+    SlabPool send_pool;      // UringSend en curso
+    Connection **send_list;  // conexiones con tramas por enviar al final del lote
+    size_t send_count;
+    size_t send_capacity;
+    uint32_t next_gen;       // siguiente Connection.gen
+
+    /* Clientes locales por memoria compartida (-U, ver shm_receive()) */
+    Connection **shm_conns;
+    size_t shm_count;
+    size_t shm_capacity;
+    uint64_t shm_active_ns;  // última vez que un anillo trajo algo, para la espera activa (-B)
+} Shard;
+
+/*
+ * Tipos de petición de io_uring, en los 4 bits bajos de user_data. El resto
+ * lleva el fd y el gen de la conexión (recv, espera de escritura y espera
+ * del eventfd de un cliente local), el fd auxiliar (sockets de escucha y
+ * esperas de eventfd, signalfd y timerfd) o la dirección del UringSend, que
+ * como todo objeto de un SlabPool está alineada a 16.
+ */
+enum { URING_ACCEPT = 1, URING_RECV, URING_SEND, URING_POLL, URING_POLL_OUT, URING_SHM, URING_CANCEL };
+
+/* Estado del recv multishot de una conexión, que se cancela mientras no se debe leer */
+enum { RECV_ARMED, RECV_CANCELLING, RECV_STOPPED };
+
+/* Listas de planificación de la lectura (ver sched_input()) */
+enum { SCHED_NONE, SCHED_READY, SCHED_PAUSED };
+
+/*
+ * UringSend
+ * - Un sendmsg en curso. Se lleva de la cola de salida las tramas que envía
+ *   con sus referencias: si la conexión se cierra antes de que termine, el
+ *   núcleo sigue leyendo de memoria válida, y la cola puede descartar sin
+ *   preocuparse de lo que está en vuelo. Tras un envío parcial se vuelve a
+ *   pedir desde 'first'.
  */
 typedef struct {
-    int socket;
-    char topic[50];
-} Subscriber;
+    int fd;
+    uint32_t gen;
+    int count;
+    int first;               /* primera entrada de 'iov' no enviada entera */
+    struct msghdr hdr;
+    struct iovec iov[URING_SEND_IOV];
+    MsgBuf *msgs[URING_SEND_IOV];
+} UringSend;
+
+/* Configuración (opciones de línea de comandos, sólo lectura tras arrancar) */
+int port = PORT;
+int shard_count = 1;
+size_t queue_limit = DEFAULT_QUEUE_LIMIT;
+OverflowPolicy overflow_policy = OVERFLOW_DROP_OLDEST;
+int use_uring = 0; // -E uring
+int last_value_cache = 0; // -V
+int peer_port = 0; // -F, 0 si no se aceptan peers
+const char *shm_path = NULL; // -U, socket Unix de los clientes locales
+int shm_listen_fd = -1;
+uint64_t busy_poll_ns = 0; // -B
+size_t read_budget = DEFAULT_READ_BUDGET; // -b, SIZE_MAX: sin límite
+RateLimit publisher_limit; // -l, por conexión
+RateLimit topic_limit;     // -T, por topic
+
+Shard shards[MAX_SHARDS];
+ShardLink *links = NULL; // links[origen * shard_count + destino]
+StatsTopicTable stats_topics; // nombres de topic de las estadísticas, común a todos los shards
+LogStore log_store = { .segment_size = LOG_DEFAULT_SEGMENT }; // logs por topic (-L), dir NULL si no hay
+Federation federation; // peers, interés y rutas (-F/-P); salvo el buzón, sólo lo toca el shard 0
+RateTable topic_buckets; // cubo de cada topic (-T), común a todos los shards
+AsyncLog event_log;    // mensajes informativos, un anillo por shard (-v/-n)
+
+/* Eventos del registro (AlogRecord.event) y su texto, ver format_event() */
+enum { EV_CONNECTED, EV_SHM_CONNECTED, EV_SUBSCRIBED, EV_UNSUBSCRIBED, EV_PUBLISHED, EV_PEER_UP, EV_PEER_DOWN,
+       EV_LOG_LEVEL };
+
+/*
+ * format_event
+ * - Convierte un registro de event_log en su línea, con el mismo texto que
+ *   el broker escribía antes con printf. Lo llama el hilo del registro, no
+ *   los shards. Una cadena recortada termina en "...".
+ */
+size_t format_event(char *out, size_t cap, const AlogRecord *rec) {
+    int n0 = rec->len[0], n1 = rec->len[1];
+    const char *s0 = alog_str(rec, 0), *s1 = alog_str(rec, 1);
+    const char *more = rec->truncated ? "..." : "";
+    int n = 0;
+    switch (rec->event) {
+    case EV_CONNECTED:
+        n = snprintf(out, cap, "Nueva conexión establecida.");
+        break;
+    case EV_SHM_CONNECTED:
+        n = snprintf(out, cap, "Nuevo cliente local por memoria compartida.");
+        break;
+    case EV_SUBSCRIBED:
+        n = snprintf(out, cap, "Nuevo suscriptor del tema: %.*s%s", n0, s0, more);
+        break;
+    case EV_UNSUBSCRIBED:
+        n = snprintf(out, cap, "Suscripción cancelada del tema: %.*s%s", n0, s0, more);
+        break;
+    case EV_PUBLISHED:
+        n = snprintf(out, cap, "Mensaje recibido del tema '%.*s': %.*s%s", n0, s0, n1, s1, more);
+        break;
+    case EV_PEER_UP:
+        n = snprintf(out, cap, "Federación: conectado con el broker %016llx", (unsigned long long)rec->num[0]);
+        break;
+    case EV_PEER_DOWN:
+        n = snprintf(out, cap, "Federación: perdida la conexión con el broker %016llx",
+                     (unsigned long long)rec->num[0]);
+        break;
+    case EV_LOG_LEVEL:
+        n = snprintf(out, cap, "Registro: nivel %s, una de cada %llu publicaciones", alog_level_name((int)rec->num[0]),
+                     (unsigned long long)rec->num[1]);
+        break;
+    }
+    return n < 0 ? 0 : (size_t)n < cap ? (size_t)n : cap - 1;
+}
+
+static inline ShardLink *shard_link(int from, int to) {
+    return &links[from * shard_count + to];
+}
+
+/*
+ * grow_array
+ * - Duplica la capacidad de un arreglo dinámico hasta que quepa 'needed'
+ *   elementos. Los elementos nuevos quedan a cero. Termina el programa si
+ *   no hay memoria, igual que los demás errores fatales del broker.
+ */
+void *grow_array(void *array, size_t *capacity, size_t needed, size_t elem_size) {
+    size_t new_capacity = *capacity ? *capacity : INITIAL_CAPACITY;
+    while (new_capacity < needed)
+        new_capacity *= 2;
+    if (new_capacity == *capacity)
+        return array;
+
+    void *grown = realloc(array, new_capacity * elem_size);
+    if (!grown) {
+        perror("Error reservando memoria");
+        exit(EXIT_FAILURE);
+    }
+    memset((char *)grown + *capacity * elem_size, 0, (new_capacity - *capacity) * elem_size);
+    *capacity = new_capacity;
+    return grown;
+}
 
-/* Estado global */
-Subscriber subscribers[MAX_CLIENTS]; // arreglo que contiene los registros de suscriptores
-int sub_count = 0;                   // número de suscriptores activos
+/* find_subscription: suscripción de 'conn' en el nodo 'node', o NULL */
+Subscription *find_subscription(Connection *conn, TrieNode *node) {
+    for (Subscription *sub = conn->subs; sub; sub = sub->conn_next) {
+        if (sub->link.node == node)
+            return sub;
+    }
+    return NULL;
+}
+
+/*
+ * fed_interest_changed
+ * - Con federación, el primer suscriptor de un filtro en el shard y el
+ *   último se notifican al shard 0, que lleva el interés del broker entero
+ *   y lo anuncia a los peers (ver fed_apply_local()).
+ */
+void fed_interest_changed(TrieNode *node, int delta) {
+    if (!federation.enabled)
+        return;
+    size_t len = trie_node_filter(node, NULL, 0);
+    char *filter = topic_alloc(NULL, len + 1);
+    trie_node_filter(node, filter, len + 1);
+    fed_post(&federation, filter, len, delta);
+    uint64_t one = 1;
+    if (write(shards[0].event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        perror("Error en write(eventfd)");
+}
 
 /*
  * add_subscriber
- * - Registra un socket como suscriptor de un topic.
- * - Copia la cadena del topic y guarda el FD del socket. No se realizan
- *   comprobaciones de unicidad más allá de la capacidad.
+ * - Suscribe una conexión a un filtro. Los niveles que falten se crean en
+ *   el árbol del shard (cada uno con su propia copia del nombre) y la
+ *   suscripción se enlaza en el nodo final y en la conexión. Los filtros mal
+ *   formados y las suscripciones repetidas se ignoran (devuelve NULL).
+ */
+Subscription *add_subscriber(Shard *shard, Connection *conn, const char *filter, size_t filter_len) {
+    if (!trie_filter_valid(filter, filter_len)) {
+        fprintf(stderr, "Filtro inválido: %.*s\n", (int)filter_len, filter);
+        return NULL;
+    }
+    TrieNode *node = trie_insert(&shard->topics, filter, filter_len);
+    if (find_subscription(conn, node))
+        return NULL; // ya suscrito
+
+    Subscription *sub = slab_calloc(&shard->sub_pool, sizeof(Subscription));
+    sub->conn = conn;
+    sub->conn_next = conn->subs;
+    if (conn->subs)
+        conn->subs->conn_prev = sub;
+    conn->subs = sub;
+    conn->sub_count++;
+    trie_sub_link(node, &sub->link);
+    if (node->sub_count == 1)
+        fed_interest_changed(node, +1);
+    shard->sub_count++;
+    stat_set(&shard->stats.subs, shard->sub_count);
+    alog_write(&event_log, shard->id, ALOG_INFO, EV_SUBSCRIBED, filter, filter_len, NULL, 0, 0, 0);
+    return sub;
+}
+
+/*
+ * remove_subscription
+ * - Desenlaza una suscripción del árbol (podando los nodos que queden
+ *   vacíos) y de su conexión, y la libera. Es O(1) salvo la poda.
+ */
+void remove_subscription(Shard *shard, Subscription *sub) {
+    Connection *conn = sub->conn;
+    if (sub->replay_chunk)
+        msgbuf_unref(sub->replay_chunk);
+    if (sub->replaying)
+        conn->replays--;
+    if (sub->link.node->sub_count == 1)
+        fed_interest_changed(sub->link.node, -1);
+    trie_sub_unlink(&shard->topics, &sub->link);
+    if (sub->conn_prev)
+        sub->conn_prev->conn_next = sub->conn_next;
+    else
+        conn->subs = sub->conn_next;
+    if (sub->conn_next)
+        sub->conn_next->conn_prev = sub->conn_prev;
+    conn->sub_count--;
+    shard->sub_count--;
+    stat_set(&shard->stats.subs, shard->sub_count);
+    slab_free(&shard->sub_pool, sub);
+}
+
+/*
+ * remove_subscriber
+ * - Atiende "UNSUBSCRIBE <filtro>": busca el nodo del filtro tal cual se
+ *   escribió al suscribirse y quita la suscripción de esta conexión, si la
+ *   había. Sólo se recorren las suscripciones de la propia conexión.
+ */
+void remove_subscriber(Shard *shard, Connection *conn, const char *filter, size_t filter_len) {
+    TrieNode *node = trie_find(&shard->topics, filter, filter_len);
+    Subscription *sub = node ? find_subscription(conn, node) : NULL;
+    if (!sub)
+        return;
+    remove_subscription(shard, sub);
+    alog_write(&event_log, shard->id, ALOG_INFO, EV_UNSUBSCRIBED, filter, filter_len, NULL, 0, 0, 0);
+}
+
+/*
+ * schedule_close
+ * - Marca una conexión para cerrarla al final del lote de eventos. Cerrarla
+ *   en el acto invalidaría punteros que el llamador todavía usa (por
+ *   ejemplo, el publisher que provocó el reenvío a un suscriptor lento).
+ */
+void schedule_close(Shard *shard, Connection *conn) {
+    if (conn->closing)
+        return;
+    conn->closing = 1;
+    shard->pending_close = grow_array(shard->pending_close, &shard->pending_close_capacity,
+                                      shard->pending_close_count + 1, sizeof(int));
+    shard->pending_close[shard->pending_close_count++] = conn->fd;
+}
+
+/*
+ * Planificación de la lectura
+ * Cada conexión procesa como mucho read_budget bytes de entrada por vuelta
+ * del bucle (-b). La que agota su presupuesto antes de vaciar su socket
+ * pasa al final del turno rotatorio (ready_head/ready_tail) y sigue en la
+ * vuelta siguiente, después de las que ya esperaban; un publicador que
+ * inunda el broker no retrasa a los demás más que un presupuesto por
+ * vuelta. El que supera su límite de ritmo (-l/-T) pasa a 'paused' hasta
+ * que su cubo se rellena, sin que se lea nada suyo. Los clientes locales
+ * (-U) no se planifican: cada llamada a shm_receive() ya está acotada.
+ */
+
+/* sched_unlink: saca la conexión de la lista de planificación en la que esté */
+void sched_unlink(Shard *shard, Connection *conn) {
+    if (conn->sched == SCHED_NONE)
+        return;
+    if (conn->sched_prev)
+        conn->sched_prev->sched_next = conn->sched_next;
+    else if (conn->sched == SCHED_READY)
+        shard->ready_head = conn->sched_next;
+    else
+        shard->paused = conn->sched_next;
+    if (conn->sched_next)
+        conn->sched_next->sched_prev = conn->sched_prev;
+    else if (conn->sched == SCHED_READY)
+        shard->ready_tail = conn->sched_prev;
+    conn->sched_prev = conn->sched_next = NULL;
+    conn->sched = SCHED_NONE;
+}
+
+/* sched_move: pasa la conexión a la lista 'sched'; al turno rotatorio se entra por el final */
+void sched_move(Shard *shard, Connection *conn, int sched) {
+    if (conn->sched == sched)
+        return;
+    sched_unlink(shard, conn);
+    conn->sched = sched;
+    if (sched == SCHED_READY) {
+        conn->sched_prev = shard->ready_tail;
+        if (shard->ready_tail)
+            shard->ready_tail->sched_next = conn;
+        else
+            shard->ready_head = conn;
+        shard->ready_tail = conn;
+    } else if (sched == SCHED_PAUSED) {
+        conn->sched_next = shard->paused;
+        if (shard->paused)
+            shard->paused->sched_prev = conn;
+        shard->paused = conn;
+    }
+}
+
+/* conn_turn: en la primera entrada de cada vuelta del shard, la conexión recupera su presupuesto */
+static inline void conn_turn(Shard *shard, Connection *conn) {
+    if (conn->turn != shard->turn) {
+        conn->turn = shard->turn;
+        conn->budget = read_budget;
+    }
+}
+
+/* conn_stalled: la conexión no debe procesar más entrada por ahora */
+static inline int conn_stalled(const Connection *conn) {
+    return !conn->shm && (conn->budget == 0 || conn->resume_ns != 0);
+}
+
+/*
+ * queue_send
+ * - Motor io_uring: apunta la conexión para enviarle sus tramas pendientes
+ *   al final del lote (ver uring_flush_sends()). Así todas las entregas de un
+ *   lote a un mismo suscriptor salen en un solo sendmsg.
+ */
+void queue_send(Shard *shard, Connection *conn) {
+    if (conn->send_listed)
+        return;
+    conn->send_listed = 1;
+    shard->send_list = grow_array(shard->send_list, &shard->send_capacity, shard->send_count + 1,
+                                  sizeof(Connection *));
+    shard->send_list[shard->send_count++] = conn;
+}
+
+/*
+ * flush_sync
+ * - Escribe en el acto lo que acepte el socket (ver out_queue_flush()).
+ *   Devuelve -1 si hay que cerrar la conexión.
+ */
+int flush_sync(Shard *shard, Connection *conn) {
+    uint64_t before = conn->out.count, calls = conn->out.syscalls;
+    int r = out_queue_flush(&conn->out, conn->fd);
+    conn->delivered += before - conn->out.count;
+    stat_add(&shard->stats.syscalls, conn->out.syscalls - calls);
+    return r;
+}
+
+/* shm_wake_client: despierta a un cliente local si duerme esperando datos */
+void shm_wake_client(Shard *shard, Connection *conn) {
+    if (shm_should_wake(&conn->shm->out.ring->want_data)) {
+        shm_signal(conn->shm->client_efd);
+        stat_add(&shard->stats.syscalls, 1);
+    }
+}
+
+/*
+ * shm_put
+ * - Copia al anillo hacia un cliente local todo lo que quepa de 'len'
+ *   bytes y devuelve cuántos copió, o -1 si el cliente dejó el anillo en un
+ *   estado imposible.
+ */
+ssize_t shm_put(Shard *shard, Connection *conn, const char *data, size_t len) {
+    ShmEnd *out = &conn->shm->out;
+    uint64_t space = shm_writable(out);
+    if (space > out->size)
+        return -1;
+    size_t n = len < space ? len : (size_t)space;
+    if (n > 0) {
+        shm_copy(out, 0, data, n);
+        shm_commit(out, n);
+        shm_wake_client(shard, conn);
+    }
+    return (ssize_t)n;
+}
+
+/*
+ * shm_flush
+ * - Pasa al anillo de un cliente local todo lo que quepa de su cola de
+ *   salida. Los tramos del log se leen del fichero directamente al anillo
+ *   con preadv(). Si el anillo se llena se marca 'want_space': el cliente
+ *   avisará por el eventfd del broker cuando haga hueco (ver
+ *   shm_receive()). Devuelve -1 si hay que cerrar la conexión.
+ */
+int shm_flush(Shard *shard, Connection *conn) {
+    ShmEnd *out = &conn->shm->out;
+    uint64_t written = 0;
+    while (conn->out.count > 0) {
+        uint64_t space = shm_writable(out);
+        if (space > out->size)
+            return -1;
+        if (space == 0) {
+            shm_arm(&out->ring->want_space);
+            if (shm_writable(out) == 0)
+                break;
+            continue;
+        }
+        MsgBuf *head = *out_queue_at(&conn->out, 0);
+        size_t n = head->len - conn->out.head_sent;
+        if (n > space)
+            n = (size_t)space;
+        if (head->file_fd >= 0) {
+            struct iovec iov[2];
+            int iovcnt = shm_span(out, 0, n, iov);
+            ssize_t r = preadv(head->file_fd, iov, iovcnt, (off_t)(head->file_off + conn->out.head_sent));
+            stat_add(&shard->stats.syscalls, 1);
+            if (r <= 0)
+                return -1; /* el fichero es más corto de lo anunciado */
+            n = (size_t)r;
+        } else {
+            shm_copy(out, 0, head->data + conn->out.head_sent, n);
+        }
+        shm_commit(out, n);
+        written += n;
+        uint64_t before = conn->out.count;
+        out_queue_advance(&conn->out, n);
+        conn->delivered += before - conn->out.count;
+    }
+    if (written > 0)
+        shm_wake_client(shard, conn);
+    return 0;
+}
+
+/* flush_queue: envía la cola de salida con el motor del shard; -1 si hay que cerrar */
+int flush_queue(Shard *shard, Connection *conn) {
+    if (conn->shm)
+        return shm_flush(shard, conn);
+    if (shard->uring) {
+        queue_send(shard, conn);
+        return 0;
+    }
+    return flush_sync(shard, conn);
+}
+
+/*
+ * deliver
+ * - Envía un mensaje a una conexión sin bloquear nunca. Si la cola está
+ *   vacía se intenta send() directamente desde el MsgBuf; si el socket no lo
+ *   acepta entero, la cola guarda una referencia (no una copia) y el resto
+ *   se enviará cuando epoll notifique EPOLLOUT. Si la cola está llena se
+ *   aplica overflow_policy.
+ * - Un cliente local (-U) recibe la trama copiada a su anillo en memoria
+ *   compartida; si no cabe, lo que falte espera en la cola igual que con
+ *   un socket lleno.
+ * - Con io_uring se encola, sin llamadas al sistema: el envío sale al final
+ *   del lote. Sólo si la cola se llena antes (una ráfaga que llena los
+ *   buffers de recepción son decenas de miles de tramas pequeñas) y no hay
+ *   un sendmsg en curso, se escribe en el acto como con epoll antes de
+ *   aplicar overflow_policy.
+ * - Hacia un peer de la federación no se descarta nada (un anuncio de
+ *   interés perdido dejaría rutas equivocadas): si su cola llega a
+ *   FED_QUEUE_LIMIT se corta el enlace y, al reconectar, se repite el estado.
+ */
+void deliver(Shard *shard, Connection *conn, MsgBuf *msg) {
+    size_t sent = 0, len = msg->len;
+    size_t limit = conn->peer ? FED_QUEUE_LIMIT : queue_limit;
+    OverflowPolicy policy = conn->peer ? OVERFLOW_DISCONNECT : overflow_policy;
+
+    if (conn->out.count == 0 && conn->shm) {
+        ssize_t n = shm_put(shard, conn, msg->data, len);
+        if (n == (ssize_t)len) {
+            conn->delivered++;
+            return;
+        }
+        if (n < 0) {
+            schedule_close(shard, conn);
+            return;
+        }
+        sent = (size_t)n;
+    } else if (conn->out.count == 0 && !shard->uring) {
+        ssize_t n = send(conn->fd, msg->data, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+        stat_add(&shard->stats.syscalls, 1);
+        if (n == (ssize_t)len) {
+            conn->delivered++;
+            return;
+        }
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            schedule_close(shard, conn);
+            return;
+        }
+        sent = n > 0 ? (size_t)n : 0;
+    }
+
+    if (shard->uring && !conn->shm && conn->out.count >= limit && !conn->sending && !conn->poll_out) {
+        /* Un lote puede traer más tramas que la cola: se escribe ya lo que acepte el socket */
+        if (flush_sync(shard, conn) < 0) {
+            schedule_close(shard, conn);
+            return;
+        }
+    }
+
+    uint64_t dropped = conn->out.dropped;
+    int r = out_queue_push(&conn->out, msg, limit, policy);
+    stat_add(&shard->stats.drops, conn->out.dropped - dropped);
+    if (r < 0) {
+        stat_add(&shard->stats.disconnects, 1);
+        fprintf(stderr, "%s %d superó %zu tramas pendientes, desconectando\n",
+                conn->peer ? "Peer" : "Suscriptor", conn->fd, limit);
+        schedule_close(shard, conn);
+        return;
+    }
+    if (sent > 0) {
+        /* La cola estaba vacía: la trama encolada es la cabeza */
+        conn->out.head_sent = sent;
+        conn->out.bytes -= sent;
+    }
+    if (conn->shm && r == 0 && shm_flush(shard, conn) < 0)
+        schedule_close(shard, conn);
+    else if (shard->uring && !conn->shm && r == 0)
+        queue_send(shard, conn);
+}
+
+/*
+ * deliver_update
+ * - Entrega una publicación a un suscriptor. Si pidió CONFLATE y su cola
+ *   guarda todavía una trama sin enviar del mismo topic, la nueva la
+ *   sustituye en su sitio (ver out_queue_conflate()); si no, sigue el
+ *   camino normal de deliver() y queda anotada para la siguiente.
+ */
+void deliver_update(Shard *shard, Connection *conn, MsgBuf *msg) {
+    if (!conn->conflate) {
+        deliver(shard, conn, msg);
+        return;
+    }
+    if (out_queue_conflate(&conn->out, msg)) {
+        stat_add(&shard->stats.conflated, 1);
+        return;
+    }
+    deliver(shard, conn, msg);
+    out_queue_mark(&conn->out, msg, queue_limit);
+}
+
+/*
+ * enable_conflation
+ * - Atiende "CONFLATE". Lo que ya está en el buffer de envío del socket no
+ *   se puede sustituir, y el núcleo lo agranda hasta varios MB con un
+ *   lector lento: se fija uno pequeño para que lo atrasado espere en la
+ *   cola, donde sí se confla.
+ */
+void enable_conflation(Connection *conn) {
+    int sndbuf = CONFLATE_SNDBUF;
+    conn->conflate = 1;
+    out_queue_enable_conflation(&conn->out);
+    if (!conn->shm)
+        setsockopt(conn->fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+}
+
+/* Contexto de deliver_matched() durante una publicación */
+typedef struct {
+    Shard *shard;
+    MsgBuf *msg;
+    uint64_t delivered; /* conexiones a las que se entregó */
+} Fanout;
+
+/*
+ * deliver_matched
+ * - Reenvía el mensaje a los suscriptores de un nodo que casó con el topic.
+ *   Una conexión suscrita a varios filtros que casan ("liga/+" y "liga/#")
+ *   recibe el mensaje una sola vez: se marca con el número de publicación.
+ *   Las suscripciones con FROM no reciben en vivo lo que les llega por el
+ *   log: ni mientras se ponen al día ni los mensajes anteriores a
+ *   'replay_end' que otro shard todavía no había pasado a éste.
+ */
+void deliver_matched(TrieNode *node, void *arg) {
+    Fanout *f = arg;
+    Shard *shard = f->shard;
+    for (TrieSub *link = node->subs; link; link = link->next) {
+        Subscription *sub = (Subscription *)link;
+        Connection *conn = sub->conn;
+        if (conn->closing || conn->last_publish == shard->publish_seq)
+            continue;
+        if (sub->replaying || (sub->replay_end && f->msg->log_offset < sub->replay_end))
+            continue; // lo envía (o ya lo envió) el reenvío desde el log
+        conn->last_publish = shard->publish_seq;
+        deliver_update(shard, conn, f->msg);
+        f->delivered++;
+    }
+}
+
+/*
+ * remember_last_value
+ * - Con -V guarda la publicación como valor actual de su topic, soltando el
+ *   anterior. Cada shard ve todas las publicaciones (las suyas y las que le
+ *   pasan los demás), así que cada uno tiene la caché completa y atender un
+ *   SUBSCRIBE no requiere preguntar a otro hilo.
  */
-void add_subscriber(int sock, const char *topic) {
-    if (sub_count < MAX_CLIENTS) {
-        subscribers[sub_count].socket = sock;
-        strcpy(subscribers[sub_count].topic, topic);
-        sub_count++;
-        printf("Nuevo suscriptor del tema: %s\n", topic);
+void remember_last_value(Shard *shard, MsgBuf *msg) {
+    Topic *topic = topic_intern(&shard->last_values, msgbuf_topic(msg), msg->topic_len);
+    if (topic->sub_count == 0) {
+        MsgBuf *none = NULL;
+        topic_sub_append(topic, &none, sizeof(none));
+    }
+    MsgBuf **value = topic->subs;
+    if (*value)
+        msgbuf_unref(*value);
+    *value = msgbuf_ref(msg);
+}
+
+/*
+ * send_last_values
+ * - Tras un SUBSCRIBE con -V, envía a la conexión el valor actual de cada
+ *   topic que casa con el filtro. Un topic concreto se busca en la tabla;
+ *   un filtro con comodines recorre todos los topics conocidos, lo que sólo
+ *   ocurre al suscribirse. Como los mensajes retenidos de MQTT, un topic
+ *   que ya casaba con otra suscripción de la conexión se vuelve a enviar.
+ */
+void send_last_values(Shard *shard, Connection *conn, const char *filter, size_t filter_len) {
+    TopicTable *values = &shard->last_values;
+    uint64_t sent = 0;
+    if (trie_topic_valid(filter, filter_len)) {
+        Topic *topic = topic_find(values, filter, filter_len, topic_hash(filter, filter_len));
+        if (topic) {
+            deliver_update(shard, conn, *(MsgBuf **)topic->subs);
+            sent++;
+        }
+    } else {
+        for (uint32_t id = 0; id < values->count && !conn->closing; id++) {
+            Topic *topic = topic_by_id(values, id);
+            if (trie_filter_matches(filter, filter_len, topic->name, topic->len)) {
+                deliver_update(shard, conn, *(MsgBuf **)topic->subs);
+                sent++;
+            }
+        }
     }
+    stat_add(&shard->stats.last_values, sent);
 }
 
 /*
  * send_to_subscribers
- * - Itera sobre los suscriptores registrados y envía 'message' a aquellos
- *   cuyo topic coincide con el topic proporcionado. Usa la llamada POSIX
- *   'send' (de <sys/socket.h>). Para sockets TCP, send() escribe los datos
- *   en la corriente TCP conectada al cliente remoto.
+ * - Recorre el árbol de filtros del shard nivel a nivel y reenvía la trama
+ *   del mensaje (cabecera + "topic|message") a los suscriptores de cada
+ *   nodo que casa, de modo que el coste depende de la profundidad del topic
+ *   y no de cuántas suscripciones haya. Cada envío pasa por deliver(), que
+ *   nunca bloquea el bucle.
+ * - Al terminar anota las entregas y el tiempo transcurrido desde que se
+ *   leyó el mensaje hasta el último envío (histograma de fanout).
  */
-void send_to_subscribers(const char *topic, const char *message) {
-    for (int i = 0; i < sub_count; i++) {
-        if (strcmp(subscribers[i].topic, topic) == 0) {
-            send(subscribers[i].socket, message, strlen(message), 0);
+void send_to_subscribers(Shard *shard, MsgBuf *msg) {
+    Fanout f = { .shard = shard, .msg = msg };
+    if (last_value_cache)
+        remember_last_value(shard, msg);
+    shard->publish_seq++;
+    trie_match(&shard->topics, msgbuf_topic(msg), msg->topic_len, deliver_matched, &f);
+    if (f.delivered == 0)
+        return;
+
+    BrokerStats *st = &shard->stats;
+    stat_add(&st->msgs_out, f.delivered);
+    stat_add(&st->bytes_out, f.delivered * (msg->len - msg->header_len));
+    if (msg->stats_topic >= 0)
+        stat_add(&st->topic_out[msg->stats_topic], f.delivered);
+    uint64_t now = stats_now_ns();
+    hist_record(&st->fanout, now > msg->rx_ns ? now - msg->rx_ns : 0);
+}
+
+/*
+ * link_push
+ * - Pasa un mensaje al shard 'to'. Si ya hay mensajes retenidos en el
+ *   backlog, el nuevo va detrás de ellos para no alterar el orden.
+ */
+void link_push(ShardLink *link, MsgBuf *msg) {
+    link->wake = 1;
+    if (link->backlog_count == 0 && spsc_push(&link->queue, msg) == 0)
+        return;
+
+    size_t needed = link->backlog_head + link->backlog_count + 1;
+    link->backlog = grow_array(link->backlog, &link->backlog_capacity, needed, sizeof(MsgBuf *));
+    link->backlog[link->backlog_head + link->backlog_count++] = msg;
+}
+
+/*
+ * link_flush_backlog
+ * - Mueve a la cola SPSC todo lo que quepa del backlog. Devuelve 1 si
+ *   todavía quedan mensajes retenidos.
+ */
+int link_flush_backlog(ShardLink *link) {
+    while (link->backlog_count > 0) {
+        if (spsc_push(&link->queue, link->backlog[link->backlog_head]) < 0)
+            return 1;
+        link->backlog_head++;
+        link->backlog_count--;
+        link->wake = 1;
+    }
+    link->backlog_head = 0;
+    return 0;
+}
+
+/*
+ * publish_remote
+ * - Pasa una referencia al mismo MsgBuf a cada shard destino. No toma
+ *   ningún lock: cada canal tiene un solo productor (este shard) y un solo
+ *   consumidor (el destino), y el contador de referencias es atómico.
+ */
+void publish_remote(Shard *shard, MsgBuf *msg) {
+    for (int to = 0; to < shard_count; to++) {
+        if (to != shard->id)
+            link_push(shard_link(shard->id, to), msgbuf_ref(msg));
+    }
+}
+
+void fed_publish_local(Shard *shard, MsgBuf *msg);
+
+/*
+ * drain_inbox
+ * - Entrega a los suscriptores locales los mensajes que otros shards dejaron
+ *   en sus canales hacia éste. Con federación, el shard 0 además pasa a los
+ *   peers las publicaciones de los demás shards.
+ */
+void drain_inbox(Shard *shard) {
+    for (int from = 0; from < shard_count; from++) {
+        if (from == shard->id)
+            continue;
+        SpscQueue *q = &shard_link(from, shard->id)->queue;
+        MsgBuf *msg;
+        while ((msg = spsc_pop(q)) != NULL) {
+            send_to_subscribers(shard, msg);
+            fed_publish_local(shard, msg);
+            msgbuf_unref(msg);
         }
     }
 }
 
 /*
- * main
- * - Crea un socket TCP en modo escucha, acepta conexiones entrantes y
- *   las multiplexa usando select(). Cuando un cliente envía datos, el
- *   servidor lee e interpreta comandos:
- *     - "SUBSCRIBE <topic>" registra al cliente como suscriptor
- *     - "<topic>|<message>" se considera una publicación y el broker
- *         reenvía <message> a todos los suscriptores de <topic>.
- *
- * Interacciones clave con encabezados no estándar:
- * - socket(AF_INET, SOCK_STREAM, 0): crea un socket TCP IPv4 (sys/socket.h).
- * - bind(...): enlaza el socket a INADDR_ANY y PORT usando sockaddr_in
- *              (arpa/inet.h define la estructura y helpers como htons()).
- * - listen(), accept(): ponen el socket en modo escucha y aceptan conexiones
- *                        TCP (sys/socket.h).
- * - select(): provisto por <sys/select.h>, permite esperar en múltiples
- *             sockets para lectura. Aquí se usa para saber cuándo hay datos
- *             disponibles en cualquier socket conectado o cuando llega una
- *             nueva conexión en el socket escuchante.
- * - read()/close(): helpers POSIX de <unistd.h> para recibir bytes y cerrar
- *                   sockets cuando los clientes se desconectan.
+ * wake_shards
+ * - Al final de cada lote, escribe una sola vez en el eventfd de cada shard
+ *   al que se le pasaron mensajes. Devuelve 1 si algún canal conserva
+ *   mensajes en el backlog (hay que volver pronto a reintentarlo).
+ */
+int wake_shards(Shard *shard) {
+    int pending = 0;
+    for (int to = 0; to < shard_count; to++) {
+        if (to == shard->id)
+            continue;
+        ShardLink *link = shard_link(shard->id, to);
+        pending |= link_flush_backlog(link);
+        if (link->wake) {
+            uint64_t one = 1;
+            link->wake = 0;
+            stat_add(&shard->stats.syscalls, 1);
+            if (write(shards[to].event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+                perror("Error en write(eventfd)");
+        }
+    }
+    return pending;
+}
+
+/*
+ * replay_pump
+ * - Avanza el reenvío desde el log de las suscripciones con FROM. Cada una
+ *   tiene como mucho un tramo del log en la cola de salida; cuando el socket
+ *   lo ha enviado entero (sólo queda la referencia de la suscripción) se
+ *   encola el siguiente. Los tramos no cuentan para el límite de la cola: es
+ *   el ritmo del socket el que marca el del reenvío, sin leer más del log de
+ *   lo que el cliente acepta. Se repite hasta que el socket se llena
+ *   (EPOLLOUT volverá a llamar) o todas se ponen al día; con io_uring cada
+ *   llamada encola un tramo y el siguiente se pide cuando éste se ha
+ *   enviado. Al ponerse al día, 'replay_end' queda en el offset del próximo
+ *   mensaje del topic y desde ese momento la suscripción recibe en vivo.
  */
-int main() {
-    int server_fd, new_socket, max_sd, sd, activity;
-    struct sockaddr_in address; /* address for bind/accept functions */
-    int addrlen = sizeof(address);
-    char buffer[BUFFER_SIZE];
-    fd_set readfds;                        /* for select() */
-    int client_sockets[MAX_CLIENTS] = {0}; /* tracked connected client FDs */
+void replay_pump(Shard *shard, Connection *conn) {
+    int progress = 1;
+    while (progress && conn->replays > 0 && !conn->closing) {
+        progress = 0;
+        for (Subscription *sub = conn->subs; sub; sub = sub->conn_next) {
+            if (!sub->replaying)
+                continue;
+            if (sub->replay_chunk) {
+                if (atomic_load_explicit(&sub->replay_chunk->refs, memory_order_acquire) > 1)
+                    continue; // todavía en la cola de salida
+                msgbuf_unref(sub->replay_chunk);
+                sub->replay_chunk = NULL;
+            }
+            MsgBuf *chunk = log_read_chunk(sub->log, &shard->msgs, &sub->replay_next, REPLAY_CHUNK,
+                                           &sub->replay_end);
+            if (!chunk) {
+                sub->replaying = 0;
+                conn->replays--;
+                continue;
+            }
+            out_queue_push(&conn->out, chunk, SIZE_MAX, overflow_policy);
+            sub->replay_chunk = chunk;
+            progress = 1;
+        }
 
-    /* Crear socket TCP: AF_INET (IPv4), SOCK_STREAM (TCP) */
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd == 0) {
-        perror("Error creando socket");
-        exit(EXIT_FAILURE);
+        if (flush_queue(shard, conn) < 0) {
+            schedule_close(shard, conn);
+            return;
+        }
     }
+}
 
-    /* Configurar dirección: INADDR_ANY escucha en todas las interfaces */
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(PORT); /* convert port to network byte order */
+/*
+ * handle_writable
+ * - El socket volvió a aceptar datos: vaciar la cola pendiente y seguir con
+ *   los reenvíos desde el log, si los hay.
+ */
+void handle_writable(Shard *shard, Connection *conn) {
+    if (flush_queue(shard, conn) < 0) {
+        schedule_close(shard, conn);
+        return;
+    }
+    if (conn->replays > 0)
+        replay_pump(shard, conn);
+}
 
-    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
-        perror("Error en bind");
-        exit(EXIT_FAILURE);
+/*
+ * dump_queue_stats
+ * - Imprime en stderr la profundidad de cola y los descartes de cada
+ *   conexión del shard que alguna vez se atrasó. Se dispara con SIGUSR1
+ *   (kill -USR1 <pid>) para localizar a los suscriptores lentos.
+ */
+void dump_queue_stats(Shard *shard) {
+    fprintf(stderr, "--- shard %d: colas de salida (límite %zu, política %s) ---\n",
+            shard->id, queue_limit, overflow_policy_name(overflow_policy));
+    fprintf(stderr, "%8s %10s %12s %10s %12s %12s\n",
+            "fd", "en_cola", "bytes", "max", "descartes", "entregadas");
+    for (size_t fd = 0; fd < shard->conn_capacity; fd++) {
+        Connection *conn = shard->connections[fd];
+        if (!conn || (conn->out.high_water == 0 && conn->out.dropped == 0))
+            continue;
+        fprintf(stderr, "%8zu %10zu %12zu %10zu %12llu %12llu\n", fd,
+                conn->out.count, conn->out.bytes, conn->out.high_water,
+                (unsigned long long)conn->out.dropped,
+                (unsigned long long)conn->delivered);
     }
+}
 
-    if (listen(server_fd, 5) < 0) {
-        perror("Error en listen");
-        exit(EXIT_FAILURE);
+/*
+ * set_nonblocking
+ * - Activa O_NONBLOCK. Con epoll en modo edge-triggered cada descriptor debe
+ *   leerse hasta EAGAIN, lo que sólo es posible si las lecturas no bloquean.
+ */
+int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0)
+        return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/*
+ * raise_fd_limit
+ * - Sube el límite blando de descriptores abiertos hasta el límite duro,
+ *   para que el broker pueda mantener decenas de miles de conexiones.
+ */
+void raise_fd_limit(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
     }
+}
+
+/*
+ * add_connection
+ * - Registra un descriptor recién aceptado en la tabla de conexiones y en
+ *   el conjunto de interés de epoll. EPOLLOUT se registra desde el principio:
+ *   en modo edge-triggered sólo produce un evento cuando el socket pasa de
+ *   lleno a escribible, así que no hace falta activarlo y desactivarlo.
+ *   Con io_uring, en su lugar, se pide el recv multishot de la conexión.
+ */
+void uring_arm_recv(Shard *shard, Connection *conn);
+void uring_stop_recv(Shard *shard, Connection *conn);
+void fed_peer_closed(FedPeer *peer);
+void shm_closed(Shard *shard, Connection *conn);
 
-    printf("Broker TCP escuchando en el puerto %d...\n", PORT);
+void add_connection(Shard *shard, int fd) {
+    shard->connections = grow_array(shard->connections, &shard->conn_capacity,
+                                    (size_t)fd + 1, sizeof(Connection *));
 
-    while (1) {
-        FD_ZERO(&readfds);
-        FD_SET(server_fd, &readfds);
-        max_sd = server_fd;
-
-        /* Register client sockets into the read set for select() */
-        for (int i = 0; i < MAX_CLIENTS; i++) {
-            sd = client_sockets[i];
-            if (sd > 0)
-                FD_SET(sd, &readfds);
-            if (sd > max_sd)
-                max_sd = sd;
-        }
-
-        /* select bloqueará hasta que ocurra actividad en algún FD en readfds */
-        activity = select(max_sd + 1, &readfds, NULL, NULL, NULL);
-        if ((activity < 0) && (errno != EINTR)) {
-            perror("Error en select");
-        }
-
-    /* Si el socket escuchante es legible, hay una nueva conexión */
-        if (FD_ISSET(server_fd, &readfds)) {
-            new_socket = accept(server_fd, (struct sockaddr *)&address, (socklen_t *)&addrlen);
-            printf("Nueva conexión establecida.\n");
-
-            for (int i = 0; i < MAX_CLIENTS; i++) {
-                if (client_sockets[i] == 0) {
-                    client_sockets[i] = new_socket;
-                    break;
-                }
-            }
-        }
-
-        /* Check each client socket for incoming data */
-        for (int i = 0; i < MAX_CLIENTS; i++) {
-            sd = client_sockets[i];
-            if (sd > 0 && FD_ISSET(sd, &readfds)) {
-                int valread = read(sd, buffer, BUFFER_SIZE - 1);
-                if (valread == 0) {
-                    /* Cliente desconectado */
-                    close(sd);
-                    client_sockets[i] = 0;
-                } else {
-                    buffer[valread] = '\0';
-                    if (strncmp(buffer, "SUBSCRIBE", 9) == 0) {
-                        char topic[50];
-                        sscanf(buffer, "SUBSCRIBE %s", topic);
-                        add_subscriber(sd, topic);
-                    } else {
-                        /* Se espera el formato "topic|message" para publicaciones */
-                        char topic[50], msg[BUFFER_SIZE];
-                        char *sep = strchr(buffer, '|');
-                        if (sep) {
-                            *sep = '\0';
-                            strcpy(topic, buffer);
-                            strcpy(msg, sep + 1);
-                            printf("Mensaje recibido del tema '%s': %s\n", topic, msg);
-                            send_to_subscribers(topic, msg);
-                        }
-                    }
-                }
-            }
-        }
-    }
-}
\ No newline at end of file
+    Connection *conn = slab_calloc(&shard->conn_pool, sizeof(Connection));
+    conn->fd = fd;
+    conn->gen = ++shard->next_gen;
+
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLET, .data.fd = fd };
+    if (shard->uring) {
+        uring_arm_recv(shard, conn);
+    } else if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        perror("Error en epoll_ctl");
+        slab_free(&shard->conn_pool, conn);
+        close(fd);
+        return;
+    }
+    shard->connections[fd] = conn;
+    shard->conn_count++;
+    stat_set(&shard->stats.conns, shard->conn_count);
+}
+
+/*
+ * close_connection
+ * - Quita todas las suscripciones de la conexión, cierra el descriptor y
+ *   libera su entrada. close() también lo quita del conjunto de interés de
+ *   epoll. Como las suscripciones se quitan antes de cerrar, un descriptor
+ *   reutilizado nunca hereda las suscripciones del cliente anterior.
+ * - Con io_uring el recv multishot pendiente mantiene vivo el socket aunque
+ *   se cierre el descriptor: shutdown() lo termina y avisa al cliente.
+ */
+void close_connection(Shard *shard, int fd) {
+    Connection *conn = shard->connections[fd];
+    sched_unlink(shard, conn);
+    while (conn->subs)
+        remove_subscription(shard, conn->subs);
+    if (conn->peer)
+        fed_peer_closed(conn->peer);
+    if (conn->shm)
+        shm_closed(shard, conn);
+    frame_buffer_free(&conn->in);
+    out_queue_free(&conn->out);
+    slab_free(&shard->conn_pool, conn);
+    shard->connections[fd] = NULL;
+    shard->conn_count--;
+    stat_set(&shard->stats.conns, shard->conn_count);
+    if (shard->uring)
+        shutdown(fd, SHUT_RDWR);
+    close(fd);
+}
+
+/* close_pending: cierra las conexiones marcadas con schedule_close() */
+void close_pending(Shard *shard) {
+    for (size_t i = 0; i < shard->pending_close_count; i++)
+        close_connection(shard, shard->pending_close[i]);
+    shard->pending_close_count = 0;
+}
+
+/*
+ * send_stats
+ * - Responde a STATS con una trama que contiene la instantánea de todos los
+ *   shards (ver stats_format() en common/stats.h). Los contadores de los
+ *   demás shards se leen directamente, sin pedirles nada, así que atender
+ *   STATS no detiene ningún bucle de eventos.
+ */
+void send_stats(Shard *shard, Connection *conn) {
+    BrokerStats *all[MAX_SHARDS];
+    for (int i = 0; i < shard_count; i++)
+        all[i] = &shards[i].stats;
+
+    static __thread char frame[FRAME_HEADER_SIZE + STATS_REPLY_MAX];
+    size_t len = stats_format(frame + FRAME_HEADER_SIZE, STATS_REPLY_MAX, all, shard_count, &stats_topics);
+    frame_put_header((unsigned char *)frame, (uint32_t)len);
+    MsgBuf *msg = msgbuf_new(&shard->msgs, frame, FRAME_HEADER_SIZE + len, FRAME_HEADER_SIZE, 0);
+    deliver(shard, conn, msg);
+    msgbuf_unref(msg);
+}
+
+/*
+ * parse_from_clause
+ * - Busca " FROM <posición>" en lo que sigue al topic de un SUBSCRIBE y deja
+ *   la posición en *from / *from_len. Devuelve 1 si la hay.
+ */
+int parse_from_clause(const char *rest, size_t len, const char **from, size_t *from_len) {
+    return len > 0 && topic_parse_command(rest + 1, len - 1, "FROM", from, from_len);
+}
+
+/*
+ * subscribe_from
+ * - Atiende "SUBSCRIBE <topic> FROM <offset|earliest|latest>": suscribe la
+ *   conexión y reenvía primero lo que el log guarda desde esa posición
+ *   (earliest es el mensaje más antiguo que queda; latest, sólo lo que se
+ *   publique a partir de ahora). Requiere -L y un topic sin comodines, que
+ *   tiene un único log.
+ */
+void subscribe_from(Shard *shard, Connection *conn, const char *topic, size_t topic_len,
+                    const char *from, size_t from_len) {
+    if (!log_store.dir) {
+        fprintf(stderr, "SUBSCRIBE ... FROM requiere arrancar el broker con -L\n");
+        return;
+    }
+    if (!trie_topic_valid(topic, topic_len)) {
+        fprintf(stderr, "FROM no admite comodines: %.*s\n", (int)topic_len, topic);
+        return;
+    }
+
+    char position[32];
+    uint64_t start = 0;
+    int latest = 0;
+    if (from_len >= sizeof(position)) {
+        fprintf(stderr, "Posición inválida en FROM\n");
+        return;
+    }
+    memcpy(position, from, from_len);
+    position[from_len] = '\0';
+    if (strcmp(position, "latest") == 0) {
+        latest = 1;
+    } else if (strcmp(position, "earliest") != 0) {
+        char *end;
+        start = strtoull(position, &end, 10);
+        if (*end != '\0' || position[0] == '-') {
+            fprintf(stderr, "Posición inválida en FROM: %s\n", position);
+            return;
+        }
+    }
+
+    TopicLog *log = log_store_get(&log_store, &shard->log_cache, topic, topic_len);
+    if (!log)
+        return;
+    Subscription *sub = add_subscriber(shard, conn, topic, topic_len);
+    if (!sub)
+        return;
+    sub->log = log;
+    if (latest) {
+        sub->replay_end = log_next_offset(log);
+        return;
+    }
+    sub->replay_next = start;
+    sub->replaying = 1;
+    conn->replays++;
+    replay_pump(shard, conn);
+}
+
+/*
+ * publish
+ * - Camino común de una publicación ya copiada a un MsgBuf, llegue de un
+ *   cliente o de otro broker: estadísticas, log del topic (-L), entrega a los
+ *   suscriptores locales y paso a los demás shards.
+ */
+void publish(Shard *shard, MsgBuf *msg) {
+    const char *topic = msgbuf_topic(msg);
+    msg->rx_ns = shard->rx_ns;
+    msg->stats_topic = stats_topic_index(&stats_topics, topic, msg->topic_len);
+    stat_add(&shard->stats.msgs_in, 1);
+    stat_add(&shard->stats.bytes_in, msg->len - msg->header_len);
+    if (msg->stats_topic >= 0)
+        stat_add(&shard->stats.topic_in[msg->stats_topic], 1);
+    if (log_store.dir) {
+        TopicLog *log = log_store_get(&log_store, &shard->log_cache, topic, msg->topic_len);
+        if (log)
+            msg->log_offset = log_append(&log_store, log, msg->data, msg->len);
+    }
+    send_to_subscribers(shard, msg);
+    if (shard_count > 1)
+        publish_remote(shard, msg);
+}
+
+/*
+ * Federación (-F/-P, ver TCP/federation.h)
+ * Los peers son conexiones más del shard 0, con las mismas colas de salida
+ * y el mismo motor de eventos que los clientes; sólo cambia que sus tramas
+ * son comandos entre brokers:
+ *   "PEER <id>"                               presentación, lo primero
+ *   "INTEREST <origen> <versión> <+|-> <filtro>"  cambio de interés
+ *   "SYNC"                                    pide repetir todo el estado
+ *   "FWD <origen> <secuencia> <saltos> <topic>|<message>"  publicación
+ * Los ids van en hexadecimal y el resto de números en decimal.
+ */
+
+/*
+ * fed_frame
+ * - Trama hacia los peers: 'head' (comando y campos) seguido de 'body_len'
+ *   bytes que el llamador escribe en *body. Hay sitio para un nulo final
+ *   que no se envía (ver trie_node_filter()).
+ */
+MsgBuf *fed_frame(Shard *shard, const char *head, size_t head_len, size_t body_len, char **body) {
+    size_t len = head_len + body_len;
+    MsgBuf *msg = msgbuf_reserve(&shard->msgs, FRAME_HEADER_SIZE + len + 1, FRAME_HEADER_SIZE, 0);
+    msg->len = (uint32_t)(FRAME_HEADER_SIZE + len);
+    frame_put_header((unsigned char *)msg->data, (uint32_t)len);
+    memcpy(msg->data + FRAME_HEADER_SIZE, head, head_len);
+    *body = msg->data + FRAME_HEADER_SIZE + head_len;
+    return msg;
+}
+
+/* fed_send: encola una trama hacia un peer conectado */
+void fed_send(Shard *shard, FedPeer *peer, MsgBuf *msg) {
+    Connection *conn = shard->connections[peer->fd];
+    if (!conn->closing)
+        deliver(shard, conn, msg);
+}
+
+/* fed_route_frame: trama "INTEREST" con el estado de una entrada */
+MsgBuf *fed_route_frame(Shard *shard, FedRoute *route) {
+    char head[96], *body;
+    int n = snprintf(head, sizeof(head), "INTEREST %016llx %llu %c ", (unsigned long long)route->origin,
+                     (unsigned long long)route->version, route->present ? '+' : '-');
+    size_t len = trie_node_filter(route->link.node, NULL, 0);
+    MsgBuf *msg = fed_frame(shard, head, (size_t)n, len, &body);
+    trie_node_filter(route->link.node, body, len + 1);
+    return msg;
+}
+
+/* fed_flood: anuncia una entrada a todos los peers salvo al de índice 'except' */
+void fed_flood(Shard *shard, FedRoute *route, int except) {
+    MsgBuf *msg = fed_route_frame(shard, route);
+    for (int i = 0; i < FED_MAX_PEERS; i++)
+        if (i != except && federation.peers[i].fd >= 0)
+            fed_send(shard, &federation.peers[i], msg);
+    msgbuf_unref(msg);
+}
+
+typedef struct {
+    Shard *shard;
+    FedPeer *peer;
+} FedDump;
+
+/*
+ * fed_dump_visit
+ * - Manda a un peer las entradas de un nodo: todo el interés propio (bajas
+ *   incluidas) y lo aprendido de otros peers con un salto vivo. Lo que vino
+ *   de ese mismo peer no se le devuelve.
+ */
+void fed_dump_visit(TrieNode *node, void *ctx) {
+    FedDump *d = ctx;
+    int index = fed_peer_index(&federation, d->peer);
+    for (TrieSub *link = node->subs; link; link = link->next) {
+        FedRoute *r = (FedRoute *)link;
+        if (r->hop == index || (r->origin != federation.id && r->present && r->hop < 0))
+            continue;
+        MsgBuf *msg = fed_route_frame(d->shard, r);
+        fed_send(d->shard, d->peer, msg);
+        msgbuf_unref(msg);
+    }
+}
+
+/* fed_send_state: todo el interés conocido, al conectar con un peer o cuando pide SYNC */
+void fed_send_state(Shard *shard, FedPeer *peer) {
+    FedDump d = { .shard = shard, .peer = peer };
+    trie_walk(&federation.routes.root, fed_dump_visit, &d);
+}
+
+/* fed_apply_local: aplica los cambios de interés que dejaron los shards y anuncia los del broker */
+void fed_apply_local(Shard *shard) {
+    size_t count;
+    FedChange *changes = fed_take(&federation, &count);
+    for (size_t i = 0; i < count; i++) {
+        FedRoute *r = fed_local_change(&federation, changes[i].filter, changes[i].len, changes[i].delta);
+        if (r)
+            fed_flood(shard, r, -1);
+        free(changes[i].filter);
+    }
+    free(changes);
+}
+
+/*
+ * fed_forward
+ * - Reenvía una publicación a los peers que son siguiente salto hacia algún
+ *   broker interesado, salvo el peer del que llegó ('except') y el broker
+ *   donde se publicó. Todos comparten una única copia de la trama "FWD".
+ */
+void fed_forward(Shard *shard, uint64_t origin, uint64_t seq, uint64_t hops, MsgBuf *msg, int except) {
+    uint32_t mask = fed_match(&federation, msgbuf_topic(msg), msg->topic_len);
+    for (int i = 0; i < FED_MAX_PEERS; i++) {
+        FedPeer *peer = &federation.peers[i];
+        if (i == except || peer->fd < 0 || peer->id == origin)
+            mask &= ~(1u << i);
+    }
+    if (!mask)
+        return;
+
+    char head[96], *body;
+    int n = snprintf(head, sizeof(head), "FWD %016llx %llu %llu ", (unsigned long long)origin,
+                     (unsigned long long)seq, (unsigned long long)hops);
+    size_t len = msg->len - msg->header_len;
+    if ((size_t)n + len > FRAME_MAX_PAYLOAD) {
+        fprintf(stderr, "Federación: publicación de %zu bytes demasiado grande para reenviarla\n", len);
+        return;
+    }
+    MsgBuf *fwd = fed_frame(shard, head, (size_t)n, len, &body);
+    memcpy(body, msg->data + msg->header_len, len);
+    for (int i = 0; i < FED_MAX_PEERS; i++) {
+        if (mask & (1u << i)) {
+            fed_send(shard, &federation.peers[i], fwd);
+            stat_add(&shard->stats.fed_out, 1);
+        }
+    }
+    msgbuf_unref(fwd);
+}
+
+/* fed_publish_local: el shard 0 numera y reenvía las publicaciones de clientes de este broker */
+void fed_publish_local(Shard *shard, MsgBuf *msg) {
+    if (federation.enabled && shard->id == 0)
+        fed_forward(shard, federation.id, federation.next_seq++, 0, msg, -1);
+}
+
+/*
+ * fed_receive
+ * - Publicación que llega de otro broker: si no había llegado ya por otro
+ *   camino, se publica aquí como una más y se sigue reenviando hacia los
+ *   demás interesados.
+ */
+void fed_receive(Shard *shard, int hop, uint64_t origin, uint64_t seq, uint64_t hops, const char *content,
+                 size_t len, size_t topic_len) {
+    if (origin == federation.id || fed_seen(&federation, origin, seq)) {
+        stat_add(&shard->stats.fed_duplicates, 1);
+        return;
+    }
+    stat_add(&shard->stats.fed_in, 1);
+    MsgBuf *msg = msgbuf_reserve(&shard->msgs, FRAME_HEADER_SIZE + len, FRAME_HEADER_SIZE, topic_len);
+    frame_put_header((unsigned char *)msg->data, (uint32_t)len);
+    memcpy(msg->data + FRAME_HEADER_SIZE, content, len);
+    publish(shard, msg);
+    if (hops + 1 < FED_MAX_HOPS)
+        fed_forward(shard, origin, seq, hops + 1, msg, hop);
+    msgbuf_unref(msg);
+}
+
+/*
+ * fed_peer_up
+ * - Conexión establecida con otro broker (entrante o de -P): se registra
+ *   como una conexión más del shard 0, se presenta y le cuenta todo el
+ *   interés que conoce.
+ */
+void fed_peer_up(Shard *shard, FedPeer *peer, int fd) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    add_connection(shard, fd);
+    if (!shard->connections[fd]) {
+        if (!peer->outgoing)
+            peer->used = 0;
+        return;
+    }
+    shard->connections[fd]->peer = peer;
+    peer->fd = fd;
+
+    char hello[32], *body;
+    int n = snprintf(hello, sizeof(hello), "PEER %016llx", (unsigned long long)federation.id);
+    MsgBuf *msg = fed_frame(shard, hello, (size_t)n, 0, &body);
+    fed_send(shard, peer, msg);
+    msgbuf_unref(msg);
+    fed_send_state(shard, peer);
+}
+
+/* fed_peer_accepted: conexión entrante por el puerto de peers (-F) */
+void fed_peer_accepted(Shard *shard, int fd) {
+    FedPeer *peer = fed_peer_slot(&federation);
+    if (!peer) {
+        fprintf(stderr, "Federación: ya hay %d peers, conexión rechazada\n", FED_MAX_PEERS);
+        close(fd);
+        return;
+    }
+    fed_peer_up(shard, peer, fd);
+}
+
+/*
+ * fed_peer_closed
+ * - Se cerró la conexión con un peer: las rutas que pasaban por él se
+ *   quedan sin salto y en el próximo tick se pide SYNC a los demás, por si
+ *   alguno ofrece otro camino. Los peers de -P se reintentan pasado
+ *   FED_RETRY_MS; el hueco de los entrantes queda libre.
+ */
+void fed_peer_closed(FedPeer *peer) {
+    if (peer->id)
+        alog_write(&event_log, 0, ALOG_INFO, EV_PEER_DOWN, NULL, 0, NULL, 0, peer->id, 0); // peers: shard 0
+    fed_routes_lost(&federation, fed_peer_index(&federation, peer));
+    peer->fd = -1;
+    peer->id = 0;
+    federation.sync_pending = 1;
+    if (peer->outgoing)
+        peer->retry_ns = stats_now_ns() + FED_RETRY_MS * 1000000ull;
+    else
+        peer->used = 0;
+}
+
+/*
+ * fed_connect
+ * - Conexión con un peer de -P sin bloquear el bucle: el connect() no
+ *   bloqueante se comprueba con poll() sin espera en cada tick hasta que
+ *   termina. Si falla, se reintenta pasado FED_RETRY_MS.
+ */
+void fed_connect(Shard *shard, FedPeer *peer) {
+    uint64_t now = stats_now_ns();
+    if (peer->connect_fd < 0) {
+        if (now < peer->retry_ns)
+            return;
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (fd < 0) {
+            perror("Error creando socket");
+            return;
+        }
+        if (connect(fd, (struct sockaddr *)&peer->addr, sizeof(peer->addr)) < 0 && errno != EINPROGRESS) {
+            close(fd);
+            peer->retry_ns = now + FED_RETRY_MS * 1000000ull;
+            return;
+        }
+        peer->connect_fd = fd;
+    }
+
+    struct pollfd pfd = { .fd = peer->connect_fd, .events = POLLOUT };
+    if (poll(&pfd, 1, 0) == 0)
+        return; // todavía en curso
+    int fd = peer->connect_fd, err = 0;
+    socklen_t err_len = sizeof(err);
+    peer->connect_fd = -1;
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &err_len) < 0 || err != 0) {
+        close(fd);
+        peer->retry_ns = now + FED_RETRY_MS * 1000000ull;
+        return;
+    }
+    fed_peer_up(shard, peer, fd);
+}
+
+/* fed_tick: tarea periódica del shard 0 (conexiones con peers de -P y SYNC pendiente) */
+void fed_tick(Shard *shard) {
+    for (int i = 0; i < FED_MAX_PEERS; i++) {
+        FedPeer *peer = &federation.peers[i];
+        if (peer->used && peer->outgoing && peer->fd < 0)
+            fed_connect(shard, peer);
+    }
+    if (federation.sync_pending) {
+        char *body;
+        MsgBuf *msg = fed_frame(shard, "SYNC", 4, 0, &body);
+        federation.sync_pending = 0;
+        for (int i = 0; i < FED_MAX_PEERS; i++)
+            if (federation.peers[i].fd >= 0)
+                fed_send(shard, &federation.peers[i], msg);
+        msgbuf_unref(msg);
+    }
+}
+
+/*
+ * fed_command
+ * - Interpreta una trama de un peer (ver la lista de comandos arriba). Una
+ *   trama que no se entiende cierra el enlace: el peer reconectará y
+ *   repetirá su estado.
+ */
+void fed_command(Shard *shard, Connection *conn, const char *payload, uint32_t len) {
+    FedPeer *peer = conn->peer;
+    int hop = fed_peer_index(&federation, peer);
+    const char *p = payload, *end = payload + len;
+    uint64_t origin, number, hops;
+
+    if (len > 5 && memcmp(payload, "PEER ", 5) == 0) {
+        char id[17];
+        size_t id_len = len - 5 < 16 ? len - 5 : 16;
+        memcpy(id, payload + 5, id_len);
+        id[id_len] = '\0';
+        peer->id = strtoull(id, NULL, 16);
+        if (peer->id == federation.id) {
+            fprintf(stderr, "Federación: conexión con este mismo broker, se descarta\n");
+            peer->outgoing = 0; // no reintentar
+            schedule_close(shard, conn);
+            return;
+        }
+        alog_write(&event_log, shard->id, ALOG_INFO, EV_PEER_UP, NULL, 0, NULL, 0, peer->id, 0);
+        return;
+    }
+    if (len > 9 && memcmp(payload, "INTEREST ", 9) == 0) {
+        p += 9;
+        if (fed_next_number(&p, end, 16, &origin) && fed_next_number(&p, end, 10, &number) && end - p > 2 &&
+            (p[0] == '+' || p[0] == '-') && p[1] == ' ' && trie_filter_valid(p + 2, end - p - 2)) {
+            int present = p[0] == '+';
+            FedRoute *r;
+            if (origin == federation.id) {
+                if ((r = fed_own_claim(&federation, p + 2, end - p - 2, number, present)) != NULL)
+                    fed_flood(shard, r, -1);
+            } else if ((r = fed_route_update(&federation, p + 2, end - p - 2, origin, number, present, hop)) != NULL) {
+                fed_flood(shard, r, hop);
+            }
+            return;
+        }
+    } else if (len == 4 && memcmp(payload, "SYNC", 4) == 0) {
+        fed_send_state(shard, peer);
+        return;
+    } else if (len > 4 && memcmp(payload, "FWD ", 4) == 0) {
+        p += 4;
+        if (fed_next_number(&p, end, 16, &origin) && fed_next_number(&p, end, 10, &number) &&
+            fed_next_number(&p, end, 10, &hops)) {
+            const char *sep = memchr(p, '|', end - p);
+            if (sep && trie_topic_valid(p, sep - p)) {
+                fed_receive(shard, hop, origin, number, hops, p, end - p, sep - p);
+                return;
+            }
+        }
+    }
+    fprintf(stderr, "Federación: trama inválida del peer %d, cerrando el enlace\n", conn->fd);
+    schedule_close(shard, conn);
+}
+
+/*
+ * rate_charge
+ * - Cuenta una publicación de un cliente en su cubo (-l) y en el de su
+ *   topic (-T). Si alguno se ha vaciado, la conexión se pausa hasta que se
+ *   rellene: sus tramas siguientes esperan en conn->in o en el socket (ver
+ *   sched_input()). El mensaje actual ya se entregó; no se descarta nada.
+ */
+void rate_charge(Shard *shard, Connection *conn, MsgBuf *msg) {
+    uint64_t wait = 0;
+    if (publisher_limit.interval_ns)
+        wait = rate_take(&conn->tat, &publisher_limit, shard->rx_ns);
+    if (topic_limit.interval_ns) {
+        uint64_t *tat = rate_table_bucket(&topic_buckets, &shard->rate_cache, msgbuf_topic(msg), msg->topic_len);
+        uint64_t topic_wait = rate_take_shared(tat, &topic_limit, shard->rx_ns);
+        if (topic_wait > wait)
+            wait = topic_wait;
+    }
+    if (wait > 0) {
+        conn->resume_ns = shard->rx_ns + wait;
+        stat_add(&shard->stats.rate_pauses, 1);
+    }
+}
+
+/*
+ * handle_command
+ * - Interpreta el contenido de una trama (no terminado en nulo):
+ *     - "SUBSCRIBE <filtro>" suscribe la conexión al filtro y, con -V, le
+ *       envía el valor actual de los topics que casan (ver send_last_values())
+ *     - "SUBSCRIBE <topic> FROM <posición>" además reenvía la historia del
+ *       topic desde el log (ver subscribe_from())
+ *     - "UNSUBSCRIBE <filtro>" cancela esa suscripción
+ *     - "CONFLATE" hace que, en la cola de la conexión, cada publicación
+ *       sustituya a la pendiente de su mismo topic (ver deliver_update())
+ *     - "STATS" responde con las estadísticas del broker
+ *     - "LOG <off|info|debug> [N]" cambia en marcha el nivel del registro y,
+ *       con N, registra sólo una de cada N publicaciones (ver alog_command())
+ *     - "<topic>|<message>" se copia una vez a un MsgBuf y se reenvía, con la
+ *       trama completa tal cual llegó, a todos los suscriptores de <topic>,
+ *       locales y de otros shards (ver publish()), y a los peers de la
+ *       federación interesados. Con -L antes se añade al log del topic, y
+ *       con -l/-T se cuenta en los límites de ritmo (ver rate_charge()).
+ * - Las tramas de un peer son comandos entre brokers (ver fed_command()).
+ */
+void handle_command(Shard *shard, int sd, const char *payload, uint32_t len) {
+    const char *topic;
+    size_t topic_len;
+
+    if (shard->connections[sd]->peer) {
+        fed_command(shard, shard->connections[sd], payload, len);
+        return;
+    }
+    if (topic_parse_command(payload, len, "SUBSCRIBE", &topic, &topic_len)) {
+        const char *from;
+        size_t from_len;
+        const char *rest = topic + topic_len;
+        if (parse_from_clause(rest, payload + len - rest, &from, &from_len))
+            subscribe_from(shard, shard->connections[sd], topic, topic_len, from, from_len);
+        else if (add_subscriber(shard, shard->connections[sd], topic, topic_len) && last_value_cache)
+            send_last_values(shard, shard->connections[sd], topic, topic_len);
+    } else if (topic_parse_command(payload, len, "UNSUBSCRIBE", &topic, &topic_len)) {
+        remove_subscriber(shard, shard->connections[sd], topic, topic_len);
+    } else if (len == 8 && memcmp(payload, "CONFLATE", 8) == 0) {
+        enable_conflation(shard->connections[sd]);
+    } else if (len == 5 && memcmp(payload, "STATS", 5) == 0) {
+        send_stats(shard, shard->connections[sd]);
+    } else if (alog_command(&event_log, payload, len)) {
+        alog_write(&event_log, shard->id, ALOG_OFF, EV_LOG_LEVEL, NULL, 0, NULL, 0,
+                   (uint64_t)atomic_load(&event_log.level), atomic_load(&event_log.sample));
+    } else {
+        /* Se espera el formato "topic|message" para publicaciones */
+        const char *sep = memchr(payload, '|', len);
+        if (sep) {
+            topic_len = sep - payload;
+            if (!trie_topic_valid(payload, topic_len)) {
+                fprintf(stderr, "Los topics publicados no pueden llevar comodines: %.*s\n",
+                        (int)topic_len, payload);
+                return;
+            }
+            alog_write(&event_log, shard->id, ALOG_DEBUG, EV_PUBLISHED, payload, topic_len, sep + 1,
+                       len - topic_len - 1, 0, 0);
+
+            MsgBuf *msg = msgbuf_new(&shard->msgs, payload - FRAME_HEADER_SIZE, FRAME_HEADER_SIZE + len,
+                                     FRAME_HEADER_SIZE, topic_len);
+            publish(shard, msg);
+            fed_publish_local(shard, msg);
+            if (!shard->connections[sd]->shm && (publisher_limit.interval_ns || topic_limit.interval_ns))
+                rate_charge(shard, shard->connections[sd], msg);
+            msgbuf_unref(msg);
+        }
+    }
+}
+
+/*
+ * process_frames
+ * - Ejecuta cada trama completa contenida en 'data' y devuelve cuántos bytes
+ *   consumió; lo que sobra es el comienzo de una trama incompleta o lo que
+ *   queda para la vuelta siguiente porque la conexión agotó su presupuesto
+ *   o quedó pausada (ver conn_stalled()). Devuelve -1 si el cliente anunció
+ *   una trama inválida.
+ */
+ssize_t process_frames(Shard *shard, int sd, const char *data, size_t len) {
+    Connection *conn = shard->connections[sd];
+    size_t off = 0;
+    while (off < len && !conn->closing && !conn_stalled(conn)) {
+        const char *payload;
+        uint32_t payload_len;
+        ssize_t used = frame_next(data + off, len - off, &payload, &payload_len);
+        if (used < 0)
+            return -1;
+        if (used == 0)
+            break;
+        handle_command(shard, sd, payload, payload_len);
+        off += used;
+        if (!conn->shm)
+            conn->budget -= (size_t)used < conn->budget ? (size_t)used : conn->budget;
+    }
+    return (ssize_t)off;
+}
+
+/*
+ * accept_connections
+ * - Con edge-triggered sólo se recibe un aviso aunque haya varias conexiones
+ *   pendientes, por lo que se llama a accept() hasta que devuelve EAGAIN.
+ *   'listen_fd' es el socket de clientes, el de peers (-F, shard 0) o el
+ *   socket Unix de los clientes locales (-U).
+ */
+void shm_accepted(Shard *shard, int fd);
+
+void accept_connections(Shard *shard, int listen_fd) {
+    while (1) {
+        int new_socket = accept(listen_fd, NULL, NULL);
+        stat_add(&shard->stats.syscalls, 1);
+        if (new_socket < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("Error en accept");
+            return;
+        }
+        set_nonblocking(new_socket);
+        if (listen_fd == shard->peer_fd) {
+            fed_peer_accepted(shard, new_socket);
+            continue;
+        }
+        if (listen_fd == shm_listen_fd) {
+            shm_accepted(shard, new_socket);
+            continue;
+        }
+        add_connection(shard, new_socket);
+        alog_write(&event_log, shard->id, ALOG_INFO, EV_CONNECTED, NULL, 0, NULL, 0, 0, 0);
+    }
+}
+
+void sched_input(Shard *shard, Connection *conn);
+
+/*
+ * consume_input
+ * - Procesa 'len' bytes recién leídos de una conexión. Pueden traer varias
+ *   tramas o sólo parte de una: se procesan las tramas completas que permita
+ *   el presupuesto de la vuelta y el resto se guarda en conn->in. Si no
+ *   había nada pendiente las tramas se procesan directamente desde el buffer
+ *   de lectura, sin copiarlas. Con 'len' 0 sólo se procesa lo pendiente.
+ *   Una trama inválida cierra la conexión (devuelve -1).
+ */
+int consume_input(Shard *shard, Connection *conn, const char *data, size_t len) {
+    ssize_t used;
+    shard->rx_ns = stats_now_ns();
+    conn_turn(shard, conn);
+    if (conn->in.len == 0) {
+        used = process_frames(shard, conn->fd, data, len);
+        if (used >= 0 && (size_t)used < len)
+            frame_buffer_append(&conn->in, data + used, len - used);
+    } else {
+        if (len > 0)
+            frame_buffer_append(&conn->in, data, len);
+        used = process_frames(shard, conn->fd, conn->in.data, conn->in.len);
+        if (used > 0)
+            frame_buffer_consume(&conn->in, used);
+    }
+    if (used < 0) {
+        fprintf(stderr, "Trama inválida, cerrando conexión %d\n", conn->fd);
+        schedule_close(shard, conn);
+        return -1;
+    }
+    sched_input(shard, conn);
+    return 0;
+}
+
+/*
+ * sched_input
+ * - Tras procesar entrada de una conexión la deja en la lista que le toca:
+ *   pausada si un límite de ritmo la frenó, en el turno rotatorio si agotó
+ *   su presupuesto (puede quedarle entrada en conn->in o en el socket) o en
+ *   ninguna. Con io_uring los datos llegan sin pedirlos, así que mientras
+ *   está pausada, o si acumula URING_IN_BACKLOG bytes aplazados, se cancela
+ *   su recv y el resto espera en el socket.
+ */
+void sched_input(Shard *shard, Connection *conn) {
+    if (conn->closing || conn->shm)
+        return;
+    if (conn->resume_ns) {
+        sched_move(shard, conn, SCHED_PAUSED);
+    } else if (conn->budget == 0) {
+        if (conn->sched != SCHED_READY)
+            stat_add(&shard->stats.read_deferred, 1);
+        sched_move(shard, conn, SCHED_READY);
+    } else {
+        sched_unlink(shard, conn);
+    }
+    if (shard->uring && (conn->resume_ns || (conn->budget == 0 && conn->in.len >= URING_IN_BACKLOG)))
+        uring_stop_recv(shard, conn);
+}
+
+/*
+ * service_input
+ * - Un turno de lectura de una conexión: primero la entrada aplazada en
+ *   conn->in y después, con epoll, el socket, hasta vaciarlo (EAGAIN) o
+ *   agotar el presupuesto de la vuelta. El presupuesto se cobra por tramas
+ *   completas (ver process_frames()): cada read() pide lo que queda de él,
+ *   salvo si hay una trama a medias, que se termina de leer por bloques de
+ *   READ_CHUNK en lugar de con lecturas del tamaño del resto del
+ *   presupuesto. Un read() de 0 bytes o un error
+ *   distinto de EAGAIN cierran la conexión. Con io_uring se vuelve a pedir
+ *   el recv si estaba parado y ya se puede leer, y la conexión que cerró el
+ *   cliente se cierra cuando termina su entrada aplazada.
+ */
+void service_input(Shard *shard, Connection *conn) {
+    static __thread char buffer[READ_CHUNK];
+
+    conn_turn(shard, conn);
+    if (conn->in.len > 0 && consume_input(shard, conn, NULL, 0) < 0)
+        return;
+    if (shard->uring) {
+        if (conn->closing)
+            return;
+        if (conn->eof) {
+            if (!conn_stalled(conn))
+                schedule_close(shard, conn);
+        } else if (conn->recv != RECV_ARMED && !conn->resume_ns && conn->in.len < URING_IN_BACKLOG) {
+            if (conn->recv == RECV_STOPPED)
+                uring_arm_recv(shard, conn);
+            conn->recv = RECV_ARMED; // si se estaba cancelando, uring_recv_done() lo pide de nuevo
+        }
+        sched_input(shard, conn);
+        return;
+    }
+    while (conn->readable && !conn->closing && !conn_stalled(conn)) {
+        /* Con una trama a medias en conn->in se pide un bloque entero: el
+         * presupuesto sólo se cobra al completarla */
+        size_t want = conn->in.len > 0 || conn->budget > sizeof(buffer) ? sizeof(buffer) : conn->budget;
+        ssize_t valread = read(conn->fd, buffer, want);
+        stat_add(&shard->stats.syscalls, 1);
+        if (valread < 0 && errno == EINTR)
+            continue;
+        if (valread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            conn->readable = 0;
+            break;
+        }
+        if (valread <= 0) {
+            /* Cliente desconectado */
+            schedule_close(shard, conn);
+            return;
+        }
+        if (consume_input(shard, conn, buffer, (size_t)valread) < 0)
+            return;
+    }
+    sched_input(shard, conn);
+}
+
+/*
+ * sched_run
+ * - Al final de cada vuelta: reanuda las conexiones pausadas cuyo cubo ya
+ *   se rellenó y da un turno a cada una de las que estaban en el turno
+ *   rotatorio al empezar; las que vuelven a agotar su presupuesto pasan al
+ *   final, detrás de las que se añadieron en esta vuelta.
+ */
+void sched_run(Shard *shard) {
+    if (shard->paused) {
+        uint64_t now = stats_now_ns();
+        for (Connection *conn = shard->paused, *next; conn; conn = next) {
+            next = conn->sched_next;
+            if (conn->resume_ns <= now) {
+                conn->resume_ns = 0;
+                sched_move(shard, conn, SCHED_READY);
+            }
+        }
+    }
+    Connection *last = shard->ready_tail;
+    while (last && shard->ready_head) {
+        Connection *conn = shard->ready_head;
+        sched_unlink(shard, conn);
+        service_input(shard, conn);
+        if (conn == last)
+            break;
+    }
+}
+
+/* sched_timeout: espera máxima del bucle en ms si hay conexiones en el turno rotatorio o pausadas */
+int sched_timeout(Shard *shard, int timeout) {
+    if (shard->ready_head)
+        return 0;
+    if (!shard->paused)
+        return timeout;
+    uint64_t next = UINT64_MAX, now = stats_now_ns();
+    for (Connection *conn = shard->paused; conn; conn = conn->sched_next)
+        if (conn->resume_ns < next)
+            next = conn->resume_ns;
+    int ms = next <= now ? 0 : (int)((next - now + 999999) / 1000000);
+    return timeout < 0 || ms < timeout ? ms : timeout;
+}
+
+/*
+ * shm_receive
+ * - Cliente local (-U): procesa lo que haya en su anillo hacia el broker
+ *   con consume_input(), como lo leído de un socket, y sigue con su cola de
+ *   salida si hizo hueco en el suyo. Con 'arm' deja puesta la marca
+ *   want_data para que el cliente despierte al broker con el siguiente
+ *   mensaje; sin ella (espera activa, -B) el cliente no hace ninguna llamada
+ *   al sistema para avisar. En cada llamada se procesa como mucho un anillo
+ *   entero: si queda más, el shard se avisa a sí mismo para volver después
+ *   de atender al resto. Devuelve 1 si había algo que hacer.
+ */
+int shm_receive(Shard *shard, Connection *conn, int arm) {
+    ShmLink *link = conn->shm;
+    uint64_t total = 0;
+    int progress = 0;
+
+    while (!conn->closing) {
+        uint64_t avail = shm_readable(&link->in);
+        if (avail > link->in.size) {
+            fprintf(stderr, "Anillo inválido, cerrando conexión %d\n", conn->fd);
+            schedule_close(shard, conn);
+            return 1;
+        }
+        if (avail == 0) {
+            if (!arm)
+                break;
+            shm_arm(&link->in.ring->want_data);
+            if (shm_readable(&link->in) == 0)
+                break;
+            continue;
+        }
+        if (total >= link->in.size) {
+            shm_signal(link->doorbell);
+            stat_add(&shard->stats.syscalls, 1);
+            break;
+        }
+        size_t chunk;
+        const char *data = shm_peek(&link->in, avail, &chunk);
+        consume_input(shard, conn, data, chunk);
+        shm_consume(&link->in, chunk);
+        total += chunk;
+        progress = 1;
+        shard->shm_active_ns = shard->rx_ns;
+        if (shm_should_wake(&link->in.ring->want_space)) {
+            shm_signal(link->client_efd);
+            stat_add(&shard->stats.syscalls, 1);
+        }
+    }
+
+    if (!conn->closing && (conn->out.count > 0 || conn->replays > 0) && shm_writable(&link->out) > 0) {
+        handle_writable(shard, conn);
+        progress = 1;
+    }
+    return progress;
+}
+
+/* shm_doorbell: el cliente local escribió en el eventfd del broker */
+void shm_doorbell(Shard *shard, Connection *conn) {
+    uint64_t count;
+    stat_add(&shard->stats.syscalls, 1);
+    if (read(conn->shm->doorbell, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        perror("Error en read(eventfd)");
+    shm_receive(shard, conn, busy_poll_ns == 0);
+}
+
+/*
+ * shm_busy
+ * - Espera activa (-B): mientras algún cliente local del shard haya tenido
+ *   actividad en los últimos busy_poll_ns, el bucle no duerme y mira los
+ *   anillos en cada vuelta (devuelve 1). Pasado ese tiempo pone las marcas
+ *   want_data y el shard vuelve a dormir hasta que un cliente lo despierte.
+ */
+int shm_busy(Shard *shard) {
+    if (busy_poll_ns == 0 || shard->shm_count == 0)
+        return 0;
+    int progress = 0;
+    for (size_t i = 0; i < shard->shm_count; i++)
+        if (!shard->shm_conns[i]->closing)
+            progress |= shm_receive(shard, shard->shm_conns[i], 0);
+    if (progress || stats_now_ns() - shard->shm_active_ns < busy_poll_ns)
+        return 1;
+    for (size_t i = 0; i < shard->shm_count; i++)
+        if (!shard->shm_conns[i]->closing)
+            progress |= shm_receive(shard, shard->shm_conns[i], 1);
+    return progress;
+}
+
+void uring_arm_poll(Shard *shard, int fd, uint32_t events, int multishot, uint64_t data);
+static inline uint64_t uring_conn_data(Connection *conn, int type);
+
+/*
+ * shm_accepted
+ * - Conexión nueva en el socket Unix (-U): prepara la memoria compartida,
+ *   se la pasa al cliente y registra la conexión como cualquier otra, más
+ *   la espera del eventfd con el que el cliente despierta al broker (con
+ *   epoll lleva el fd de la conexión, así que llega como un evento más de
+ *   ella).
+ */
+void shm_accepted(Shard *shard, int fd) {
+    ShmLink *link = malloc(sizeof(ShmLink));
+    if (!link || shm_link_create(link, fd, SHM_RING_SIZE) < 0) {
+        if (link)
+            shm_link_free(link);
+        free(link);
+        close(fd);
+        return;
+    }
+    add_connection(shard, fd);
+    Connection *conn = shard->connections[fd];
+    if (!conn) {
+        shm_link_free(link);
+        free(link);
+        return;
+    }
+    conn->shm = link;
+
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLET, .data.fd = fd };
+    if (shard->uring)
+        uring_arm_poll(shard, link->doorbell, POLLIN, 1, uring_conn_data(conn, URING_SHM));
+    else if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, link->doorbell, &ev) < 0)
+        perror("Error en epoll_ctl");
+    shard->shm_conns = grow_array(shard->shm_conns, &shard->shm_capacity, shard->shm_count + 1,
+                                  sizeof(Connection *));
+    link->index = shard->shm_count;
+    shard->shm_conns[shard->shm_count++] = conn;
+    alog_write(&event_log, shard->id, ALOG_INFO, EV_SHM_CONNECTED, NULL, 0, NULL, 0, 0, 0);
+}
+
+/*
+ * shm_closed
+ * - Libera la memoria compartida de un cliente local que se cierra. La
+ *   espera del eventfd se quita explícitamente: el cliente todavía puede
+ *   tener abierto el mismo eventfd, y ni epoll ni io_uring la olvidarían
+ *   al cerrar sólo nuestro descriptor.
+ */
+void shm_closed(Shard *shard, Connection *conn) {
+    ShmLink *link = conn->shm;
+    Connection *last = shard->shm_conns[--shard->shm_count];
+    shard->shm_conns[link->index] = last;
+    last->shm->index = link->index;
+
+    if (shard->uring) {
+        struct io_uring_sqe *sqe = uring_sqe(&shard->ring);
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = uring_conn_data(conn, URING_SHM);
+    } else {
+        epoll_ctl(shard->epoll_fd, EPOLL_CTL_DEL, link->doorbell, NULL);
+    }
+    shm_link_free(link);
+    free(link);
+    conn->shm = NULL;
+}
+
+/*
+ * handle_readable
+ * - El socket tiene datos: se leen en un turno de service_input(), como
+ *   mucho lo que permita el presupuesto de la vuelta. Si una pausa o el
+ *   presupuesto dejan datos en el socket, la conexión sigue en su lista de
+ *   planificación aunque epoll (edge-triggered) no vuelva a avisar. Para un
+ *   cliente local, primero su anillo (el evento puede venir de su eventfd o
+ *   del socket Unix).
+ */
+void handle_readable(Shard *shard, int sd) {
+    Connection *conn = shard->connections[sd];
+
+    if (conn->shm) {
+        shm_doorbell(shard, conn);
+        if (conn->closing)
+            return;
+    }
+    conn->readable = 1;
+    service_input(shard, conn);
+}
+
+/*
+ * create_listener
+ * - Crea un socket TCP escuchando en 'port'. Con SO_REUSEPORT cada shard
+ *   abre su propio socket en el mismo puerto y el kernel reparte las
+ *   conexiones nuevas entre ellos, sin un hilo aceptador compartido.
+ */
+int create_listener(int listen_port) {
+    struct sockaddr_in address; /* address for bind */
+    int opt = 1;
+
+    /* Crear socket TCP: AF_INET (IPv4), SOCK_STREAM (TCP) */
+    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (server_fd < 0) {
+        perror("Error creando socket");
+        exit(EXIT_FAILURE);
+    }
+    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        perror("Error en SO_REUSEPORT");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Configurar dirección: INADDR_ANY escucha en todas las interfaces */
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(listen_port); /* convert port to network byte order */
+
+    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        perror("Error en bind");
+        exit(EXIT_FAILURE);
+    }
+
+    if (listen(server_fd, SOMAXCONN) < 0) {
+        perror("Error en listen");
+        exit(EXIT_FAILURE);
+    }
+    set_nonblocking(server_fd);
+    return server_fd;
+}
+
+/*
+ * create_unix_listener
+ * - Socket Unix de los clientes locales (-U). Lo comparten todos los
+ *   shards: el que despierte acepta (ver shard_epoll_setup()). Un fichero
+ *   que quedara en la ruta de una ejecución anterior se borra antes.
+ */
+int create_unix_listener(const char *path) {
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Ruta de socket demasiado larga: %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(address.sun_path, path);
+    unlink(path);
+
+    int server_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server_fd < 0) {
+        perror("Error creando socket Unix");
+        exit(EXIT_FAILURE);
+    }
+    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        perror("Error en bind");
+        exit(EXIT_FAILURE);
+    }
+    if (listen(server_fd, SOMAXCONN) < 0) {
+        perror("Error en listen");
+        exit(EXIT_FAILURE);
+    }
+    set_nonblocking(server_fd);
+    return server_fd;
+}
+
+/* epoll_add_fd: registra un descriptor auxiliar (escucha, eventfd, signalfd) */
+void epoll_add_fd(Shard *shard, int fd, uint32_t events) {
+    struct epoll_event ev = { .events = events, .data.fd = fd };
+    if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        perror("Error en epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * shard_init
+ * - Prepara el estado de un shard: socket de escucha propio y eventfd para
+ *   que los demás shards lo despierten. El motor de eventos (epoll o
+ *   io_uring) lo prepara el propio hilo del shard al arrancar.
+ */
+void shard_init(Shard *shard, int id) {
+    memset(shard, 0, sizeof(*shard));
+    shard->id = id;
+    shard->turn = 1; // las conexiones nuevas (turn 0) empiezan con presupuesto
+    shard->signal_fd = -1;
+    shard->timer_fd = -1;
+    shard->peer_fd = -1;
+    atomic_init(&shard->dump_requested, 0);
+    stats_init(&shard->stats);
+    msg_pool_init(&shard->msgs, &shard->stats.heap_allocs);
+    slab_pool_init(&shard->conn_pool, sizeof(Connection), &shard->stats.heap_allocs);
+    slab_pool_init(&shard->sub_pool, sizeof(Subscription), &shard->stats.heap_allocs);
+    shard->listen_fd = create_listener(port);
+
+    shard->event_fd = eventfd(0, EFD_NONBLOCK);
+    if (shard->event_fd < 0) {
+        perror("Error en eventfd");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * shard_epoll_setup
+ * - Crea la instancia de epoll del shard y registra el socket de escucha,
+ *   el eventfd y, en el shard 0, el signalfd, el timerfd y la escucha de
+ *   peers. El socket Unix de -U lo registran todos los shards con
+ *   EPOLLEXCLUSIVE: cada conexión nueva despierta a uno solo.
+ */
+void shard_epoll_setup(Shard *shard) {
+    shard->epoll_fd = epoll_create1(0);
+    if (shard->epoll_fd < 0) {
+        perror("Error en epoll_create1");
+        exit(EXIT_FAILURE);
+    }
+    epoll_add_fd(shard, shard->listen_fd, EPOLLIN | EPOLLET);
+    epoll_add_fd(shard, shard->event_fd, EPOLLIN);
+    if (shard->signal_fd >= 0)
+        epoll_add_fd(shard, shard->signal_fd, EPOLLIN);
+    if (shard->timer_fd >= 0)
+        epoll_add_fd(shard, shard->timer_fd, EPOLLIN);
+    if (shard->peer_fd >= 0)
+        epoll_add_fd(shard, shard->peer_fd, EPOLLIN | EPOLLET);
+    if (shm_listen_fd >= 0)
+        epoll_add_fd(shard, shm_listen_fd, EPOLLIN | EPOLLET | EPOLLEXCLUSIVE);
+}
+
+/*
+ * request_dump
+ * - SIGUSR1 lo recibe el shard 0, pero cada shard debe imprimir sus propias
+ *   conexiones: se marca la petición y se despierta a todos.
+ */
+void request_dump(void) {
+    for (int i = 0; i < shard_count; i++) {
+        uint64_t one = 1;
+        atomic_store(&shards[i].dump_requested, 1);
+        if (write(shards[i].event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            perror("Error en write(eventfd)");
+    }
+}
+
+/*
+ * handle_control
+ * - Atiende los descriptores auxiliares del shard: el eventfd (mensajes de
+ *   otros shards, cambios de interés para la federación y peticiones de
+ *   volcado), el timerfd (barrido de retención del log y tareas de la
+ *   federación) y el signalfd de SIGUSR1. Devuelve 0 si 'fd' no es ninguno.
+ */
+int handle_control(Shard *shard, int fd) {
+    if (fd == shard->event_fd) {
+        uint64_t count;
+        stat_add(&shard->stats.syscalls, 1);
+        if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+            perror("Error en read(eventfd)");
+        drain_inbox(shard);
+        if (federation.enabled && shard->id == 0)
+            fed_apply_local(shard);
+        if (atomic_exchange(&shard->dump_requested, 0))
+            dump_queue_stats(shard);
+        return 1;
+    }
+    if (fd == shard->timer_fd) {
+        uint64_t expirations;
+        if (read(fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+            perror("Error en read(timerfd)");
+        if (log_store.dir && log_store.max_age > 0)
+            log_store_sweep(&log_store);
+        if (federation.enabled)
+            fed_tick(shard);
+        return 1;
+    }
+    if (fd == shard->signal_fd) {
+        struct signalfd_siginfo info;
+        while (read(fd, &info, sizeof(info)) == sizeof(info))
+            request_dump();
+        return 1;
+    }
+    return 0;
+}
+
+/* uring_conn_data: user_data de una petición de io_uring sobre una conexión */
+static inline uint64_t uring_conn_data(Connection *conn, int type) {
+    return ((uint64_t)conn->gen << 32) | ((uint64_t)(uint32_t)conn->fd << 4) | (uint64_t)type;
+}
+
+/* uring_conn: la conexión 'fd' si sigue abierta y es la número 'gen', o NULL */
+Connection *uring_conn(Shard *shard, int fd, uint32_t gen) {
+    if (fd < 0 || (size_t)fd >= shard->conn_capacity)
+        return NULL;
+    Connection *conn = shard->connections[fd];
+    if (!conn || conn->gen != gen || conn->closing)
+        return NULL;
+    return conn;
+}
+
+/* uring_data_conn: conexión a la que se refiere un resultado (ver uring_conn_data()) */
+static inline Connection *uring_data_conn(Shard *shard, uint64_t data) {
+    return uring_conn(shard, (int)((uint32_t)data >> 4), (uint32_t)(data >> 32));
+}
+
+/* uring_arm_accept: accept multishot sobre un socket de escucha; cada conexión nueva es un resultado */
+void uring_arm_accept(Shard *shard, int listen_fd) {
+    struct io_uring_sqe *sqe = uring_sqe(&shard->ring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK;
+    sqe->user_data = ((uint64_t)listen_fd << 4) | URING_ACCEPT;
+}
+
+/*
+ * uring_arm_recv
+ * - recv multishot: cada vez que llegan datos, el núcleo los deja en un
+ *   buffer del anillo proporcionado y produce un resultado con su número,
+ *   sin que haya que volver a pedir la lectura.
+ */
+void uring_arm_recv(Shard *shard, Connection *conn) {
+    struct io_uring_sqe *sqe = uring_sqe(&shard->ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    sqe->user_data = uring_conn_data(conn, URING_RECV);
+}
+
+/*
+ * uring_stop_recv
+ * - Cancela el recv multishot de una conexión que no se debe leer (ver
+ *   sched_input()). Lo que ya estaba en camino llega igualmente; el
+ *   resultado final del recv lo deja parado hasta que service_input() lo
+ *   vuelve a pedir.
+ */
+void uring_stop_recv(Shard *shard, Connection *conn) {
+    if (conn->recv != RECV_ARMED)
+        return;
+    struct io_uring_sqe *sqe = uring_sqe(&shard->ring);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = uring_conn_data(conn, URING_RECV);
+    sqe->user_data = URING_CANCEL;
+    conn->recv = RECV_CANCELLING;
+}
+
+/* uring_arm_poll: espera a que 'fd' tenga 'events'; multishot la mantiene activa */
+void uring_arm_poll(Shard *shard, int fd, uint32_t events, int multishot, uint64_t data) {
+    struct io_uring_sqe *sqe = uring_sqe(&shard->ring);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    sqe->len = multishot ? IORING_POLL_ADD_MULTI : 0;
+    sqe->user_data = data;
+}
+
+/* uring_submit_send: pide el sendmsg de lo que queda por enviar de 'send' */
+void uring_submit_send(Shard *shard, UringSend *send) {
+    memset(&send->hdr, 0, sizeof(send->hdr));
+    send->hdr.msg_iov = &send->iov[send->first];
+    send->hdr.msg_iovlen = (size_t)(send->count - send->first);
+
+    struct io_uring_sqe *sqe = uring_sqe(&shard->ring);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = send->fd;
+    sqe->addr = (uint64_t)(uintptr_t)&send->hdr;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uint64_t)(uintptr_t)send | URING_SEND;
+}
+
+/*
+ * uring_send
+ * - Pide un sendmsg con las tramas en memoria de la cabeza de la cola. Un
+ *   tramo del log en la cabeza se envía en el acto con sendfile() (io_uring
+ *   no lo tiene); si el socket se llena, se espera con un poll de escritura.
+ */
+void uring_send(Shard *shard, Connection *conn) {
+    MsgBuf *head = *out_queue_at(&conn->out, 0);
+    if (head->file_fd >= 0) {
+        if (flush_sync(shard, conn) < 0) {
+            schedule_close(shard, conn);
+        } else if (conn->out.count > 0) {
+            conn->poll_out = 1;
+            uring_arm_poll(shard, conn->fd, POLLOUT, 0, uring_conn_data(conn, URING_POLL_OUT));
+        } else if (conn->replays > 0) {
+            replay_pump(shard, conn);
+        }
+        return;
+    }
+
+    UringSend *send = slab_alloc(&shard->send_pool);
+    send->fd = conn->fd;
+    send->gen = conn->gen;
+    send->first = 0;
+    send->count = out_queue_iov(&conn->out, send->iov, URING_SEND_IOV);
+    for (int i = 0; i < send->count; i++)
+        send->msgs[i] = out_queue_pop(&conn->out);
+    uring_submit_send(shard, send);
+    conn->sending = 1;
+}
+
+/*
+ * uring_flush_sends
+ * - Al final del lote, un envío por cada conexión que recibió tramas. Una
+ *   conexión tiene como mucho un envío en curso; lo que llegue mientras
+ *   tanto sale cuando termina (ver uring_send_done()). La lista puede crecer
+ *   mientras se recorre (un reenvío desde el log que avanza).
+ */
+void uring_flush_sends(Shard *shard) {
+    for (size_t i = 0; i < shard->send_count; i++) {
+        Connection *conn = shard->send_list[i];
+        conn->send_listed = 0;
+        if (!conn->closing && !conn->sending && !conn->poll_out && conn->out.count > 0)
+            uring_send(shard, conn);
+    }
+    shard->send_count = 0;
+}
+
+/* uring_send_advance: descuenta 'n' bytes enviados; devuelve 1 si todavía queda algo */
+int uring_send_advance(UringSend *send, size_t n) {
+    while (send->first < send->count) {
+        struct iovec *v = &send->iov[send->first];
+        if (n < v->iov_len) {
+            v->iov_base = (char *)v->iov_base + n;
+            v->iov_len -= n;
+            return 1;
+        }
+        n -= v->iov_len;
+        send->first++;
+    }
+    return 0;
+}
+
+/*
+ * uring_send_done
+ * - Resultado de un sendmsg. Si el núcleo escribió sólo una parte, se pide
+ *   el resto; si no, se sueltan las tramas y se sigue con lo que se haya
+ *   encolado mientras tanto o con el reenvío desde el log.
+ */
+void uring_send_done(Shard *shard, UringSend *send, int res) {
+    Connection *conn = uring_conn(shard, send->fd, send->gen);
+    if (conn && (res == -EINTR || res == -EAGAIN || (res > 0 && uring_send_advance(send, (size_t)res)))) {
+        uring_submit_send(shard, send);
+        return;
+    }
+
+    int count = send->count;
+    for (int i = 0; i < count; i++)
+        msgbuf_unref(send->msgs[i]);
+    slab_free(&shard->send_pool, send);
+    if (!conn)
+        return;
+
+    conn->sending = 0;
+    if (res <= 0) {
+        schedule_close(shard, conn);
+        return;
+    }
+    conn->delivered += (uint64_t)count;
+    if (conn->replays > 0)
+        replay_pump(shard, conn);
+    if (conn->out.count > 0)
+        queue_send(shard, conn);
+}
+
+/*
+ * uring_recv_done
+ * - Procesa los datos de un resultado del recv multishot y devuelve el
+ *   buffer al anillo, también si la conexión ya se cerró. 0 bytes o un error
+ *   cierran la conexión (con entrada aplazada, cuando termine de
+ *   procesarla); -ENOBUFS (se agotaron los buffers) sólo obliga a pedir de
+ *   nuevo el recv, igual que cuando el núcleo lo da por terminado, salvo que
+ *   se haya cancelado con uring_stop_recv().
+ */
+void uring_recv_done(Shard *shard, const struct io_uring_cqe *cqe) {
+    Connection *conn = uring_data_conn(shard, cqe->user_data);
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        unsigned id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (conn && cqe->res > 0)
+            consume_input(shard, conn, uring_buf(&shard->bufs, id), (size_t)cqe->res);
+        uring_buf_recycle(&shard->bufs, id);
+    }
+    if (!conn || conn->closing)
+        return;
+    if (cqe->res == 0 && conn_stalled(conn)) {
+        conn->eof = 1; // queda entrada aplazada: se cierra después (ver service_input())
+        conn->recv = RECV_STOPPED;
+    } else if (cqe->res == 0 || (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED)) {
+        schedule_close(shard, conn);
+    } else if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        if (conn->recv == RECV_ARMED)
+            uring_arm_recv(shard, conn);
+        else
+            conn->recv = RECV_STOPPED;
+    }
+}
+
+/* uring_complete: atiende un resultado según el tipo guardado en user_data */
+void uring_complete(Shard *shard, const struct io_uring_cqe *cqe) {
+    uint64_t data = cqe->user_data;
+    int more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+    Connection *conn;
+
+    switch (data & 15) {
+    case URING_ACCEPT:
+        if (cqe->res >= 0 && (int)(data >> 4) == shard->peer_fd) {
+            fed_peer_accepted(shard, cqe->res);
+        } else if (cqe->res >= 0 && (int)(data >> 4) == shm_listen_fd) {
+            shm_accepted(shard, cqe->res);
+        } else if (cqe->res >= 0) {
+            add_connection(shard, cqe->res);
+            alog_write(&event_log, shard->id, ALOG_INFO, EV_CONNECTED, NULL, 0, NULL, 0, 0, 0);
+        } else {
+            fprintf(stderr, "Error en accept: %s\n", strerror(-cqe->res));
+        }
+        if (!more)
+            uring_arm_accept(shard, (int)(data >> 4));
+        break;
+    case URING_RECV:
+        uring_recv_done(shard, cqe);
+        break;
+    case URING_SEND:
+        uring_send_done(shard, (UringSend *)(uintptr_t)(data & ~(uint64_t)15), cqe->res);
+        break;
+    case URING_POLL:
+        handle_control(shard, (int)(data >> 4));
+        if (!more)
+            uring_arm_poll(shard, (int)(data >> 4), POLLIN, 1, data);
+        break;
+    case URING_POLL_OUT:
+        conn = uring_data_conn(shard, data);
+        if (conn) {
+            conn->poll_out = 0;
+            handle_writable(shard, conn);
+        }
+        break;
+    case URING_CANCEL:
+        break; // el recv cancelado da su propio resultado
+    case URING_SHM:
+        conn = uring_data_conn(shard, data);
+        if (conn && conn->shm && !conn->closing) {
+            shm_doorbell(shard, conn);
+            if (!more && !conn->closing)
+                uring_arm_poll(shard, conn->shm->doorbell, POLLIN, 1, data);
+        }
+        break;
+    }
+}
+
+/*
+ * shard_uring_setup
+ * - Crea el io_uring del shard (desde su propio hilo, ver uring_init()) con
+ *   su anillo de buffers de recepción y pide el accept multishot y las
+ *   esperas de los descriptores auxiliares. Devuelve -1 si el núcleo lo
+ *   rechaza; el shard usa entonces epoll.
+ */
+int shard_uring_setup(Shard *shard) {
+    int err = uring_init(&shard->ring, URING_ENTRIES);
+    if (err == 0) {
+        err = uring_buf_ring_init(&shard->ring, &shard->bufs, URING_BUF_GROUP, URING_BUF_COUNT, URING_BUF_SIZE);
+        if (err < 0)
+            close(shard->ring.fd);
+    }
+    if (err < 0) {
+        fprintf(stderr, "Shard %d: io_uring no disponible (%s), se usa epoll\n", shard->id, strerror(-err));
+        return -1;
+    }
+    slab_pool_init(&shard->send_pool, sizeof(UringSend), &shard->stats.heap_allocs);
+    shard->uring = 1;
+
+    uring_arm_accept(shard, shard->listen_fd);
+    if (shard->peer_fd >= 0)
+        uring_arm_accept(shard, shard->peer_fd);
+    if (shm_listen_fd >= 0)
+        uring_arm_accept(shard, shm_listen_fd);
+    int aux[] = { shard->event_fd, shard->signal_fd, shard->timer_fd };
+    for (size_t i = 0; i < sizeof(aux) / sizeof(aux[0]); i++)
+        if (aux[i] >= 0)
+            uring_arm_poll(shard, aux[i], POLLIN, 1, ((uint64_t)aux[i] << 4) | URING_POLL);
+    return 0;
+}
+
+/*
+ * shard_run_uring
+ * - Bucle de un shard con io_uring. Cada vuelta es una sola
+ *   io_uring_enter(), que entrega las peticiones acumuladas (envíos,
+ *   recv que hay que renovar) y espera resultados. Los resultados se leen del
+ *   anillo compartido sin llamadas al sistema y, como en el bucle de epoll,
+ *   al final del lote salen los envíos, se avisa a los demás shards y se
+ *   cierran las conexiones marcadas. Durante la espera activa (-B), o si
+ *   quedan conexiones en el turno rotatorio (ver sched_run()), la vuelta
+ *   sólo entrega peticiones, sin esperar.
+ */
+void *shard_run_uring(Shard *shard) {
+    int timeout = -1, busy = 0;
+    uint64_t enters = 0;
+
+    while (1) {
+        int r = uring_enter(&shard->ring, busy ? 0 : 1, timeout);
+        if (r < 0 && r != -EINTR && r != -ETIME && r != -EBUSY)
+            fprintf(stderr, "Error en io_uring_enter: %s\n", strerror(-r));
+
+        shard->turn++;
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_cqe(&shard->ring)) != NULL) {
+            struct io_uring_cqe done = *cqe;
+            uring_cqe_seen(&shard->ring);
+            uring_complete(shard, &done);
+        }
+
+        sched_run(shard);
+        busy = shm_busy(shard);
+        uring_flush_sends(shard);
+        timeout = sched_timeout(shard, shard_count > 1 && wake_shards(shard) ? 1 : -1);
+        busy |= timeout == 0;
+        close_pending(shard);
+        stat_add(&shard->stats.syscalls, shard->ring.enters - enters);
+        enters = shard->ring.enters;
+    }
+    return NULL;
+}
+
+/*
+ * shard_run
+ * - Bucle de eventos de un shard. epoll_wait bloquea hasta que algún
+ *   descriptor registrado esté listo y devuelve únicamente esos descriptores
+ *   (con -B, mientras haya actividad en los anillos de los clientes locales,
+ *   vuelve enseguida: ver shm_busy()). Con -E uring el shard usa
+ *   shard_run_uring() si el núcleo lo permite.
+ */
+void *shard_run(void *arg) {
+    Shard *shard = arg;
+    struct epoll_event events[MAX_EVENTS];
+    int timeout = -1;
+
+    if (use_uring && shard_uring_setup(shard) == 0)
+        return shard_run_uring(shard);
+    shard_epoll_setup(shard);
+
+    while (1) {
+        int nready = epoll_wait(shard->epoll_fd, events, MAX_EVENTS, shm_busy(shard) ? 0 : timeout);
+        stat_add(&shard->stats.syscalls, 1);
+        if (nready < 0) {
+            if (errno != EINTR)
+                perror("Error en epoll_wait");
+            continue;
+        }
+        shard->turn++;
+
+        for (int i = 0; i < nready; i++) {
+            int sd = events[i].data.fd;
+
+            /* Si un socket escuchante es legible, hay nuevas conexiones */
+            if (sd == shard->listen_fd || sd == shard->peer_fd || sd == shm_listen_fd) {
+                accept_connections(shard, sd);
+                continue;
+            }
+            if (handle_control(shard, sd))
+                continue;
+            if ((size_t)sd >= shard->conn_capacity || shard->connections[sd] == NULL)
+                continue;
+
+            Connection *conn = shard->connections[sd];
+            if (!conn->closing && (events[i].events & EPOLLOUT))
+                handle_writable(shard, conn);
+            if (!conn->closing && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+                handle_readable(shard, sd);
+        }
+
+        /* Un turno para las conexiones que se quedaron con entrada pendiente */
+        sched_run(shard);
+
+        /* Avisar una sola vez a cada shard que recibió mensajes en este lote;
+         * si algún canal quedó lleno, volver en 1 ms a reintentar. Sin esperar
+         * si queda alguien en el turno rotatorio, o hasta la próxima pausa */
+        timeout = sched_timeout(shard, shard_count > 1 && wake_shards(shard) ? 1 : -1);
+
+        /* Cerrar al final del lote, cuando nadie guarda punteros a las conexiones */
+        close_pending(shard);
+    }
+    return NULL;
+}
+
+/*
+ * main
+ * - Crea los shards (uno por hilo), cada uno con su socket TCP en modo
+ *   escucha, y los pone a correr. El shard 0 usa el hilo principal.
+ *   Cuando un cliente envía datos, su shard reensambla las tramas e
+ *   interpreta cada comando (ver handle_command() y common/frame.h).
+ *
+ * Interacciones clave con encabezados no estándar:
+ * - socket(AF_INET, SOCK_STREAM, 0): crea un socket TCP IPv4 (sys/socket.h).
+ * - bind(...): enlaza el socket a INADDR_ANY y PORT usando sockaddr_in
+ *              (arpa/inet.h define la estructura y helpers como htons()).
+ * - listen(), accept(): ponen el socket en modo escucha y aceptan conexiones
+ *                        TCP (sys/socket.h).
+ * - epoll_wait(): provisto por <sys/epoll.h>, devuelve sólo los descriptores
+ *                 que tienen actividad. A diferencia de select(), el coste de
+ *                 cada despertar no depende del número de conexiones inactivas
+ *                 y no existe el tope de FD_SETSIZE.
+ * - read()/close(): helpers POSIX de <unistd.h> para recibir bytes y cerrar
+ *                   sockets cuando los clientes se desconectan.
+ *
+ * Opciones:
+ *   -p <puerto>  puerto de escucha (por defecto PORT).
+ *   -t <hilos>   número de shards/hilos de eventos (por defecto 1).
+ *   -q <tramas>  profundidad máxima de la cola de salida de cada suscriptor
+ *                (por defecto DEFAULT_QUEUE_LIMIT).
+ *   -o <policy>  qué hacer cuando la cola se llena: drop-oldest (por
+ *                defecto), drop-newest o disconnect.
+ *   -L <dir>     guarda cada topic en un log en disco bajo <dir> y permite
+ *                "SUBSCRIBE <topic> FROM <posición>" (ver TCP/topic_log.h).
+ *   -R <MB>      tamaño máximo del log de cada topic (por defecto sin límite).
+ *   -A <seg>     antigüedad máxima de los mensajes del log (sin límite).
+ *   -S <MB>      tamaño de cada segmento del log (por defecto 16).
+ *   -E <motor>   epoll (por defecto) o uring (io_uring, Linux 6.0 o
+ *                posterior; si no está disponible se usa epoll).
+ *   -F <puerto>  acepta en <puerto> conexiones de otros brokers (federación,
+ *                ver TCP/federation.h).
+ *   -P <ip:puerto>  se conecta al puerto -F de otro broker; se puede repetir.
+ *                Cada enlace basta con darlo en uno de los dos extremos.
+ *   -U <ruta>    acepta clientes locales en el socket Unix <ruta> y les da
+ *                anillos en memoria compartida (ver TCP/shm_ring.h).
+ *   -B <µs>      espera activa: tras la última actividad de un cliente
+ *                local, el shard mira los anillos en bucle durante <µs>
+ *                antes de dormir (por defecto 0, sin espera activa).
+ *   -V           guarda la última publicación de cada topic y la envía a
+ *                quien se suscribe (ver send_last_values()).
+ *   -v <nivel>   registro en la salida estándar: off, info (conexiones y
+ *                suscripciones) o debug (además cada publicación, por
+ *                defecto). Se puede cambiar en marcha con "LOG".
+ *   -n <N>       con debug, registra sólo una de cada N publicaciones.
+ *   -b <KB>      bytes que se leen y procesan de cada conexión por vuelta
+ *                del bucle antes de pasar a la siguiente (por defecto
+ *                DEFAULT_READ_BUDGET; 0: sin límite, se vacía el socket).
+ *   -l <mensajes/s>[:ráfaga]  ritmo máximo de publicación de cada conexión;
+ *                por encima el broker deja de leerla un tiempo.
+ *   -T <mensajes/s>[:ráfaga]  lo mismo para cada topic, sumando todos sus
+ *                publicadores.
+ */
+int main(int argc, char *argv[]) {
+    int opt_char;
+
+    int fed_requested = 0;
+    int log_level = ALOG_DEBUG;
+    unsigned log_sample = 1;
+
+    while ((opt_char = getopt(argc, argv, "p:t:q:o:L:R:A:S:E:F:P:U:B:Vv:n:b:l:T:")) != -1) {
+        switch (opt_char) {
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 't':
+            shard_count = atoi(optarg);
+            if (shard_count < 1 || shard_count > MAX_SHARDS) {
+                fprintf(stderr, "El número de hilos debe estar entre 1 y %d\n", MAX_SHARDS);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'q':
+            queue_limit = strtoul(optarg, NULL, 10);
+            if (queue_limit == 0) {
+                fprintf(stderr, "La profundidad de cola debe ser mayor que 0\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'o':
+            if (overflow_policy_parse(optarg, &overflow_policy) < 0) {
+                fprintf(stderr, "Política desconocida: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'L':
+            log_store.dir = optarg;
+            break;
+        case 'R':
+            log_store.max_bytes = (size_t)strtoull(optarg, NULL, 10) << 20;
+            break;
+        case 'A':
+            log_store.max_age = (time_t)strtol(optarg, NULL, 10);
+            break;
+        case 'S':
+            log_store.segment_size = (size_t)strtoull(optarg, NULL, 10) << 20;
+            if (log_store.segment_size < LOG_MIN_SEGMENT) {
+                fprintf(stderr, "Los segmentos deben ocupar al menos %zu bytes\n", (size_t)LOG_MIN_SEGMENT);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'E':
+            if (strcmp(optarg, "uring") == 0) {
+                use_uring = 1;
+            } else if (strcmp(optarg, "epoll") != 0) {
+                fprintf(stderr, "Motor desconocido: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'F':
+            peer_port = atoi(optarg);
+            fed_requested = 1;
+            break;
+        case 'P': {
+            FedPeer *peer = fed_peer_slot(&federation);
+            if (!peer || fed_parse_addr(optarg, &peer->addr) < 0) {
+                fprintf(stderr, "Peer inválido: %s (se espera ip:puerto, como mucho %d)\n", optarg, FED_MAX_PEERS);
+                exit(EXIT_FAILURE);
+            }
+            peer->outgoing = 1;
+            fed_requested = 1;
+            break;
+        }
+        case 'U':
+            shm_path = optarg;
+            break;
+        case 'B':
+            busy_poll_ns = strtoull(optarg, NULL, 10) * 1000;
+            break;
+        case 'V':
+            last_value_cache = 1;
+            break;
+        case 'v':
+            if (alog_level_parse(optarg, strlen(optarg), &log_level) < 0) {
+                fprintf(stderr, "Nivel de registro desconocido: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'n':
+            log_sample = (unsigned)strtoul(optarg, NULL, 10);
+            if (log_sample == 0) {
+                fprintf(stderr, "El muestreo del registro debe ser mayor que 0\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'b':
+            read_budget = (size_t)strtoull(optarg, NULL, 10) * 1024;
+            if (read_budget == 0)
+                read_budget = SIZE_MAX;
+            break;
+        case 'l':
+            if (rate_limit_parse(optarg, &publisher_limit) < 0) {
+                fprintf(stderr, "Ritmo inválido: %s (se espera mensajes/s[:ráfaga])\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'T':
+            if (rate_limit_parse(optarg, &topic_limit) < 0) {
+                fprintf(stderr, "Ritmo inválido: %s (se espera mensajes/s[:ráfaga])\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        default:
+            fprintf(stderr, "Uso: %s [-p puerto] [-t hilos] [-q tramas] "
+                            "[-o drop-oldest|drop-newest|disconnect] "
+                            "[-L dir [-R MB] [-A segundos] [-S MB]] [-E epoll|uring] "
+                            "[-F puerto_peers] [-P ip:puerto ...] [-U ruta_unix [-B µs]] [-V] "
+                            "[-v off|info|debug] [-n N] [-b KB] [-l mensajes/s[:ráfaga]] "
+                            "[-T mensajes/s[:ráfaga]]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (use_uring && !uring_supported()) {
+        fprintf(stderr, "Este núcleo no admite el motor io_uring, se usa epoll\n");
+        use_uring = 0;
+    }
+    raise_fd_limit();
+    /* writev() no acepta MSG_NOSIGNAL: un suscriptor que cierra no debe matar al broker */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Bloquear SIGUSR1 antes de crear hilos (lo heredan); llega por signalfd */
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    links = calloc((size_t)shard_count * shard_count, sizeof(ShardLink));
+    if (!links) {
+        perror("Error reservando memoria");
+        exit(EXIT_FAILURE);
+    }
+    for (int from = 0; from < shard_count; from++)
+        for (int to = 0; to < shard_count; to++)
+            if (from != to)
+                spsc_init(&shard_link(from, to)->queue, LINK_CAPACITY);
+
+    rate_table_init(&topic_buckets);
+    for (int i = 0; i < shard_count; i++)
+        shard_init(&shards[i], i);
+    alog_init(&event_log, shard_count, STDOUT_FILENO, format_event, log_level, log_sample);
+    for (int i = 0; i < shard_count; i++)
+        alog_ring_counter(&event_log, i, &shards[i].stats.log_dropped);
+
+    shards[0].signal_fd = signalfd(-1, &mask, SFD_NONBLOCK);
+
+    if (log_store.dir)
+        log_store_open(&log_store);
+    if (shm_path)
+        shm_listen_fd = create_unix_listener(shm_path);
+    if (fed_requested) {
+        fed_init(&federation);
+        if (peer_port > 0)
+            shards[0].peer_fd = create_listener(peer_port);
+    }
+
+    /* La retención por tamaño se aplica al añadir; la de antigüedad necesita
+     * un barrido periódico para los topics que ya no reciben. La federación
+     * usa el mismo timer, más a menudo, para conectar con sus peers */
+    long tick_ms = federation.enabled ? FED_TICK_MS : log_store.dir && log_store.max_age > 0 ? 1000 : 0;
+    if (tick_ms > 0) {
+        struct timespec every = { tick_ms / 1000, (tick_ms % 1000) * 1000000 };
+        struct itimerspec timer = { .it_interval = every, .it_value = every };
+        shards[0].timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+        if (shards[0].timer_fd < 0 || timerfd_settime(shards[0].timer_fd, 0, &timer, NULL) < 0) {
+            perror("Error en timerfd");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    printf("Broker TCP escuchando en el puerto %d (%d hilos, cola %zu, política %s, motor %s)...\n",
+           port, shard_count, queue_limit, overflow_policy_name(overflow_policy), use_uring ? "uring" : "epoll");
+    if (federation.enabled && peer_port > 0)
+        printf("Federación: broker %016llx, peers en el puerto %d\n", (unsigned long long)federation.id, peer_port);
+    else if (federation.enabled)
+        printf("Federación: broker %016llx\n", (unsigned long long)federation.id);
+    if (last_value_cache)
+        printf("Caché de últimos valores activada: cada SUBSCRIBE recibe el valor actual\n");
+    if (shm_path)
+        printf("Clientes locales por memoria compartida en %s (espera activa %llu µs)\n", shm_path,
+               (unsigned long long)(busy_poll_ns / 1000));
+    if (log_level != ALOG_DEBUG || log_sample > 1)
+        printf("Registro: nivel %s, una de cada %u publicaciones\n", alog_level_name(log_level), log_sample);
+    if (read_budget == SIZE_MAX)
+        printf("Lectura sin turnos: cada conexión se lee hasta vaciar su socket\n");
+    else if (read_budget != DEFAULT_READ_BUDGET)
+        printf("Lectura por turnos de %zu KB por conexión\n", read_budget / 1024);
+    if (publisher_limit.interval_ns)
+        printf("Ritmo máximo por publicador: %llu mensajes/s, ráfagas de %llu\n",
+               1000000000ull / publisher_limit.interval_ns,
+               (unsigned long long)(publisher_limit.burst_ns / publisher_limit.interval_ns));
+    if (topic_limit.interval_ns)
+        printf("Ritmo máximo por topic: %llu mensajes/s, ráfagas de %llu\n", 1000000000ull / topic_limit.interval_ns,
+               (unsigned long long)(topic_limit.burst_ns / topic_limit.interval_ns));
+    alog_start(&event_log);
+
+    for (int i = 1; i < shard_count; i++) {
+        if (pthread_create(&shards[i].thread, NULL, shard_run, &shards[i]) != 0) {
+            perror("Error creando hilo");
+            exit(EXIT_FAILURE);
+        }
+    }
+    shard_run(&shards[0]);
+    return 0;
+}
@@ -0,0 +1,393 @@
+/*
+ * federation.h
+ *
+ * Estado de la federación de brokers TCP: varios procesos broker_tcp unidos
+ * por conexiones TCP ("peers") que se cuentan qué filtros tienen
+ * suscriptores locales, de modo que una publicación sólo viaja hacia los
+ * brokers que la quieren. Aquí sólo está el estado y sus reglas; los
+ * sockets y las tramas los lleva el broker (shard 0).
+ *
+ * Interés. Cada broker tiene un id aleatorio de 64 bits. Su interés es el
+ * conjunto de filtros con al menos un suscriptor en alguno de sus shards, y
+ * cada cambio ("+" al aparecer el primero, "-" al irse el último) lleva una
+ * versión nueva. Los cambios se propagan por inundación a todos los peers:
+ * quien recibe "INTEREST <origen> <versión> <+|-> <filtro>" lo aplica y lo
+ * reenvía a los demás sólo si la versión es más nueva que la que tenía para
+ * ese (origen, filtro). Así cada anuncio cruza cada enlace como mucho una
+ * vez por sentido aunque la malla tenga ciclos, las bajas se propagan igual
+ * que las altas (no quedan intereses "fantasma" rebotando entre dos peers)
+ * y, como cada filtro tiene su propia versión, el orden de llegada entre
+ * filtros distintos no importa. Las bajas se guardan (present = 0) para
+ * seguir reconociendo anuncios viejos.
+ *
+ * Rutas. El peer por el que llegó primero la versión vigente de un (origen,
+ * filtro) es el siguiente salto hacia ese origen: una publicación se
+ * reenvía sólo a los peers que son siguiente salto de alguna entrada cuyo
+ * filtro casa con el topic (el mismo árbol de common/topic_trie.h que usan
+ * las suscripciones). Si se cae un peer, las entradas que dependían de él
+ * se quedan sin salto y se pide a los demás que repitan su estado ("SYNC");
+ * quien repite omite lo que aprendió del que pregunta, para no ofrecerle
+ * rutas que vuelven a él.
+ *
+ * Duplicados y bucles. Cada publicación federada lleva el id del broker
+ * donde se publicó, un número de secuencia de ese broker y los saltos que
+ * lleva. En una malla puede llegar por dos caminos: cada broker recuerda,
+ * por origen, una ventana de las últimas FED_WINDOW secuencias vistas y
+ * descarta las repetidas. Nunca se reenvía al peer del que llegó ni al
+ * broker de origen, y FED_MAX_HOPS corta cualquier bucle que quedara.
+ *
+ * Versiones y secuencias empiezan en el reloj de tiempo real en
+ * nanosegundos: un broker que se reinicia sigue numerando por encima de lo
+ * que recuerdan sus peers. Si un peer anuncia sobre este broker algo que ya
+ * no es cierto (un filtro de antes del reinicio), el broker lo corrige con
+ * una versión nueva (fed_own_claim()).
+ */
+
+#ifndef FEDERATION_H
+#define FEDERATION_H
+
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../common/topic_trie.h"
+
+#define FED_MAX_PEERS 32   /* conexiones con otros brokers (entrantes y -P) */
+#define FED_MAX_HOPS 16    /* saltos como máximo de una publicación federada */
+#define FED_WINDOW 4096    /* secuencias recientes recordadas por origen (múltiplo de 64) */
+
+/*
+ * FedRoute
+ * - Interés de un broker (origin) en un filtro: la entrada está en la lista
+ *   del nodo del filtro. 'hop' es el peer que la trajo, -1 para las del
+ *   propio broker o si se perdió el peer.
+ */
+typedef struct {
+    TrieSub link;        /* enlace en el nodo del filtro; debe ir primero */
+    uint64_t origin;
+    uint64_t version;
+    int present;         /* 0: baja, se guarda sólo por su versión */
+    int hop;
+    uint32_t shards;     /* sólo las propias: shards con suscriptores al filtro */
+} FedRoute;
+
+/* Secuencias vistas de un origen: bit (seq % FED_WINDOW) de las FED_WINDOW últimas */
+typedef struct {
+    uint64_t origin;
+    uint64_t max_seq;
+    uint64_t bits[FED_WINDOW / 64];
+} FedSeen;
+
+/*
+ * FedPeer
+ * - Una conexión con otro broker. Las configuradas con -P guardan su
+ *   dirección y se reconectan; las entrantes (-F) liberan su hueco al
+ *   cerrarse.
+ */
+typedef struct {
+    int used;
+    int fd;                  /* conexión establecida, -1 si no hay */
+    int connect_fd;          /* connect() no bloqueante en curso, -1 si no */
+    uint64_t id;             /* id del broker remoto, 0 hasta recibir "PEER" */
+    int outgoing;            /* configurado con -P */
+    struct sockaddr_in addr; /* sólo los de -P */
+    uint64_t retry_ns;       /* próximo intento de conexión (CLOCK_MONOTONIC) */
+} FedPeer;
+
+/* Cambio de interés local que un shard deja al shard 0 */
+typedef struct {
+    char *filter;
+    size_t len;
+    int delta;               /* +1 primer suscriptor del shard, -1 el último */
+} FedChange;
+
+typedef struct {
+    int enabled;
+    uint64_t id;
+    uint64_t next_version;
+    uint64_t next_seq;
+    TopicTrie routes;        /* filtro -> FedRoute de cada origen */
+    FedSeen *seen;
+    size_t seen_count;
+    size_t seen_capacity;
+    FedPeer peers[FED_MAX_PEERS];
+    int sync_pending;        /* pedir SYNC a los peers en el próximo tick */
+
+    /* Buzón de cambios de interés: lo escriben todos los shards */
+    pthread_mutex_t lock;
+    FedChange *changes;
+    size_t change_count;
+    size_t change_capacity;
+} Federation;
+
+static inline uint64_t fed_realtime_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/* fed_init: id aleatorio y numeración desde el reloj (ver arriba) */
+static inline void fed_init(Federation *fed) {
+    uint64_t now = fed_realtime_ns();
+    uint64_t x = now ^ ((uint64_t)getpid() << 32);
+    /* splitmix64: mezcla reloj y pid en un id sin patrones visibles */
+    x += 0x9e3779b97f4a7c15ull;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    fed->id = (x ^ (x >> 31)) | 1;
+    fed->next_version = now;
+    fed->next_seq = now;
+    fed->enabled = 1;
+    for (int i = 0; i < FED_MAX_PEERS; i++) {
+        fed->peers[i].fd = -1;
+        fed->peers[i].connect_fd = -1;
+    }
+    pthread_mutex_init(&fed->lock, NULL);
+}
+
+static inline int fed_peer_index(const Federation *fed, const FedPeer *peer) {
+    return (int)(peer - fed->peers);
+}
+
+/* fed_peer_slot: hueco libre para un peer nuevo, o NULL si no quedan */
+static inline FedPeer *fed_peer_slot(Federation *fed) {
+    for (int i = 0; i < FED_MAX_PEERS; i++) {
+        if (!fed->peers[i].used) {
+            FedPeer *peer = &fed->peers[i];
+            memset(peer, 0, sizeof(*peer));
+            peer->used = 1;
+            peer->fd = -1;
+            peer->connect_fd = -1;
+            return peer;
+        }
+    }
+    return NULL;
+}
+
+/* fed_route_find: entrada de 'origin' en el nodo de un filtro, o NULL */
+static inline FedRoute *fed_route_find(const TrieNode *node, uint64_t origin) {
+    for (TrieSub *link = node ? node->subs : NULL; link; link = link->next) {
+        FedRoute *r = (FedRoute *)link;
+        if (r->origin == origin)
+            return r;
+    }
+    return NULL;
+}
+
+static inline FedRoute *fed_route_new(TrieNode *node, uint64_t origin) {
+    FedRoute *r = calloc(1, sizeof(FedRoute));
+    if (!r) {
+        perror("Error reservando memoria");
+        exit(EXIT_FAILURE);
+    }
+    r->origin = origin;
+    r->hop = -1;
+    trie_sub_link(node, &r->link);
+    return r;
+}
+
+/*
+ * fed_route_update
+ * - Aplica un anuncio de otro broker recibido por el peer 'hop'. Devuelve
+ *   la entrada si era nuevo (hay que reenviarlo a los demás peers) y NULL si
+ *   ya se conocía. Un anuncio con la misma versión sólo sirve para recuperar
+ *   el salto de una entrada que lo perdió.
+ */
+static inline FedRoute *fed_route_update(Federation *fed, const char *filter, size_t len, uint64_t origin,
+                                   uint64_t version, int present, int hop) {
+    TrieNode *node = trie_insert(&fed->routes, filter, len);
+    FedRoute *r = fed_route_find(node, origin);
+    if (!r)
+        r = fed_route_new(node, origin);
+    else if (version < r->version)
+        return NULL;
+    else if (version == r->version) {
+        if (r->hop < 0)
+            r->hop = hop;
+        return NULL;
+    }
+    r->version = version;
+    r->present = present;
+    r->hop = hop;
+    return r;
+}
+
+/*
+ * fed_local_change
+ * - Aplica el cambio de un shard en el interés propio. Devuelve la entrada
+ *   si el broker en conjunto ganó o perdió el filtro (hay que anunciarlo) y
+ *   NULL si sólo cambió el número de shards interesados.
+ */
+static inline FedRoute *fed_local_change(Federation *fed, const char *filter, size_t len, int delta) {
+    TrieNode *node = delta > 0 ? trie_insert(&fed->routes, filter, len) : trie_find(&fed->routes, filter, len);
+    FedRoute *r = fed_route_find(node, fed->id);
+    if (delta > 0) {
+        if (!r)
+            r = fed_route_new(node, fed->id);
+        if (r->shards++ > 0)
+            return NULL;
+        r->present = 1;
+    } else {
+        if (!r || r->shards == 0 || --r->shards > 0)
+            return NULL;
+        r->present = 0;
+    }
+    r->version = ++fed->next_version;
+    return r;
+}
+
+/*
+ * fed_own_claim
+ * - Un peer anuncia algo sobre este broker. Si coincide con la realidad no
+ *   hay nada que hacer; si no (un estado de antes de reiniciar), devuelve la
+ *   entrada propia con una versión mayor que la anunciada, para propagarla.
+ */
+static inline FedRoute *fed_own_claim(Federation *fed, const char *filter, size_t len, uint64_t version,
+                                      int present) {
+    TrieNode *node = trie_find(&fed->routes, filter, len);
+    FedRoute *r = fed_route_find(node, fed->id);
+    if (r ? r->present == present && r->version >= version : !present)
+        return NULL;
+    if (!r)
+        r = fed_route_new(trie_insert(&fed->routes, filter, len), fed->id);
+    if (fed->next_version < version)
+        fed->next_version = version;
+    r->version = ++fed->next_version;
+    return r;
+}
+
+/* fed_routes_lost: las entradas aprendidas del peer 'hop' se quedan sin salto */
+static inline void fed_routes_lost_visit(TrieNode *node, void *ctx) {
+    int hop = *(int *)ctx;
+    for (TrieSub *link = node->subs; link; link = link->next)
+        if (((FedRoute *)link)->hop == hop)
+            ((FedRoute *)link)->hop = -1;
+}
+
+static inline void fed_routes_lost(Federation *fed, int hop) {
+    trie_walk(&fed->routes.root, fed_routes_lost_visit, &hop);
+}
+
+static inline void fed_match_visit(TrieNode *node, void *ctx) {
+    uint32_t *mask = ctx;
+    for (TrieSub *link = node->subs; link; link = link->next) {
+        FedRoute *r = (FedRoute *)link;
+        if (r->present && r->hop >= 0)
+            *mask |= 1u << r->hop;
+    }
+}
+
+/* fed_match: peers (un bit por índice) que son siguiente salto hacia algún interesado en 'topic' */
+static inline uint32_t fed_match(Federation *fed, const char *topic, size_t len) {
+    uint32_t mask = 0;
+    trie_match(&fed->routes, topic, len, fed_match_visit, &mask);
+    return mask;
+}
+
+/*
+ * fed_seen
+ * - Anota la publicación 'seq' de 'origin' y devuelve 1 si ya había
+ *   llegado (o es tan antigua que ya salió de la ventana).
+ */
+static inline int fed_seen(Federation *fed, uint64_t origin, uint64_t seq) {
+    FedSeen *s = NULL;
+    for (size_t i = 0; i < fed->seen_count && !s; i++)
+        if (fed->seen[i].origin == origin)
+            s = &fed->seen[i];
+    if (!s) {
+        if (fed->seen_count == fed->seen_capacity) {
+            fed->seen_capacity = fed->seen_capacity ? fed->seen_capacity * 2 : 8;
+            fed->seen = topic_alloc(fed->seen, fed->seen_capacity * sizeof(FedSeen));
+        }
+        s = &fed->seen[fed->seen_count++];
+        memset(s, 0, sizeof(*s));
+        s->origin = origin;
+        s->max_seq = seq;
+    } else if (seq > s->max_seq) {
+        /* Avanza la ventana: se olvidan las secuencias que quedan fuera */
+        if (seq - s->max_seq >= FED_WINDOW)
+            memset(s->bits, 0, sizeof(s->bits));
+        else
+            for (uint64_t q = s->max_seq + 1; q < seq; q++)
+                s->bits[(q % FED_WINDOW) / 64] &= ~(1ull << (q % 64));
+        s->max_seq = seq;
+    } else if (s->max_seq - seq >= FED_WINDOW) {
+        return 1;
+    } else if (s->bits[(seq % FED_WINDOW) / 64] & (1ull << (seq % 64))) {
+        return 1;
+    }
+    s->bits[(seq % FED_WINDOW) / 64] |= 1ull << (seq % 64);
+    return 0;
+}
+
+/*
+ * fed_post
+ * - Deja en el buzón un cambio de interés de un shard; 'filter' pasa a ser
+ *   del buzón. Suscribirse es poco frecuente, así que basta un mutex.
+ */
+static inline void fed_post(Federation *fed, char *filter, size_t len, int delta) {
+    pthread_mutex_lock(&fed->lock);
+    if (fed->change_count == fed->change_capacity) {
+        fed->change_capacity = fed->change_capacity ? fed->change_capacity * 2 : 16;
+        fed->changes = topic_alloc(fed->changes, fed->change_capacity * sizeof(FedChange));
+    }
+    fed->changes[fed->change_count++] = (FedChange){ .filter = filter, .len = len, .delta = delta };
+    pthread_mutex_unlock(&fed->lock);
+}
+
+/* fed_take: se lleva los cambios del buzón (el llamador libera el arreglo y los filtros) */
+static inline FedChange *fed_take(Federation *fed, size_t *count) {
+    pthread_mutex_lock(&fed->lock);
+    FedChange *changes = fed->changes;
+    *count = fed->change_count;
+    fed->changes = NULL;
+    fed->change_count = fed->change_capacity = 0;
+    pthread_mutex_unlock(&fed->lock);
+    return changes;
+}
+
+/*
+ * fed_next_number
+ * - Lee un número en base 'base' al principio de [*p, end) seguido de un
+ *   espacio, y deja *p detrás del espacio. Devuelve 0 si no lo hay.
+ */
+static inline int fed_next_number(const char **p, const char *end, int base, uint64_t *out) {
+    uint64_t v = 0;
+    const char *s = *p;
+    for (; s < end && *s != ' '; s++) {
+        int d;
+        if (*s >= '0' && *s <= '9')
+            d = *s - '0';
+        else if (base == 16 && *s >= 'a' && *s <= 'f')
+            d = *s - 'a' + 10;
+        else
+            return 0;
+        v = v * (uint64_t)base + (uint64_t)d;
+    }
+    if (s == *p || s == end)
+        return 0;
+    *out = v;
+    *p = s + 1;
+    return 1;
+}
+
+/* fed_parse_addr: "ip:puerto" de la opción -P */
+static inline int fed_parse_addr(const char *text, struct sockaddr_in *addr) {
+    char host[64];
+    const char *colon = strrchr(text, ':');
+    if (!colon || (size_t)(colon - text) >= sizeof(host))
+        return -1;
+    memcpy(host, text, colon - text);
+    host[colon - text] = '\0';
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons((uint16_t)atoi(colon + 1));
+    return inet_pton(AF_INET, host, &addr->sin_addr) == 1 && addr->sin_port ? 0 : -1;
+}
+
+#endif /* FEDERATION_H */
@@ -0,0 +1,348 @@
+/*
+ * out_queue.h
+ *
+ * Cola de salida acotada por conexión para el broker TCP. Cuando el socket
+ * de un suscriptor no acepta más datos (send() devuelve EAGAIN), las tramas
+ * pendientes se guardan aquí y se envían cuando epoll avisa que el socket
+ * vuelve a ser escribible. Así un suscriptor lento nunca bloquea el bucle de
+ * eventos ni al resto de clientes.
+ *
+ * La cola es un anillo que crece por duplicación hasta el límite configurado,
+ * de modo que las conexiones que nunca se atrasan no reservan memoria. Al
+ * llegar al límite se aplica una política de desbordamiento (OverflowPolicy).
+ *
+ * Las entradas no son copias: cada una es una referencia a un MsgBuf
+ * compartido (common/msgbuf.h), y writev() envía directamente desde él. Las
+ * entradas que describen un tramo de fichero (reenvío desde el log de un
+ * topic) se envían con sendfile(), directamente desde la caché de páginas.
+ *
+ * Con el motor io_uring del broker las tramas salen de la cola al pedir su
+ * envío (out_queue_pop()): el envío en curso se queda con sus referencias y
+ * la cola sólo guarda lo que todavía no se ha pedido.
+ *
+ * Con conflación (out_queue_enable_conflation()) una trama que llega para un
+ * topic que ya tiene otra esperando en la cola ocupa su lugar en vez de
+ * ponerse al final: el suscriptor recibe sólo el valor más reciente de cada
+ * topic y su cola nunca tiene más tramas que topics distintos.
+ */
+
+#ifndef OUT_QUEUE_H
+#define OUT_QUEUE_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "../common/msgbuf.h"
+#include "../common/topic_table.h"
+
+#define OUT_QUEUE_MAX_IOV 64 /* tramas enviadas por cada writev() */
+#define OUT_QUEUE_MARKS_MIN 16 /* entradas iniciales del índice de conflación */
+
+/* Qué hacer cuando la cola de un suscriptor está llena */
+typedef enum {
+    OVERFLOW_DROP_OLDEST, /* descartar la trama más antigua que no esté a medio enviar */
+    OVERFLOW_DROP_NEWEST, /* descartar la trama que acaba de llegar */
+    OVERFLOW_DISCONNECT   /* cerrar la conexión del suscriptor */
+} OverflowPolicy;
+
+/*
+ * OutQueueMark
+ * - Dónde quedó en la cola la última trama encolada de un topic. 'pos' es
+ *   absoluta (ver OutQueue.base), así que sigue valiendo cuando la cabeza
+ *   avanza; la marca sólo se usa si esa posición sigue en la cola y guarda
+ *   todavía la misma trama.
+ */
+typedef struct {
+    uint64_t pos;
+    MsgBuf *msg;         /* sin referencia propia: la tiene la cola */
+} OutQueueMark;
+
+typedef struct {
+    MsgBuf **ring;       /* anillo de referencias, capacidad potencia de dos */
+    size_t cap;
+    size_t head;         /* índice de la trama más antigua */
+    size_t count;        /* tramas en cola */
+    size_t head_sent;    /* bytes de ring[head] ya escritos en el socket */
+    size_t bytes;        /* bytes pendientes en total */
+    size_t high_water;   /* profundidad máxima observada */
+    uint64_t dropped;    /* tramas descartadas por desbordamiento */
+    uint64_t syscalls;   /* llamadas a writev()/sendfile() */
+    uint64_t base;       /* posición absoluta de ring[head]: tramas que ya salieron */
+    OutQueueMark *marks; /* índice de conflación por hash del topic, NULL si no conflaciona */
+    size_t mark_cap;     /* potencia de dos */
+} OutQueue;
+
+static inline const char *overflow_policy_name(OverflowPolicy p) {
+    switch (p) {
+    case OVERFLOW_DROP_OLDEST: return "drop-oldest";
+    case OVERFLOW_DROP_NEWEST: return "drop-newest";
+    default:                   return "disconnect";
+    }
+}
+
+/* overflow_policy_parse: devuelve 0 y rellena *p si 'name' es válido */
+static inline int overflow_policy_parse(const char *name, OverflowPolicy *p) {
+    if (strcmp(name, "drop-oldest") == 0)
+        *p = OVERFLOW_DROP_OLDEST;
+    else if (strcmp(name, "drop-newest") == 0)
+        *p = OVERFLOW_DROP_NEWEST;
+    else if (strcmp(name, "disconnect") == 0)
+        *p = OVERFLOW_DISCONNECT;
+    else
+        return -1;
+    return 0;
+}
+
+static inline MsgBuf **out_queue_at(OutQueue *q, size_t i) {
+    return &q->ring[(q->head + i) & (q->cap - 1)];
+}
+
+/* out_queue_grow: duplica el anillo conservando el orden de las tramas */
+static inline void out_queue_grow(OutQueue *q) {
+    size_t cap = q->cap ? q->cap * 2 : 8;
+    MsgBuf **ring = malloc(cap * sizeof(MsgBuf *));
+    if (!ring) {
+        perror("Error reservando memoria");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < q->count; i++)
+        ring[i] = *out_queue_at(q, i);
+    free(q->ring);
+    q->ring = ring;
+    q->cap = cap;
+    q->head = 0;
+}
+
+/* out_queue_drop_oldest: descarta la trama más antigua que no está a medio enviar */
+static inline void out_queue_drop_oldest(OutQueue *q) {
+    size_t victim = q->head_sent > 0 ? 1 : 0;
+    if (victim >= q->count)
+        return;
+    MsgBuf **m = out_queue_at(q, victim);
+    q->bytes -= (*m)->len;
+    msgbuf_unref(*m);
+    /* Desplazar la trama a medio enviar (si la hay) una posición hacia delante */
+    if (victim == 1)
+        *m = *out_queue_at(q, 0);
+    q->head = (q->head + 1) & (q->cap - 1);
+    q->base++;
+    q->count--;
+    q->dropped++;
+}
+
+/*
+ * out_queue_push
+ * - Encola una referencia al mensaje (sin copiarlo). 'limit' es la
+ *   profundidad máxima en tramas. Devuelve 0 si se encoló (aunque se haya
+ *   descartado la más antigua), 1 si se descartó la nueva y -1 si la
+ *   política pide desconectar.
+ */
+static inline int out_queue_push(OutQueue *q, MsgBuf *msg, size_t limit, OverflowPolicy policy) {
+    if (q->count >= limit) {
+        if (policy == OVERFLOW_DISCONNECT)
+            return -1;
+        if (policy == OVERFLOW_DROP_NEWEST || (q->count == 1 && q->head_sent > 0)) {
+            q->dropped++;
+            return 1;
+        }
+        out_queue_drop_oldest(q);
+    }
+    if (q->count == q->cap)
+        out_queue_grow(q);
+
+    *out_queue_at(q, q->count) = msgbuf_ref(msg);
+    q->count++;
+    q->bytes += msg->len;
+    if (q->count > q->high_water)
+        q->high_water = q->count;
+    return 0;
+}
+
+/* out_queue_advance: descuenta 'n' bytes escritos y suelta las tramas completas */
+static inline void out_queue_advance(OutQueue *q, size_t n) {
+    q->bytes -= n;
+    while (n > 0) {
+        MsgBuf *m = *out_queue_at(q, 0);
+        size_t left = m->len - q->head_sent;
+        if (n < left) {
+            q->head_sent += n;
+            break;
+        }
+        n -= left;
+        msgbuf_unref(m);
+        q->head = (q->head + 1) & (q->cap - 1);
+        q->base++;
+        q->count--;
+        q->head_sent = 0;
+    }
+}
+
+/*
+ * out_queue_pop
+ * - Saca la trama de la cabeza y devuelve su referencia al llamador, que
+ *   pasa a ser quien la envía (y la suelta). Si estaba a medio enviar, lo ya
+ *   enviado se descuenta igual que si se hubiera completado.
+ */
+static inline MsgBuf *out_queue_pop(OutQueue *q) {
+    MsgBuf *m = *out_queue_at(q, 0);
+    q->bytes -= m->len - q->head_sent;
+    q->head = (q->head + 1) & (q->cap - 1);
+    q->base++;
+    q->count--;
+    q->head_sent = 0;
+    return m;
+}
+
+/*
+ * out_queue_iov
+ * - Describe en 'iov' (como mucho 'max' entradas) las tramas en memoria de
+ *   la cabeza de la cola, hasta el primer tramo de fichero, y devuelve
+ *   cuántas entradas usó.
+ */
+static inline int out_queue_iov(OutQueue *q, struct iovec *iov, int max) {
+    int iovcnt = 0;
+    for (size_t i = 0; i < q->count && iovcnt < max; i++) {
+        MsgBuf *m = *out_queue_at(q, i);
+        if (m->file_fd >= 0)
+            break;
+        size_t skip = i == 0 ? q->head_sent : 0;
+        iov[iovcnt].iov_base = m->data + skip;
+        iov[iovcnt].iov_len = m->len - skip;
+        iovcnt++;
+    }
+    return iovcnt;
+}
+
+/*
+ * out_queue_flush
+ * - Escribe con writev() tantas tramas como acepte el socket no bloqueante.
+ *   Un tramo de fichero en la cabeza se envía con sendfile(); writev() se
+ *   detiene antes del siguiente tramo de fichero para conservar el orden.
+ *   Devuelve 0 si la cola quedó vacía o el socket se llenó (EAGAIN) y -1 si
+ *   hubo un error que obliga a cerrar la conexión.
+ */
+static inline int out_queue_flush(OutQueue *q, int fd) {
+    while (q->count > 0) {
+        MsgBuf *head = *out_queue_at(q, 0);
+        ssize_t n;
+        if (head->file_fd >= 0) {
+            off_t off = (off_t)(head->file_off + q->head_sent);
+            n = sendfile(fd, head->file_fd, &off, head->len - q->head_sent);
+            if (n == 0)
+                return -1; /* el fichero es más corto de lo anunciado */
+        } else {
+            struct iovec iov[OUT_QUEUE_MAX_IOV];
+            n = writev(fd, iov, out_queue_iov(q, iov, OUT_QUEUE_MAX_IOV));
+        }
+        q->syscalls++;
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        out_queue_advance(q, (size_t)n);
+    }
+    return 0;
+}
+
+/*
+ * out_queue_mark_live
+ * - Devuelve la entrada de la cola a la que apunta 'm' si todavía se puede
+ *   sustituir: sigue en la cola con la misma trama y no está a medio enviar.
+ */
+static inline MsgBuf **out_queue_mark_live(OutQueue *q, const OutQueueMark *m) {
+    uint64_t first = q->base + (q->head_sent > 0 ? 1 : 0);
+    if (!m->msg || m->pos < first || m->pos >= q->base + q->count)
+        return NULL;
+    MsgBuf **slot = out_queue_at(q, (size_t)(m->pos - q->base));
+    return *slot == m->msg ? slot : NULL;
+}
+
+static inline OutQueueMark *out_queue_mark_slot(OutQueue *q, const MsgBuf *msg) {
+    return &q->marks[topic_hash(msgbuf_topic(msg), msg->topic_len) & (q->mark_cap - 1)];
+}
+
+/* out_queue_enable_conflation: activa la conflación en la cola (ver out_queue_conflate()) */
+static inline void out_queue_enable_conflation(OutQueue *q) {
+    if (q->marks)
+        return;
+    q->marks = topic_alloc(NULL, OUT_QUEUE_MARKS_MIN * sizeof(OutQueueMark));
+    memset(q->marks, 0, OUT_QUEUE_MARKS_MIN * sizeof(OutQueueMark));
+    q->mark_cap = OUT_QUEUE_MARKS_MIN;
+}
+
+/*
+ * out_queue_marks_grow
+ * - Duplica el índice conservando las marcas que siguen vivas. Se llama
+ *   cuando dos topics con tramas en la cola caen en la misma entrada.
+ */
+static inline void out_queue_marks_grow(OutQueue *q) {
+    OutQueueMark *old = q->marks;
+    size_t old_cap = q->mark_cap;
+    q->mark_cap *= 2;
+    q->marks = topic_alloc(NULL, q->mark_cap * sizeof(OutQueueMark));
+    memset(q->marks, 0, q->mark_cap * sizeof(OutQueueMark));
+    for (size_t i = 0; i < old_cap; i++) {
+        if (out_queue_mark_live(q, &old[i]))
+            *out_queue_mark_slot(q, old[i].msg) = old[i];
+    }
+    free(old);
+}
+
+/*
+ * out_queue_conflate
+ * - Si el topic de 'msg' ya tiene una trama esperando en la cola (y no a
+ *   medio enviar), la sustituye por 'msg' en su misma posición y devuelve
+ *   1. Si no, devuelve 0 y el llamador encola 'msg' como siempre y lo anota
+ *   con out_queue_mark().
+ */
+static inline int out_queue_conflate(OutQueue *q, MsgBuf *msg) {
+    if (!q->marks || q->count == 0)
+        return 0;
+    OutQueueMark *m = out_queue_mark_slot(q, msg);
+    MsgBuf **slot = out_queue_mark_live(q, m);
+    if (!slot || (*slot)->topic_len != msg->topic_len ||
+        memcmp(msgbuf_topic(*slot), msgbuf_topic(msg), msg->topic_len) != 0)
+        return 0;
+    q->bytes = q->bytes - (*slot)->len + msg->len;
+    msgbuf_unref(*slot);
+    *slot = msgbuf_ref(msg);
+    m->msg = msg;
+    return 1;
+}
+
+/*
+ * out_queue_mark
+ * - Anota que 'msg' es la última trama de la cola, para que la siguiente
+ *   de su topic la sustituya. Si la entrada del índice la ocupa otro topic
+ *   que también espera en la cola, el índice crece hasta tener el doble de
+ *   entradas que 'limit' tramas caben en la cola; a partir de ahí, el topic
+ *   que pierde la entrada simplemente se encola sin conflar.
+ */
+static inline void out_queue_mark(OutQueue *q, MsgBuf *msg, size_t limit) {
+    if (!q->marks || q->count == 0 || *out_queue_at(q, q->count - 1) != msg)
+        return;
+    OutQueueMark *m = out_queue_mark_slot(q, msg);
+    while (m->msg && q->mark_cap < 2 * limit && out_queue_mark_live(q, m)) {
+        out_queue_marks_grow(q);
+        m = out_queue_mark_slot(q, msg);
+    }
+    m->pos = q->base + q->count - 1;
+    m->msg = msg;
+}
+
+static inline void out_queue_free(OutQueue *q) {
+    for (size_t i = 0; i < q->count; i++)
+        msgbuf_unref(*out_queue_at(q, i));
+    free(q->ring);
+    free(q->marks);
+    memset(q, 0, sizeof(*q));
+}
+
+#endif /* OUT_QUEUE_H */
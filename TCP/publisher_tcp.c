@@ -1,66 +1,73 @@
 /*
  * publisher_tcp.c
  *
- * Publicador TCP: se conecta al socket del broker y envía líneas
- * introducidas por el usuario. El formato esperado es: "tópico|mensaje".
+ * Publicador TCP: se conecta al broker y envía las líneas que llegan por la
+ * entrada estándar. El formato esperado es: "tópico|mensaje". Cada línea se
+ * convierte en una trama con prefijo de longitud (common/frame.h).
  *
- * Encabezados de red usados:
- * - <arpa/inet.h>: proporciona inet_pton() para convertir la IP textual
- *   "127.0.0.1" a la forma binaria necesaria para sockaddr_in.
- * - <sys/socket.h>: declara tipos de sockets y prototipos
- *   de send()/connect(). <unistd.h> provee close().
+ * Los envíos pasan por la biblioteca de publicación (common/publisher.h):
+ * las líneas se acumulan y salen en lotes, con un send() por lote y no por
+ * línea, así que un fichero o una tubería con miles de mensajes se publica
+ * con pocas llamadas al sistema. Un lote sale como mucho -d microsegundos
+ * después de su primera línea, de modo que al escribir a mano cada línea se
+ * envía enseguida. Si el broker se cae, el publicador reintenta (con los
+ * demás brokers de -e, si los hay) sin perder lo pendiente.
+ *
+ * Uso: ./publisher_tcp [-e host:puerto[,host:puerto...]] [-b bytes] [-d us]
+ *
+ * El bucle que lee la entrada y publica cada línea es publisher_run_lines(),
+ * de la misma biblioteca; aquí sólo se leen las opciones.
  */
 
+#define _GNU_SOURCE /* ppoll() y sendmmsg() (common/publisher.h) */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <arpa/inet.h>
 
-#define SERVER_IP "127.0.0.1"
-#define PORT 8080
-#define BUFFER_SIZE 1024
-
-int main() {
-    int sock = 0;
-    struct sockaddr_in serv_addr;
-    char buffer[BUFFER_SIZE];
-
-    /* Crear un socket TCP (IPv4) */
-    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        perror("Error creando socket");
-        return -1;
-    }
+#include "../common/publisher.h"
 
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(PORT);
+#define SERVER "127.0.0.1:8080"
 
-    /* Convertir la IP textual a la forma binaria para sockaddr_in */
-    if (inet_pton(AF_INET, SERVER_IP, &serv_addr.sin_addr) <= 0) {
-        perror("Dirección inválida");
-        return -1;
-    }
+int main(int argc, char *argv[]) {
+    Publisher pub;
+    int opt_char, endpoints = 0;
 
-    /* Conectar con el broker: esto realiza el handshake TCP.
-     * connect() es provisto por la API de sockets (<sys/socket.h>). */
-    if (connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
-        perror("Conexión fallida");
-        return -1;
+    publisher_init(&pub, PUBLISHER_TCP);
+    while ((opt_char = getopt(argc, argv, "e:b:d:")) != -1) {
+        switch (opt_char) {
+        case 'e':
+            for (char *spec = strtok(optarg, ","); spec; spec = strtok(NULL, ",")) {
+                if (publisher_add_endpoint(&pub, spec) < 0)
+                    return EXIT_FAILURE;
+                endpoints++;
+            }
+            break;
+        case 'b':
+            pub.flush_bytes = strtoul(optarg, NULL, 10);
+            break;
+        case 'd':
+            pub.flush_ns = strtoull(optarg, NULL, 10) * 1000;
+            break;
+        default:
+            fprintf(stderr, "Uso: %s [-e host:puerto[,host:puerto...]] [-b bytes] [-d us]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
     }
+    if (endpoints == 0 && publisher_add_endpoint(&pub, SERVER) < 0)
+        return EXIT_FAILURE;
 
-    printf("Publisher conectado al broker TCP.\n");
-    printf("Formato: tema|mensaje (ejemplo: partido1|Gol minuto 32)\n");
-
-    while (1) {
-        printf("> ");
-        fgets(buffer, BUFFER_SIZE, stdin);
-    buffer[strcspn(buffer, "\n")] = 0; // eliminar salto de línea
-        if (strcmp(buffer, "exit") == 0)
-            break;
-    /* send() escribe los datos en la corriente TCP hacia el broker */
-        send(sock, buffer, strlen(buffer), 0);
+    if (isatty(STDIN_FILENO)) {
+        printf("Publisher TCP hacia %s.\n", pub.endpoints[0].name);
+        printf("Formato: tema|mensaje (ejemplo: partido1|Gol minuto 32)\n");
+        fflush(stdout);
     }
 
-    close(sock);
+    publisher_run_lines(&pub, STDIN_FILENO);
+    fprintf(stderr, "Publicados %llu mensajes en %llu envíos (%llu rechazados, %llu reconexiones)\n",
+            (unsigned long long)pub.published, (unsigned long long)pub.batches,
+            (unsigned long long)pub.rejected, (unsigned long long)pub.reconnects);
+    publisher_free(&pub);
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,129 @@
+/*
+ * rate_limit.h
+ *
+ * Cubos de tokens del broker TCP para limitar el ritmo de cada publicador
+ * (-l) y de cada topic (-T). Un cubo se guarda como un solo instante, 'tat'
+ * (el algoritmo GCRA): cada mensaje lo adelanta 'interval_ns' y el cubo se
+ * ha vaciado cuando 'tat' queda más de 'burst_ns' por delante del reloj.
+ * Equivale a un cubo de 'ráfaga' tokens que se rellena a 'mensajes/s', pero
+ * cabe en un entero: el cubo de un topic, que comparten todos los shards, se
+ * actualiza con un solo compare-and-swap y sin locks.
+ *
+ * Los cubos de los topics viven en una RateTable que crece con cada topic
+ * nuevo. Como topic_log.h con los logs, la tabla común tiene un lock y cada
+ * shard una caché propia con los cubos que ya resolvió, así que el lock sólo
+ * se toma la primera vez que un shard ve un topic.
+ *
+ * Nada se descarta: rate_take() admite siempre el mensaje (ya está leído) y
+ * devuelve cuánto tiene que esperar el publicador antes del siguiente. El
+ * broker deja de leer su socket ese tiempo y el control de flujo de TCP
+ * frena al cliente.
+ */
+
+#ifndef RATE_LIMIT_H
+#define RATE_LIMIT_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "../common/topic_table.h"
+
+#define RATE_MIN_BURST_NS 1000000ull /* el bucle del broker espera en milisegundos */
+
+typedef struct {
+    uint64_t interval_ns; /* tiempo entre mensajes al ritmo límite; 0: sin límite */
+    uint64_t burst_ns;    /* cuánto puede adelantarse el cubo (ráfaga * intervalo) */
+} RateLimit;
+
+/*
+ * RateTable
+ * - Cubo de cada topic, común a todos los shards. Cada Topic de 'by_name'
+ *   guarda como único "suscriptor" el puntero a su cubo, que no se mueve
+ *   aunque la tabla crezca. Los topics no se borran nunca.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    TopicTable by_name;
+} RateTable;
+
+/*
+ * rate_limit_parse
+ * - Lee "<mensajes/s>[:ráfaga]". Sin ráfaga se admiten de golpe los
+ *   mensajes de 100 ms (al menos uno). La ráfaga cubre siempre al menos
+ *   RATE_MIN_BURST_NS: una pausa más corta no se puede esperar y el ritmo
+ *   real quedaría por debajo del límite. Devuelve -1 si no es válido.
+ */
+static inline int rate_limit_parse(const char *arg, RateLimit *limit) {
+    char *end;
+    unsigned long long rate = strtoull(arg, &end, 10), burst;
+    if (rate == 0 || rate > 1000000000ull)
+        return -1;
+    if (*end == ':') {
+        burst = strtoull(end + 1, &end, 10);
+        if (burst == 0)
+            return -1;
+    } else {
+        burst = rate / 10 ? rate / 10 : 1;
+    }
+    if (*end != '\0')
+        return -1;
+    limit->interval_ns = 1000000000ull / rate;
+    limit->burst_ns = burst * limit->interval_ns;
+    if (limit->burst_ns < RATE_MIN_BURST_NS)
+        limit->burst_ns = RATE_MIN_BURST_NS;
+    return 0;
+}
+
+/* rate_wait: espera que corresponde a un cubo que ha llegado a 'tat' */
+static inline uint64_t rate_wait(uint64_t tat, const RateLimit *limit, uint64_t now) {
+    return tat - now > limit->burst_ns ? tat - now - limit->burst_ns : 0;
+}
+
+/* rate_take: cuenta un mensaje en un cubo propio del hilo; devuelve la espera en ns (0 si quedan tokens) */
+static inline uint64_t rate_take(uint64_t *tat, const RateLimit *limit, uint64_t now) {
+    *tat = (*tat > now ? *tat : now) + limit->interval_ns;
+    return rate_wait(*tat, limit, now);
+}
+
+/* rate_take_shared: lo mismo en un cubo que comparten varios hilos */
+static inline uint64_t rate_take_shared(uint64_t *tat, const RateLimit *limit, uint64_t now) {
+    uint64_t old = __atomic_load_n(tat, __ATOMIC_RELAXED), next;
+    do {
+        next = (old > now ? old : now) + limit->interval_ns;
+    } while (!__atomic_compare_exchange_n(tat, &old, next, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return rate_wait(next, limit, now);
+}
+
+static inline void rate_table_init(RateTable *table) {
+    pthread_mutex_init(&table->lock, NULL);
+    memset(&table->by_name, 0, sizeof(table->by_name));
+}
+
+/*
+ * rate_table_bucket
+ * - Devuelve el cubo del topic, creándolo la primera vez. 'cache' es la
+ *   tabla propia del shard que llama, igual que en log_store_get(): sólo la
+ *   primera publicación de un topic en cada shard toma el lock.
+ */
+static inline uint64_t *rate_table_bucket(RateTable *table, TopicTable *cache, const char *name, size_t len) {
+    Topic *cached = topic_find(cache, name, len, topic_hash(name, len));
+    if (cached)
+        return *(uint64_t **)cached->subs;
+
+    pthread_mutex_lock(&table->lock);
+    Topic *t = topic_intern(&table->by_name, name, len);
+    if (t->sub_count == 0) {
+        uint64_t *tat = topic_alloc(NULL, sizeof(uint64_t));
+        *tat = 0;
+        topic_sub_append(t, &tat, sizeof(tat));
+    }
+    uint64_t *tat = *(uint64_t **)t->subs;
+    pthread_mutex_unlock(&table->lock);
+
+    cached = topic_intern(cache, name, len);
+    topic_sub_append(cached, &tat, sizeof(tat));
+    return tat;
+}
+
+#endif /* RATE_LIMIT_H */
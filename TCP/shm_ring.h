@@ -0,0 +1,473 @@
+/*
+ * shm_ring.h
+ *
+ * Transporte por memoria compartida entre el broker TCP y los clientes de la
+ * misma máquina (opción -U del broker). Un cliente local se conecta al
+ * socket Unix del broker y recibe por él, con SCM_RIGHTS, un memfd y dos
+ * eventfd. El memfd contiene dos anillos de bytes de un solo productor y un
+ * solo consumidor:
+ *
+ *     +-----------+------------------------+------------------------+
+ *     | ShmHeader | datos hacia el broker  | datos hacia el cliente |
+ *     | (4 KB)    | (ring_size bytes)      | (ring_size bytes)      |
+ *     +-----------+------------------------+------------------------+
+ *
+ * Por los anillos viaja exactamente el mismo flujo de tramas que por TCP
+ * (common/frame.h): el broker procesa lo que lee del anillo con el mismo
+ * código que lo que lee de un socket y entrega a los suscriptores locales
+ * copiando la trama del MsgBuf al anillo, sin pasar por la pila de red. Una
+ * trama puede escribirse en varias partes, así que cabe aunque sea mayor que
+ * el anillo.
+ *
+ * Cada lado sólo escribe su propio índice (el productor 'tail', el
+ * consumidor 'head') con semántica release y lee el del otro con acquire,
+ * como en common/spsc_queue.h. Cada lado guarda además su índice en memoria
+ * propia: lo que el otro proceso escriba en la zona compartida nunca hace
+ * que se lea o se escriba fuera del anillo (un índice imposible se trata
+ * como un error del otro lado).
+ *
+ * Despertar al otro lado cuesta un write() en su eventfd, y sólo se hace si
+ * está dormido o a punto de dormirse: antes de bloquearse, el consumidor
+ * marca 'want_data' y vuelve a mirar el anillo; el productor, después de
+ * publicar 'tail', mira la marca y sólo si está puesta la quita y escribe
+ * en el eventfd. Con una barrera completa en ambos lados al menos uno de
+ * los dos ve al otro, así que no se pierden avisos. 'want_space' hace lo
+ * mismo para un productor que espera hueco. Con tráfico, ninguno de los
+ * dos duerme y no hay llamadas al sistema por mensaje. Con espera activa
+ * (shm_client_connect(..., spin_ns) y -B en el broker) se mira el anillo
+ * en bucle durante un tiempo antes de marcar y dormir.
+ *
+ * El socket Unix sigue abierto: el broker nota por él que el cliente ha
+ * terminado (y el cliente que el broker ha terminado) y también admite
+ * tramas, como un socket TCP.
+ */
+
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <errno.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/memfd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "../common/frame.h"
+
+#define SHM_MAGIC 0x53484d31u   /* "SHM1" */
+#define SHM_HEADER_SPACE 4096   /* el primer anillo empieza en la segunda página */
+#define SHM_CACHE_LINE 64
+
+/* Índices y marcas de un anillo; los datos van fuera de la cabecera */
+typedef struct {
+    _Alignas(SHM_CACHE_LINE) _Atomic uint64_t head; /* escrito por el consumidor */
+    _Atomic uint32_t want_data;                      /* el consumidor duerme hasta que haya datos */
+    _Alignas(SHM_CACHE_LINE) _Atomic uint64_t tail; /* escrito por el productor */
+    _Atomic uint32_t want_space;                     /* el productor duerme hasta que haya hueco */
+} ShmRing;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t ring_size;
+    ShmRing to_broker;  /* lo escribe el cliente */
+    ShmRing to_client;  /* lo escribe el broker */
+} ShmHeader;
+
+/* ShmEnd: un extremo de un anillo en un proceso; 'pos' es su índice (tail o head) */
+typedef struct {
+    ShmRing *ring;
+    char *data;
+    uint64_t size;  /* potencia de dos */
+    uint64_t pos;
+} ShmEnd;
+
+static inline size_t shm_map_size(uint32_t ring_size) {
+    return SHM_HEADER_SPACE + 2 * (size_t)ring_size;
+}
+
+/* shm_ends: extremos del anillo de entrada y del de salida desde el lado del broker o del cliente */
+static inline void shm_ends(ShmHeader *hdr, int broker, ShmEnd *in, ShmEnd *out) {
+    char *base = (char *)hdr + SHM_HEADER_SPACE;
+    ShmEnd to_broker = { &hdr->to_broker, base, hdr->ring_size, 0 };
+    ShmEnd to_client = { &hdr->to_client, base + hdr->ring_size, hdr->ring_size, 0 };
+    *in = broker ? to_broker : to_client;
+    *out = broker ? to_client : to_broker;
+}
+
+/* shm_readable: bytes por leer; más que 'size' significa que el otro lado escribió un índice imposible */
+static inline uint64_t shm_readable(const ShmEnd *e) {
+    return atomic_load_explicit(&e->ring->tail, memory_order_acquire) - e->pos;
+}
+
+/* shm_writable: hueco libre; más que 'size', igual que shm_readable() */
+static inline uint64_t shm_writable(const ShmEnd *e) {
+    return e->size - (e->pos - atomic_load_explicit(&e->ring->head, memory_order_acquire));
+}
+
+/* shm_peek: primer tramo contiguo de los 'avail' bytes por leer */
+static inline const char *shm_peek(const ShmEnd *e, uint64_t avail, size_t *len) {
+    uint64_t off = e->pos & (e->size - 1);
+    *len = (size_t)(avail < e->size - off ? avail : e->size - off);
+    return e->data + off;
+}
+
+/* shm_consume: el consumidor suelta 'n' bytes leídos */
+static inline void shm_consume(ShmEnd *e, uint64_t n) {
+    e->pos += n;
+    atomic_store_explicit(&e->ring->head, e->pos, memory_order_release);
+}
+
+/* shm_span: los (uno o dos) tramos del anillo donde van 'n' bytes a partir de pos + 'offset' */
+static inline int shm_span(const ShmEnd *e, uint64_t offset, size_t n, struct iovec iov[2]) {
+    uint64_t off = (e->pos + offset) & (e->size - 1);
+    size_t first = n < e->size - off ? n : (size_t)(e->size - off);
+    iov[0].iov_base = e->data + off;
+    iov[0].iov_len = first;
+    iov[1].iov_base = e->data;
+    iov[1].iov_len = n - first;
+    return n > first ? 2 : 1;
+}
+
+/* shm_copy: el productor copia 'n' bytes a partir de pos + 'offset', todavía sin publicarlos */
+static inline void shm_copy(const ShmEnd *e, uint64_t offset, const void *src, size_t n) {
+    struct iovec iov[2];
+    shm_span(e, offset, n, iov);
+    memcpy(iov[0].iov_base, src, iov[0].iov_len);
+    memcpy(iov[1].iov_base, (const char *)src + iov[0].iov_len, iov[1].iov_len);
+}
+
+/* shm_commit: el productor publica los 'n' bytes siguientes, ya escritos */
+static inline void shm_commit(ShmEnd *e, uint64_t n) {
+    e->pos += n;
+    atomic_store_explicit(&e->ring->tail, e->pos, memory_order_release);
+}
+
+/*
+ * shm_arm
+ * - Pone la marca de "despiértame" antes de dormir. El llamador vuelve a
+ *   mirar el anillo después: si el otro lado publicó justo antes, lo ve.
+ */
+static inline void shm_arm(_Atomic uint32_t *flag) {
+    atomic_store_explicit(flag, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+/* shm_should_wake: tras publicar, 1 si el otro lado duerme (y quita la marca: un aviso por sueño) */
+static inline int shm_should_wake(_Atomic uint32_t *flag) {
+    atomic_thread_fence(memory_order_seq_cst);
+    return atomic_load_explicit(flag, memory_order_relaxed) &&
+           atomic_exchange_explicit(flag, 0, memory_order_relaxed);
+}
+
+static inline void shm_signal(int efd) {
+    uint64_t one = 1;
+    if (write(efd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        perror("Error en write(eventfd)");
+}
+
+/*
+ * ShmLink
+ * - Lado del broker de un cliente local: la zona compartida, sus dos
+ *   extremos y los eventfd. 'doorbell' lo escribe el cliente para despertar
+ *   al broker; 'client_efd', el broker para despertar al cliente.
+ */
+typedef struct {
+    ShmHeader *hdr;
+    size_t map_len;
+    ShmEnd in;
+    ShmEnd out;
+    int doorbell;
+    int client_efd;
+    size_t index;   /* posición en la lista de clientes locales del shard */
+} ShmLink;
+
+/*
+ * shm_link_create
+ * - Crea la zona compartida (un memfd de shm_map_size() bytes) y los dos
+ *   eventfd, y se los pasa al cliente por el socket Unix 'sock' junto con
+ *   la trama "SHM <ring_size>". El memfd se cierra después: basta con la
+ *   proyección. Devuelve 0 o -1.
+ */
+static inline int shm_link_create(ShmLink *l, int sock, uint32_t ring_size) {
+    memset(l, 0, sizeof(*l));
+    l->doorbell = l->client_efd = -1;
+    l->map_len = shm_map_size(ring_size);
+    int memfd = (int)syscall(SYS_memfd_create, "broker-shm", MFD_CLOEXEC);
+    if (memfd < 0 || ftruncate(memfd, (off_t)l->map_len) < 0) {
+        perror("Error creando la memoria compartida");
+        if (memfd >= 0)
+            close(memfd);
+        return -1;
+    }
+    l->hdr = mmap(NULL, l->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    l->doorbell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    l->client_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (l->hdr == MAP_FAILED || l->doorbell < 0 || l->client_efd < 0) {
+        perror("Error preparando la memoria compartida");
+        close(memfd);
+        return -1;
+    }
+    l->hdr->magic = SHM_MAGIC;
+    l->hdr->ring_size = ring_size;
+    shm_ends(l->hdr, 1, &l->in, &l->out);
+    shm_arm(&l->in.ring->want_data); // el broker duerme hasta el primer mensaje
+
+    char text[32];
+    unsigned char frame[FRAME_HEADER_SIZE + sizeof(text)];
+    int n = snprintf(text, sizeof(text), "SHM %u", ring_size);
+    frame_put_header(frame, (uint32_t)n);
+    memcpy(frame + FRAME_HEADER_SIZE, text, (size_t)n);
+
+    int fds[3] = { memfd, l->doorbell, l->client_efd };
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(fds))];
+    } control;
+    struct iovec iov = { .iov_base = frame, .iov_len = FRAME_HEADER_SIZE + (size_t)n };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf,
+                          .msg_controllen = sizeof(control.buf) };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    ssize_t sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    close(memfd);
+    if (sent != (ssize_t)iov.iov_len) {
+        perror("Error enviando la memoria compartida");
+        return -1;
+    }
+    return 0;
+}
+
+static inline void shm_link_free(ShmLink *l) {
+    if (l->hdr && l->hdr != MAP_FAILED)
+        munmap(l->hdr, l->map_len);
+    if (l->doorbell >= 0)
+        close(l->doorbell);
+    if (l->client_efd >= 0)
+        close(l->client_efd);
+}
+
+/*
+ * ShmClient
+ * - Lado del cliente. Las llamadas son bloqueantes, como frame_send() y
+ *   frame_recv() sobre un socket: esperan en bucle hasta 'spin_ns' y después
+ *   duermen en su eventfd (o hasta que el broker cierre el socket Unix).
+ */
+typedef struct {
+    int sock;
+    int doorbell;    /* despierta al broker */
+    int efd;         /* lo escribe el broker para despertarnos */
+    ShmHeader *hdr;
+    size_t map_len;
+    ShmEnd in;
+    ShmEnd out;
+    uint64_t spin_ns;
+} ShmClient;
+
+static inline uint64_t shm_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * shm_client_connect
+ * - Se conecta al socket Unix 'path' del broker y proyecta la zona que
+ *   éste le pasa. Devuelve 0 o -1.
+ */
+static inline int shm_client_connect(ShmClient *c, const char *path, uint64_t spin_ns) {
+    memset(c, 0, sizeof(*c));
+    c->spin_ns = spin_ns;
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Ruta de socket demasiado larga: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    c->sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (c->sock < 0 || connect(c->sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        if (c->sock >= 0)
+            close(c->sock);
+        return -1;
+    }
+
+    char text[64];
+    unsigned char hdr[FRAME_HEADER_SIZE];
+    int fds[3];
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(fds))];
+    } control;
+    struct iovec iov = { .iov_base = hdr, .iov_len = FRAME_HEADER_SIZE };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf,
+                          .msg_controllen = sizeof(control.buf) };
+    ssize_t n;
+    while ((n = recvmsg(c->sock, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR)
+        ;
+    struct cmsghdr *cmsg = n == FRAME_HEADER_SIZE ? CMSG_FIRSTHDR(&msg) : NULL;
+    uint32_t len = frame_get_header(hdr);
+    unsigned ring_size = 0;
+    if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(fds)) ||
+        len >= sizeof(text) || read_exact(c->sock, text, len) <= 0) {
+        fprintf(stderr, "El broker no ofreció memoria compartida\n");
+        close(c->sock);
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    text[len] = '\0';
+    c->doorbell = fds[1];
+    c->efd = fds[2];
+    if (sscanf(text, "SHM %u", &ring_size) == 1 && ring_size > 0 && (ring_size & (ring_size - 1)) == 0) {
+        c->map_len = shm_map_size(ring_size);
+        c->hdr = mmap(NULL, c->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    }
+    close(fds[0]);
+    if (!c->hdr || c->hdr == MAP_FAILED || c->hdr->magic != SHM_MAGIC || c->hdr->ring_size != ring_size) {
+        fprintf(stderr, "Memoria compartida inválida\n");
+        c->hdr = NULL;
+        close(c->sock);
+        close(c->doorbell);
+        close(c->efd);
+        return -1;
+    }
+    shm_ends(c->hdr, 0, &c->in, &c->out);
+    return 0;
+}
+
+/*
+ * shm_client_wait
+ * - Espera a que 'ready' (datos por leer o hueco para escribir) deje de ser
+ *   0: primero en bucle hasta 'spin_ns', después marcando 'flag' y durmiendo
+ *   en el eventfd. Devuelve -1 si el broker cerró el socket Unix.
+ */
+static inline int shm_client_wait(ShmClient *c, uint64_t (*ready)(const ShmEnd *), const ShmEnd *e,
+                                  _Atomic uint32_t *flag) {
+    uint64_t deadline = c->spin_ns ? shm_now_ns() + c->spin_ns : 0;
+    while (deadline && shm_now_ns() < deadline)
+        if (ready(e))
+            return 0;
+    while (1) {
+        shm_arm(flag);
+        if (ready(e))
+            return 0;
+        struct pollfd pfd[2] = { { .fd = c->efd, .events = POLLIN }, { .fd = c->sock, .events = POLLIN } };
+        if (poll(pfd, 2, -1) < 0 && errno != EINTR)
+            return -1;
+        if (pfd[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+            char byte;
+            ssize_t r = recv(c->sock, &byte, 1, MSG_DONTWAIT | MSG_PEEK);
+            if (r == 0 || (r < 0 && errno != EAGAIN && errno != EINTR))
+                return -1;
+        }
+        uint64_t count;
+        if (pfd[0].revents & POLLIN && read(c->efd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+            return -1;
+    }
+}
+
+/* shm_client_write: escribe 'n' bytes en el anillo hacia el broker, esperando hueco si hace falta */
+static inline int shm_client_write(ShmClient *c, const void *src, size_t n) {
+    const char *p = src;
+    while (n > 0) {
+        uint64_t space = shm_writable(&c->out);
+        if (space > c->out.size)
+            return -1;
+        if (space == 0) {
+            if (shm_client_wait(c, shm_writable, &c->out, &c->out.ring->want_space) < 0)
+                return -1;
+            continue;
+        }
+        size_t chunk = n < space ? n : (size_t)space;
+        shm_copy(&c->out, 0, p, chunk);
+        shm_commit(&c->out, chunk);
+        p += chunk;
+        n -= chunk;
+        if (shm_should_wake(&c->out.ring->want_data))
+            shm_signal(c->doorbell);
+    }
+    return 0;
+}
+
+/* shm_client_read: lee exactamente 'n' bytes del anillo (buf NULL los descarta) */
+static inline int shm_client_read(ShmClient *c, void *buf, size_t n) {
+    char *p = buf;
+    while (n > 0) {
+        uint64_t avail = shm_readable(&c->in);
+        if (avail > c->in.size)
+            return -1;
+        if (avail == 0) {
+            if (shm_client_wait(c, shm_readable, &c->in, &c->in.ring->want_data) < 0)
+                return -1;
+            continue;
+        }
+        size_t chunk;
+        const char *src = shm_peek(&c->in, avail, &chunk);
+        if (chunk > n)
+            chunk = n;
+        if (p) {
+            memcpy(p, src, chunk);
+            p += chunk;
+        }
+        shm_consume(&c->in, chunk);
+        n -= chunk;
+        if (shm_should_wake(&c->in.ring->want_space))
+            shm_signal(c->doorbell);
+    }
+    return 0;
+}
+
+/*
+ * shm_client_send
+ * - Como frame_send(). Si la trama cabe entera, cabecera y contenido se
+ *   publican juntos: un solo aviso al broker.
+ */
+static inline int shm_client_send(ShmClient *c, const void *payload, size_t len) {
+    unsigned char hdr[FRAME_HEADER_SIZE];
+    frame_put_header(hdr, (uint32_t)len);
+    uint64_t space = shm_writable(&c->out);
+    if (space >= FRAME_HEADER_SIZE + len && space <= c->out.size) {
+        shm_copy(&c->out, 0, hdr, FRAME_HEADER_SIZE);
+        shm_copy(&c->out, FRAME_HEADER_SIZE, payload, len);
+        shm_commit(&c->out, FRAME_HEADER_SIZE + len);
+        if (shm_should_wake(&c->out.ring->want_data))
+            shm_signal(c->doorbell);
+        return 0;
+    }
+    if (shm_client_write(c, hdr, FRAME_HEADER_SIZE) < 0)
+        return -1;
+    return shm_client_write(c, payload, len);
+}
+
+/* shm_client_recv: como frame_recv(), una trama terminada en nulo y truncada a 'cap - 1' */
+static inline ssize_t shm_client_recv(ShmClient *c, char *buf, size_t cap) {
+    unsigned char hdr[FRAME_HEADER_SIZE];
+    if (shm_client_read(c, hdr, FRAME_HEADER_SIZE) < 0)
+        return -1;
+    uint32_t len = frame_get_header(hdr);
+    size_t keep = len < cap - 1 ? len : cap - 1;
+    if (shm_client_read(c, buf, keep) < 0 || shm_client_read(c, NULL, len - keep) < 0)
+        return -1;
+    buf[keep] = '\0';
+    return (ssize_t)keep;
+}
+
+static inline void shm_client_close(ShmClient *c) {
+    munmap(c->hdr, c->map_len);
+    close(c->sock);
+    close(c->doorbell);
+    close(c->efd);
+}
+
+#endif /* SHM_RING_H */
@@ -1,10 +1,18 @@
 /*
  * subscriber_tcp.c
  *
- * Suscriptor TCP simple: se conecta al broker y envía el comando
- * "SUBSCRIBE <topic>". Después de suscribirse, espera en un bucle leyendo
- * del socket TCP e imprime cualquier mensaje reenviado por el broker para
- * el topic suscrito.
+ * Suscriptor TCP simple: se conecta al broker y envía un comando
+ * "SUBSCRIBE <topic>" por cada tema (o filtro con '+' y '#') que escriba el
+ * usuario, todos por la misma conexión. Después espera en un bucle leyendo
+ * del socket TCP e imprime cualquier mensaje reenviado por el broker junto
+ * con su topic. Tanto el comando como los mensajes viajan en tramas con
+ * prefijo de longitud (common/frame.h); cada trama recibida es "topic|message".
+ * La palabra CONFLATE entre los temas se envía tal cual: el broker pasa a
+ * mandar sólo el valor más reciente de cada topic si el suscriptor se atrasa.
+ *
+ * Con una ruta como argumento (./subscriber_tcp /tmp/broker.sock) se conecta
+ * al socket Unix de un broker arrancado con -U y recibe por memoria
+ * compartida (TCP/shm_ring.h) en lugar de por TCP; las tramas son las mismas.
  *
  * Uso de librerías:
  * - inet_pton() (<arpa/inet.h>) para preparar la dirección remota.
@@ -19,18 +27,32 @@
 #include <unistd.h>
 #include <arpa/inet.h>
 
+#include "../common/frame.h"
+#include "shm_ring.h"
+
 #define SERVER_IP "127.0.0.1"
 #define PORT 8080
 #define BUFFER_SIZE 1024
 
-int main() {
-    int sock = 0;
+/* Transporte elegido: el socket TCP o, con una ruta de socket Unix, la memoria compartida */
+int sock = -1;
+ShmClient shm;
+
+int send_frame(const char *payload, size_t len) {
+    return sock >= 0 ? frame_send(sock, payload, len) : shm_client_send(&shm, payload, len);
+}
+
+ssize_t recv_frame(char *buf, size_t cap) {
+    return sock >= 0 ? frame_recv(sock, buf, cap) : shm_client_recv(&shm, buf, cap);
+}
+
+/* connect_tcp: conecta con el broker por TCP; devuelve el socket o -1 */
+int connect_tcp(void) {
     struct sockaddr_in serv_addr;
-    char buffer[BUFFER_SIZE];
-    char topic[50];
 
     /* Crear socket TCP */
-    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
         perror("Error creando socket");
         return -1;
     }
@@ -41,33 +63,71 @@ int main() {
     /* Convertir la cadena IP a la representación binaria */
     if (inet_pton(AF_INET, SERVER_IP, &serv_addr.sin_addr) <= 0) {
         perror("Dirección inválida");
+        close(fd);
         return -1;
     }
 
     /* Conectar con el broker. Si tiene éxito, se pueden enviar comandos y
      * leer los mensajes reenviados desde el mismo socket. */
-    if (connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
+    if (connect(fd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
         perror("Conexión fallida");
+        close(fd);
         return -1;
     }
+    return fd;
+}
 
-    printf("Suscriptor conectado al broker TCP.\n");
-    printf("Tema al que deseas suscribirte: ");
-    scanf("%s", topic);
+int main(int argc, char *argv[]) {
+    char topics[BUFFER_SIZE];
+    /* Cabe la trama más grande que acepta el broker: nada se trunca */
+    static char buffer[FRAME_MAX_PAYLOAD + 1];
 
-    char subscribe_msg[BUFFER_SIZE];
-    sprintf(subscribe_msg, "SUBSCRIBE %s", topic);
-    send(sock, subscribe_msg, strlen(subscribe_msg), 0);
+    if (argc > 1) {
+        if (shm_client_connect(&shm, argv[1], 0) < 0) {
+            perror("Conexión fallida");
+            return -1;
+        }
+        printf("Suscriptor conectado al broker por memoria compartida.\n");
+    } else {
+        if ((sock = connect_tcp()) < 0)
+            return -1;
+        printf("Suscriptor conectado al broker TCP.\n");
+    }
 
-    printf("Esperando mensajes del tema '%s'...\n", topic);
+    printf("Temas a los que deseas suscribirte (separados por espacios): ");
+    if (!fgets(topics, sizeof(topics), stdin))
+        return 0;
+
+    /* Una trama SUBSCRIBE por tema; el broker las acumula en la conexión */
+    char subscribe_msg[BUFFER_SIZE + 16];
+    for (char *topic = strtok(topics, " \t\r\n"); topic; topic = strtok(NULL, " \t\r\n")) {
+        if (strcmp(topic, "CONFLATE") == 0) {
+            send_frame(topic, strlen(topic));
+            printf("Sólo el valor más reciente de cada tema\n");
+            continue;
+        }
+        int len = snprintf(subscribe_msg, sizeof(subscribe_msg), "SUBSCRIBE %s", topic);
+        send_frame(subscribe_msg, len);
+        printf("Suscrito a '%s'\n", topic);
+    }
+
+    printf("Esperando mensajes...\n");
     while (1) {
-        int valread = read(sock, buffer, BUFFER_SIZE - 1);
-        if (valread > 0) {
-            buffer[valread] = '\0';
-            printf("%s\n", buffer);
+        /* recv_frame() devuelve exactamente un mensaje por llamada */
+        if (recv_frame(buffer, sizeof(buffer)) < 0) {
+            printf("El broker cerró la conexión.\n");
+            break;
         }
+        char *sep = strchr(buffer, '|');
+        if (sep)
+            printf("[%.*s] %s\n", (int)(sep - buffer), buffer, sep + 1);
+        else
+            printf("%s\n", buffer);
     }
 
-    close(sock);
+    if (sock >= 0)
+        close(sock);
+    else
+        shm_client_close(&shm);
     return 0;
 }
\ No newline at end of file
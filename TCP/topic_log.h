@@ -0,0 +1,485 @@
+/*
+ * topic_log.h
+ *
+ * Log de mensajes por topic para el modo con retención del broker TCP
+ * (opción -L). Cada topic guarda sus mensajes, en orden de llegada, en
+ * segmentos: ficheros de tamaño fijo proyectados en memoria con mmap() a los
+ * que se añaden las tramas tal cual viajan por la red (cabecera de longitud
+ * + "topic|message"). Cada mensaje tiene un offset: su número de orden en el
+ * topic, empezando en 0.
+ *
+ * Como lo guardado es exactamente lo que se envía, un suscriptor que pide
+ * "SUBSCRIBE <topic> FROM <offset>" se pone al día con sendfile() sobre un
+ * tramo del segmento: los bytes salen de la caché de páginas al socket sin
+ * copiarse a memoria de usuario. Para encontrar un offset sin recorrer el
+ * segmento entero, cada segmento tiene un índice disperso con la posición de
+ * uno de cada LOG_INDEX_INTERVAL mensajes.
+ *
+ * La retención se limita por tamaño y por antigüedad: se borran segmentos
+ * enteros, los más antiguos primero. Al arrancar, los segmentos que ya
+ * existan en el directorio se vuelven a abrir y su índice se reconstruye.
+ *
+ * Cualquier shard puede publicar en cualquier topic, así que cada log tiene
+ * su propio mutex. Añadir un mensaje y asignarle offset ocurren bajo ese
+ * mutex, antes de reenviarlo a nadie: cualquier copia en vivo de un mensaje
+ * que llegue a un suscriptor ya está en el log. El mutex es por topic y sólo
+ * se disputa si dos shards publican a la vez en el mismo topic.
+ */
+
+#ifndef TOPIC_LOG_H
+#define TOPIC_LOG_H
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "../common/frame.h"
+#include "../common/msgbuf.h"
+#include "../common/topic_table.h"
+
+#define LOG_INDEX_INTERVAL 64           /* un mensaje indexado de cada 64 */
+#define LOG_DEFAULT_SEGMENT (16u << 20) /* bytes por segmento */
+#define LOG_MIN_SEGMENT (FRAME_HEADER_SIZE + FRAME_MAX_PAYLOAD)
+#define LOG_MAX_TOPIC_LEN 120           /* el nombre va en hexadecimal en una ruta */
+
+typedef struct {
+    uint64_t offset;
+    size_t pos;
+} LogIndexEntry;
+
+/*
+ * LogSegment
+ * - Un fichero del log. Lo referencian el propio log y cada tramo que
+ *   todavía espera en una cola de salida, así que borrarlo por retención
+ *   sólo lo desenlaza: el descriptor y la proyección se liberan al soltar la
+ *   última referencia.
+ */
+typedef struct LogSegment {
+    atomic_uint refs;
+    int fd;
+    char *map;
+    size_t capacity;          /* bytes proyectados */
+    size_t size;              /* bytes ocupados por tramas */
+    uint64_t base_offset;     /* offset del primer mensaje */
+    uint64_t count;           /* mensajes guardados */
+    time_t last_append;
+    char *path;
+    LogIndexEntry *index;
+    size_t index_count;
+    size_t index_capacity;
+    struct LogSegment *next;  /* segmento siguiente (más reciente) */
+} LogSegment;
+
+typedef struct {
+    pthread_mutex_t lock;
+    char *dir;
+    LogSegment *head;         /* más antiguo */
+    LogSegment *tail;         /* activo, donde se añade */
+    uint64_t next_offset;     /* offset que recibirá el próximo mensaje */
+    size_t total_bytes;
+} TopicLog;
+
+/*
+ * LogStore
+ * - Todos los logs del broker. 'by_name' (protegida por 'lock') asocia cada
+ *   nombre con su TopicLog; los shards guardan además una caché propia para
+ *   no tomar el lock en cada publicación.
+ */
+typedef struct {
+    char *dir;
+    size_t segment_size;
+    size_t max_bytes;         /* por topic, 0 = sin límite */
+    time_t max_age;           /* segundos, 0 = sin límite */
+    pthread_mutex_t lock;
+    TopicTable by_name;
+    TopicLog **logs;
+    size_t log_count;
+    size_t log_capacity;
+} LogStore;
+
+static inline void log_segment_unref(LogSegment *seg) {
+    if (atomic_fetch_sub_explicit(&seg->refs, 1, memory_order_acq_rel) != 1)
+        return;
+    munmap(seg->map, seg->capacity);
+    close(seg->fd);
+    free(seg->index);
+    free(seg->path);
+    free(seg);
+}
+
+static inline void log_segment_release(void *arg) {
+    log_segment_unref(arg);
+}
+
+static inline void log_index_add(LogSegment *seg, uint64_t offset, size_t pos) {
+    if (seg->index_count == seg->index_capacity) {
+        seg->index_capacity = seg->index_capacity ? seg->index_capacity * 2 : 16;
+        seg->index = topic_alloc(seg->index, seg->index_capacity * sizeof(LogIndexEntry));
+    }
+    seg->index[seg->index_count++] = (LogIndexEntry){ .offset = offset, .pos = pos };
+}
+
+/*
+ * log_segment_open
+ * - Abre (o crea, con 'create') un segmento y lo proyecta en memoria. Al
+ *   abrir uno existente recorre sus tramas para recuperar tamaño, número de
+ *   mensajes e índice; el área sin escribir está a cero y una cabecera de
+ *   longitud 0 marca el final. Devuelve NULL si falla.
+ */
+static inline LogSegment *log_segment_open(const char *path, uint64_t base_offset, size_t segment_size,
+                                           int create) {
+    int fd = open(path, O_RDWR | (create ? O_CREAT | O_TRUNC : 0), 0644);
+    if (fd < 0) {
+        perror("Error abriendo segmento del log");
+        return NULL;
+    }
+    struct stat st;
+    if (create ? ftruncate(fd, (off_t)segment_size) < 0 : fstat(fd, &st) < 0) {
+        perror("Error preparando segmento del log");
+        close(fd);
+        return NULL;
+    }
+    size_t capacity = create ? segment_size : (size_t)st.st_size;
+    char *map = capacity ? mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    if (map == MAP_FAILED) {
+        if (capacity)
+            perror("Error en mmap del segmento");
+        close(fd);
+        return NULL;
+    }
+
+    LogSegment *seg = calloc(1, sizeof(LogSegment));
+    if (!seg) {
+        perror("Error reservando memoria");
+        exit(EXIT_FAILURE);
+    }
+    atomic_init(&seg->refs, 1);
+    seg->fd = fd;
+    seg->map = map;
+    seg->capacity = capacity;
+    seg->base_offset = base_offset;
+    seg->path = strdup(path);
+    seg->last_append = create ? time(NULL) : st.st_mtime;
+
+    while (!create && seg->size + FRAME_HEADER_SIZE <= capacity) {
+        uint32_t len = frame_get_header((unsigned char *)map + seg->size);
+        if (len == 0 || len > FRAME_MAX_PAYLOAD || seg->size + FRAME_HEADER_SIZE + len > capacity)
+            break;
+        if (seg->count % LOG_INDEX_INTERVAL == 0)
+            log_index_add(seg, base_offset + seg->count, seg->size);
+        seg->size += FRAME_HEADER_SIZE + len;
+        seg->count++;
+    }
+    return seg;
+}
+
+/* log_drop_head: borra el segmento más antiguo (retención) */
+static inline void log_drop_head(TopicLog *log) {
+    LogSegment *seg = log->head;
+    log->head = seg->next;
+    if (log->tail == seg)
+        log->tail = NULL;
+    log->total_bytes -= seg->size;
+    if (unlink(seg->path) < 0)
+        perror("Error borrando segmento del log");
+    log_segment_unref(seg);
+}
+
+/*
+ * log_enforce_retention
+ * - Borra segmentos antiguos mientras el log supere 'max_bytes' o su
+ *   segmento más antiguo lleve más de 'max_age' segundos sin recibir nada.
+ *   El segmento activo sólo se borra por antigüedad (el topic lleva todo ese
+ *   tiempo sin mensajes). Se llama con log->lock tomado.
+ */
+static inline void log_enforce_retention(const LogStore *store, TopicLog *log, time_t now) {
+    while (log->head) {
+        int too_big = store->max_bytes && log->total_bytes > store->max_bytes && log->head != log->tail;
+        int too_old = store->max_age && now - log->head->last_append > store->max_age;
+        if (!too_big && !too_old)
+            break;
+        log_drop_head(log);
+    }
+}
+
+/* log_roll: abre un segmento nuevo al final del log. Se llama con log->lock tomado */
+static inline LogSegment *log_roll(const LogStore *store, TopicLog *log) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%020llu.log", log->dir, (unsigned long long)log->next_offset);
+    LogSegment *seg = log_segment_open(path, log->next_offset, store->segment_size, 1);
+    if (!seg)
+        return NULL;
+    if (log->tail)
+        log->tail->next = seg;
+    else
+        log->head = seg;
+    log->tail = seg;
+    return seg;
+}
+
+/*
+ * log_append
+ * - Añade una trama completa (cabecera incluida) al log y devuelve su
+ *   offset, o MSGBUF_NO_OFFSET si no se pudo guardar. La cabecera se
+ *   escribe después del contenido, de modo que si el proceso muere a mitad
+ *   la trama incompleta no se ve al reabrir el segmento.
+ */
+static inline uint64_t log_append(const LogStore *store, TopicLog *log, const char *frame, size_t len) {
+    time_t now = time(NULL);
+    uint64_t offset = MSGBUF_NO_OFFSET;
+
+    pthread_mutex_lock(&log->lock);
+    LogSegment *seg = log->tail;
+    if (!seg || seg->size + len > seg->capacity)
+        seg = log_roll(store, log);
+    if (seg) {
+        memcpy(seg->map + seg->size + FRAME_HEADER_SIZE, frame + FRAME_HEADER_SIZE, len - FRAME_HEADER_SIZE);
+        memcpy(seg->map + seg->size, frame, FRAME_HEADER_SIZE);
+        if (seg->count % LOG_INDEX_INTERVAL == 0)
+            log_index_add(seg, log->next_offset, seg->size);
+        seg->size += len;
+        seg->count++;
+        seg->last_append = now;
+        log->total_bytes += len;
+        offset = log->next_offset++;
+        log_enforce_retention(store, log, now);
+    }
+    pthread_mutex_unlock(&log->lock);
+    return offset;
+}
+
+/*
+ * log_read_chunk
+ * - Prepara el siguiente tramo de reenvío a partir de *next: tramas
+ *   completas y consecutivas de un mismo segmento, hasta 'max_bytes' (al
+ *   menos una). Devuelve un MsgBuf de fichero que mantiene vivo el segmento
+ *   y avanza *next. Si *next apunta a mensajes ya borrados por retención,
+ *   salta al más antiguo que quede. Si no queda nada por reenviar devuelve
+ *   NULL y deja en *end el offset del próximo mensaje que se publicará.
+ *   El MsgBuf sale de 'pool', el del hilo que llama.
+ */
+static inline MsgBuf *log_read_chunk(TopicLog *log, MsgPool *pool, uint64_t *next, size_t max_bytes,
+                                     uint64_t *end) {
+    MsgBuf *chunk = NULL;
+
+    pthread_mutex_lock(&log->lock);
+    LogSegment *seg = log->head;
+    if (seg && *next < seg->base_offset)
+        *next = seg->base_offset;
+    if (!seg || *next >= log->next_offset) {
+        if (*next > log->next_offset)
+            *next = log->next_offset;
+        *end = log->next_offset;
+        pthread_mutex_unlock(&log->lock);
+        return NULL;
+    }
+    while (seg->next && seg->next->base_offset <= *next)
+        seg = seg->next;
+
+    /* Última entrada del índice con offset <= *next y avance trama a trama */
+    size_t lo = 0, hi = seg->index_count;
+    while (hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+        if (seg->index[mid].offset <= *next)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    uint64_t offset = seg->index[lo].offset;
+    size_t pos = seg->index[lo].pos;
+    for (; offset < *next; offset++)
+        pos += FRAME_HEADER_SIZE + frame_get_header((unsigned char *)seg->map + pos);
+
+    size_t start = pos;
+    uint64_t seg_end = seg->base_offset + seg->count;
+    while (offset < seg_end && (pos == start || pos - start < max_bytes)) {
+        pos += FRAME_HEADER_SIZE + frame_get_header((unsigned char *)seg->map + pos);
+        offset++;
+    }
+    atomic_fetch_add_explicit(&seg->refs, 1, memory_order_relaxed);
+    chunk = msgbuf_new_file(pool, seg->fd, start, pos - start, log_segment_release, seg);
+    *next = offset;
+    pthread_mutex_unlock(&log->lock);
+    return chunk;
+}
+
+/* log_next_offset: offset que recibirá el próximo mensaje del topic */
+static inline uint64_t log_next_offset(TopicLog *log) {
+    pthread_mutex_lock(&log->lock);
+    uint64_t next = log->next_offset;
+    pthread_mutex_unlock(&log->lock);
+    return next;
+}
+
+static inline int log_compare_segments(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * log_open_topic
+ * - Crea el TopicLog de un topic en "<dir>/<nombre en hexadecimal>" y
+ *   vuelve a abrir los segmentos que ya estuvieran allí, en orden de offset.
+ *   Se llama con store->lock tomado.
+ */
+static inline TopicLog *log_open_topic(LogStore *store, const char *name, size_t len) {
+    char path[PATH_MAX];
+    int n = snprintf(path, sizeof(path), "%s/", store->dir);
+    for (size_t i = 0; i < len; i++)
+        n += snprintf(path + n, sizeof(path) - n, "%02x", (unsigned char)name[i]);
+    if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+        perror("Error creando el directorio del log");
+        return NULL;
+    }
+
+    TopicLog *log = calloc(1, sizeof(TopicLog));
+    if (!log) {
+        perror("Error reservando memoria");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_init(&log->lock, NULL);
+    log->dir = strdup(path);
+
+    /* Segmentos existentes: "<offset base>.log" */
+    uint64_t *bases = NULL;
+    size_t count = 0, capacity = 0;
+    DIR *d = opendir(path);
+    struct dirent *e;
+    while (d && (e = readdir(d)) != NULL) {
+        char *endp;
+        unsigned long long base = strtoull(e->d_name, &endp, 10);
+        if (endp == e->d_name || strcmp(endp, ".log") != 0)
+            continue;
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 8;
+            bases = topic_alloc(bases, capacity * sizeof(uint64_t));
+        }
+        bases[count++] = base;
+    }
+    if (d)
+        closedir(d);
+    qsort(bases, count, sizeof(uint64_t), log_compare_segments);
+
+    for (size_t i = 0; i < count; i++) {
+        char seg_path[PATH_MAX];
+        snprintf(seg_path, sizeof(seg_path), "%s/%020llu.log", log->dir, (unsigned long long)bases[i]);
+        LogSegment *seg = log_segment_open(seg_path, bases[i], store->segment_size, 0);
+        if (!seg)
+            continue;
+        if (log->tail)
+            log->tail->next = seg;
+        else
+            log->head = seg;
+        log->tail = seg;
+        log->total_bytes += seg->size;
+        log->next_offset = seg->base_offset + seg->count;
+    }
+    free(bases);
+    log_enforce_retention(store, log, time(NULL));
+
+    if (store->log_count == store->log_capacity) {
+        store->log_capacity = store->log_capacity ? store->log_capacity * 2 : 16;
+        store->logs = topic_alloc(store->logs, store->log_capacity * sizeof(TopicLog *));
+    }
+    store->logs[store->log_count++] = log;
+    return log;
+}
+
+/*
+ * log_store_get
+ * - Devuelve el log de un topic, abriéndolo la primera vez. 'cache' es la
+ *   tabla propia del shard que llama: en ella cada Topic guarda como único
+ *   "suscriptor" el puntero a su TopicLog, así que sólo la primera
+ *   publicación de un topic en cada shard toma el lock global. Devuelve NULL
+ *   si el topic no puede tener log (nombre demasiado largo o error de disco).
+ */
+static inline TopicLog *log_store_get(LogStore *store, TopicTable *cache, const char *name, size_t len) {
+    Topic *cached = topic_find(cache, name, len, topic_hash(name, len));
+    if (cached)
+        return *(TopicLog **)cached->subs;
+    if (len > LOG_MAX_TOPIC_LEN)
+        return NULL;
+
+    pthread_mutex_lock(&store->lock);
+    Topic *t = topic_intern(&store->by_name, name, len);
+    if (t->sub_count == 0) {
+        TopicLog *log = log_open_topic(store, name, len);
+        if (!log) {
+            pthread_mutex_unlock(&store->lock);
+            return NULL;
+        }
+        topic_sub_append(t, &log, sizeof(log));
+    }
+    TopicLog *log = *(TopicLog **)t->subs;
+    pthread_mutex_unlock(&store->lock);
+
+    cached = topic_intern(cache, name, len);
+    topic_sub_append(cached, &log, sizeof(log));
+    return log;
+}
+
+/*
+ * log_store_open
+ * - Prepara el directorio del log y abre los topics que ya tuvieran
+ *   segmentos de una ejecución anterior.
+ */
+static inline void log_store_open(LogStore *store) {
+    pthread_mutex_init(&store->lock, NULL);
+    if (mkdir(store->dir, 0755) < 0 && errno != EEXIST) {
+        perror("Error creando el directorio del log");
+        exit(EXIT_FAILURE);
+    }
+    DIR *d = opendir(store->dir);
+    if (!d) {
+        perror("Error abriendo el directorio del log");
+        exit(EXIT_FAILURE);
+    }
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        size_t hex_len = strlen(e->d_name);
+        char name[LOG_MAX_TOPIC_LEN];
+        if (hex_len == 0 || hex_len % 2 != 0 || hex_len / 2 > sizeof(name) ||
+            strspn(e->d_name, "0123456789abcdef") != hex_len)
+            continue;
+        for (size_t i = 0; i < hex_len / 2; i++) {
+            unsigned byte;
+            sscanf(e->d_name + 2 * i, "%2x", &byte);
+            name[i] = (char)byte;
+        }
+        pthread_mutex_lock(&store->lock);
+        Topic *t = topic_intern(&store->by_name, name, hex_len / 2);
+        TopicLog *log = t->sub_count == 0 ? log_open_topic(store, name, hex_len / 2) : NULL;
+        if (log) {
+            topic_sub_append(t, &log, sizeof(log));
+            printf("Log recuperado del tema %.*s: offsets hasta %llu\n", (int)(hex_len / 2), name,
+                   (unsigned long long)log->next_offset);
+        }
+        pthread_mutex_unlock(&store->lock);
+    }
+    closedir(d);
+}
+
+/* log_store_sweep: aplica la retención por antigüedad a todos los logs */
+static inline void log_store_sweep(LogStore *store) {
+    time_t now = time(NULL);
+    pthread_mutex_lock(&store->lock);
+    for (size_t i = 0; i < store->log_count; i++) {
+        TopicLog *log = store->logs[i];
+        pthread_mutex_lock(&log->lock);
+        log_enforce_retention(store, log, now);
+        pthread_mutex_unlock(&log->lock);
+    }
+    pthread_mutex_unlock(&store->lock);
+}
+
+#endif /* TOPIC_LOG_H */
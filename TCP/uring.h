@@ -0,0 +1,264 @@
+/*
+ * uring.h
+ *
+ * Acceso mínimo a io_uring directamente con las llamadas al sistema, sin
+ * liburing, para el motor de completado del broker TCP (opción -E uring).
+ * Un Uring son dos anillos compartidos con el núcleo: en el de envío (SQ)
+ * el programa deja peticiones (SQE) y en el de completado (CQ) el núcleo
+ * deja los resultados (CQE). Escribir peticiones y leer resultados no cuesta
+ * ninguna llamada al sistema; una sola io_uring_enter() entrega todas las
+ * peticiones acumuladas y espera resultados.
+ *
+ * Además de los anillos, aquí está el anillo de buffers proporcionados
+ * (UringBufRing): una reserva de buffers de recepción registrada en el
+ * núcleo, del que una recepción "multishot" toma un buffer cada vez que
+ * llegan datos. Así una sola petición de recepción por conexión sirve para
+ * siempre y los buffers sólo están ocupados mientras hay datos sin procesar.
+ *
+ * Requiere Linux 6.0 o posterior (recepción multishot); uring_supported()
+ * lo comprueba al arrancar para poder volver a epoll.
+ *
+ * Encabezados usados:
+ * - <linux/io_uring.h>: estructuras y constantes de io_uring.
+ * - <sys/syscall.h>: números de io_uring_setup/enter/register.
+ * - <sys/mman.h>: mmap() de los anillos compartidos.
+ * - <sys/utsname.h>: uname() para la versión del núcleo.
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+
+typedef struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_array;
+    unsigned sq_mask, sq_entries;
+    unsigned sq_local;             /* SQE preparadas y aún no publicadas al núcleo */
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head, *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_map, *cq_map;
+    size_t sq_map_size, cq_map_size;
+    uint64_t enters;               /* llamadas a io_uring_enter(), para las estadísticas */
+} Uring;
+
+/* Anillo de buffers proporcionados: 'count' buffers de 'size' bytes */
+typedef struct {
+    struct io_uring_buf_ring *ring;
+    char *base;
+    unsigned count;
+    unsigned size;
+    uint16_t tail;
+    uint16_t group;
+} UringBufRing;
+
+static inline int uring_setup_raw(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int uring_enter_raw(int fd, unsigned submit, unsigned wait, unsigned flags, void *arg, size_t argsz) {
+    return (int)syscall(__NR_io_uring_enter, fd, submit, wait, flags, arg, argsz);
+}
+
+static inline int uring_register_raw(int fd, unsigned op, void *arg, unsigned n) {
+    return (int)syscall(__NR_io_uring_register, fd, op, arg, n);
+}
+
+/*
+ * uring_init
+ * - Crea el anillo con 'entries' peticiones (el de completado, cuatro veces
+ *   más grande, porque cada petición multishot produce muchos resultados) y
+ *   proyecta los anillos en memoria. Devuelve 0 o -errno.
+ * - Hay que llamarla desde el hilo que lo va a usar: con SINGLE_ISSUER y
+ *   DEFER_TASKRUN (Linux 6.1) el núcleo completa las peticiones sólo cuando
+ *   ese hilo espera resultados, sin interrumpirlo mientras procesa el lote.
+ *   Si el núcleo no los admite, se crea sin ellos.
+ */
+static inline int uring_init(Uring *u, unsigned entries) {
+    struct io_uring_params p;
+    memset(u, 0, sizeof(*u));
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    p.cq_entries = entries * 4;
+    u->fd = uring_setup_raw(entries, &p);
+    if (u->fd < 0 && errno == EINVAL) {
+        memset(&p, 0, sizeof(p));
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = entries * 4;
+        u->fd = uring_setup_raw(entries, &p);
+    }
+    if (u->fd < 0)
+        return -errno;
+
+    u->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_map_size > u->sq_map_size)
+            u->sq_map_size = u->cq_map_size;
+        u->cq_map_size = u->sq_map_size;
+    }
+    u->sq_map = mmap(NULL, u->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd,
+                     IORING_OFF_SQ_RING);
+    u->cq_map = (p.features & IORING_FEAT_SINGLE_MMAP)
+                    ? u->sq_map
+                    : mmap(NULL, u->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd,
+                           IORING_OFF_CQ_RING);
+    u->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sq_map == MAP_FAILED || u->cq_map == MAP_FAILED || u->sqes == MAP_FAILED) {
+        int err = -errno;
+        close(u->fd);
+        return err;
+    }
+
+    char *sq = u->sq_map, *cq = u->cq_map;
+    u->sq_head = (unsigned *)(sq + p.sq_off.head);
+    u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    u->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    u->sq_entries = p.sq_entries;
+    u->sq_array = (unsigned *)(sq + p.sq_off.array);
+    u->sq_local = *u->sq_tail;
+    u->cq_head = (unsigned *)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    u->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+/*
+ * uring_enter
+ * - Publica las SQE preparadas y, si 'wait' > 0, espera a que haya al menos
+ *   ese número de resultados o venza 'timeout_ms' (< 0: sin límite).
+ */
+static inline int uring_enter(Uring *u, unsigned wait, int timeout_ms) {
+    unsigned submit = u->sq_local - *u->sq_tail;
+    atomic_store_explicit((_Atomic unsigned *)u->sq_tail, u->sq_local, memory_order_release);
+    struct __kernel_timespec ts = { .tv_sec = timeout_ms / 1000, .tv_nsec = (timeout_ms % 1000) * 1000000ll };
+    struct io_uring_getevents_arg arg = { .ts = timeout_ms >= 0 ? (uint64_t)(uintptr_t)&ts : 0 };
+    unsigned flags = wait > 0 ? IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG : 0;
+    if (submit == 0 && wait == 0)
+        return 0;
+    u->enters++;
+    int r = uring_enter_raw(u->fd, submit, wait, flags, wait > 0 ? &arg : NULL, wait > 0 ? sizeof(arg) : 0);
+    return r < 0 ? -errno : r;
+}
+
+/* uring_sqe: siguiente SQE libre y a cero; si el anillo está lleno, publica las pendientes */
+static inline struct io_uring_sqe *uring_sqe(Uring *u) {
+    while (u->sq_local - atomic_load_explicit((_Atomic unsigned *)u->sq_head, memory_order_acquire) >=
+           u->sq_entries)
+        uring_enter(u, 0, 0);
+    unsigned i = u->sq_local & u->sq_mask;
+    u->sq_array[i] = i;
+    u->sq_local++;
+    memset(&u->sqes[i], 0, sizeof(u->sqes[i]));
+    return &u->sqes[i];
+}
+
+/* uring_cqe: primer resultado sin consumir, o NULL */
+static inline struct io_uring_cqe *uring_cqe(Uring *u) {
+    unsigned head = *u->cq_head;
+    if (head == atomic_load_explicit((_Atomic unsigned *)u->cq_tail, memory_order_acquire))
+        return NULL;
+    return &u->cqes[head & u->cq_mask];
+}
+
+/* uring_cqe_seen: devuelve al núcleo el hueco del resultado ya procesado */
+static inline void uring_cqe_seen(Uring *u) {
+    atomic_store_explicit((_Atomic unsigned *)u->cq_head, *u->cq_head + 1, memory_order_release);
+}
+
+/*
+ * uring_buf_ring_init
+ * - Reserva 'count' buffers de 'size' bytes (count potencia de dos), los
+ *   registra como grupo 'group' y los deja todos disponibles. Devuelve 0 o
+ *   -errno.
+ */
+static inline int uring_buf_ring_init(Uring *u, UringBufRing *br, uint16_t group, unsigned count, unsigned size) {
+    size_t ring_size = count * sizeof(struct io_uring_buf);
+    br->ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    br->base = malloc((size_t)count * size);
+    if (br->ring == MAP_FAILED || !br->base)
+        return -ENOMEM;
+    br->count = count;
+    br->size = size;
+    br->group = group;
+    br->tail = 0;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)br->ring;
+    reg.ring_entries = count;
+    reg.bgid = group;
+    if (uring_register_raw(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        return -errno;
+    for (unsigned i = 0; i < count; i++) {
+        struct io_uring_buf *b = &br->ring->bufs[i];
+        b->addr = (uint64_t)(uintptr_t)(br->base + (size_t)i * size);
+        b->len = size;
+        b->bid = (uint16_t)i;
+    }
+    br->tail = (uint16_t)count;
+    atomic_store_explicit((_Atomic uint16_t *)&br->ring->tail, br->tail, memory_order_release);
+    return 0;
+}
+
+static inline char *uring_buf(UringBufRing *br, unsigned id) {
+    return br->base + (size_t)id * br->size;
+}
+
+/* uring_buf_recycle: devuelve el buffer 'id' al núcleo una vez procesados sus datos */
+static inline void uring_buf_recycle(UringBufRing *br, unsigned id) {
+    struct io_uring_buf *b = &br->ring->bufs[br->tail & (br->count - 1)];
+    b->addr = (uint64_t)(uintptr_t)uring_buf(br, id);
+    b->len = br->size;
+    b->bid = (uint16_t)id;
+    br->tail++;
+    atomic_store_explicit((_Atomic uint16_t *)&br->ring->tail, br->tail, memory_order_release);
+}
+
+/*
+ * uring_supported
+ * - 1 si el núcleo tiene todo lo que usa el motor io_uring: las operaciones
+ *   necesarias, esperas con límite de tiempo (EXT_ARG), anillos de buffers
+ *   proporcionados y recepción multishot (Linux 6.0).
+ */
+static inline int uring_supported(void) {
+    struct utsname un;
+    int major = 0, minor = 0;
+    if (uname(&un) != 0 || sscanf(un.release, "%d.%d", &major, &minor) != 2 || major < 6)
+        return 0;
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = uring_setup_raw(4, &p);
+    if (fd < 0)
+        return 0;
+    struct {
+        struct io_uring_probe probe;
+        struct io_uring_probe_op ops[256];
+    } pr;
+    memset(&pr, 0, sizeof(pr));
+    int ok = (p.features & IORING_FEAT_EXT_ARG) && uring_register_raw(fd, IORING_REGISTER_PROBE, &pr, 256) == 0;
+    static const int needed[] = { IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_POLL_ADD,
+                                  IORING_OP_ASYNC_CANCEL };
+    for (size_t i = 0; ok && i < sizeof(needed) / sizeof(needed[0]); i++)
+        ok = needed[i] <= pr.probe.last_op && (pr.ops[needed[i]].flags & IO_URING_OP_SUPPORTED);
+    close(fd);
+    return ok;
+}
+
+#endif /* URING_H */
@@ -5,74 +5,1007 @@
  * y subscribers envían datagramas al puerto UDP del broker. Los subscribers
  * se registran enviando "SUBSCRIBE <topic>" desde su dirección UDP. Cuando
  * un publisher envía "topic|message", el broker reenvía el mensaje usando
- * sendto() a las direcciones de los subscribers registrados.
+ * sendmmsg() a las direcciones de los subscribers registrados.
+ *
+ * Para reducir el coste por paquete, el broker trabaja por lotes: un solo
+ * recvmmsg() recoge hasta 'batch_size' datagramas y los envíos a todos los
+ * suscriptores de esos mensajes se agrupan en llamadas sendmmsg(). El tamaño
+ * de lote se elige al arrancar con -b (con -b 1 el comportamiento equivale a
+ * un recvfrom()/sendto() por datagrama).
+ *
+ * Cada topic numera sus mensajes y guarda los últimos en un anillo acotado
+ * (UDP/udp_seq.h). Los suscriptores reciben "topic|message" precedido de la
+ * secuencia, detectan los huecos y piden lo que les falta con
+ * "NACK <topic> <desde> <hasta>"; el broker lo reenvía desde el anillo sólo
+ * a quien lo pidió. Cada HEARTBEAT_MS los topics que publicaron envían un
+ * latido con su última secuencia, para que también se detecten las pérdidas
+ * al final de una ráfaga.
+ *
+ * Las suscripciones son arrendamientos (leases): cada cliente (IP, puerto)
+ * tiene un plazo de -l segundos que renueva con "RENEW" (o repitiendo un
+ * SUBSCRIBE). Si deja de renovar, por ejemplo porque el proceso murió o
+ * cambió de puerto, el broker lo da de baja de todos sus topics y deja de
+ * enviarle datagramas. Los vencimientos los lleva una rueda de
+ * temporizadores jerárquica (common/timer_wheel.h), así que vigilar 100000
+ * clientes no cuesta recorrerlos: en cada tick sólo se mira una ranura. La
+ * misma rueda dispara los latidos de secuencia. El número de suscripciones
+ * está acotado por -m; las que no caben se rechazan.
+ *
+ * Cada SUBSCRIBE se confirma con un SUBACK. Con -M <n>, un topic que llega a
+ * n suscriptores pasa a multicast: se le asigna un grupo (a partir de -g, en
+ * el puerto del broker + 1) y el SUBACK lleva su dirección. Los suscriptores
+ * se unen al grupo y lo confirman con "JOINED <topic>"; desde entonces cada
+ * mensaje del topic sale una sola vez hacia el grupo, en lugar de un envío
+ * por suscriptor. Los que no se han unido (todavía, o porque no saben)
+ * siguen recibiendo por unicast, y los topics pequeños no cambian.
+ *
+ * Los datagramas se reciben enteros, hasta el máximo de UDP; como el broker
+ * antepone la cabecera de secuencia, los mensajes de más de SEQ_MAX_PAYLOAD
+ * bytes se descartan. El anillo de cada topic guarda los mensajes con su
+ * tamaño real, y los Client salen de un pool (common/slab.h), así que el
+ * camino de un mensaje no reserva memoria.
+ *
+ * Un datagrama "STATS" recibe como respuesta las estadísticas del broker
+ * (common/stats.h): mensajes y bytes de entrada y salida, descartes,
+ * suscripciones, contadores por topic y un histograma del tiempo desde que
+ * llega cada mensaje hasta que sale el último envío de su lote.
+ *
+ * Los mensajes informativos (suscripciones, leases, multicast y, con el
+ * nivel debug, cada publicación) pasan como registros binarios a un hilo
+ * aparte que los formatea y los escribe por lotes (common/async_log.h), así
+ * que una salida estándar lenta no frena el bucle de datagramas. El nivel
+ * (-v) y el muestreo de las publicaciones (-n) se cambian en marcha con un
+ * datagrama "LOG <nivel> [N]"; los registros que no caben en el anillo se
+ * cuentan en "log_descartados".
  *
  * Encabezados no estándar clave:
  * - <arpa/inet.h>: define sockaddr_in y helpers como htons/inet_pton.
- * - <sys/socket.h>: prototipos de socket(), bind(), recvfrom(), sendto().
+ * - <sys/socket.h>: prototipos de socket(), bind(), recvmmsg(), sendmmsg().
+ * - <pthread.h>: el hilo del registro (compilar con -pthread).
  */
 
+#define _GNU_SOURCE /* recvmmsg() y sendmmsg() son extensiones de Linux */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 
+#include "../common/async_log.h"
+#include "../common/slab.h"
+#include "../common/stats.h"
+#include "../common/timer_wheel.h"
+#include "../common/topic_table.h"
+#include "udp_seq.h"
+
 #define PORT 8080
-#define BUFFER_SIZE 1024
-#define MAX_SUBS 50
+#define DEFAULT_BATCH 64 /* datagramas por recvmmsg()/sendmmsg() */
+#define MAX_BATCH 1024
+#define STATS_REPLY_MAX 65000 /* la respuesta a STATS cabe en un datagrama */
+#define DEFAULT_RING 1024     /* mensajes retransmisibles por topic */
+#define RING_BYTES_PER_MSG 1024 /* memoria del anillo por mensaje retransmisible */
+#define HEARTBEAT_MS 50       /* intervalo de los latidos de secuencia */
+#define TICK_MS 50            /* resolución de la rueda de temporizadores */
+#define DEFAULT_LEASE_S 30    /* plazo de un cliente sin renovar */
+#define DEFAULT_MAX_SUBS 1000000
+#define DEFAULT_MCAST_GROUP "239.255.0.1" /* primer grupo; los siguientes, consecutivos */
+#define DEFAULT_MCAST_IF "127.0.0.1"      /* interfaz de salida del multicast */
+
+/* Suscripción de un cliente: topic y posición de su entrada en la lista del topic */
+typedef struct {
+    uint32_t topic_id;
+    uint32_t pos;
+} ClientSub;
+
+/*
+ * Client
+ * - Un endpoint UDP (IP, puerto) con al menos una suscripción. Su lease
+ *   vence en 'expires_ns'; renovar sólo mueve esa marca, y el temporizador
+ *   de la rueda, al dispararse, comprueba si de verdad venció o vuelve a
+ *   armarse para la nueva fecha. Así una renovación no toca la rueda.
+ */
+typedef struct {
+    TimerNode timer;         /* primer miembro: el nodo es el propio Client */
+    struct sockaddr_in addr;
+    uint64_t expires_ns;
+    ClientSub *subs;
+    size_t sub_count;
+    size_t sub_capacity;
+} Client;
 
 /* Entrada de suscriptor para UDP
  * - addr: sockaddr_in que contiene la IP y el puerto del endpoint UDP del suscriptor.
  *         En UDP debemos recordar la dirección del cliente para poder
  *         enviarle datagramas de vuelta con sendto().
- * - topic: cadena con el topic al que el cliente se suscribió.
+ * - client, slot: dueño de la entrada y posición en su arreglo 'subs', para
+ *         darla de baja en O(1) cuando vence el lease.
+ *
+ * Cada entrada vive en la lista del Topic correspondiente (common/topic_table.h).
  */
 typedef struct {
     struct sockaddr_in addr;
-    char topic[50];
+    Client *client;
+    uint32_t slot;
 } Subscriber;
 
-Subscriber subscribers[MAX_SUBS];
-int sub_count = 0;
+/* Clave del índice de suscripciones: (topic, IP, puerto) */
+typedef struct {
+    uint32_t topic_id;
+    uint32_t ip;
+    uint16_t port;
+    uint8_t used;
+} SubKey;
+
+TopicTable topics;            // registro de topics con sus listas de suscriptores
+SubKey *sub_index = NULL;     // conjunto hash de suscripciones existentes
+size_t sub_index_capacity = 0;
+size_t sub_count = 0;
+Client **clients = NULL;      // tabla hash de clientes por (IP, puerto)
+size_t client_capacity = 0;
+size_t client_count = 0;
+TimerWheel wheel;             // leases de los clientes y latidos de secuencia
+TimerNode heartbeat_timer;
+uint64_t lease_ns = DEFAULT_LEASE_S * 1000000000ull;
+size_t max_subs = DEFAULT_MAX_SUBS;
+size_t mcast_threshold = 0;   // suscriptores para pasar un topic a multicast (0 = nunca)
+struct in_addr mcast_base;    // primer grupo multicast
+uint32_t mcast_groups = 0;    // grupos asignados
+int mcast_port;
+
+/*
+ * TopicState
+ * - Estado del broker UDP para cada topic, indexado por id y reservado por
+ *   separado (los envíos pendientes del lote apuntan a 'group', así que no
+ *   puede moverse al crecer el arreglo).
+ * - La lista de suscriptores del topic está partida en dos: las primeras
+ *   'unicast' entradas reciben cada mensaje por unicast; las demás ya se
+ *   unieron al grupo multicast y les basta un envío al grupo. Mientras el
+ *   topic no es multicast, 'unicast' es toda la lista.
+ */
+typedef struct {
+    SeqRing ring;              /* anillo de retransmisión (se crea al publicar) */
+    size_t unicast;
+    int mcast;                 /* el topic tiene grupo multicast */
+    struct sockaddr_in group;
+    char *suback;              /* "topic grupo:puerto", contenido de su SUBACK */
+    size_t suback_len;
+} TopicState;
+
+TopicState **topic_states = NULL;
+size_t state_capacity = 0;
+
+/*
+ * TxBatch
+ * - Envíos pendientes del lote actual. Cada entrada lleva su cabecera de
+ *   secuencia y apunta directamente al mensaje dentro del buffer de
+ *   recepción (válido hasta que termina el lote), o dentro del anillo si es
+ *   una retransmisión, y a la dirección del suscriptor, sin copiar nada.
+ */
+typedef struct {
+    struct mmsghdr *msgs;
+    struct iovec *iovs;                        /* dos por envío: cabecera y mensaje */
+    unsigned char (*hdrs)[SEQ_HEADER_SIZE];    /* cabecera de secuencia de cada envío */
+    size_t count;
+    size_t capacity;
+    uint64_t gen;                              /* se incrementa en cada tx_flush() */
+} TxBatch;
+
+int batch_size = DEFAULT_BATCH;
+uint32_t ring_size = DEFAULT_RING;
+
+uint32_t *dirty_topics = NULL; // topics que publicaron desde el último latido
+size_t dirty_count = 0;
+size_t dirty_capacity = 0;
+
+BrokerStats stats;            // contadores del broker (un solo hilo)
+SlabPool client_pool;         // Client de los suscriptores
+StatsTopicTable stats_topics; // nombres de topic de las estadísticas
+size_t fanout_pending = 0;    // publicaciones del lote actual que tienen suscriptores
+AsyncLog event_log;           // mensajes informativos, un solo anillo (-v/-n)
+
+/* Eventos del registro (AlogRecord.event) y su texto, ver format_event() */
+enum { EV_SUB_REJECTED, EV_SUBSCRIBED, EV_MULTICAST, EV_LEASE_EXPIRED, EV_PUBLISHED, EV_LOG_LEVEL };
+
+/* ip_text: dirección IPv4 (en orden de red) como texto */
+static inline const char *ip_text(uint64_t ip, char *buf) {
+    struct in_addr addr = { .s_addr = (uint32_t)ip };
+    return inet_ntop(AF_INET, &addr, buf, INET_ADDRSTRLEN);
+}
+
+/*
+ * format_event
+ * - Convierte un registro de event_log en su línea, con el mismo texto que
+ *   el broker escribía antes con printf. Las direcciones viajan como números
+ *   y se pasan a texto aquí, en el hilo del registro.
+ */
+size_t format_event(char *out, size_t cap, const AlogRecord *rec) {
+    int n0 = rec->len[0], n1 = rec->len[1];
+    const char *s0 = alog_str(rec, 0), *s1 = alog_str(rec, 1);
+    const char *more = rec->truncated ? "..." : "";
+    char ip[INET_ADDRSTRLEN];
+    int n = 0;
+    switch (rec->event) {
+    case EV_SUB_REJECTED:
+        n = snprintf(out, cap, "Suscripción rechazada al tema %.*s%s: registro lleno (%llu)", n0, s0, more,
+                     (unsigned long long)rec->num[0]);
+        break;
+    case EV_SUBSCRIBED:
+        n = snprintf(out, cap, "Nuevo suscriptor al tema: %.*s%s", n0, s0, more);
+        break;
+    case EV_MULTICAST:
+        n = snprintf(out, cap, "Tema %.*s%s pasa a multicast (%llu suscriptores): %s:%d", n0, s0, more,
+                     (unsigned long long)rec->num[1], ip_text(rec->num[0], ip), mcast_port);
+        break;
+    case EV_LEASE_EXPIRED: /* num[1]: puerto en los 16 bits altos, suscripciones en el resto */
+        n = snprintf(out, cap, "Lease vencido: %s:%u (%llu suscripciones)", ip_text(rec->num[0], ip),
+                     (unsigned)(rec->num[1] >> 48), (unsigned long long)(rec->num[1] & 0xffffffffffffull));
+        break;
+    case EV_PUBLISHED:
+        n = snprintf(out, cap, "Mensaje recibido del tema '%.*s': %.*s%s", n0, s0, n1, s1, more);
+        break;
+    case EV_LOG_LEVEL:
+        n = snprintf(out, cap, "Registro: nivel %s, una de cada %llu publicaciones", alog_level_name((int)rec->num[0]),
+                     (unsigned long long)rec->num[1]);
+        break;
+    }
+    return n < 0 ? 0 : (size_t)n < cap ? (size_t)n : cap - 1;
+}
+
+uint32_t sub_key_hash(uint32_t topic_id, uint32_t ip, uint16_t port) {
+    uint64_t k = ((uint64_t)ip << 32) ^ ((uint64_t)port << 16) ^ topic_id;
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    return (uint32_t)k;
+}
+
+/* grow_ids: amplía un arreglo de ids de topic para que quepan 'needed' */
+uint32_t *grow_ids(uint32_t *ids, size_t *capacity, size_t needed) {
+    if (needed <= *capacity)
+        return ids;
+    *capacity = *capacity ? *capacity * 2 : TOPIC_TABLE_INITIAL;
+    return topic_alloc(ids, *capacity * sizeof(uint32_t));
+}
+
+/* sub_index_insert
+ * - Inserta la clave si no estaba. Devuelve 0 si ya existía y 1 si es nueva.
+ *   La tabla se duplica al superar el 50% de ocupación.
+ */
+int sub_index_insert(uint32_t topic_id, uint32_t ip, uint16_t port) {
+    if ((sub_count + 1) * 2 > sub_index_capacity) {
+        size_t old_capacity = sub_index_capacity;
+        SubKey *old = sub_index;
+        sub_index_capacity = old_capacity ? old_capacity * 2 : TOPIC_TABLE_INITIAL;
+        sub_index = calloc(sub_index_capacity, sizeof(SubKey));
+        if (!sub_index) {
+            perror("Error reservando memoria");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < old_capacity; i++) {
+            if (!old[i].used)
+                continue;
+            size_t j = sub_key_hash(old[i].topic_id, old[i].ip, old[i].port) & (sub_index_capacity - 1);
+            while (sub_index[j].used)
+                j = (j + 1) & (sub_index_capacity - 1);
+            sub_index[j] = old[i];
+        }
+        free(old);
+    }
+
+    size_t mask = sub_index_capacity - 1;
+    for (size_t i = sub_key_hash(topic_id, ip, port) & mask;; i = (i + 1) & mask) {
+        SubKey *k = &sub_index[i];
+        if (!k->used) {
+            *k = (SubKey){ .topic_id = topic_id, .ip = ip, .port = port, .used = 1 };
+            sub_count++;
+            return 1;
+        }
+        if (k->topic_id == topic_id && k->ip == ip && k->port == port)
+            return 0;
+    }
+}
+
+int sub_index_contains(uint32_t topic_id, uint32_t ip, uint16_t port) {
+    if (sub_index_capacity == 0)
+        return 0;
+    size_t mask = sub_index_capacity - 1;
+    for (size_t i = sub_key_hash(topic_id, ip, port) & mask; sub_index[i].used; i = (i + 1) & mask)
+        if (sub_index[i].topic_id == topic_id && sub_index[i].ip == ip && sub_index[i].port == port)
+            return 1;
+    return 0;
+}
+
+/* in_probe_range: ¿la posición 'k' está en el tramo circular (i, j]? */
+int in_probe_range(size_t i, size_t k, size_t j) {
+    return i <= j ? (i < k && k <= j) : (i < k || k <= j);
+}
+
+/*
+ * sub_index_remove
+ * - Borra la clave sin dejar lápidas: las claves siguientes de la misma
+ *   racha que ya no serían alcanzables se desplazan hacia atrás.
+ */
+void sub_index_remove(uint32_t topic_id, uint32_t ip, uint16_t port) {
+    size_t mask = sub_index_capacity - 1;
+    size_t i = sub_key_hash(topic_id, ip, port) & mask;
+    while (sub_index[i].used &&
+           !(sub_index[i].topic_id == topic_id && sub_index[i].ip == ip && sub_index[i].port == port))
+        i = (i + 1) & mask;
+    if (!sub_index[i].used)
+        return;
+    sub_count--;
+    for (size_t j = i;;) {
+        sub_index[i].used = 0;
+        size_t home;
+        do {
+            j = (j + 1) & mask;
+            if (!sub_index[j].used)
+                return;
+            home = sub_key_hash(sub_index[j].topic_id, sub_index[j].ip, sub_index[j].port) & mask;
+        } while (in_probe_range(i, home, j));
+        sub_index[i] = sub_index[j];
+        i = j;
+    }
+}
+
+uint32_t client_hash(uint32_t ip, uint16_t port) {
+    return sub_key_hash(UINT32_MAX, ip, port);
+}
+
+Client *client_find(uint32_t ip, uint16_t port) {
+    if (client_capacity == 0)
+        return NULL;
+    size_t mask = client_capacity - 1;
+    for (size_t i = client_hash(ip, port) & mask; clients[i]; i = (i + 1) & mask)
+        if (clients[i]->addr.sin_addr.s_addr == ip && clients[i]->addr.sin_port == port)
+            return clients[i];
+    return NULL;
+}
+
+/* client_slot_put: coloca el cliente en la tabla (que ya tiene sitio) */
+void client_slot_put(Client **table, size_t capacity, Client *c) {
+    size_t mask = capacity - 1;
+    size_t i = client_hash(c->addr.sin_addr.s_addr, c->addr.sin_port) & mask;
+    while (table[i])
+        i = (i + 1) & mask;
+    table[i] = c;
+}
+
+void lease_expired(TimerNode *node, void *arg);
+
+/* client_new: registra un cliente nuevo y arma su lease */
+Client *client_new(struct sockaddr_in addr, uint64_t now) {
+    if ((client_count + 1) * 2 > client_capacity) {
+        size_t new_capacity = client_capacity ? client_capacity * 2 : TOPIC_TABLE_INITIAL;
+        Client **table = calloc(new_capacity, sizeof(Client *));
+        if (!table) {
+            perror("Error reservando memoria");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < client_capacity; i++)
+            if (clients[i])
+                client_slot_put(table, new_capacity, clients[i]);
+        free(clients);
+        clients = table;
+        client_capacity = new_capacity;
+    }
+    Client *c = slab_calloc(&client_pool, sizeof(Client));
+    c->addr = addr;
+    c->expires_ns = now + lease_ns;
+    c->timer.fire = lease_expired;
+    timer_add(&wheel, &c->timer, c->expires_ns);
+    client_slot_put(clients, client_capacity, c);
+    client_count++;
+    stat_set(&stats.conns, client_count);
+    return c;
+}
+
+/* client_remove: quita el cliente de la tabla hash (mismo desplazamiento que sub_index_remove) */
+void client_remove(Client *c) {
+    size_t mask = client_capacity - 1;
+    size_t i = client_hash(c->addr.sin_addr.s_addr, c->addr.sin_port) & mask;
+    while (clients[i] != c)
+        i = (i + 1) & mask;
+    for (size_t j = i;;) {
+        clients[i] = NULL;
+        size_t home;
+        do {
+            j = (j + 1) & mask;
+            if (!clients[j])
+                goto removed;
+            home = client_hash(clients[j]->addr.sin_addr.s_addr, clients[j]->addr.sin_port) & mask;
+        } while (in_probe_range(i, home, j));
+        clients[i] = clients[j];
+        i = j;
+    }
+removed:
+    client_count--;
+    stat_set(&stats.conns, client_count);
+}
+
+/* lease_renew: alarga el lease; el temporizador ya armado lo notará al dispararse */
+void lease_renew(Client *c, uint64_t now) {
+    c->expires_ns = now + lease_ns;
+    stat_add(&stats.leases_renewed, 1);
+}
+
+TopicState *topic_state(Topic *t) {
+    if (t->id >= state_capacity) {
+        size_t old = state_capacity;
+        state_capacity = old ? old * 2 : TOPIC_TABLE_INITIAL;
+        while (state_capacity <= t->id)
+            state_capacity *= 2;
+        topic_states = topic_alloc(topic_states, state_capacity * sizeof(TopicState *));
+        memset(topic_states + old, 0, (state_capacity - old) * sizeof(TopicState *));
+    }
+    if (!topic_states[t->id]) {
+        topic_states[t->id] = calloc(1, sizeof(TopicState));
+        if (!topic_states[t->id]) {
+            perror("Error reservando memoria");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return topic_states[t->id];
+}
+
+/* sub_place: copia la entrada 'from' de la lista del topic a 'to' y avisa a su dueño */
+void sub_place(Topic *t, size_t from, size_t to) {
+    Subscriber *subs = t->subs;
+    subs[to] = subs[from];
+    subs[to].client->subs[subs[to].slot].pos = (uint32_t)to;
+}
+
+/* sub_swap: intercambia dos entradas de la lista del topic */
+void sub_swap(Topic *t, size_t a, size_t b) {
+    Subscriber *subs = t->subs;
+    Subscriber tmp = subs[a];
+    sub_place(t, b, a);
+    subs[b] = tmp;
+    subs[b].client->subs[subs[b].slot].pos = (uint32_t)b;
+}
+
+/* sub_link: añade la entrada al final del tramo unicast de la lista y devuelve su posición */
+size_t sub_link(Topic *t, const Subscriber *sub) {
+    TopicState *st = topic_state(t);
+    size_t pos = topic_sub_append(t, sub, sizeof(*sub));
+    if (pos != st->unicast) {
+        sub_swap(t, pos, st->unicast);
+        pos = st->unicast;
+    }
+    st->unicast++;
+    return pos;
+}
+
+/*
+ * sub_unlink
+ * - Quita la entrada 'pos' en O(1) sin romper la partición: si era unicast,
+ *   el último unicast ocupa su hueco y el hueco pasa al final de ese tramo;
+ *   después topic_sub_remove() lo rellena con el último de la lista.
+ */
+void sub_unlink(Topic *t, size_t pos) {
+    TopicState *st = topic_state(t);
+    if (pos < st->unicast) {
+        st->unicast--;
+        if (pos != st->unicast)
+            sub_place(t, st->unicast, pos);
+        pos = st->unicast;
+    }
+    topic_sub_remove(t, pos, sizeof(Subscriber));
+    if (pos < t->sub_count)
+        sub_place(t, pos, pos); /* la entrada movida: corregir la posición de su dueño */
+}
 
 /* add_subscriber
- * - Añade la dirección y el topic del cliente a la lista de suscriptores.
- * - Comprueba entradas existentes para evitar suscripciones duplicadas
- *   desde el mismo par (IP, puerto)/topic.
+ * - Añade la dirección del cliente a la lista del topic y renueva su lease.
+ * - El índice hash (topic, IP, puerto) evita suscripciones duplicadas desde
+ *   el mismo par (IP, puerto)/topic sin recorrer ninguna lista.
+ * - Con max_subs suscripciones activas, las nuevas se rechazan sin crear
+ *   el topic.
+ * - Devuelve el topic, o NULL si la suscripción se rechazó.
  */
-void add_subscriber(struct sockaddr_in addr, const char *topic) {
-    for (int i = 0; i < sub_count; i++) {
-        if (strcmp(subscribers[i].topic, topic) == 0 &&
-            subscribers[i].addr.sin_addr.s_addr == addr.sin_addr.s_addr &&
-            subscribers[i].addr.sin_port == addr.sin_port)
-            return; // ya suscrito
+Topic *add_subscriber(struct sockaddr_in addr, const char *topic, size_t topic_len, uint64_t now) {
+    uint32_t ip = addr.sin_addr.s_addr;
+    Client *c = client_find(ip, addr.sin_port);
+    if (c)
+        lease_renew(c, now);
+
+    /* Un SUBSCRIBE rechazado no debe dejar un topic nuevo en el registro */
+    Topic *t = topic_find(&topics, topic, topic_len, topic_hash(topic, topic_len));
+    if (sub_count >= max_subs && !(t && sub_index_contains(t->id, ip, addr.sin_port))) {
+        stat_add(&stats.subs_rejected, 1);
+        alog_write(&event_log, 0, ALOG_INFO, EV_SUB_REJECTED, topic, topic_len, NULL, 0, max_subs, 0);
+        return NULL;
+    }
+    if (!t)
+        t = topic_intern(&topics, topic, topic_len);
+    if (!sub_index_insert(t->id, ip, addr.sin_port))
+        return t; // ya suscrito
+    if (!c)
+        c = client_new(addr, now);
+
+    if (c->sub_count == c->sub_capacity) {
+        c->sub_capacity = c->sub_capacity ? c->sub_capacity * 2 : 4;
+        c->subs = topic_alloc(c->subs, c->sub_capacity * sizeof(ClientSub));
     }
-    subscribers[sub_count].addr = addr;
-    strcpy(subscribers[sub_count].topic, topic);
-    sub_count++;
-    printf("Nuevo suscriptor al tema: %s\n", topic);
+    Subscriber sub = { .addr = addr, .client = c, .slot = (uint32_t)c->sub_count };
+    c->subs[c->sub_count++] = (ClientSub){ .topic_id = t->id, .pos = (uint32_t)sub_link(t, &sub) };
+    stat_set(&stats.subs, sub_count);
+    alog_write(&event_log, 0, ALOG_INFO, EV_SUBSCRIBED, topic, topic_len, NULL, 0, 0, 0);
+    return t;
 }
 
-/* send_to_subscribers
- * - Para cada suscriptor cuyo topic coincide con 'topic', envía el mensaje
- *   usando sendto(). sendto() recibe una sockaddr de destino explícita y
- *   es la llamada adecuada para datagramas UDP (declarada en <sys/socket.h>). */
-void send_to_subscribers(int sockfd, const char *topic, const char *msg) {
-    for (int i = 0; i < sub_count; i++) {
-        if (strcmp(subscribers[i].topic, topic) == 0) {
-            sendto(sockfd, msg, strlen(msg), 0,
-                   (struct sockaddr *)&subscribers[i].addr, sizeof(subscribers[i].addr));
+void topic_ring_release(Topic *t);
+
+/*
+ * client_drop
+ * - Da de baja todas las suscripciones del cliente y lo libera. Cada baja
+ *   cuesta O(1) (ver sub_unlink()). Un topic que se queda sin suscriptores
+ *   libera su anillo de retransmisión; el lote pendiente ya se envió (ver
+ *   lease_expired()).
+ */
+void client_drop(Client *c) {
+    uint32_t ip = c->addr.sin_addr.s_addr;
+    for (size_t i = 0; i < c->sub_count; i++) {
+        Topic *t = topic_by_id(&topics, c->subs[i].topic_id);
+        sub_unlink(t, c->subs[i].pos);
+        sub_index_remove(t->id, ip, c->addr.sin_port);
+        if (t->sub_count == 0)
+            topic_ring_release(t);
+    }
+    timer_del(&wheel, &c->timer);
+    client_remove(c);
+    stat_set(&stats.subs, sub_count);
+    free(c->subs);
+    slab_free(&client_pool, c);
+}
+
+/* tx_flush
+ * - Envía todo el lote pendiente con sendmmsg(). Si un destino falla (por
+ *   ejemplo, ICMP de puerto inalcanzable), se salta y se sigue con el resto.
+ */
+void tx_flush(int sockfd, TxBatch *tx) {
+    size_t done = 0;
+    while (done < tx->count) {
+        int n = sendmmsg(sockfd, tx->msgs + done, tx->count - done, 0);
+        stat_add(&stats.syscalls, 1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            done++; /* descartar el datagrama que falló */
+            stat_add(&stats.drops, 1);
+            continue;
         }
+        done += n;
+    }
+    tx->count = 0;
+    tx->gen++;
+}
+
+/* tx_add: añade un envío (cabecera de secuencia + mensaje) al lote, vaciándolo antes si está lleno */
+void tx_add(int sockfd, TxBatch *tx, uint64_t seq, char kind, const char *msg, size_t len,
+            struct sockaddr_in *addr) {
+    if (tx->count == tx->capacity)
+        tx_flush(sockfd, tx);
+
+    struct iovec *iov = &tx->iovs[2 * tx->count];
+    struct mmsghdr *m = &tx->msgs[tx->count];
+    seq_put_header(tx->hdrs[tx->count], seq, kind);
+    iov[0].iov_base = tx->hdrs[tx->count];
+    iov[0].iov_len = SEQ_HEADER_SIZE;
+    iov[1].iov_base = (void *)msg;
+    iov[1].iov_len = len;
+    memset(m, 0, sizeof(*m));
+    m->msg_hdr.msg_name = addr;
+    m->msg_hdr.msg_namelen = sizeof(*addr);
+    m->msg_hdr.msg_iov = iov;
+    m->msg_hdr.msg_iovlen = 2;
+    tx->count++;
+}
+
+/*
+ * topic_ring
+ * - Anillo de retransmisión del topic, creado la primera vez que se publica
+ *   en él con suscriptores. Cuando vence el lease del último, el anillo
+ *   (unos ring_size * RING_BYTES_PER_MSG bytes) se libera y la numeración
+ *   queda donde iba: si vuelve a tener suscriptores, el anillo se crea de
+ *   nuevo y sigue por la misma secuencia. Mientras no tiene suscriptores
+ *   sus publicaciones no se numeran ni se guardan.
+ */
+int topic_ring_exists(const Topic *t) {
+    return t->id < state_capacity && topic_states[t->id] && topic_states[t->id]->ring.data;
+}
+
+SeqRing *topic_ring(Topic *t) {
+    SeqRing *ring = &topic_state(t)->ring;
+    if (!ring->data) {
+        size_t bytes = (size_t)ring_size * RING_BYTES_PER_MSG;
+        seq_ring_init(ring, ring_size, bytes > SEQ_MAX_PAYLOAD ? bytes : SEQ_MAX_PAYLOAD);
+    }
+    return ring;
+}
+
+void topic_ring_release(Topic *t) {
+    if (topic_ring_exists(t))
+        seq_ring_release(&topic_states[t->id]->ring);
+}
+
+/*
+ * send_suback
+ * - Confirma la suscripción al emisor. El SUBACK lleva la cabecera de
+ *   secuencia (tipo 'A', secuencia 0) y como contenido el topic, seguido de
+ *   "grupo:puerto" si el topic es multicast.
+ */
+void send_suback(int sockfd, TxBatch *tx, Topic *t, struct sockaddr_in *addr) {
+    TopicState *st = topic_state(t);
+    if (st->mcast)
+        tx_add(sockfd, tx, 0, SEQ_SUBACK, st->suback, st->suback_len, addr);
+    else
+        tx_add(sockfd, tx, 0, SEQ_SUBACK, t->name, t->len, addr);
+}
+
+/*
+ * topic_promote
+ * - Si el topic acaba de llegar al umbral, le asigna el siguiente grupo
+ *   multicast y envía el SUBACK con el grupo a todos sus suscriptores.
+ *   Devuelve 1 si lo promovió. Un topic promovido no vuelve a unicast.
+ */
+int topic_promote(int sockfd, TxBatch *tx, Topic *t) {
+    TopicState *st = topic_state(t);
+    if (mcast_threshold == 0 || st->mcast || t->sub_count < mcast_threshold)
+        return 0;
+
+    st->mcast = 1;
+    st->group.sin_family = AF_INET;
+    st->group.sin_addr.s_addr = htonl(ntohl(mcast_base.s_addr) + mcast_groups++);
+    st->group.sin_port = htons(mcast_port);
+    char group[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &st->group.sin_addr, group, sizeof(group));
+    st->suback_len = t->len + strlen(group) + 8;
+    st->suback = topic_alloc(NULL, st->suback_len + 1);
+    st->suback_len = (size_t)snprintf(st->suback, st->suback_len + 1, "%s %s:%d", t->name, group, mcast_port);
+    alog_write(&event_log, 0, ALOG_INFO, EV_MULTICAST, t->name, t->len, NULL, 0, st->group.sin_addr.s_addr,
+               t->sub_count);
+
+    Subscriber *subs = t->subs;
+    for (size_t i = 0; i < t->sub_count; i++)
+        send_suback(sockfd, tx, t, &subs[i].addr);
+    return 1;
+}
+
+/*
+ * mark_joined
+ * - "JOINED <topic>": el emisor ya está en el grupo del topic. Su entrada
+ *   pasa del tramo unicast al multicast y deja de recibir envíos propios.
+ */
+void mark_joined(int sockfd, TxBatch *tx, const char *topic, size_t topic_len, struct sockaddr_in *addr) {
+    Topic *t = topic_find(&topics, topic, topic_len, topic_hash(topic, topic_len));
+    Client *c = client_find(addr->sin_addr.s_addr, addr->sin_port);
+    if (!t || !c || !topic_state(t)->mcast)
+        return;
+    TopicState *st = topic_state(t);
+    for (size_t i = 0; i < c->sub_count; i++) {
+        if (c->subs[i].topic_id != t->id || c->subs[i].pos >= st->unicast)
+            continue;
+        tx_flush(sockfd, tx); /* el lote apunta a entradas de la lista que van a moverse */
+        sub_swap(t, c->subs[i].pos, --st->unicast);
+        return;
+    }
+}
+
+/*
+ * renew_client
+ * - "RENEW": alarga el lease del emisor y le repite el SUBACK de los topics
+ *   multicast a los que aún no se ha unido, por si se perdió el primero.
+ */
+void renew_client(int sockfd, TxBatch *tx, struct sockaddr_in *addr, uint64_t now) {
+    Client *c = client_find(addr->sin_addr.s_addr, addr->sin_port);
+    if (!c)
+        return;
+    lease_renew(c, now);
+    for (size_t i = 0; i < c->sub_count; i++) {
+        Topic *t = topic_by_id(&topics, c->subs[i].topic_id);
+        TopicState *st = topic_state(t);
+        if (st->mcast && c->subs[i].pos < st->unicast)
+            send_suback(sockfd, tx, t, addr);
+    }
+}
+
+/* fanout: añade el envío de un mensaje (o aviso) al grupo del topic y a sus suscriptores unicast */
+void fanout(int sockfd, TxBatch *tx, Topic *t, uint64_t seq, char kind, const char *msg, size_t len) {
+    TopicState *st = topic_state(t);
+    Subscriber *subs = t->subs;
+    if (st->mcast && st->unicast < t->sub_count) {
+        tx_add(sockfd, tx, seq, kind, msg, len, &st->group);
+        stat_add(&stats.mcast_out, 1);
+    }
+    for (size_t i = 0; i < st->unicast; i++)
+        tx_add(sockfd, tx, seq, kind, msg, len, &subs[i].addr);
+}
+
+/* send_to_subscribers
+ * - Busca el topic en la tabla hash, le asigna al mensaje su secuencia
+ *   (guardando una copia en el anillo) y añade un envío por suscriptor de su
+ *   lista al lote de sendmmsg() (uno solo para los que están en el grupo
+ *   multicast). Los envíos en vivo apuntan al buffer de
+ *   recepción, no a la copia. sendmmsg() recibe, por cada datagrama, una
+ *   sockaddr de destino explícita como sendto() (declarada en <sys/socket.h>),
+ *   pero envía muchos datagramas en una sola llamada al sistema. */
+void send_to_subscribers(int sockfd, TxBatch *tx, const char *msg, size_t topic_len, size_t len,
+                         int stats_topic) {
+    Topic *t = topic_find(&topics, msg, topic_len, topic_hash(msg, topic_len));
+    if (!t || t->sub_count == 0)
+        return;
+
+    SeqRing *ring = topic_ring(t);
+    if (ring->tx_gen == tx->gen)
+        tx_flush(sockfd, tx); /* hay retransmisiones pendientes que apuntan a este anillo */
+    if (!ring->dirty) {
+        dirty_topics = grow_ids(dirty_topics, &dirty_capacity, dirty_count + 1);
+        dirty_topics[dirty_count++] = t->id;
+    }
+    uint64_t seq = seq_ring_append(ring, msg, len);
+    fanout(sockfd, tx, t, seq, SEQ_LIVE, msg, len);
+
+    stat_add(&stats.msgs_out, t->sub_count);
+    stat_add(&stats.bytes_out, t->sub_count * len);
+    if (stats_topic >= 0)
+        stat_add(&stats.topic_out[stats_topic], t->sub_count);
+    fanout_pending++;
+}
+
+/*
+ * handle_nack
+ * - Atiende "NACK <topic> <desde> <hasta>": reenvía al remitente los
+ *   mensajes del rango que sigan en el anillo. Si parte del rango ya se
+ *   pisó, le avisa con un 'L' que lleva la secuencia más antigua disponible
+ *   para que deje de pedirla.
+ */
+void handle_nack(int sockfd, TxBatch *tx, const char *cmd, size_t len, struct sockaddr_in *client_addr) {
+    const char *topic;
+    size_t topic_len;
+    char range[64];
+    unsigned long long from, to;
+    if (!topic_parse_command(cmd, len, "NACK", &topic, &topic_len))
+        return;
+    size_t rest = cmd + len - (topic + topic_len);
+    if (rest >= sizeof(range))
+        return;
+    memcpy(range, topic + topic_len, rest);
+    range[rest] = '\0';
+    if (sscanf(range, "%llu %llu", &from, &to) != 2 || from > to)
+        return;
+
+    Topic *t = topic_find(&topics, topic, topic_len, topic_hash(topic, topic_len));
+    if (!t || !topic_ring_exists(t))
+        return;
+    SeqRing *ring = &topic_state(t)->ring;
+    stat_add(&stats.nacks, 1);
+
+    uint64_t oldest = seq_ring_oldest(ring);
+    if (from < oldest)
+        tx_add(sockfd, tx, oldest, SEQ_LOST, t->name, t->len, client_addr);
+    if (to - from >= SEQ_NACK_MAX_RANGE)
+        to = from + SEQ_NACK_MAX_RANGE - 1;
+    for (uint64_t seq = from < oldest ? oldest : from; seq <= to; seq++) {
+        size_t msg_len;
+        const char *msg = seq_ring_get(ring, seq, &msg_len);
+        if (!msg)
+            break;
+        tx_add(sockfd, tx, seq, SEQ_RETRANSMIT, msg, msg_len, client_addr);
+        stat_add(&stats.retransmits, 1);
     }
+    ring->tx_gen = tx->gen;
 }
 
-int main() {
+/*
+ * send_heartbeats
+ * - Envía a los suscriptores de cada topic que publicó desde la vuelta
+ *   anterior un latido con su última secuencia. Sin él, un suscriptor que
+ *   pierde los últimos mensajes de una ráfaga no lo sabría hasta el
+ *   siguiente mensaje del topic.
+ */
+void send_heartbeats(int sockfd, TxBatch *tx) {
+    for (size_t i = 0; i < dirty_count; i++) {
+        Topic *t = topic_by_id(&topics, dirty_topics[i]);
+        SeqRing *ring = &topic_state(t)->ring; /* sin suscriptores ya no tiene anillo: no llega a nadie */
+        ring->dirty = 0;
+        fanout(sockfd, tx, t, ring->next_seq - 1, SEQ_HEARTBEAT, t->name, t->len);
+    }
+    dirty_count = 0;
+    tx_flush(sockfd, tx);
+}
+
+/* Lo que necesitan los temporizadores de la rueda al dispararse */
+typedef struct {
     int sockfd;
-    char buffer[BUFFER_SIZE];
-    struct sockaddr_in broker_addr, client_addr;
-    socklen_t addr_len = sizeof(client_addr);
+    TxBatch *tx;
+} TimerCtx;
+
+/* heartbeat_fire: temporizador periódico de los latidos de secuencia */
+void heartbeat_fire(TimerNode *node, void *arg) {
+    TimerCtx *ctx = arg;
+    send_heartbeats(ctx->sockfd, ctx->tx);
+    timer_add(&wheel, node, wheel.now * wheel.tick_ns + HEARTBEAT_MS * 1000000ull);
+}
+
+/*
+ * lease_expired
+ * - Temporizador del lease de un cliente. Si se renovó desde que se armó,
+ *   se vuelve a armar para el nuevo vencimiento; si no, el cliente se da de
+ *   baja. El lote pendiente puede apuntar a sus entradas: se envía antes.
+ */
+void lease_expired(TimerNode *node, void *arg) {
+    TimerCtx *ctx = arg;
+    Client *c = (Client *)node;
+    if (c->expires_ns > wheel.now * wheel.tick_ns) {
+        timer_add(&wheel, node, c->expires_ns);
+        return;
+    }
+    alog_write(&event_log, 0, ALOG_INFO, EV_LEASE_EXPIRED, NULL, 0, NULL, 0, c->addr.sin_addr.s_addr,
+               (uint64_t)ntohs(c->addr.sin_port) << 48 | c->sub_count);
+    tx_flush(ctx->sockfd, ctx->tx);
+    client_drop(c);
+    stat_add(&stats.leases_expired, 1);
+}
+
+/*
+ * send_stats
+ * - Responde a "STATS" con un datagrama de texto "clave valor" (ver
+ *   stats_format() en common/stats.h) dirigido al remitente.
+ */
+void send_stats(int sockfd, struct sockaddr_in *client_addr) {
+    static char reply[STATS_REPLY_MAX];
+    BrokerStats *all[1] = { &stats };
+    size_t len = stats_format(reply, sizeof(reply), all, 1, &stats_topics);
+    sendto(sockfd, reply, len, 0, (struct sockaddr *)client_addr, sizeof(*client_addr));
+}
+
+/* handle_datagram
+ * - Interpreta un datagrama recibido. El datagrama se analiza en su propio
+ *   buffer de recepción, sin copiar el topic ni el mensaje:
+ *     - "SUBSCRIBE <topic>" registra la dirección del emisor.
+ *     - "RENEW" renueva el lease del emisor.
+ *     - "JOINED <topic>" el emisor ya recibe el topic por su grupo multicast.
+ *     - "NACK <topic> <desde> <hasta>" retransmite al emisor lo que falta.
+ *     - "STATS" responde al emisor con las estadísticas.
+ *     - "LOG <off|info|debug> [N]" cambia el nivel y el muestreo del registro.
+ *     - "topic|message" se numera y se reenvía a los suscriptores del topic.
+ */
+void handle_datagram(int sockfd, TxBatch *tx, const char *buffer, size_t len,
+                     struct sockaddr_in *client_addr, uint64_t now) {
+    const char *topic;
+    size_t topic_len;
+
+    if (topic_parse_command(buffer, len, "SUBSCRIBE", &topic, &topic_len)) {
+        /* add_subscriber() puede mover la lista del topic en memoria, y el
+         * lote pendiente apunta a direcciones dentro de esas listas */
+        tx_flush(sockfd, tx);
+        Topic *t = add_subscriber(*client_addr, topic, topic_len, now);
+        if (t && !topic_promote(sockfd, tx, t))
+            send_suback(sockfd, tx, t, client_addr);
+    } else if (topic_parse_command(buffer, len, "JOINED", &topic, &topic_len)) {
+        mark_joined(sockfd, tx, topic, topic_len, client_addr);
+    } else if (len == 5 && memcmp(buffer, "RENEW", 5) == 0) {
+        renew_client(sockfd, tx, client_addr, now);
+    } else if (len > 5 && memcmp(buffer, "NACK ", 5) == 0) {
+        handle_nack(sockfd, tx, buffer, len, client_addr);
+    } else if (len == 5 && memcmp(buffer, "STATS", 5) == 0) {
+        send_stats(sockfd, client_addr);
+    } else if (alog_command(&event_log, buffer, len)) {
+        alog_write(&event_log, 0, ALOG_OFF, EV_LOG_LEVEL, NULL, 0, NULL, 0, (uint64_t)atomic_load(&event_log.level),
+                   atomic_load(&event_log.sample));
+    } else {
+        const char *sep = memchr(buffer, '|', len);
+        if (sep) {
+            topic_len = sep - buffer;
+            size_t msg_len = len - topic_len - 1;
+            if (len > SEQ_MAX_PAYLOAD) {
+                /* Con la cabecera de secuencia ya no cabría en un datagrama */
+                fprintf(stderr, "Mensaje de %zu bytes descartado: el máximo es %d\n", len, SEQ_MAX_PAYLOAD);
+                stat_add(&stats.drops, 1);
+                return;
+            }
+            alog_write(&event_log, 0, ALOG_DEBUG, EV_PUBLISHED, buffer, topic_len, sep + 1, msg_len, 0, 0);
+            int stats_topic = stats_topic_index(&stats_topics, buffer, topic_len);
+            stat_add(&stats.msgs_in, 1);
+            stat_add(&stats.bytes_in, len);
+            if (stats_topic >= 0)
+                stat_add(&stats.topic_in[stats_topic], 1);
+            send_to_subscribers(sockfd, tx, buffer, topic_len, len, stats_topic);
+        }
+    }
+}
+
+/*
+ * main
+ * - Crea el socket UDP y atiende datagramas por lotes: recvmmsg() con
+ *   MSG_WAITFORONE bloquea hasta que llega el primero y devuelve además
+ *   todos los que ya estén en cola (hasta batch_size). Los reenvíos de todo
+ *   el lote se acumulan en TxBatch y salen con sendmmsg().
+ *
+ * Opciones:
+ *   -p <puerto>  puerto de escucha (por defecto PORT).
+ *   -b <n>       tamaño de lote de recvmmsg()/sendmmsg() (por defecto
+ *                DEFAULT_BATCH, máximo MAX_BATCH).
+ *   -r <n>       mensajes retransmisibles por topic (por defecto DEFAULT_RING);
+ *                el anillo reserva RING_BYTES_PER_MSG bytes por mensaje.
+ *   -l <seg>     duración del lease de un cliente (por defecto DEFAULT_LEASE_S).
+ *   -m <n>       máximo de suscripciones activas (por defecto DEFAULT_MAX_SUBS).
+ *   -M <n>       pasa a multicast los topics con n suscriptores o más
+ *                (por defecto, nunca).
+ *   -g <ip>      primer grupo multicast (por defecto DEFAULT_MCAST_GROUP).
+ *   -i <ip>      interfaz de salida del multicast (por defecto DEFAULT_MCAST_IF).
+ *   -v <nivel>   registro en la salida estándar: off, info o debug (además
+ *                cada publicación, por defecto).
+ *   -n <N>       con debug, registra sólo una de cada N publicaciones.
+ */
+int main(int argc, char *argv[]) {
+    int sockfd, opt_char, port = PORT;
+    int log_level = ALOG_DEBUG;
+    unsigned log_sample = 1;
+    struct sockaddr_in broker_addr;
+    const char *mcast_group_arg = DEFAULT_MCAST_GROUP, *mcast_if_arg = DEFAULT_MCAST_IF;
+
+    while ((opt_char = getopt(argc, argv, "p:b:r:l:m:M:g:i:v:n:")) != -1) {
+        switch (opt_char) {
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'b':
+            batch_size = atoi(optarg);
+            if (batch_size < 1 || batch_size > MAX_BATCH) {
+                fprintf(stderr, "El tamaño de lote debe estar entre 1 y %d\n", MAX_BATCH);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'r':
+            ring_size = (uint32_t)strtoul(optarg, NULL, 10);
+            if (ring_size == 0) {
+                fprintf(stderr, "El anillo debe guardar al menos un mensaje\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'l':
+            lease_ns = strtoull(optarg, NULL, 10) * 1000000000ull;
+            if (lease_ns == 0) {
+                fprintf(stderr, "El lease debe durar al menos un segundo\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'm':
+            max_subs = strtoull(optarg, NULL, 10);
+            break;
+        case 'M':
+            mcast_threshold = strtoull(optarg, NULL, 10);
+            break;
+        case 'g':
+            mcast_group_arg = optarg;
+            break;
+        case 'i':
+            mcast_if_arg = optarg;
+            break;
+        case 'v':
+            if (alog_level_parse(optarg, strlen(optarg), &log_level) < 0) {
+                fprintf(stderr, "Nivel de registro desconocido: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'n':
+            log_sample = (unsigned)strtoul(optarg, NULL, 10);
+            if (log_sample == 0) {
+                fprintf(stderr, "El muestreo del registro debe ser mayor que 0\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        default:
+            fprintf(stderr, "Uso: %s [-p puerto] [-b lote] [-r mensajes] [-l segundos] [-m suscripciones]\n"
+                            "          [-M umbral_multicast] [-g grupo] [-i interfaz] [-v off|info|debug] [-n N]\n",
+                    argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
 
     /* Crear socket UDP */
     sockfd = socket(AF_INET, SOCK_DGRAM, 0);
@@ -83,39 +1016,100 @@ int main() {
 
     broker_addr.sin_family = AF_INET;
     broker_addr.sin_addr.s_addr = INADDR_ANY;
-    broker_addr.sin_port = htons(PORT);
+    broker_addr.sin_port = htons(port);
 
     if (bind(sockfd, (struct sockaddr *)&broker_addr, sizeof(broker_addr)) < 0) {
         perror("Error en bind");
         exit(EXIT_FAILURE);
     }
 
-    printf("Broker UDP escuchando en puerto %d...\n", PORT);
+    /* Multicast: los grupos van al puerto siguiente al del broker, por la interfaz de -i */
+    mcast_port = port + 1;
+    if (mcast_threshold > 0) {
+        struct in_addr mcast_if;
+        if (inet_pton(AF_INET, mcast_group_arg, &mcast_base) != 1 || !IN_MULTICAST(ntohl(mcast_base.s_addr)) ||
+            inet_pton(AF_INET, mcast_if_arg, &mcast_if) != 1) {
+            fprintf(stderr, "Grupo o interfaz multicast inválidos: %s, %s\n", mcast_group_arg, mcast_if_arg);
+            exit(EXIT_FAILURE);
+        }
+        if (setsockopt(sockfd, IPPROTO_IP, IP_MULTICAST_IF, &mcast_if, sizeof(mcast_if)) < 0) {
+            perror("Error en IP_MULTICAST_IF");
+            exit(EXIT_FAILURE);
+        }
+        printf("Multicast desde %zu suscriptores: grupos %s:%d en adelante por %s\n", mcast_threshold,
+               mcast_group_arg, mcast_port, mcast_if_arg);
+    }
+
+    /* Buffers de recepción: un datagrama por entrada del lote, del tamaño
+     * máximo de UDP para no truncar nunca (las páginas que no se tocan no
+     * ocupan memoria física) */
+    char (*buffers)[UDP_MAX_DATAGRAM] = malloc((size_t)batch_size * UDP_MAX_DATAGRAM);
+    struct sockaddr_in *addrs = calloc(batch_size, sizeof(struct sockaddr_in));
+    struct iovec *rx_iovs = calloc(batch_size, sizeof(struct iovec));
+    struct mmsghdr *rx_msgs = calloc(batch_size, sizeof(struct mmsghdr));
+    TxBatch tx = {
+        .msgs = calloc(batch_size, sizeof(struct mmsghdr)),
+        .iovs = calloc(2 * (size_t)batch_size, sizeof(struct iovec)),
+        .hdrs = calloc(batch_size, SEQ_HEADER_SIZE),
+        .capacity = (size_t)batch_size,
+        .gen = 1,
+    };
+    if (!buffers || !addrs || !rx_iovs || !rx_msgs || !tx.msgs || !tx.iovs || !tx.hdrs) {
+        perror("Error reservando memoria");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Despertar aunque no llegue nada, para avanzar la rueda de temporizadores */
+    struct timeval tick = { .tv_usec = TICK_MS * 1000 };
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tick, sizeof(tick));
+    TimerCtx timer_ctx = { .sockfd = sockfd, .tx = &tx };
+    timer_wheel_init(&wheel, TICK_MS * 1000000ull, stats_now_ns());
+    heartbeat_timer.fire = heartbeat_fire;
+    timer_add(&wheel, &heartbeat_timer, stats_now_ns() + HEARTBEAT_MS * 1000000ull);
+
+    stats_init(&stats);
+    slab_pool_init(&client_pool, sizeof(Client), &stats.heap_allocs);
+    alog_init(&event_log, 1, STDOUT_FILENO, format_event, log_level, log_sample);
+    alog_ring_counter(&event_log, 0, &stats.log_dropped);
+    printf("Broker UDP escuchando en puerto %d (lote %d, anillo %u, lease %llu s)...\n", port, batch_size,
+           ring_size, (unsigned long long)(lease_ns / 1000000000ull));
+    if (log_level != ALOG_DEBUG || log_sample > 1)
+        printf("Registro: nivel %s, una de cada %u publicaciones\n", alog_level_name(log_level), log_sample);
+    alog_start(&event_log);
 
     while (1) {
-        int len = recvfrom(sockfd, buffer, BUFFER_SIZE - 1, 0,
-                           (struct sockaddr *)&client_addr, &addr_len);
-        if (len < 0) continue;
-
-        buffer[len] = '\0';
-
-        if (strncmp(buffer, "SUBSCRIBE", 9) == 0) {
-            char topic[50];
-            sscanf(buffer, "SUBSCRIBE %s", topic);
-            add_subscriber(client_addr, topic);
-        } else {
-            char topic[50], msg[BUFFER_SIZE];
-            char *sep = strchr(buffer, '|');
-            if (sep) {
-                *sep = '\0';
-                strcpy(topic, buffer);
-                strcpy(msg, sep + 1);
-                printf("Mensaje recibido del tema '%s': %s\n", topic, msg);
-                send_to_subscribers(sockfd, topic, msg);
-            }
+        for (int i = 0; i < batch_size; i++) {
+            rx_iovs[i].iov_base = buffers[i];
+            rx_iovs[i].iov_len = UDP_MAX_DATAGRAM;
+            memset(&rx_msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+            rx_msgs[i].msg_hdr.msg_name = &addrs[i];
+            rx_msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+            rx_msgs[i].msg_hdr.msg_iov = &rx_iovs[i];
+            rx_msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        int n = recvmmsg(sockfd, rx_msgs, batch_size, MSG_WAITFORONE, NULL);
+        uint64_t rx_ns = stats_now_ns();
+        stat_add(&stats.syscalls, 1);
+        timer_wheel_advance(&wheel, rx_ns, &timer_ctx);
+        if (n < 0)
+            continue;
+
+        for (int i = 0; i < n; i++) {
+            handle_datagram(sockfd, &tx, buffers[i], rx_msgs[i].msg_len, &addrs[i], rx_ns);
+        }
+        /* Los buffers se reutilizan en la siguiente vuelta: enviar antes */
+        tx_flush(sockfd, &tx);
+
+        /* Todo el lote llegó en el mismo recvmmsg() y salió con el último
+         * sendmmsg(): todas sus publicaciones comparten la misma latencia */
+        if (fanout_pending > 0) {
+            uint64_t fanout_ns = stats_now_ns() - rx_ns;
+            for (; fanout_pending > 0; fanout_pending--)
+                hist_record(&stats.fanout, fanout_ns);
         }
     }
 
     close(sockfd);
     return 0;
-}
\ No newline at end of file
+}
@@ -1,59 +1,71 @@
 /*
  * publisher_udp.c
  *
- * Publicador UDP simple que envía datagramas al broker. Como UDP es
- * sin conexión, el publicador no llama a connect(); en su lugar usa
- * sendto() especificando la dirección del broker.
+ * Publicador UDP: envía al broker, como datagramas, las líneas que llegan
+ * por la entrada estándar con el formato "tema|mensaje". Como UDP es sin
+ * conexión no hay handshake: el socket sólo fija su destino con connect().
  *
- * Uso:
- * - socket(AF_INET, SOCK_DGRAM, 0) para crear un socket UDP IPv4.
- * - inet_pton() para convertir la IP en forma binaria para sockaddr_in.
- * - sendto() para transmitir datagramas al broker.
+ * Los envíos pasan por la biblioteca de publicación (common/publisher.h):
+ * las líneas se acumulan y cada lote sale con sendmmsg(), una llamada para
+ * muchos datagramas en lugar de un sendto() por línea. Un lote sale como
+ * mucho -d microsegundos después de su primera línea, así que al escribir a
+ * mano cada línea se envía enseguida.
+ *
+ * Uso: ./publisher_udp [-e host:puerto[,host:puerto...]] [-b bytes] [-d us]
+ *
+ * El bucle que lee la entrada y publica cada línea es publisher_run_lines(),
+ * de la misma biblioteca; aquí sólo se leen las opciones.
  */
 
+#define _GNU_SOURCE /* ppoll() y sendmmsg() (common/publisher.h) */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <arpa/inet.h>
-#include <sys/socket.h>
-
-#define SERVER_IP "127.0.0.1"
-#define PORT 8080
-#define BUFFER_SIZE 1024
-
-int main() {
-    int sockfd;
-    struct sockaddr_in serv_addr;
-    char buffer[BUFFER_SIZE];
-
-    /* Crear socket UDP */
-    sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sockfd < 0) {
-        perror("Error creando socket UDP");
-        return -1;
-    }
 
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(PORT);
-    inet_pton(AF_INET, SERVER_IP, &serv_addr.sin_addr);
+#include "../common/publisher.h"
 
-    printf("Publisher UDP iniciado.\n");
-    printf("Formato: tema|mensaje (ejemplo: partido1|Gol minuto 45)\n");
+#define SERVER "127.0.0.1:8080"
 
-    while (1) {
-        printf("> ");
-        fgets(buffer, BUFFER_SIZE, stdin);
-    buffer[strcspn(buffer, "\n")] = 0; /* eliminar salto de línea */
+int main(int argc, char *argv[]) {
+    Publisher pub;
+    int opt_char, endpoints = 0;
 
-        if (strcmp(buffer, "exit") == 0)
+    publisher_init(&pub, PUBLISHER_UDP);
+    while ((opt_char = getopt(argc, argv, "e:b:d:")) != -1) {
+        switch (opt_char) {
+        case 'e':
+            for (char *spec = strtok(optarg, ","); spec; spec = strtok(NULL, ",")) {
+                if (publisher_add_endpoint(&pub, spec) < 0)
+                    return EXIT_FAILURE;
+                endpoints++;
+            }
             break;
+        case 'b':
+            pub.flush_bytes = strtoul(optarg, NULL, 10);
+            break;
+        case 'd':
+            pub.flush_ns = strtoull(optarg, NULL, 10) * 1000;
+            break;
+        default:
+            fprintf(stderr, "Uso: %s [-e host:puerto[,host:puerto...]] [-b bytes] [-d us]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (endpoints == 0 && publisher_add_endpoint(&pub, SERVER) < 0)
+        return EXIT_FAILURE;
 
-    /* sendto() envía un datagrama UDP al broker */
-        sendto(sockfd, buffer, strlen(buffer), 0,
-               (struct sockaddr *)&serv_addr, sizeof(serv_addr));
+    if (isatty(STDIN_FILENO)) {
+        printf("Publisher UDP hacia %s.\n", pub.endpoints[0].name);
+        printf("Formato: tema|mensaje (ejemplo: partido1|Gol minuto 45)\n");
+        fflush(stdout);
     }
 
-    close(sockfd);
+    publisher_run_lines(&pub, STDIN_FILENO);
+    fprintf(stderr, "Publicados %llu mensajes en %llu envíos (%llu rechazados, %llu reconexiones)\n",
+            (unsigned long long)pub.published, (unsigned long long)pub.batches,
+            (unsigned long long)pub.rejected, (unsigned long long)pub.reconnects);
+    publisher_free(&pub);
     return 0;
-}
\ No newline at end of file
+}
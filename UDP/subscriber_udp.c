@@ -6,29 +6,72 @@
  * del emisor (IP y puerto efímero) y luego envía datagramas de vuelta a
  * esa dirección cuando se publica un mensaje para el topic.
  *
+ * Cada datagrama trae el número de secuencia del mensaje en su topic
+ * (UDP/udp_seq.h). Si falta alguno, el suscriptor lo pide con
+ * "NACK <topic> <desde> <hasta>" y sigue mostrando los que llegan; los
+ * recuperados se muestran cuando llegan, marcados como tales.
+ *
+ * La suscripción es un lease: si el broker no recibe nada del suscriptor
+ * durante su plazo (30 s por defecto) lo da de baja. Por eso el suscriptor
+ * envía "RENEW" cada RENEW_INTERVAL_MS.
+ *
+ * El broker confirma la suscripción con un SUBACK. Si el topic tiene muchos
+ * suscriptores, el SUBACK trae un grupo multicast: el suscriptor se une a
+ * él con un segundo socket (UDP/udp_mcast.h) y recibe por los dos.
+ *
  * Interacciones notables con librerías:
  * - bind(): utilizada para asignar una dirección/puerto local al socket UDP.
  *   Aquí usamos INADDR_ANY y puerto 0 para que el SO elija un puerto efímero.
  * - sendto(): envía el comando SUBSCRIBE a la dirección del broker.
- * - recvfrom(): bloquea esperando datagramas entrantes (mensajes del broker)
- *   y devuelve los bytes recibidos y la dirección del emisor si se solicita.
+ * - recvfrom(): recibe los datagramas entrantes (mensajes del broker) y
+ *   devuelve los bytes recibidos y la dirección del emisor si se solicita.
+ * - poll(): espera datagramas sin pasarse del momento del próximo NACK ni
+ *   de la próxima renovación.
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <poll.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 
+#include "udp_mcast.h"
+#include "udp_seq.h"
+
 #define SERVER_IP "127.0.0.1"
 #define PORT 8080
 #define BUFFER_SIZE 1024
+#define RENEW_INTERVAL_MS 10000
+
+/* Destino de los NACK */
+typedef struct {
+    int sockfd;
+    struct sockaddr_in *broker;
+    const char *topic;
+} NackTarget;
+
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/* send_nack: pide al broker que reenvíe el rango [from, to] */
+void send_nack(uint64_t from, uint64_t to, void *arg) {
+    NackTarget *target = arg;
+    char nack[BUFFER_SIZE];
+    int len = snprintf(nack, sizeof(nack), "NACK %s %llu %llu", target->topic,
+                       (unsigned long long)from, (unsigned long long)to);
+    sendto(target->sockfd, nack, len, 0, (struct sockaddr *)target->broker, sizeof(*target->broker));
+}
 
 int main() {
     int sockfd;
     struct sockaddr_in serv_addr, my_addr;
-    char buffer[BUFFER_SIZE];
+    static char buffer[UDP_MAX_DATAGRAM + 1]; /* un datagrama entero, sin truncar */
     char topic[50];
 
     /* Crear socket UDP */
@@ -63,11 +106,55 @@ int main() {
            (struct sockaddr *)&serv_addr, sizeof(serv_addr));
 
     printf("Esperando mensajes del tema '%s'...\n", topic);
+    SeqTracker track = { 0 };
+    NackTarget target = { .sockfd = sockfd, .broker = &serv_addr, .topic = topic };
+    uint64_t reported_lost = 0;
+    int mcast_fd = -1;
+    uint64_t next_renew = now_ns() + RENEW_INTERVAL_MS * 1000000ull;
     while (1) {
-        int len = recvfrom(sockfd, buffer, BUFFER_SIZE - 1, 0, NULL, NULL);
-        if (len > 0) {
-            buffer[len] = '\0';
-            printf("%s\n", buffer);
+        uint64_t now = now_ns();
+        if (now >= next_renew) {
+            sendto(sockfd, "RENEW", 5, 0, (struct sockaddr *)&serv_addr, sizeof(serv_addr));
+            next_renew = now + RENEW_INTERVAL_MS * 1000000ull;
+        }
+        int64_t wait = seq_track_timeout_ns(&track, now);
+        if (wait < 0 || (uint64_t)wait > next_renew - now)
+            wait = (int64_t)(next_renew - now);
+        struct pollfd pfds[2] = {
+            { .fd = sockfd, .events = POLLIN },
+            { .fd = mcast_fd, .events = POLLIN }, /* poll() ignora los fd negativos */
+        };
+        poll(pfds, 2, (int)((wait + 999999) / 1000000));
+        for (int i = 0; i < 2; i++) {
+            if (!(pfds[i].revents & POLLIN))
+                continue;
+            int len = recvfrom(pfds[i].fd, buffer, sizeof(buffer) - 1, 0, NULL, NULL);
+            if (len >= SEQ_HEADER_SIZE) {
+                uint64_t seq = seq_get((unsigned char *)buffer);
+                char kind = buffer[SEQ_HEADER_SIZE - 1];
+                if (kind == SEQ_SUBACK) {
+                    /* Si el topic va por multicast, unirse al grupo (o repetir el JOINED perdido) */
+                    if (mcast_fd < 0) {
+                        mcast_fd = mcast_join(buffer + SEQ_HEADER_SIZE, len - SEQ_HEADER_SIZE, &serv_addr);
+                        if (mcast_fd >= 0)
+                            printf("El tema '%s' llega ahora por multicast\n", topic);
+                    }
+                    if (mcast_fd >= 0)
+                        mcast_send_joined(sockfd, &serv_addr, topic, strlen(topic));
+                } else if (seq_track(&track, seq, kind, now_ns())) {
+                    char *content = buffer + SEQ_HEADER_SIZE;
+                    buffer[len] = '\0';
+                    char *sep = strchr(content, '|');
+                    printf("[%llu] %s%s\n", (unsigned long long)seq, sep ? sep + 1 : content,
+                           kind == SEQ_RETRANSMIT ? " (recuperado)" : "");
+                }
+            }
+        }
+        seq_track_nacks(&track, now_ns(), send_nack, &target);
+        if (track.lost > reported_lost) {
+            printf("Perdidos %llu mensajes que el broker ya no guarda\n",
+                   (unsigned long long)(track.lost - reported_lost));
+            reported_lost = track.lost;
         }
     }
 
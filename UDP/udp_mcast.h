@@ -0,0 +1,95 @@
+/*
+ * udp_mcast.h
+ *
+ * Lado del suscriptor del modo multicast del broker UDP. Cuando un topic
+ * tiene muchos suscriptores, el broker le asigna un grupo multicast y lo
+ * anuncia en el SUBACK ("topic grupo:puerto"). El suscriptor abre un
+ * segundo socket, se une al grupo y avisa al broker con "JOINED <topic>";
+ * a partir de ahí el broker le deja de enviar copias propias y los
+ * mensajes le llegan por el grupo, con la misma cabecera de secuencia.
+ *
+ * Encabezados usados:
+ * - <netinet/in.h>: ip_mreq, IP_ADD_MEMBERSHIP e IP_MULTICAST_ALL.
+ * - <arpa/inet.h>: inet_pton() para la dirección del grupo.
+ */
+
+#ifndef UDP_MCAST_H
+#define UDP_MCAST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+/*
+ * mcast_local_if
+ * - Dirección local por la que se llega al broker: es la interfaz en la que
+ *   hay que unirse al grupo (en una sola máquina, 127.0.0.1). connect() en
+ *   UDP no envía nada, sólo elige la ruta.
+ */
+static inline struct in_addr mcast_local_if(const struct sockaddr_in *broker) {
+    struct sockaddr_in local = { 0 };
+    socklen_t len = sizeof(local);
+    int probe = socket(AF_INET, SOCK_DGRAM, 0);
+    if (probe >= 0 && connect(probe, (const struct sockaddr *)broker, sizeof(*broker)) == 0)
+        getsockname(probe, (struct sockaddr *)&local, &len);
+    if (probe >= 0)
+        close(probe);
+    return local.sin_addr;
+}
+
+/*
+ * mcast_join
+ * - Interpreta el contenido de un SUBACK ('len' bytes) y, si anuncia un
+ *   grupo, devuelve un socket unido a él; -1 si el topic va por unicast o
+ *   si falla la unión (en ese caso se sigue recibiendo por unicast).
+ * - El socket se enlaza a la dirección del grupo y con IP_MULTICAST_ALL a 0,
+ *   para no recibir los grupos de otros topics que use el mismo puerto.
+ *   SO_REUSEADDR permite varios suscriptores del mismo grupo en la misma
+ *   máquina: cada uno recibe su copia.
+ */
+static inline int mcast_join(const char *suback, size_t len, const struct sockaddr_in *broker) {
+    char text[256], group[INET_ADDRSTRLEN];
+    int port;
+    if (len >= sizeof(text))
+        return -1;
+    memcpy(text, suback, len);
+    text[len] = '\0';
+    char *space = strchr(text, ' ');
+    if (!space || sscanf(space + 1, "%15[0-9.]:%d", group, &port) != 2)
+        return -1;
+
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port) };
+    struct ip_mreq mreq = { .imr_interface = mcast_local_if(broker) };
+    if (inet_pton(AF_INET, group, &addr.sin_addr) != 1)
+        return -1;
+    mreq.imr_multiaddr = addr.sin_addr;
+
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    int one = 1, zero = 0;
+    if (fd < 0)
+        return -1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    setsockopt(fd, IPPROTO_IP, IP_MULTICAST_ALL, &zero, sizeof(zero));
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+        perror("Error uniéndose al grupo multicast");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* mcast_send_joined: avisa al broker de que el topic ya llega por el grupo */
+static inline void mcast_send_joined(int sockfd, const struct sockaddr_in *broker, const char *topic,
+                                     size_t topic_len) {
+    char joined[300];
+    int len = snprintf(joined, sizeof(joined), "JOINED %.*s", (int)topic_len, topic);
+    if (len > 0 && (size_t)len < sizeof(joined))
+        sendto(sockfd, joined, (size_t)len, 0, (const struct sockaddr *)broker, sizeof(*broker));
+}
+
+#endif /* UDP_MCAST_H */
@@ -0,0 +1,313 @@
+/*
+ * udp_seq.h
+ *
+ * Números de secuencia y recuperación de pérdidas para el broker UDP. El
+ * broker numera los mensajes de cada topic (1, 2, 3...) y antepone a cada
+ * datagrama que envía a un suscriptor una cabecera fija:
+ *
+ *     +-------------------------+--------+------------------+
+ *     | secuencia (8 bytes,     | tipo   | "topic|message"  |
+ *     | big-endian)             | 1 byte |                  |
+ *     +-------------------------+--------+------------------+
+ *
+ * Tipos: 'D' mensaje en vivo, 'R' retransmisión, 'H' latido (la secuencia
+ * es la del último mensaje del topic) y 'L' pérdida irrecuperable (la
+ * secuencia es la más antigua que el broker aún guarda). Los latidos y los
+ * avisos de pérdida llevan sólo el nombre del topic, sin '|' ni mensaje.
+ * 'A' confirma un SUBSCRIBE (secuencia 0): lleva el topic y, si el topic
+ * se reparte por multicast, " grupo:puerto".
+ *
+ * El broker guarda los últimos mensajes de cada topic en un anillo acotado
+ * (SeqRing). El suscriptor detecta los huecos en la secuencia (SeqTracker)
+ * y pide lo que falta con "NACK <topic> <desde> <hasta>"; el broker lo
+ * reenvía sólo a quien lo pidió. Los mensajes que llegan después de un hueco
+ * se entregan enseguida, sin esperar a que se rellene: una pérdida no
+ * retrasa al resto (no hay bloqueo de cabeza de línea como en TCP), y los
+ * recuperados llegan después, fuera de orden.
+ */
+
+#ifndef UDP_SEQ_H
+#define UDP_SEQ_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SEQ_HEADER_SIZE 9
+#define UDP_MAX_DATAGRAM 65507                              /* contenido máximo de un datagrama IPv4 */
+#define SEQ_MAX_PAYLOAD (UDP_MAX_DATAGRAM - SEQ_HEADER_SIZE) /* mensaje más grande reenviable */
+#define SEQ_MAX_GAPS 64                  /* huecos pendientes por topic en el suscriptor */
+#define SEQ_NACK_INTERVAL_NS 20000000ull /* espera antes de repetir un NACK */
+#define SEQ_NACK_RETRIES 10              /* NACKs por hueco antes de darlo por perdido */
+#define SEQ_NACK_MAX_RANGE 1024          /* mensajes como máximo por NACK */
+
+enum { SEQ_LIVE = 'D', SEQ_RETRANSMIT = 'R', SEQ_HEARTBEAT = 'H', SEQ_LOST = 'L', SEQ_SUBACK = 'A' };
+
+static inline void seq_put_header(unsigned char *h, uint64_t seq, char kind) {
+    for (int i = 7; i >= 0; i--, seq >>= 8)
+        h[i] = (unsigned char)seq;
+    h[8] = (unsigned char)kind;
+}
+
+static inline uint64_t seq_get(const unsigned char *h) {
+    uint64_t seq = 0;
+    for (int i = 0; i < 8; i++)
+        seq = seq << 8 | h[i];
+    return seq;
+}
+
+/*
+ * SeqRing (broker)
+ * - Últimos mensajes de un topic, copiados ("topic|message") uno tras otro
+ *   en un área circular de 'data_size' bytes; cada uno ocupa sólo lo que
+ *   mide. El mensaje 'seq' se localiza por la entrada seq % capacity de
+ *   'offs'/'lens'. Guardar uno nuevo descarta los más antiguos que pisa, y
+ *   como mucho se guardan 'capacity' mensajes.
+ * - Un mensaje que no cabe al final del área empieza en el byte 0; el
+ *   hueco que queda al final no se usa en esa vuelta.
+ */
+typedef struct {
+    uint64_t next_seq;   /* número del próximo mensaje (el primero es 1) */
+    uint64_t oldest;     /* secuencia más antigua guardada (== next_seq si no hay ninguna) */
+    uint32_t capacity;
+    uint32_t *offs;
+    uint32_t *lens;
+    char *data;
+    size_t data_size;
+    size_t head;         /* donde se escribe el siguiente mensaje */
+    uint64_t tx_gen;     /* lote de envío que todavía apunta a estos huecos */
+    int dirty;           /* publicó desde el último latido */
+} SeqRing;
+
+/*
+ * seq_ring_init
+ * - 'data_size' debe admitir el mensaje más grande (SEQ_MAX_PAYLOAD). 'r'
+ *   empieza a ceros; un anillo que se liberó con seq_ring_release() sigue
+ *   numerando donde iba y conserva 'dirty': si el topic ya espera su latido
+ *   en la lista del broker, no debe apuntarse otra vez.
+ */
+static inline void seq_ring_init(SeqRing *r, uint32_t capacity, size_t data_size) {
+    if (r->next_seq == 0)
+        r->next_seq = 1;
+    r->oldest = r->next_seq;
+    r->capacity = capacity;
+    r->offs = calloc(capacity, sizeof(uint32_t));
+    r->lens = calloc(capacity, sizeof(uint32_t));
+    r->data = malloc(data_size);
+    if (!r->offs || !r->lens || !r->data) {
+        perror("Error reservando memoria");
+        exit(EXIT_FAILURE);
+    }
+    r->data_size = data_size;
+    r->head = 0;
+    r->tx_gen = 0;
+}
+
+/* seq_ring_release: libera los mensajes guardados y su memoria; conserva la secuencia y 'dirty' */
+static inline void seq_ring_release(SeqRing *r) {
+    free(r->offs);
+    free(r->lens);
+    free(r->data);
+    r->offs = r->lens = NULL;
+    r->data = NULL;
+    r->oldest = r->next_seq;
+}
+
+/* seq_ring_oldest: secuencia más antigua que todavía se puede retransmitir */
+static inline uint64_t seq_ring_oldest(const SeqRing *r) {
+    return r->oldest;
+}
+
+/*
+ * seq_ring_append
+ * - Guarda una copia del mensaje y devuelve su secuencia. 'len' no puede
+ *   superar data_size.
+ */
+static inline uint64_t seq_ring_append(SeqRing *r, const char *msg, size_t len) {
+    size_t pos = r->head;
+    int wrap = pos + len > r->data_size;
+    if (wrap)
+        pos = 0;
+    /* Descartar lo que se va a pisar: con 'wrap', también todo lo que quedaba
+     * entre head y el final; sin él, lo que empiece dentro de [pos, pos + len) */
+    while (r->oldest < r->next_seq) {
+        size_t slot = r->oldest % r->capacity;
+        size_t off = r->offs[slot];
+        int full = r->next_seq - r->oldest == r->capacity;
+        int hit = (wrap && off >= r->head) || (off < pos + len && off + r->lens[slot] > pos);
+        if (!full && !hit)
+            break;
+        r->oldest++;
+    }
+
+    uint64_t seq = r->next_seq++;
+    size_t slot = seq % r->capacity;
+    memcpy(r->data + pos, msg, len);
+    r->offs[slot] = (uint32_t)pos;
+    r->lens[slot] = (uint32_t)len;
+    r->head = pos + len;
+    r->dirty = 1;
+    return seq;
+}
+
+/* seq_ring_get: mensaje 'seq' si sigue en el anillo, o NULL */
+static inline const char *seq_ring_get(const SeqRing *r, uint64_t seq, size_t *len) {
+    if (seq < r->oldest || seq >= r->next_seq)
+        return NULL;
+    size_t slot = seq % r->capacity;
+    *len = r->lens[slot];
+    return r->data + r->offs[slot];
+}
+
+/*
+ * SeqTracker (suscriptor)
+ * - Estado de la secuencia de un topic: el siguiente número esperado y los
+ *   huecos todavía sin rellenar, cada uno con el instante de su próximo
+ *   NACK.
+ */
+typedef struct {
+    uint64_t from, to;   /* rango que falta, ambos incluidos */
+    uint64_t nack_at_ns;
+    int retries;
+} SeqGap;
+
+typedef struct {
+    uint64_t expected;   /* próxima secuencia en orden; 0 = aún no llegó nada */
+    SeqGap gaps[SEQ_MAX_GAPS];
+    size_t gap_count;
+    uint64_t delivered;  /* mensajes entregados (en vivo o recuperados) */
+    uint64_t recovered;  /* de ellos, los que llegaron por retransmisión */
+    uint64_t duplicates;
+    uint64_t lost;       /* dados por perdidos */
+    uint64_t nacks;      /* NACKs enviados */
+} SeqTracker;
+
+/* seq_gap_drop: quita el hueco 'i' contando sus mensajes como perdidos */
+static inline void seq_gap_drop(SeqTracker *t, size_t i) {
+    t->lost += t->gaps[i].to - t->gaps[i].from + 1;
+    t->gaps[i] = t->gaps[--t->gap_count];
+}
+
+static inline void seq_gap_add(SeqTracker *t, uint64_t from, uint64_t to, uint64_t now_ns) {
+    if (t->gap_count == SEQ_MAX_GAPS) {
+        /* Sin sitio: el hueco más antiguo se da por perdido */
+        size_t oldest = 0;
+        for (size_t i = 1; i < t->gap_count; i++)
+            if (t->gaps[i].from < t->gaps[oldest].from)
+                oldest = i;
+        seq_gap_drop(t, oldest);
+    }
+    t->gaps[t->gap_count++] = (SeqGap){ .from = from, .to = to, .nack_at_ns = now_ns };
+}
+
+/*
+ * seq_track
+ * - Registra la llegada de la secuencia 'seq' de tipo 'kind'. Devuelve 1 si
+ *   el mensaje es nuevo y hay que entregarlo a la aplicación, 0 si es un
+ *   duplicado o un aviso sin mensaje (latido, pérdida o SUBACK). Un salto
+ *   abre un hueco que se pedirá en el siguiente seq_track_nacks().
+ */
+static inline int seq_track(SeqTracker *t, uint64_t seq, char kind, uint64_t now_ns) {
+    if (kind == SEQ_LOST) {
+        /* El broker ya no guarda nada anterior a 'seq' */
+        for (size_t i = 0; i < t->gap_count;) {
+            if (t->gaps[i].to < seq) {
+                seq_gap_drop(t, i);
+                continue;
+            }
+            if (t->gaps[i].from < seq) {
+                t->lost += seq - t->gaps[i].from;
+                t->gaps[i].from = seq;
+            }
+            i++;
+        }
+        return 0;
+    }
+    if (kind == SEQ_HEARTBEAT) {
+        /* 'seq' es el último publicado: detecta pérdidas al final de una ráfaga */
+        if (t->expected != 0 && seq >= t->expected) {
+            seq_gap_add(t, t->expected, seq, now_ns);
+            t->expected = seq + 1;
+        }
+        return 0;
+    }
+    if (kind != SEQ_LIVE && kind != SEQ_RETRANSMIT)
+        return 0; /* SUBACK u otro aviso de control */
+
+    if (t->expected == 0 || seq == t->expected) {
+        /* Primer mensaje (se empieza donde se unió el suscriptor) o el esperado */
+        t->expected = seq + 1;
+    } else if (seq > t->expected) {
+        seq_gap_add(t, t->expected, seq - 1, now_ns);
+        t->expected = seq + 1;
+    } else {
+        /* Anterior al esperado: sólo es nuevo si rellena un hueco */
+        size_t i = 0;
+        while (i < t->gap_count && (seq < t->gaps[i].from || seq > t->gaps[i].to))
+            i++;
+        if (i == t->gap_count) {
+            t->duplicates++;
+            return 0;
+        }
+        SeqGap *g = &t->gaps[i];
+        if (g->from == g->to) {
+            t->gaps[i] = t->gaps[--t->gap_count];
+        } else if (seq == g->from) {
+            g->from++;
+        } else if (seq == g->to) {
+            g->to--;
+        } else {
+            SeqGap tail = *g;
+            g->to = seq - 1;
+            tail.from = seq + 1;
+            if (t->gap_count == SEQ_MAX_GAPS)
+                t->lost += tail.to - tail.from + 1;
+            else
+                t->gaps[t->gap_count++] = tail;
+        }
+        t->recovered++;
+    }
+    t->delivered++;
+    return 1;
+}
+
+/*
+ * seq_track_nacks
+ * - Llama a send(from, to, arg) por cada hueco cuyo NACK toca enviar ahora
+ *   y programa el siguiente. Tras SEQ_NACK_RETRIES intentos el hueco se da
+ *   por perdido.
+ */
+static inline void seq_track_nacks(SeqTracker *t, uint64_t now_ns,
+                                   void (*send)(uint64_t from, uint64_t to, void *arg), void *arg) {
+    for (size_t i = 0; i < t->gap_count;) {
+        SeqGap *g = &t->gaps[i];
+        if (g->nack_at_ns > now_ns) {
+            i++;
+            continue;
+        }
+        if (g->retries == SEQ_NACK_RETRIES) {
+            seq_gap_drop(t, i);
+            continue;
+        }
+        uint64_t to = g->to - g->from >= SEQ_NACK_MAX_RANGE ? g->from + SEQ_NACK_MAX_RANGE - 1 : g->to;
+        send(g->from, to, arg);
+        t->nacks++;
+        g->retries++;
+        g->nack_at_ns = now_ns + SEQ_NACK_INTERVAL_NS;
+        i++;
+    }
+}
+
+/* seq_track_timeout_ns: cuánto falta para el próximo NACK, -1 si no hay huecos */
+static inline int64_t seq_track_timeout_ns(const SeqTracker *t, uint64_t now_ns) {
+    int64_t wait = -1;
+    for (size_t i = 0; i < t->gap_count; i++) {
+        int64_t w = t->gaps[i].nack_at_ns > now_ns ? (int64_t)(t->gaps[i].nack_at_ns - now_ns) : 0;
+        if (wait < 0 || w < wait)
+            wait = w;
+    }
+    return wait;
+}
+
+#endif /* UDP_SEQ_H */
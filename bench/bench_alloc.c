@@ -0,0 +1,230 @@
+/*
+ * bench_alloc.c
+ *
+ * Comprueba que el camino de un mensaje no reserva memoria. Arranca el
+ * broker (TCP o UDP), suscribe varios clientes a un tema y publica mensajes
+ * de tamaños muy distintos (desde unos pocos bytes hasta casi el máximo del
+ * protocolo) en ráfagas. Tras una fase de calentamiento, en la que los pools
+ * del broker (common/slab.h) crecen hasta lo que necesitan, lee
+ * "reservas_heap" de STATS antes y después de la fase medida: en régimen
+ * estable la diferencia debe ser 0.
+ *
+ * Además cada suscriptor comprueba que cada mensaje llega con su longitud
+ * completa, es decir, que los mensajes grandes no se truncan.
+ *
+ * Uso: ./bench_alloc <ruta_broker> [tcp|udp] [mensajes] [suscriptores]
+ *   Por defecto tcp, 20000 mensajes medidos y 4 suscriptores.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include "../common/frame.h"
+#include "../UDP/udp_seq.h"
+#include "bench_util.h"
+
+#define TEST_PORT 9083
+#define TOPIC "reservas"
+#define MAX_SUBS 64
+#define TCP_BURST 32    /* mensajes publicados antes de leer a los suscriptores */
+#define WARMUP_ROUNDS 4 /* vueltas completas a la lista de tamaños antes de medir */
+#define RECV_TIMEOUT_MS 1000
+
+/* Tamaños de mensaje (contenido tras '|') que se van alternando */
+static const size_t sizes[] = { 16, 200, 1000, 3000, 12000, 60000, 250000, 900000 };
+#define SIZE_COUNT (sizeof(sizes) / sizeof(sizes[0]))
+
+int udp;
+int subs[MAX_SUBS];
+int nsubs = 4;
+int pub;
+struct sockaddr_in broker_addr;
+char *msg_buf;
+char *recv_buf;
+uint64_t truncated, lost;
+
+/* max_payload: mayor contenido que admite el protocolo tras "topic|" */
+size_t max_payload(void) {
+    return (udp ? SEQ_MAX_PAYLOAD : FRAME_MAX_PAYLOAD) - (sizeof(TOPIC) - 1) - 1;
+}
+
+int open_socket(void) {
+    int sock = socket(AF_INET, udp ? SOCK_DGRAM : SOCK_STREAM, 0);
+    struct timeval tv = { .tv_sec = RECV_TIMEOUT_MS / 1000, .tv_usec = (RECV_TIMEOUT_MS % 1000) * 1000 };
+    if (sock < 0) {
+        perror("Error creando socket");
+        exit(EXIT_FAILURE);
+    }
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if (udp) {
+        int rcvbuf = 4 << 20;
+        setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+        return sock;
+    }
+    if (connect(sock, (struct sockaddr *)&broker_addr, sizeof(broker_addr)) < 0) {
+        perror("Conexión fallida");
+        exit(EXIT_FAILURE);
+    }
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return sock;
+}
+
+void send_command(int sock, const char *cmd, size_t len) {
+    if (udp)
+        sendto(sock, cmd, len, 0, (struct sockaddr *)&broker_addr, sizeof(broker_addr));
+    else
+        frame_send(sock, cmd, len);
+}
+
+/* recv_message: siguiente mensaje del suscriptor (sin cabecera de secuencia), -1 si no llega */
+ssize_t recv_message(int sock, const char **content) {
+    while (1) {
+        if (!udp) {
+            *content = recv_buf;
+            return frame_recv(sock, recv_buf, FRAME_MAX_PAYLOAD + 1);
+        }
+        ssize_t n = recv(sock, recv_buf, UDP_MAX_DATAGRAM, 0);
+        if (n < 0)
+            return -1;
+        if (n < SEQ_HEADER_SIZE || recv_buf[SEQ_HEADER_SIZE - 1] != SEQ_LIVE)
+            continue; /* SUBACK y latidos */
+        *content = recv_buf + SEQ_HEADER_SIZE;
+        return n - SEQ_HEADER_SIZE;
+    }
+}
+
+/* broker_stat: valor de 'key' en la respuesta a STATS, por TCP o por UDP según el broker */
+unsigned long long broker_stat(const char *key) {
+    static char reply[BENCH_STATS_MAX + 1];
+    int sock = open_socket();
+    if (!udp) {
+        unsigned long long value = stat_value(sock, key);
+        close(sock);
+        return value;
+    }
+    send_command(sock, "STATS", 5);
+    ssize_t n = recv(sock, reply, sizeof(reply) - 1, 0);
+    close(sock);
+    if (n < 0) {
+        fprintf(stderr, "El broker no respondió a STATS\n");
+        exit(EXIT_FAILURE);
+    }
+    reply[n] = '\0';
+    return stats_field(reply, key, 1);
+}
+
+/*
+ * run_messages
+ * - Publica 'count' mensajes alternando los tamaños de 'sizes' y los lee
+ *   de todos los suscriptores. En TCP se publica en ráfagas de TCP_BURST;
+ *   en UDP de uno en uno, para no desbordar los buffers de los sockets con
+ *   datagramas de 64 KB (lo que se mide son las reservas, no el caudal).
+ */
+void run_messages(uint64_t count, uint64_t *next_id) {
+    size_t burst = udp ? 1 : TCP_BURST;
+    size_t prefix = sizeof(TOPIC) - 1 + 1;
+    size_t lens[TCP_BURST];
+    for (uint64_t done = 0; done < count;) {
+        size_t n = 0;
+        for (; n < burst && done + n < count; n++) {
+            size_t payload = sizes[(*next_id)++ % SIZE_COUNT];
+            if (payload > max_payload())
+                payload = max_payload();
+            memcpy(msg_buf, TOPIC "|", prefix);
+            memset(msg_buf + prefix, 'a' + (int)(*next_id % 26), payload);
+            lens[n] = prefix + payload;
+            send_command(pub, msg_buf, lens[n]);
+        }
+        for (int s = 0; s < nsubs; s++) {
+            for (size_t i = 0; i < n; i++) {
+                const char *content;
+                ssize_t got = recv_message(subs[s], &content);
+                if (got < 0) {
+                    lost += n - i;
+                    break;
+                }
+                if ((size_t)got != lens[i])
+                    truncated++;
+            }
+        }
+        done += n;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Uso: %s <ruta_broker> [tcp|udp] [mensajes] [suscriptores]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    udp = argc > 2 && strcmp(argv[2], "udp") == 0;
+    uint64_t total = argc > 3 ? strtoull(argv[3], NULL, 10) : 20000;
+    nsubs = argc > 4 ? atoi(argv[4]) : 4;
+    if (nsubs < 1 || nsubs > MAX_SUBS) {
+        fprintf(stderr, "Entre 1 y %d suscriptores\n", MAX_SUBS);
+        return EXIT_FAILURE;
+    }
+    msg_buf = malloc(FRAME_MAX_PAYLOAD);
+    recv_buf = malloc(FRAME_MAX_PAYLOAD + 1);
+    if (!msg_buf || !recv_buf) {
+        perror("Error reservando memoria");
+        return EXIT_FAILURE;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    char port_arg[16];
+    snprintf(port_arg, sizeof(port_arg), "%d", TEST_PORT);
+    char *broker_args[] = { argv[1], "-p", port_arg, NULL };
+    pid_t pid = spawn_broker(broker_args, -1);
+    usleep(200000); /* esperar a que el broker haga bind() (por UDP no hay connect() que reintentar) */
+
+    broker_addr.sin_family = AF_INET;
+    broker_addr.sin_port = htons(TEST_PORT);
+    inet_pton(AF_INET, SERVER_IP, &broker_addr.sin_addr);
+
+    for (int s = 0; s < nsubs; s++) {
+        subs[s] = open_socket();
+        send_command(subs[s], "SUBSCRIBE " TOPIC, strlen("SUBSCRIBE " TOPIC));
+    }
+    pub = open_socket();
+    usleep(100000);
+
+    /* Calentamiento: cada clase de tamaño llega a su máximo de objetos vivos.
+     * Un STATS intermedio deja también preparado el MsgBuf de su respuesta. */
+    uint64_t next_id = 0;
+    run_messages(WARMUP_ROUNDS * SIZE_COUNT * (udp ? 1 : TCP_BURST), &next_id);
+    broker_stat("reservas_heap");
+    unsigned long long warm_allocs = broker_stat("reservas_heap");
+    unsigned long long msgs_before = broker_stat("mensajes_entrada");
+    uint64_t warm_lost = lost;
+
+    run_messages(total, &next_id);
+    unsigned long long allocs = broker_stat("reservas_heap") - warm_allocs;
+    unsigned long long msgs = broker_stat("mensajes_entrada") - msgs_before;
+
+    stop_broker(pid);
+
+    size_t largest = sizes[SIZE_COUNT - 1] < max_payload() ? sizes[SIZE_COUNT - 1] : max_payload();
+    printf("protocolo              %s\n", udp ? "udp" : "tcp");
+    printf("suscriptores           %d\n", nsubs);
+    printf("tamaños de mensaje     %zu .. %zu bytes\n", sizes[0], largest);
+    printf("reservas al calentar   %llu\n", warm_allocs);
+    printf("mensajes medidos       %llu\n", msgs);
+    printf("reservas medidas       %llu\n", allocs);
+    printf("reservas por mensaje   %.6f\n", msgs ? (double)allocs / (double)msgs : 0.0);
+    printf("truncados              %llu\n", (unsigned long long)truncated);
+    printf("perdidos               %llu (%llu al calentar)\n", (unsigned long long)lost,
+           (unsigned long long)warm_lost);
+    int ok = allocs == 0 && truncated == 0 && lost == 0 && msgs == total;
+    printf("%s\n", ok ? "OK: ninguna reserva por mensaje en régimen estable" : "FALLO");
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
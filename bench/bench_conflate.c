@@ -0,0 +1,167 @@
+/*
+ * bench_conflate.c
+ *
+ * Prueba la caché de últimos valores (-V) y el modo CONFLATE del broker TCP
+ * con un marcador: K topics "marcador/<k>" que se actualizan sin parar.
+ *
+ * Primero publica unas rondas y comprueba que un suscriptor nuevo recibe en
+ * el acto el valor actual de cada topic, tanto con un filtro con comodines
+ * como con un topic concreto.
+ *
+ * Después compara tres suscriptores que no leen mientras se publican N
+ * actualizaciones (un lector lento llevado al extremo) y luego vacían lo que
+ * el broker les guardó: con las políticas drop-oldest y drop-newest y con
+ * CONFLATE. Para cada uno informa de las tramas y bytes que recibió, los
+ * descartes y conflaciones del broker y cuántos topics terminaron con su
+ * último valor. Con CONFLATE la cola del suscriptor nunca pasa de K tramas,
+ * así que no hay descartes y todos los topics acaban al día.
+ *
+ * Uso: ./bench_conflate <ruta_broker_tcp> [topics=64] [actualizaciones=200000] [epoll|uring]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/socket.h>
+
+#include "../common/frame.h"
+#include "bench_util.h"
+
+#define BENCH_PORT 9086      /* cada broker arrancado usa el siguiente (ver bench_util.h) */
+#define PAYLOAD 200          /* bytes de cada actualización, para llenar pronto los buffers */
+#define RCVBUF 4096          /* buffer de recepción pequeño: el suscriptor apenas absorbe nada */
+#define RECV_TIMEOUT_MS 300  /* sin nada en este tiempo, el suscriptor ya lo vació todo */
+
+char frame_buf[FRAME_MAX_PAYLOAD + 1];
+int broker_port = BENCH_PORT - 1;
+
+/* start_broker: broker con -V y la política de cola indicada, en el puerto siguiente */
+pid_t start_broker(const char *path, const char *engine, const char *policy) {
+    char port_arg[16];
+    snprintf(port_arg, sizeof(port_arg), "%d", ++broker_port);
+    char *args[] = { (char *)path, "-p", port_arg, "-V", "-E", (char *)engine, "-o", (char *)policy, NULL };
+    return spawn_broker(args, -1);
+}
+
+/* publish_rounds: publica 'count' actualizaciones repartidas por turno entre los topics */
+void publish_rounds(int pub, int topics, long first, long count, long *last) {
+    char msg[64 + PAYLOAD];
+    for (long i = first; i < first + count; i++) {
+        int k = (int)(i % topics);
+        int len = snprintf(msg, sizeof(msg), "marcador/%d|%ld|", k, i);
+        memset(msg + len, 'x', PAYLOAD - len);
+        frame_send(pub, msg, PAYLOAD);
+        last[k] = i;
+    }
+}
+
+typedef struct {
+    long frames;
+    long bytes;
+    int fresh;  /* topics cuyo último valor recibido es el último publicado */
+} Drain;
+
+/* drain: lee hasta que el broker deja de enviar y compara con los últimos valores publicados */
+Drain drain(int sub, int topics, const long *last) {
+    Drain d = { 0 };
+    long *seen = malloc(sizeof(long) * topics);
+    for (int k = 0; k < topics; k++)
+        seen[k] = -1;
+    ssize_t n;
+    while ((n = frame_recv(sub, frame_buf, sizeof(frame_buf) - 1)) >= 0) {
+        frame_buf[n] = '\0';
+        int k;
+        long value;
+        if (sscanf(frame_buf, "marcador/%d|%ld|", &k, &value) != 2 || k < 0 || k >= topics)
+            continue;
+        d.frames++;
+        d.bytes += n;
+        seen[k] = value;
+    }
+    for (int k = 0; k < topics; k++)
+        d.fresh += seen[k] == last[k];
+    free(seen);
+    return d;
+}
+
+/* check_cache: un suscriptor nuevo debe recibir el valor actual de cada topic */
+int check_cache(const char *broker, const char *engine, int topics) {
+    long *last = malloc(sizeof(long) * topics);
+    pid_t pid = start_broker(broker, engine, "drop-oldest");
+    int pub = connect_broker(broker_port, 0, RECV_TIMEOUT_MS);
+    publish_rounds(pub, topics, 0, 3L * topics, last);
+    stat_value(pub, "mensajes_entrada");
+
+    int all = connect_broker(broker_port, 0, RECV_TIMEOUT_MS), one = connect_broker(broker_port, 0, RECV_TIMEOUT_MS);
+    send_text(all, "SUBSCRIBE marcador/#");
+    send_text(one, "SUBSCRIBE marcador/3");
+    Drain d_all = drain(all, topics, last);
+    long *last_one = calloc(topics, sizeof(long));
+    for (int k = 0; k < topics; k++)
+        last_one[k] = k == 3 ? last[3] : -1;
+    Drain d_one = drain(one, topics, last_one);
+    unsigned long long sent = stat_value(pub, "ultimos_valores_enviados");
+    close(all);
+    close(one);
+    close(pub);
+    stop_broker(pid);
+
+    int ok = d_all.frames == topics && d_all.fresh == topics && d_one.frames == 1 && d_one.fresh == topics &&
+             sent == (unsigned long long)topics + 1;
+    printf("caché de últimos valores: marcador/# recibió %ld/%d valores actuales, marcador/3 %ld/1   %s\n\n",
+           d_all.frames, topics, d_one.frames, ok ? "OK" : "FALLO");
+    free(last);
+    free(last_one);
+    return ok;
+}
+
+/* run_mode: suscriptor que no lee mientras se publica, con una política o con CONFLATE */
+int run_mode(const char *broker, const char *engine, const char *name, const char *policy, int conflate,
+             int topics, long updates) {
+    long *last = malloc(sizeof(long) * topics);
+    pid_t pid = start_broker(broker, engine, policy);
+    int sub = connect_broker(broker_port, RCVBUF, RECV_TIMEOUT_MS);
+    if (conflate)
+        send_text(sub, "CONFLATE");
+    send_text(sub, "SUBSCRIBE marcador/#");
+    int pub = connect_broker(broker_port, 0, RECV_TIMEOUT_MS);
+    stat_value(pub, "suscripciones"); /* el SUBSCRIBE ya se procesó */
+
+    publish_rounds(pub, topics, 0, updates, last);
+    unsigned long long drops = stat_value(pub, "descartes");
+    unsigned long long conflated = stat_value(pub, "conflaciones");
+    Drain d = drain(sub, topics, last);
+    close(sub);
+    close(pub);
+    stop_broker(pid);
+    free(last);
+
+    printf("%-12s %10ld %12ld %10llu %13llu %9d/%d\n", name, d.frames, d.bytes, drops, conflated, d.fresh, topics);
+    return !conflate || (d.fresh == topics && drops == 0);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Uso: %s <ruta_broker_tcp> [topics] [actualizaciones] [epoll|uring]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    int topics = argc > 2 ? atoi(argv[2]) : 64;
+    long updates = argc > 3 ? atol(argv[3]) : 200000;
+    const char *engine = argc > 4 ? argv[4] : "epoll";
+    if (topics < 4 || updates < topics) {
+        fprintf(stderr, "Hacen falta al menos 4 topics y una actualización por topic\n");
+        return EXIT_FAILURE;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    int ok = check_cache(argv[1], engine, topics);
+    printf("%-12s %10s %12s %10s %13s %11s\n", "modo", "recibidas", "bytes", "descartes", "conflaciones",
+           "al_dia");
+    ok &= run_mode(argv[1], engine, "drop-oldest", "drop-oldest", 0, topics, updates);
+    ok &= run_mode(argv[1], engine, "drop-newest", "drop-newest", 0, topics, updates);
+    ok &= run_mode(argv[1], engine, "conflate", "drop-oldest", 1, topics, updates);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,268 @@
+/*
+ * bench_fair.c
+ *
+ * Mide cuánto retrasa al resto un publicador que inunda el broker TCP. Un
+ * hilo publica en "flood/x" tramas de FLOOD_PAYLOAD (o FLOOD_BIG_PAYLOAD)
+ * bytes sin parar, con write() grandes, y otro las lee en un suscriptor de
+ * flood/#. Mientras
+ * tanto P publicadores educados envían "ok/<i>|<instante de envío>" a un
+ * ritmo modesto y un suscriptor de ok/# mide cuánto tardan en llegar. Para
+ * cada configuración del broker informa de:
+ *   - latencia de los publicadores educados (p50/p99/p999/máximo);
+ *   - sus mensajes perdidos (no deberían perderse: el broker no descarta);
+ *   - mensajes por segundo del flood que llegaron a su suscriptor;
+ *   - llamadas al sistema del broker por mensaje recibido;
+ *   - "lecturas_aplazadas" y "pausas_por_ritmo" de STATS.
+ * Las filas: sin flood; con flood y -b 0 (cada conexión se lee hasta vaciar
+ * su socket, como antes de la lectura por turnos); con flood y el
+ * presupuesto por defecto; con flood y un límite de ritmo por publicador
+ * (-l); y, con tramas de casi 64 KB, -b 0 frente al presupuesto por
+ * defecto: una trama mayor que lo que queda del presupuesto no debe costar
+ * más lecturas que sin él. Ver "Planificación de la lectura" en
+ * TCP/broker_tcp.c.
+ *
+ * Uso: ./bench_fair <ruta_broker_tcp> [segundos=3] [publicadores=4] [mensajes_s=1000] [limite_s=20000] [epoll|uring]
+ *
+ * Compilar con -pthread.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "../common/frame.h"
+#include "bench_util.h"
+
+#define BENCH_PORT 9100      /* cada broker arrancado usa el siguiente (ver bench_util.h) */
+#define FLOOD_PAYLOAD 256    /* bytes de cada publicación del flood */
+#define FLOOD_BIG_PAYLOAD 65000 /* tramas grandes: casi el presupuesto por defecto */
+#define FLOOD_BATCH_BYTES 65536 /* bytes del flood por write() (al menos una trama) */
+#define MAX_PUBLISHERS 64
+#define RECV_TIMEOUT_MS 10000 /* el suscriptor de ok/# deja de esperar el final */
+
+typedef struct {
+    const char *name;
+    size_t flood;        /* bytes de cada publicación del flood; 0: sin flood */
+    const char *budget;  /* -b, NULL: el valor por defecto */
+    int limited;         /* -l con el límite de la línea de órdenes */
+} Mode;
+
+int broker_port = BENCH_PORT - 1;
+volatile int stop_flood;
+
+/* start_broker: arranca el broker de la fila 'm' en el puerto siguiente */
+pid_t start_broker(const char *path, const char *engine, const Mode *m, const char *limit) {
+    char port_arg[16];
+    char *args[16];
+    int n = 0;
+    snprintf(port_arg, sizeof(port_arg), "%d", ++broker_port);
+    args[n++] = (char *)path;
+    args[n++] = "-p";
+    args[n++] = port_arg;
+    args[n++] = "-E";
+    args[n++] = (char *)engine;
+    args[n++] = "-v";
+    args[n++] = "off";
+    if (m->budget) {
+        args[n++] = "-b";
+        args[n++] = (char *)m->budget;
+    }
+    if (m->limited) {
+        args[n++] = "-l";
+        args[n++] = (char *)limit;
+    }
+    args[n] = NULL;
+    return spawn_broker(args, -1);
+}
+
+typedef struct {
+    int sock;
+    size_t payload;
+} Flood;
+
+/* flood_main: publica en flood/x por lotes hasta stop_flood */
+void *flood_main(void *arg) {
+    Flood *f = arg;
+    size_t frame = FRAME_HEADER_SIZE + f->payload;
+    size_t frames = FLOOD_BATCH_BYTES / frame ? FLOOD_BATCH_BYTES / frame : 1;
+    size_t size = frames * frame;
+    char *batch = malloc(size), *p = batch;
+    for (size_t i = 0; i < frames; i++) {
+        frame_put_header((unsigned char *)p, (uint32_t)f->payload);
+        memcpy(p + FRAME_HEADER_SIZE, "flood/x|", 8);
+        memset(p + FRAME_HEADER_SIZE + 8, 'f', f->payload - 8);
+        p += frame;
+    }
+    while (!stop_flood) {
+        for (size_t off = 0; off < size && !stop_flood;) {
+            ssize_t n = write(f->sock, batch + off, size - off);
+            if (n <= 0) {
+                free(batch);
+                return NULL;
+            }
+            off += (size_t)n;
+        }
+    }
+    free(batch);
+    return NULL;
+}
+
+typedef struct {
+    int sock;
+    long long bytes;
+} Drainer;
+
+/* drainer_main: lee lo que le llega al suscriptor del flood hasta que se cierra */
+void *drainer_main(void *arg) {
+    Drainer *d = arg;
+    static char buf[256 * 1024];
+    ssize_t n;
+    while ((n = read(d->sock, buf, sizeof(buf))) > 0)
+        d->bytes += n;
+    return NULL;
+}
+
+typedef struct {
+    int sock;
+    uint64_t *lat;
+    long capacity;
+    long received;
+} Receiver;
+
+/* receiver_main: latencia de cada "ok/<i>|<ns>" hasta "ok/fin" */
+void *receiver_main(void *arg) {
+    Receiver *r = arg;
+    static char buf[4096];
+    ssize_t n;
+    while ((n = frame_recv(r->sock, buf, sizeof(buf) - 1)) >= 0) {
+        uint64_t now = now_ns();
+        buf[n] = '\0';
+        if (strcmp(buf, "ok/fin|") == 0)
+            break;
+        char *sep = strchr(buf, '|');
+        if (sep && r->received < r->capacity)
+            r->lat[r->received++] = now - strtoull(sep + 1, NULL, 10);
+    }
+    return NULL;
+}
+
+int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+void run_mode(const char *broker, const char *engine, const Mode *m, int seconds, int publishers, long rate,
+              const char *limit) {
+    pid_t pid = start_broker(broker, engine, m, limit);
+
+    Receiver receiver = { .sock = connect_broker(broker_port, 0, RECV_TIMEOUT_MS),
+                          .capacity = rate * seconds + publishers };
+    receiver.lat = malloc(sizeof(uint64_t) * (size_t)receiver.capacity);
+    frame_send(receiver.sock, "SUBSCRIBE ok/#", 14);
+    Drainer drainer = { .sock = connect_broker(broker_port, 0, 0) };
+    frame_send(drainer.sock, "SUBSCRIBE flood/#", 17);
+    int pubs[MAX_PUBLISHERS];
+    for (int i = 0; i < publishers; i++)
+        pubs[i] = connect_broker(broker_port, 0, 0);
+    Flood flood = { .sock = m->flood ? connect_broker(broker_port, 0, 0) : -1, .payload = m->flood };
+    stat_of(broker_port, "suscripciones"); /* los SUBSCRIBE ya se procesaron */
+
+    pthread_t receiver_thread, drainer_thread, flood_thread;
+    pthread_create(&receiver_thread, NULL, receiver_main, &receiver);
+    pthread_create(&drainer_thread, NULL, drainer_main, &drainer);
+    stop_flood = 0;
+    if (m->flood)
+        pthread_create(&flood_thread, NULL, flood_main, &flood);
+
+    /* Los publicadores educados se turnan: uno cada 1/rate segundos */
+    char msg[64];
+    long sent = 0, total = rate * seconds;
+    uint64_t start = now_ns(), interval = 1000000000ull / (uint64_t)rate;
+    for (; sent < total; sent++) {
+        uint64_t due = start + (uint64_t)sent * interval;
+        uint64_t now = now_ns();
+        if (due > now) {
+            struct timespec pause = { (time_t)((due - now) / 1000000000ull), (long)((due - now) % 1000000000ull) };
+            nanosleep(&pause, NULL);
+        }
+        int len = snprintf(msg, sizeof(msg), "ok/%ld|%llu", sent % publishers, (unsigned long long)now_ns());
+        frame_send(pubs[sent % publishers], msg, (size_t)len);
+    }
+    double elapsed = (double)(now_ns() - start) / 1e9;
+    long long flood_bytes = drainer.bytes;
+
+    /* Sin lectura por turnos, una conexión nueva puede no atenderse mientras
+     * dure el flood: STATS se pide después de pararlo */
+    stop_flood = 1;
+    if (m->flood) {
+        shutdown(flood.sock, SHUT_RDWR); /* por si el write() está bloqueado por el límite */
+        pthread_join(flood_thread, NULL);
+        close(flood.sock);
+    }
+    unsigned long long deferred = stat_of(broker_port, "lecturas_aplazadas");
+    unsigned long long paused = stat_of(broker_port, "pausas_por_ritmo");
+    unsigned long long msgs_in = stat_of(broker_port, "mensajes_entrada");
+    unsigned long long calls = stat_of(broker_port, "llamadas_sistema");
+    for (int i = 0; i < publishers; i++)
+        frame_send(pubs[i], "ok/fin|", 7);
+    pthread_join(receiver_thread, NULL);
+    for (int i = 0; i < publishers; i++)
+        close(pubs[i]);
+    close(receiver.sock);
+    shutdown(drainer.sock, SHUT_RDWR);
+    pthread_join(drainer_thread, NULL);
+    close(drainer.sock);
+    stop_broker(pid);
+
+    long n = receiver.received;
+    uint64_t *lat = receiver.lat;
+    qsort(lat, (size_t)n, sizeof(uint64_t), cmp_u64);
+    printf("%-16s %10.1f %10.1f %10.1f %10.1f %9ld %12.0f %13.4f %10llu %10llu\n", m->name,
+           n ? lat[n / 2] / 1000.0 : 0.0, n ? lat[(size_t)(n * 0.99)] / 1000.0 : 0.0,
+           n ? lat[(size_t)(n * 0.999)] / 1000.0 : 0.0, n ? lat[n - 1] / 1000.0 : 0.0, total - n,
+           m->flood ? flood_bytes / (double)(FRAME_HEADER_SIZE + m->flood) / elapsed : 0.0,
+           msgs_in ? (double)calls / msgs_in : 0.0, deferred, paused);
+    fflush(stdout);
+    free(lat);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Uso: %s <ruta_broker_tcp> [segundos] [publicadores] [mensajes_s] [limite_s] [epoll|uring]\n",
+                argv[0]);
+        return EXIT_FAILURE;
+    }
+    int seconds = argc > 2 ? atoi(argv[2]) : 3;
+    int publishers = argc > 3 ? atoi(argv[3]) : 4;
+    long rate = argc > 4 ? atol(argv[4]) : 1000;
+    const char *limit = argc > 5 ? argv[5] : "20000";
+    const char *engine = argc > 6 ? argv[6] : "epoll";
+    if (seconds < 1 || publishers < 1 || publishers > MAX_PUBLISHERS || rate < 1 || atol(limit) < 1) {
+        fprintf(stderr, "Los segundos, el ritmo y el límite deben ser mayores que 0, y de 1 a %d publicadores\n",
+                MAX_PUBLISHERS);
+        return EXIT_FAILURE;
+    }
+    char limit_name[32];
+    snprintf(limit_name, sizeof(limit_name), "flood -l %s", limit);
+    const Mode modes[] = {
+        { "sin flood", 0, NULL, 0 },
+        { "flood -b 0", FLOOD_PAYLOAD, "0", 0 },
+        { "flood", FLOOD_PAYLOAD, NULL, 0 },
+        { limit_name, FLOOD_PAYLOAD, NULL, 1 },
+        { "flood 64KB -b 0", FLOOD_BIG_PAYLOAD, "0", 0 },
+        { "flood 64KB", FLOOD_BIG_PAYLOAD, NULL, 0 },
+    };
+
+    signal(SIGPIPE, SIG_IGN);
+    printf("%d publicadores, %ld mensajes/s en total, %d s por fila, motor %s\n", publishers, rate, seconds, engine);
+    printf("%-16s %10s %10s %10s %10s %9s %12s %13s %10s %10s\n", "modo", "p50_us", "p99_us", "p999_us", "max_us",
+           "perdidos", "flood_msg/s", "llamadas/msg", "aplazadas", "pausas");
+    for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); i++)
+        run_mode(argv[1], engine, &modes[i], seconds, publishers, rate, limit);
+    return 0;
+}
@@ -0,0 +1,117 @@
+/*
+ * bench_idle_conns.c
+ *
+ * Benchmark de conexiones inactivas para el broker TCP. Abre un número
+ * creciente de conexiones que no envían nada y, en cada escalón, mide el
+ * tiempo de ida y vuelta publish -> entrega entre un publisher y un
+ * subscriber activos. Con un bucle basado en select() el coste de cada
+ * despertar crece con el número de conexiones (y no se puede pasar de
+ * FD_SETSIZE); con epoll debe mantenerse plano.
+ *
+ * Uso: ./bench_idle_conns [max_conexiones] [iteraciones]
+ *   max_conexiones: tope de conexiones inactivas (por defecto 10000).
+ *   iteraciones:    publicaciones medidas por escalón (por defecto 2000).
+ *
+ * El broker debe estar corriendo en SERVER_IP:PORT.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+
+#include "../common/frame.h"
+
+#define SERVER_IP "127.0.0.1"
+#define PORT 8080
+#define BUFFER_SIZE 1024
+
+/* connect_broker: abre una conexión TCP al broker o termina el programa */
+int connect_broker(struct sockaddr_in *serv_addr) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        perror("Error creando socket");
+        exit(EXIT_FAILURE);
+    }
+    if (connect(sock, (struct sockaddr *)serv_addr, sizeof(*serv_addr)) < 0) {
+        perror("Conexión fallida");
+        exit(EXIT_FAILURE);
+    }
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return sock;
+}
+
+double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/*
+ * measure_rtt
+ * - Publica 'iterations' mensajes de uno en uno y espera a que cada uno
+ *   llegue al subscriber. Devuelve el tiempo medio por mensaje en µs.
+ */
+double measure_rtt(int pub, int sub, int iterations) {
+    char buffer[BUFFER_SIZE];
+    const char *msg = "bench|ping";
+
+    double start = now_us();
+    for (int i = 0; i < iterations; i++) {
+        frame_send(pub, msg, strlen(msg));
+        if (frame_recv(sub, buffer, sizeof(buffer)) < 0) {
+            fprintf(stderr, "El broker cerró la conexión\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return (now_us() - start) / iterations;
+}
+
+int main(int argc, char *argv[]) {
+    int max_idle = argc > 1 ? atoi(argv[1]) : 10000;
+    int iterations = argc > 2 ? atoi(argv[2]) : 2000;
+    struct sockaddr_in serv_addr;
+
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_port = htons(PORT);
+    inet_pton(AF_INET, SERVER_IP, &serv_addr.sin_addr);
+
+    int sub = connect_broker(&serv_addr);
+    int pub = connect_broker(&serv_addr);
+    const char *subscribe_msg = "SUBSCRIBE bench";
+    frame_send(sub, subscribe_msg, strlen(subscribe_msg));
+    usleep(100000); /* dar tiempo al broker para registrar la suscripción */
+
+    int *idle = malloc(sizeof(int) * (max_idle > 0 ? max_idle : 1));
+    int idle_count = 0;
+
+    printf("%12s %16s\n", "inactivas", "rtt_medio_us");
+    for (int step = 0; step <= max_idle; step = step ? step * 10 : 10) {
+        while (idle_count < step)
+            idle[idle_count++] = connect_broker(&serv_addr);
+        usleep(100000); /* dejar que el broker acepte las conexiones nuevas */
+
+        measure_rtt(pub, sub, iterations / 10 + 1); /* calentamiento */
+        printf("%12d %16.2f\n", idle_count, measure_rtt(pub, sub, iterations));
+        fflush(stdout);
+    }
+
+    for (int i = 0; i < idle_count; i++)
+        close(idle[i]);
+    free(idle);
+    close(pub);
+    close(sub);
+    return 0;
+}
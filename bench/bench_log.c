@@ -0,0 +1,156 @@
+/*
+ * bench_log.c
+ *
+ * Mide cuánto frena al broker TCP su salida estándar cuando es lenta. El
+ * broker escribe en una tubería que un hilo de este programa lee a un ritmo
+ * fijo (un terminal lento o un proceso que procesa el log), y un publisher
+ * envía N mensajes a un subscriber lo más rápido que puede. Para cada nivel
+ * de registro (-v/-n del broker, ver common/async_log.h) informa de:
+ *   - mensajes por segundo que llegan al subscriber;
+ *   - líneas que salieron por la tubería;
+ *   - registros descartados por el broker ("log_descartados" de STATS).
+ * Con el registro asíncrono el caudal no depende del lector: lo que no cabe
+ * en el anillo se descarta y se cuenta. La fila "debug" arranca el broker sin
+ * opciones de registro, así que también sirve para medir un broker anterior
+ * que escribía cada mensaje con printf.
+ *
+ * Uso: ./bench_log <ruta_broker_tcp> [mensajes=200000] [lector_kb_s=1024]
+ *
+ * Compilar con -pthread.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "../common/frame.h"
+#include "bench_util.h"
+
+#define BENCH_PORT 9087      /* cada broker arrancado usa el siguiente (ver bench_util.h) */
+#define PIPE_CHUNK 4096      /* bytes por cada lectura del lector lento */
+
+typedef struct {
+    const char *name;
+    const char *level;   /* NULL: sin opciones, el valor por defecto del broker */
+    const char *sample;
+} Mode;
+
+int broker_port = BENCH_PORT - 1;
+
+/* start_broker: arranca el broker con la salida estándar en 'out_fd' */
+pid_t start_broker(const char *path, const Mode *m, int out_fd) {
+    char port_arg[16];
+    snprintf(port_arg, sizeof(port_arg), "%d", ++broker_port);
+    char *args[] = { (char *)path, "-p", port_arg, "-q", "65536",
+                     "-v", (char *)m->level, "-n", (char *)m->sample, NULL };
+    if (!m->level)
+        args[5] = NULL; /* sin opciones de registro */
+    return spawn_broker(args, out_fd);
+}
+
+typedef struct {
+    int fd;
+    long kb_per_s;
+    long lines;
+} SlowReader;
+
+/* slow_reader_main: lee la salida del broker a kb_per_s hasta que se cierra */
+void *slow_reader_main(void *arg) {
+    SlowReader *r = arg;
+    static char buf[PIPE_CHUNK];
+    struct timespec pause = { 0, (long)(PIPE_CHUNK * 1000000000ull / ((uint64_t)r->kb_per_s * 1024)) };
+    ssize_t n;
+    while ((n = read(r->fd, buf, sizeof(buf))) > 0) {
+        for (ssize_t i = 0; i < n; i++)
+            r->lines += buf[i] == '\n';
+        nanosleep(&pause, NULL);
+    }
+    return NULL;
+}
+
+typedef struct {
+    int sock;
+    long received;
+} Receiver;
+
+/* receiver_main: cuenta lo que llega al subscriber hasta "bench/fin" */
+void *receiver_main(void *arg) {
+    Receiver *r = arg;
+    static char buf[4096];
+    while (frame_recv(r->sock, buf, sizeof(buf)) >= 0) {
+        if (strcmp(buf, "bench/fin|") == 0)
+            break;
+        r->received++;
+    }
+    return NULL;
+}
+
+void run_mode(const char *broker, const Mode *m, long messages, long kb_per_s) {
+    int pipe_fds[2];
+    if (pipe(pipe_fds) < 0) {
+        perror("Error en pipe");
+        exit(EXIT_FAILURE);
+    }
+    pid_t pid = start_broker(broker, m, pipe_fds[1]);
+    close(pipe_fds[1]);
+    SlowReader reader = { .fd = pipe_fds[0], .kb_per_s = kb_per_s };
+    pthread_t reader_thread, receiver_thread;
+    pthread_create(&reader_thread, NULL, slow_reader_main, &reader);
+
+    Receiver receiver = { .sock = connect_broker(broker_port, 0, 0) };
+    frame_send(receiver.sock, "SUBSCRIBE bench/#", 17);
+    int pub = connect_broker(broker_port, 0, 0);
+    stat_of(broker_port, "suscripciones"); /* el SUBSCRIBE ya se procesó */
+    pthread_create(&receiver_thread, NULL, receiver_main, &receiver);
+
+    char msg[64];
+    uint64_t start = now_ns();
+    for (long i = 0; i < messages; i++) {
+        int len = snprintf(msg, sizeof(msg), "bench/log|mensaje %ld", i);
+        frame_send(pub, msg, (size_t)len);
+    }
+    frame_send(pub, "bench/fin|", 10);
+    pthread_join(receiver_thread, NULL);
+    double elapsed = (double)(now_ns() - start) / 1e9;
+    unsigned long long dropped = stat_of_or_zero(broker_port, "log_descartados");
+
+    close(pub);
+    close(receiver.sock);
+    stop_broker(pid);
+    pthread_join(reader_thread, NULL);
+    close(pipe_fds[0]);
+
+    printf("%-12s %14.0f %10ld %12ld %16llu\n", m->name, receiver.received / elapsed, messages - receiver.received,
+           reader.lines, dropped);
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Uso: %s <ruta_broker_tcp> [mensajes] [lector_kb_s]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    long messages = argc > 2 ? atol(argv[2]) : 200000;
+    long kb_per_s = argc > 3 ? atol(argv[3]) : 1024;
+    if (messages < 1 || kb_per_s < 1) {
+        fprintf(stderr, "Los mensajes y el ritmo del lector deben ser mayores que 0\n");
+        return EXIT_FAILURE;
+    }
+    const Mode modes[] = {
+        { "debug", NULL, NULL },
+        { "debug 1/100", "debug", "100" },
+        { "info", "info", "1" },
+        { "off", "off", "1" },
+    };
+
+    signal(SIGPIPE, SIG_IGN);
+    printf("lector de la salida: %ld KB/s, %ld mensajes\n", kb_per_s, messages);
+    printf("%-12s %14s %10s %12s %16s\n", "registro", "mensajes/s", "perdidos", "lineas", "log_descartados");
+    for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); i++)
+        run_mode(argv[1], &modes[i], messages, kb_per_s);
+    return 0;
+}
@@ -0,0 +1,197 @@
+/*
+ * bench_shm.c
+ *
+ * Compara los clientes TCP con los clientes locales por memoria compartida
+ * del broker TCP (opciones -U y -B, ver TCP/shm_ring.h). Para cada
+ * transporte arranca el broker, conecta un subscriber y un publisher del
+ * mismo tipo y mide:
+ *   - latencia: el publisher publica un mensaje y espera a que llegue al
+ *     subscriber antes de publicar el siguiente; cada muestra es el viaje
+ *     completo cliente -> broker -> cliente, sin colas (p50/p99/p999);
+ *   - caudal: el publisher publica sin pausa y un hilo lee en el subscriber;
+ *     mensajes por segundo y llamadas al sistema del broker por mensaje
+ *     ("llamadas_sistema" de STATS).
+ * La fila "shm+espera" arranca el broker con -B y los clientes también
+ * esperan en bucle antes de dormir: ningún lado hace llamadas al sistema
+ * mientras hay tráfico, a costa de ocupar una CPU cada uno (con menos CPUs
+ * que hilos activos, la espera activa empeora en lugar de mejorar).
+ *
+ * Uso: ./bench_shm <ruta_broker_tcp> [muestras] [mensajes] [espera_us]
+ *   Por defecto 20000 muestras de latencia, 200000 mensajes de caudal y
+ *   50 µs de espera activa.
+ *
+ * Compilar con -pthread.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "../common/frame.h"
+#include "../TCP/shm_ring.h"
+#include "bench_util.h"
+
+#define BENCH_PORT 9085
+#define SHM_PATH "/tmp/bench_shm.sock"
+#define WARMUP 1000
+
+/* Un cliente del broker por TCP o por memoria compartida */
+typedef struct {
+    int sock;
+    int use_shm;
+    ShmClient shm;
+} Client;
+
+typedef struct {
+    const char *name;
+    int use_shm;
+    int busy;
+} Transport;
+
+char recv_buf[FRAME_MAX_PAYLOAD + 1];
+
+void client_open(Client *c, int use_shm, uint64_t spin_ns) {
+    c->use_shm = use_shm;
+    if (!use_shm) {
+        int one = 1;
+        c->sock = connect_broker(BENCH_PORT, 0, 0);
+        setsockopt(c->sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        return;
+    }
+    for (int attempt = 0; attempt < 50; attempt++) {
+        if (shm_client_connect(&c->shm, SHM_PATH, spin_ns) == 0)
+            return;
+        usleep(20000);
+    }
+    fprintf(stderr, "No se pudo conectar por memoria compartida a %s\n", SHM_PATH);
+    exit(EXIT_FAILURE);
+}
+
+int client_send(Client *c, const char *text, size_t len) {
+    return c->use_shm ? shm_client_send(&c->shm, text, len) : frame_send(c->sock, text, len);
+}
+
+ssize_t client_recv(Client *c, char *buf, size_t cap) {
+    return c->use_shm ? shm_client_recv(&c->shm, buf, cap) : frame_recv(c->sock, buf, cap);
+}
+
+void client_close(Client *c) {
+    if (c->use_shm)
+        shm_client_close(&c->shm);
+    else
+        close(c->sock);
+}
+
+pid_t start_broker(const char *path, unsigned busy_us) {
+    char busy_arg[16], port_arg[16];
+    snprintf(busy_arg, sizeof(busy_arg), "%u", busy_us);
+    snprintf(port_arg, sizeof(port_arg), "%d", BENCH_PORT);
+    char *args[] = { (char *)path, "-p", port_arg, "-U", SHM_PATH, "-B", busy_arg, "-q", "65536", NULL };
+    return spawn_broker(args, -1);
+}
+
+int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+typedef struct {
+    Client *sub;
+    long expected;
+    long received;
+} Reader;
+
+/* reader_main: lee del subscriber hasta "bench/fin" */
+void *reader_main(void *arg) {
+    Reader *r = arg;
+    static char buf[4096];
+    while (client_recv(r->sub, buf, sizeof(buf)) >= 0) {
+        if (strcmp(buf, "bench/fin|") == 0)
+            break;
+        r->received++;
+    }
+    return NULL;
+}
+
+void run_transport(const char *broker, const Transport *t, int samples, long messages, unsigned busy_us) {
+    uint64_t spin_ns = t->busy ? (uint64_t)busy_us * 1000 : 0;
+    pid_t pid = start_broker(broker, t->busy ? busy_us : 0);
+    Client sub, pub;
+    client_open(&sub, t->use_shm, spin_ns);
+    client_send(&sub, "SUBSCRIBE bench/#", 17);
+    client_open(&pub, t->use_shm, spin_ns);
+
+    /* Latencia: un mensaje en vuelo cada vez */
+    uint64_t *lat = malloc(sizeof(uint64_t) * (size_t)samples);
+    char msg[64];
+    for (int i = -WARMUP; i < samples; i++) {
+        int len = snprintf(msg, sizeof(msg), "bench/lat|%d", i);
+        uint64_t start = now_ns();
+        client_send(&pub, msg, (size_t)len);
+        if (client_recv(&sub, recv_buf, sizeof(recv_buf)) < 0) {
+            fprintf(stderr, "%s: el broker cerró la conexión\n", t->name);
+            exit(EXIT_FAILURE);
+        }
+        if (i >= 0)
+            lat[i] = now_ns() - start;
+    }
+    qsort(lat, (size_t)samples, sizeof(uint64_t), cmp_u64);
+
+    /* Caudal: el publisher no espera; un hilo lee */
+    Reader reader = { .sub = &sub, .expected = messages };
+    pthread_t thread;
+    unsigned long long calls_before = stat_of(BENCH_PORT, "llamadas_sistema");
+    pthread_create(&thread, NULL, reader_main, &reader);
+    uint64_t start = now_ns();
+    for (long i = 0; i < messages; i++) {
+        int len = snprintf(msg, sizeof(msg), "bench/rate|%ld", i);
+        client_send(&pub, msg, (size_t)len);
+    }
+    client_send(&pub, "bench/fin|", 10);
+    pthread_join(thread, NULL);
+    double elapsed = (double)(now_ns() - start) / 1e9;
+    unsigned long long calls = stat_of(BENCH_PORT, "llamadas_sistema") - calls_before;
+
+    printf("%-11s %10.2f %10.2f %10.2f %14.0f %12.4f %10ld\n", t->name, lat[samples / 2] / 1000.0,
+           lat[(size_t)(samples * 0.99)] / 1000.0, lat[(size_t)(samples * 0.999)] / 1000.0,
+           reader.received / elapsed, reader.received ? (double)calls / reader.received : 0.0,
+           messages - reader.received);
+    fflush(stdout);
+
+    free(lat);
+    client_close(&pub);
+    client_close(&sub);
+    stop_broker(pid);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Uso: %s <ruta_broker_tcp> [muestras] [mensajes] [espera_us]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    int samples = argc > 2 ? atoi(argv[2]) : 20000;
+    long messages = argc > 3 ? atol(argv[3]) : 200000;
+    unsigned busy_us = argc > 4 ? (unsigned)atoi(argv[4]) : 50;
+    if (samples < 1 || messages < 1) {
+        fprintf(stderr, "Las muestras y los mensajes deben ser mayores que 0\n");
+        return EXIT_FAILURE;
+    }
+    const Transport transports[] = {
+        { "tcp", 0, 0 },
+        { "shm", 1, 0 },
+        { "shm+espera", 1, 1 },
+    };
+
+    signal(SIGPIPE, SIG_IGN);
+    printf("%-11s %10s %10s %10s %14s %12s %10s\n", "transporte", "p50_us", "p99_us", "p999_us",
+           "mensajes/s", "llamadas/msg", "perdidos");
+    for (size_t i = 0; i < sizeof(transports) / sizeof(transports[0]); i++)
+        run_transport(argv[1], &transports[i], samples, messages, busy_us);
+    return 0;
+}
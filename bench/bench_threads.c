@@ -0,0 +1,178 @@
+/*
+ * bench_threads.c
+ *
+ * Benchmark de escalado por hilos del broker TCP. Para cada número de hilos
+ * (1, 2, 4 y 8) arranca el broker con "-t N" y el motor de eventos pedido
+ * (-E epoll o -E uring), conecta varios subscribers a un mismo topic y
+ * varios publishers que publican sin pausa durante unos segundos, y cuenta
+ * cuántos mensajes llegan a los subscribers. Para comparar los motores basta
+ * con ejecutarlo una vez con cada uno.
+ * Al terminar cada prueba lee "llamadas_sistema" de STATS y la divide entre
+ * todos los mensajes que recibieron los subscribers: llamadas al sistema
+ * del broker por mensaje entregado. STATS se pide con los publishers ya
+ * parados (con epoll, un publisher que escribe sin pausa puede tener al
+ * bucle leyendo de su socket sin atender conexiones nuevas); el contador es
+ * acumulado desde el arranque, así que el cociente cubre toda la prueba.
+ *
+ * Uso: ./bench_threads <ruta_broker_tcp> [subscribers] [publishers] [segundos] [epoll|uring]
+ *   Por defecto 32 subscribers, 4 publishers, 3 segundos por escalón y epoll.
+ *
+ * Compilar con -pthread. Cada escalón arranca el broker en un puerto nuevo a
+ * partir de BENCH_PORT (ver bench_util.h), con la salida estándar redirigida
+ * a /dev/null; si el núcleo no admite io_uring, el broker lo avisa por la
+ * salida de error y mide epoll.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "../common/frame.h"
+#include "bench_util.h"
+
+#define BENCH_PORT 9080      /* cada broker arrancado usa el siguiente (ver bench_util.h) */
+#define PAYLOAD "bench|0123456789abcdef0123456789abcdef0123456789abcdef0123456789ab"
+#define FRAMES_PER_WRITE 256
+
+const size_t frame_len = FRAME_HEADER_SIZE + sizeof(PAYLOAD) - 1;
+atomic_int running;
+atomic_ullong received_bytes;
+int broker_port = BENCH_PORT - 1;
+
+typedef struct {
+    double delivered_per_s;   /* mensajes recibidos por los subscribers */
+    double syscalls_per_msg;  /* llamadas al sistema del broker por mensaje recibido */
+} StepResult;
+
+/* publisher_main: escribe lotes de tramas idénticas hasta que termine la prueba */
+void *publisher_main(void *arg) {
+    int sock = *(int *)arg;
+    char *batch = malloc(frame_len * FRAMES_PER_WRITE);
+    for (int i = 0; i < FRAMES_PER_WRITE; i++) {
+        frame_put_header((unsigned char *)batch + i * frame_len, sizeof(PAYLOAD) - 1);
+        memcpy(batch + i * frame_len + FRAME_HEADER_SIZE, PAYLOAD, sizeof(PAYLOAD) - 1);
+    }
+    while (atomic_load(&running)) {
+        if (write(sock, batch, frame_len * FRAMES_PER_WRITE) < 0 && errno != EINTR)
+            break;
+    }
+    free(batch);
+    return NULL;
+}
+
+/* reader_main: un único hilo lee todos los subscribers con epoll y cuenta bytes */
+void *reader_main(void *arg) {
+    int epfd = *(int *)arg;
+    struct epoll_event events[64];
+    static char buffer[1 << 16];
+    while (atomic_load(&running)) {
+        int n = epoll_wait(epfd, events, 64, 50);
+        for (int i = 0; i < n; i++) {
+            ssize_t r;
+            while ((r = read(events[i].data.fd, buffer, sizeof(buffer))) > 0)
+                atomic_fetch_add(&received_bytes, (unsigned long long)r);
+        }
+    }
+    return NULL;
+}
+
+/* run_step: mide la carga con 'threads' hilos y el motor 'engine' */
+StepResult run_step(const char *broker, const char *engine, int threads, int nsubs, int npubs,
+                    double seconds) {
+    char threads_arg[16], port_arg[16];
+    snprintf(threads_arg, sizeof(threads_arg), "%d", threads);
+    snprintf(port_arg, sizeof(port_arg), "%d", ++broker_port);
+
+    char *args[] = { (char *)broker, "-E", (char *)engine, "-t", threads_arg, "-p", port_arg, NULL };
+    pid_t pid = spawn_broker(args, -1);
+
+    int epfd = epoll_create1(0);
+    int *subs = malloc(sizeof(int) * nsubs);
+    const char *subscribe_msg = "SUBSCRIBE bench";
+    for (int i = 0; i < nsubs; i++) {
+        subs[i] = connect_broker(broker_port, 0, 0);
+        frame_send(subs[i], subscribe_msg, strlen(subscribe_msg));
+        fcntl(subs[i], F_SETFL, O_NONBLOCK);
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLET, .data.fd = subs[i] };
+        epoll_ctl(epfd, EPOLL_CTL_ADD, subs[i], &ev);
+    }
+    usleep(200000); /* que todas las suscripciones queden registradas */
+
+    int *pubs = malloc(sizeof(int) * npubs);
+    pthread_t *pub_threads = malloc(sizeof(pthread_t) * npubs);
+    pthread_t reader;
+    atomic_store(&running, 1);
+    atomic_store(&received_bytes, 0);
+    pthread_create(&reader, NULL, reader_main, &epfd);
+
+    for (int i = 0; i < npubs; i++) {
+        pubs[i] = connect_broker(broker_port, 0, 0);
+        pthread_create(&pub_threads[i], NULL, publisher_main, &pubs[i]);
+    }
+    usleep(200000); /* medir en régimen estable, no el arranque */
+
+    unsigned long long bytes_before = atomic_load(&received_bytes);
+    double start = now_s();
+    usleep((useconds_t)(seconds * 1e6));
+    unsigned long long bytes = atomic_load(&received_bytes) - bytes_before;
+    double elapsed = now_s() - start;
+
+    atomic_store(&running, 0);
+    for (int i = 0; i < npubs; i++)
+        shutdown(pubs[i], SHUT_RDWR);
+    for (int i = 0; i < npubs; i++) {
+        pthread_join(pub_threads[i], NULL);
+        close(pubs[i]);
+    }
+    pthread_join(reader, NULL);
+    unsigned long long total = atomic_load(&received_bytes) / frame_len;
+    unsigned long long calls = stat_of(broker_port, "llamadas_sistema");
+    for (int i = 0; i < nsubs; i++)
+        close(subs[i]);
+    close(epfd);
+    stop_broker(pid);
+    free(subs);
+    free(pubs);
+    free(pub_threads);
+
+    StepResult r = {
+        .delivered_per_s = (double)(bytes / frame_len) / elapsed,
+        .syscalls_per_msg = total ? (double)calls / (double)total : 0.0,
+    };
+    return r;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Uso: %s <ruta_broker_tcp> [subscribers] [publishers] [segundos] [epoll|uring]\n",
+                argv[0]);
+        return EXIT_FAILURE;
+    }
+    int nsubs = argc > 2 ? atoi(argv[2]) : 32;
+    int npubs = argc > 3 ? atoi(argv[3]) : 4;
+    double seconds = argc > 4 ? atof(argv[4]) : 3.0;
+    const char *engine = argc > 5 ? argv[5] : "epoll";
+    if (strcmp(engine, "epoll") != 0 && strcmp(engine, "uring") != 0) {
+        fprintf(stderr, "Motor desconocido: %s (epoll o uring)\n", engine);
+        return EXIT_FAILURE;
+    }
+    int steps[] = { 1, 2, 4, 8 };
+
+    signal(SIGPIPE, SIG_IGN);
+    printf("motor %s\n", engine);
+    printf("%8s %22s %22s\n", "hilos", "mensajes_entregados/s", "llamadas/mensaje");
+    for (size_t i = 0; i < sizeof(steps) / sizeof(steps[0]); i++) {
+        StepResult r = run_step(argv[1], engine, steps[i], nsubs, npubs, seconds);
+        printf("%8d %22.0f %22.6f\n", steps[i], r.delivered_per_s, r.syscalls_per_msg);
+        fflush(stdout);
+    }
+    return 0;
+}
@@ -0,0 +1,136 @@
+/*
+ * bench_topic_trie.c
+ *
+ * Microbenchmark del árbol de suscripciones (common/topic_trie.h). Registra
+ * 100 000 filtros mezclados (exactos, con '+' y con '#') sobre topics de la
+ * forma "liga/partidoN/evento", y mide cuántos topics por segundo se casan
+ * contra el árbol. Como referencia mide también un recorrido lineal que
+ * compara el topic con cada filtro, que es lo que costaría sin el árbol.
+ * Al final da de baja todas las suscripciones y comprueba que el árbol se
+ * poda por completo.
+ *
+ * Uso: ./bench_topic_trie [suscripciones] [topics]
+ *   Por defecto 100000 suscripciones y 1000000 topics casados.
+ *
+ * No necesita el broker: incluye la cabecera directamente.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../common/topic_trie.h"
+
+#define MATCHES 10000   /* partidos distintos */
+#define EVENTS 16       /* eventos por partido */
+#define LINEAR_TOPICS 200 /* topics casados con el recorrido lineal */
+
+const char *events[EVENTS] = {
+    "goles", "tarjetas", "corners", "faltas", "cambios", "posesion", "tiros", "penales",
+    "fueras", "lesiones", "var", "clima", "publico", "arbitro", "minuto", "marcador",
+};
+
+double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* make_filter: 70% exactos, 20% con '+' en algún nivel y 10% con '#' */
+size_t make_filter(char *out, size_t cap) {
+    int match = rand() % MATCHES, event = rand() % EVENTS, kind = rand() % 10;
+    if (kind < 7)
+        return snprintf(out, cap, "liga/partido%d/%s", match, events[event]);
+    if (kind == 7)
+        return snprintf(out, cap, "liga/+/%s", events[event]);
+    if (kind == 8)
+        return snprintf(out, cap, "liga/partido%d/+", match);
+    return snprintf(out, cap, "liga/partido%d/#", match);
+}
+
+size_t make_topic(char *out, size_t cap) {
+    return snprintf(out, cap, "liga/partido%d/%s", rand() % MATCHES, events[rand() % EVENTS]);
+}
+
+/* filter_matches: casado nivel a nivel sin árbol, para el recorrido lineal */
+int filter_matches(const char *filter, const char *topic) {
+    while (1) {
+        if (filter[0] == '#')
+            return 1;
+        const char *fs = strchr(filter, '/'), *ts = strchr(topic, '/');
+        size_t fl = fs ? (size_t)(fs - filter) : strlen(filter);
+        size_t tl = ts ? (size_t)(ts - topic) : strlen(topic);
+        if (!(fl == 1 && filter[0] == '+') && (fl != tl || memcmp(filter, topic, fl) != 0))
+            return 0;
+        if (!fs || !ts)
+            return !fs && !ts;
+        filter = fs + 1;
+        topic = ts + 1;
+    }
+}
+
+void count_subs(TrieNode *node, void *ctx) {
+    *(size_t *)ctx += node->sub_count;
+}
+
+int main(int argc, char *argv[]) {
+    size_t nsubs = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000;
+    size_t ntopics = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000000;
+    TopicTrie trie = { 0 };
+    char **filters = malloc(nsubs * sizeof(char *));
+    TrieSub *subs = calloc(nsubs, sizeof(TrieSub));
+    char buf[64];
+
+    srand(42);
+    for (size_t i = 0; i < nsubs; i++) {
+        size_t len = make_filter(buf, sizeof(buf));
+        filters[i] = strdup(buf);
+        trie_sub_link(trie_insert(&trie, buf, len), &subs[i]);
+    }
+
+    char (*topics)[64] = malloc(ntopics * sizeof(*topics));
+    size_t *topic_lens = malloc(ntopics * sizeof(size_t));
+    for (size_t i = 0; i < ntopics; i++)
+        topic_lens[i] = make_topic(topics[i], sizeof(topics[i]));
+
+    size_t delivered = 0;
+    double start = now_s();
+    for (size_t i = 0; i < ntopics; i++)
+        trie_match(&trie, topics[i], topic_lens[i], count_subs, &delivered);
+    double trie_time = now_s() - start;
+
+    size_t linear_topics = ntopics < LINEAR_TOPICS ? ntopics : LINEAR_TOPICS;
+    size_t linear_delivered = 0, trie_check = 0;
+    start = now_s();
+    for (size_t i = 0; i < linear_topics; i++) {
+        for (size_t j = 0; j < nsubs; j++)
+            linear_delivered += filter_matches(filters[j], topics[i]);
+    }
+    double linear_time = now_s() - start;
+    for (size_t i = 0; i < linear_topics; i++)
+        trie_match(&trie, topics[i], topic_lens[i], count_subs, &trie_check);
+
+    printf("suscripciones: %zu (nodos del árbol: %zu)\n", nsubs, trie.node_count);
+    printf("%-10s %14s %14s %16s\n", "metodo", "topics/s", "ns/topic", "entregas/topic");
+    printf("%-10s %14.0f %14.1f %16.2f\n", "arbol", ntopics / trie_time,
+           trie_time * 1e9 / ntopics, (double)delivered / ntopics);
+    printf("%-10s %14.0f %14.1f %16.2f\n", "lineal", linear_topics / linear_time,
+           linear_time * 1e9 / linear_topics, (double)linear_delivered / linear_topics);
+    if (trie_check != linear_delivered) {
+        fprintf(stderr, "Los resultados no coinciden: árbol %zu, lineal %zu\n", trie_check, linear_delivered);
+        return EXIT_FAILURE;
+    }
+
+    /* Dar de baja todo: el árbol debe quedar podado hasta la raíz */
+    start = now_s();
+    for (size_t i = 0; i < nsubs; i++)
+        trie_sub_unlink(&trie, &subs[i]);
+    double unlink_time = now_s() - start;
+    printf("bajas/s: %.0f, nodos restantes: %zu\n", nsubs / unlink_time, trie.node_count);
+    if (trie.node_count != 0) {
+        fprintf(stderr, "El árbol no quedó vacío tras las bajas\n");
+        return EXIT_FAILURE;
+    }
+    return 0;
+}
@@ -0,0 +1,161 @@
+/*
+ * bench_udp.c
+ *
+ * Generador de carga para el broker UDP. Para cada tamaño de lote indicado
+ * arranca el broker con "-b N", suscribe varios sockets a un topic y publica
+ * datagramas sin pausa durante unos segundos desde un hilo publicador. Mide
+ * los datagramas ofrecidos por segundo y los entregados por segundo a los
+ * suscriptores, lo que permite comparar "-b 1" (un recvfrom()/sendto() por
+ * datagrama) con lotes grandes de recvmmsg()/sendmmsg().
+ *
+ * Uso: ./bench_udp <ruta_broker_udp> [subscribers] [segundos] [lote...]
+ *   Por defecto 8 subscribers, 3 segundos y los lotes 1 y 64.
+ *
+ * Compilar con -pthread.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "bench_util.h"
+
+#define BENCH_PORT 9081
+#define PAYLOAD "bench|0123456789abcdef0123456789abcdef0123456789abcdef0123456789ab"
+#define SEND_BATCH 64
+
+atomic_int running;
+atomic_ullong sent_count;
+atomic_ullong received_count;
+struct sockaddr_in broker_addr;
+
+/* publisher_main: publica con sendmmsg() para que el generador no sea el cuello de botella */
+void *publisher_main(void *arg) {
+    (void)arg;
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    struct mmsghdr msgs[SEND_BATCH];
+    struct iovec iov = { .iov_base = PAYLOAD, .iov_len = sizeof(PAYLOAD) - 1 };
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < SEND_BATCH; i++) {
+        msgs[i].msg_hdr.msg_name = &broker_addr;
+        msgs[i].msg_hdr.msg_namelen = sizeof(broker_addr);
+        msgs[i].msg_hdr.msg_iov = &iov;
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    while (atomic_load(&running)) {
+        int n = sendmmsg(sock, msgs, SEND_BATCH, 0);
+        if (n > 0)
+            atomic_fetch_add(&sent_count, (unsigned long long)n);
+    }
+    close(sock);
+    return NULL;
+}
+
+/* reader_main: cuenta los datagramas que llegan a todos los suscriptores */
+void *reader_main(void *arg) {
+    int epfd = *(int *)arg;
+    struct epoll_event events[64];
+    struct mmsghdr msgs[SEND_BATCH];
+    static char buffers[SEND_BATCH][256];
+    struct iovec iovs[SEND_BATCH];
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < SEND_BATCH; i++) {
+        iovs[i].iov_base = buffers[i];
+        iovs[i].iov_len = sizeof(buffers[i]);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    while (atomic_load(&running)) {
+        int n = epoll_wait(epfd, events, 64, 50);
+        for (int i = 0; i < n; i++) {
+            int r;
+            while ((r = recvmmsg(events[i].data.fd, msgs, SEND_BATCH, MSG_DONTWAIT, NULL)) > 0)
+                atomic_fetch_add(&received_count, (unsigned long long)r);
+        }
+    }
+    return NULL;
+}
+
+/* run_step: arranca el broker con el lote indicado y mide durante 'seconds' */
+void run_step(const char *broker, int batch, int nsubs, double seconds) {
+    char batch_arg[16], port_arg[16];
+    snprintf(batch_arg, sizeof(batch_arg), "%d", batch);
+    snprintf(port_arg, sizeof(port_arg), "%d", BENCH_PORT);
+
+    char *args[] = { (char *)broker, "-b", batch_arg, "-p", port_arg, NULL };
+    pid_t pid = spawn_broker(args, -1);
+    usleep(200000); /* esperar a que el broker haga bind() */
+
+    int epfd = epoll_create1(0);
+    int *subs = malloc(sizeof(int) * nsubs);
+    const char *subscribe_msg = "SUBSCRIBE bench";
+    for (int i = 0; i < nsubs; i++) {
+        int rcvbuf = 4 << 20;
+        subs[i] = socket(AF_INET, SOCK_DGRAM, 0);
+        setsockopt(subs[i], SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+        sendto(subs[i], subscribe_msg, strlen(subscribe_msg), 0,
+               (struct sockaddr *)&broker_addr, sizeof(broker_addr));
+        struct epoll_event ev = { .events = EPOLLIN, .data.fd = subs[i] };
+        epoll_ctl(epfd, EPOLL_CTL_ADD, subs[i], &ev);
+    }
+    usleep(100000);
+
+    pthread_t publisher, reader;
+    atomic_store(&running, 1);
+    atomic_store(&sent_count, 0);
+    atomic_store(&received_count, 0);
+    pthread_create(&reader, NULL, reader_main, &epfd);
+    double start = now_s();
+    pthread_create(&publisher, NULL, publisher_main, NULL);
+    usleep((useconds_t)(seconds * 1e6));
+    unsigned long long sent = atomic_load(&sent_count);
+    unsigned long long received = atomic_load(&received_count);
+    double elapsed = now_s() - start;
+
+    atomic_store(&running, 0);
+    pthread_join(publisher, NULL);
+    pthread_join(reader, NULL);
+    for (int i = 0; i < nsubs; i++)
+        close(subs[i]);
+    close(epfd);
+    free(subs);
+    stop_broker(pid);
+
+    printf("%8d %16.0f %18.0f %14.0f\n", batch, sent / elapsed, received / elapsed,
+           received / elapsed / nsubs);
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Uso: %s <ruta_broker_udp> [subscribers] [segundos] [lote...]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    int nsubs = argc > 2 ? atoi(argv[2]) : 8;
+    double seconds = argc > 3 ? atof(argv[3]) : 3.0;
+
+    broker_addr.sin_family = AF_INET;
+    broker_addr.sin_port = htons(BENCH_PORT);
+    inet_pton(AF_INET, SERVER_IP, &broker_addr.sin_addr);
+
+    printf("%8s %16s %18s %14s\n", "lote", "ofrecidos/s", "entregados/s", "msgs/s");
+    if (argc > 4) {
+        for (int i = 4; i < argc; i++)
+            run_step(argv[1], atoi(argv[i]), nsubs, seconds);
+    } else {
+        run_step(argv[1], 1, nsubs, seconds);
+        run_step(argv[1], 64, nsubs, seconds);
+    }
+    return 0;
+}
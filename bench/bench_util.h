@@ -0,0 +1,169 @@
+/*
+ * bench_util.h
+ *
+ * Piezas comunes de los programas de bench/ que arrancan su propio broker:
+ * el reloj, arrancar y parar el broker, conectarse a él mientras arranca y
+ * leer un contador de STATS. Como las de common/, es una biblioteca sólo de
+ * cabecera: basta con incluirla desde el .c del benchmark.
+ *
+ * Un broker con -E uring que se acaba de terminar puede retener un momento
+ * su socket de escucha (el núcleo cierra el anillo después que el proceso)
+ * y, con SO_REUSEPORT, quedarse conexiones del broker siguiente. Por eso los
+ * benchmarks que arrancan varios brokers dan a cada uno un puerto nuevo.
+ */
+
+#ifndef BENCH_UTIL_H
+#define BENCH_UTIL_H
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include "../common/frame.h"
+
+#define SERVER_IP "127.0.0.1"
+#define BENCH_CONNECT_ATTEMPTS 100  /* reintentos cada 20 ms mientras el broker arranca */
+#define BENCH_STATS_TIMEOUT_S 10    /* espera máxima de la respuesta a STATS */
+#define BENCH_STATS_MAX (256 * 1024)
+
+static inline uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static inline double now_s(void) {
+    return now_ns() / 1e9;
+}
+
+/*
+ * spawn_broker
+ * - Arranca argv[0] con esos argumentos y la salida estándar en 'out_fd'
+ *   (en /dev/null si es -1). No espera a que escuche: connect_broker()
+ *   reintenta hasta que acepte conexiones.
+ */
+static inline pid_t spawn_broker(char *const argv[], int out_fd) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("Error en fork");
+        exit(EXIT_FAILURE);
+    }
+    if (pid == 0) {
+        if (out_fd < 0)
+            out_fd = open("/dev/null", O_WRONLY);
+        dup2(out_fd, STDOUT_FILENO);
+        execv(argv[0], argv);
+        perror("Error ejecutando el broker");
+        _exit(EXIT_FAILURE);
+    }
+    return pid;
+}
+
+static inline void stop_broker(pid_t pid) {
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+}
+
+/*
+ * connect_broker
+ * - Conexión TCP al broker de 'port', reintentando mientras arranca.
+ *   'rcvbuf' > 0 limita el buffer de recepción (se fija antes de conectar
+ *   para que cuente en la ventana de TCP) y 'timeout_ms' > 0 pone un
+ *   timeout a las lecturas. Termina el programa si no se puede conectar.
+ */
+static inline int connect_broker(int port, int rcvbuf, int timeout_ms) {
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port) };
+    inet_pton(AF_INET, SERVER_IP, &addr.sin_addr);
+    for (int attempt = 0; attempt < BENCH_CONNECT_ATTEMPTS; attempt++) {
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock < 0) {
+            perror("Error creando socket");
+            exit(EXIT_FAILURE);
+        }
+        if (rcvbuf > 0)
+            setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+        if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            if (timeout_ms > 0) {
+                struct timeval tv = { .tv_sec = timeout_ms / 1000, .tv_usec = (timeout_ms % 1000) * 1000 };
+                setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            }
+            return sock;
+        }
+        close(sock);
+        usleep(20000); /* el broker todavía está arrancando */
+    }
+    perror("Conexión fallida");
+    exit(EXIT_FAILURE);
+}
+
+static inline void send_text(int sock, const char *text) {
+    frame_send(sock, text, strlen(text));
+}
+
+/*
+ * stats_field
+ * - Valor de 'key' en una respuesta de STATS. Si no está, termina el
+ *   programa o, sin 'required', devuelve 0 (un broker anterior que no tenía
+ *   ese contador).
+ */
+static inline unsigned long long stats_field(const char *reply, const char *key, int required) {
+    size_t key_len = strlen(key);
+    for (const char *line = reply; line && *line; line = strchr(line, '\n') ? strchr(line, '\n') + 1 : NULL)
+        if (strncmp(line, key, key_len) == 0 && line[key_len] == ' ')
+            return strtoull(line + key_len + 1, NULL, 10);
+    if (!required)
+        return 0;
+    fprintf(stderr, "STATS no incluye '%s'\n", key);
+    exit(EXIT_FAILURE);
+}
+
+/* stats_request: pide STATS por 'sock'; con timeout de lectura reintenta hasta BENCH_STATS_TIMEOUT_S */
+static inline const char *stats_request(int sock) {
+    static char reply[BENCH_STATS_MAX + 1];
+    double deadline = now_s() + BENCH_STATS_TIMEOUT_S;
+    ssize_t n;
+    send_text(sock, "STATS");
+    while ((n = frame_recv(sock, reply, sizeof(reply))) < 0 && now_s() < deadline)
+        ;
+    if (n < 0) {
+        fprintf(stderr, "El broker no respondió a STATS\n");
+        exit(EXIT_FAILURE);
+    }
+    return reply;
+}
+
+/*
+ * stat_value
+ * - Pide STATS por 'sock' y devuelve 'key'. Por la conexión de un
+ *   publicador, la respuesta llega después de procesar todo lo que publicó.
+ */
+static inline unsigned long long stat_value(int sock, const char *key) {
+    return stats_field(stats_request(sock), key, 1);
+}
+
+/* stat_of: 'key' del broker de 'port', por una conexión nueva */
+static inline unsigned long long stat_of(int port, const char *key) {
+    int sock = connect_broker(port, 0, 0);
+    unsigned long long value = stats_field(stats_request(sock), key, 1);
+    close(sock);
+    return value;
+}
+
+/* stat_of_or_zero: como stat_of(), pero 0 si el broker no tiene ese contador */
+static inline unsigned long long stat_of_or_zero(int port, const char *key) {
+    int sock = connect_broker(port, 0, 0);
+    unsigned long long value = stats_field(stats_request(sock), key, 0);
+    close(sock);
+    return value;
+}
+
+#endif /* BENCH_UTIL_H */
@@ -0,0 +1,88 @@
+/*
+ * broker_stats.c
+ *
+ * Cliente del comando STATS. Pide al broker (TCP o UDP) una instantánea de
+ * sus estadísticas y la imprime tal cual llega: una línea "clave valor" por
+ * dato y una línea "topic <nombre> <entrada> <salida>" por topic. Con -i
+ * repite la consulta cada N segundos, útil para seguir un incidente en vivo.
+ *
+ * Uso: ./broker_stats [-P tcp|udp] [-h ip] [-p puerto] [-i segundos]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "../common/frame.h"
+
+#define DEFAULT_PORT 8080
+#define REPLY_MAX (256 * 1024)
+
+int main(int argc, char *argv[]) {
+    int udp = 0, port = DEFAULT_PORT, opt_char;
+    const char *host = "127.0.0.1";
+    double interval = 0;
+
+    while ((opt_char = getopt(argc, argv, "P:h:p:i:")) != -1) {
+        switch (opt_char) {
+        case 'P': udp = strcmp(optarg, "udp") == 0; break;
+        case 'h': host = optarg; break;
+        case 'p': port = atoi(optarg); break;
+        case 'i': interval = atof(optarg); break;
+        default:
+            fprintf(stderr, "Uso: %s [-P tcp|udp] [-h ip] [-p puerto] [-i segundos]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    struct sockaddr_in broker_addr = { .sin_family = AF_INET, .sin_port = htons(port) };
+    if (inet_pton(AF_INET, host, &broker_addr.sin_addr) <= 0) {
+        fprintf(stderr, "Dirección inválida: %s\n", host);
+        return EXIT_FAILURE;
+    }
+
+    int sock = socket(AF_INET, udp ? SOCK_DGRAM : SOCK_STREAM, 0);
+    if (sock < 0) {
+        perror("Error creando socket");
+        return EXIT_FAILURE;
+    }
+    if (!udp && connect(sock, (struct sockaddr *)&broker_addr, sizeof(broker_addr)) < 0) {
+        perror("Conexión fallida");
+        return EXIT_FAILURE;
+    }
+    struct timeval tv = { .tv_sec = 2 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    char *reply = malloc(REPLY_MAX + 1);
+    while (1) {
+        ssize_t n;
+        if (udp) {
+            sendto(sock, "STATS", 5, 0, (struct sockaddr *)&broker_addr, sizeof(broker_addr));
+            n = recv(sock, reply, REPLY_MAX, 0);
+        } else {
+            if (frame_send(sock, "STATS", 5) < 0) {
+                perror("Error enviando STATS");
+                return EXIT_FAILURE;
+            }
+            n = frame_recv(sock, reply, REPLY_MAX + 1);
+        }
+        if (n < 0) {
+            fprintf(stderr, "El broker no respondió\n");
+            return EXIT_FAILURE;
+        }
+        reply[n] = '\0';
+        fputs(reply, stdout);
+        if (interval <= 0)
+            break;
+        printf("\n");
+        fflush(stdout);
+        usleep((useconds_t)(interval * 1e6));
+    }
+    free(reply);
+    close(sock);
+    return 0;
+}
@@ -0,0 +1,228 @@
+/*
+ * fed_test.c
+ *
+ * Prueba de la federación del broker TCP (opciones -F/-P). Arranca tres
+ * brokers en puertos de localhost unidos de dos maneras:
+ *
+ *     malla:  A ---- B        línea:  A ---- B ---- C
+ *              \    /
+ *               \  /
+ *                C
+ *
+ * B y C tienen un suscriptor a "liga/#" y el publicador está en A. En la
+ * malla cada publicación puede llegar a C por dos caminos (directo y a
+ * través de B); en la línea B hace de intermediario. Comprueba que:
+ *   - cada suscriptor recibe cada mensaje exactamente una vez;
+ *   - un topic sin interesados ("nadie/...") no sale de A;
+ *   - tras desconectarse los suscriptores, A deja de reenviar "liga/...".
+ * Informa además de cuántas copias repetidas descartaron los brokers.
+ *
+ * Uso: ./fed_test <ruta_broker_tcp> [mensajes] [epoll|uring]
+ *   Por defecto 2000 mensajes por fase y motor epoll.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/socket.h>
+
+#include "../common/frame.h"
+#include "bench_util.h"
+
+#define CLIENT_PORT 9090 /* broker i de la prueba t: clientes en CLIENT_PORT + 10 * t + i */
+#define PEER_PORT 9190   /* y peers en PEER_PORT + 10 * t + i */
+#define BROKERS 3
+#define RECV_TIMEOUT_MS 200
+#define READY_TIMEOUT_S 10
+
+pid_t pids[BROKERS];
+int port_base; /* 10 * t: cada topología usa sus propios puertos (ver stop_brokers()) */
+char frame_buf[FRAME_MAX_PAYLOAD + 1];
+
+/* client_port: puerto de clientes del broker 'i' en la prueba actual */
+int client_port(int i) {
+    return CLIENT_PORT + port_base + i;
+}
+
+/* connect_client: conexión de cliente al broker 'i', con timeout de lectura */
+int connect_client(int i) {
+    return connect_broker(client_port(i), 0, RECV_TIMEOUT_MS);
+}
+
+/* duplicates: copias repetidas que han descartado B y C */
+unsigned long long duplicates(void) {
+    return stat_of(client_port(1), "federacion_duplicados") + stat_of(client_port(2), "federacion_duplicados");
+}
+
+/* start_broker: arranca el broker 'i' con los peers de 'peers' (-1 termina la lista) */
+void start_broker(const char *path, const char *engine, int i, const int *peers) {
+    char port[16], peer_port[16], targets[BROKERS][32];
+    char *argv[32];
+    int argc = 0;
+    snprintf(port, sizeof(port), "%d", client_port(i));
+    snprintf(peer_port, sizeof(peer_port), "%d", PEER_PORT + port_base + i);
+    argv[argc++] = (char *)path;
+    argv[argc++] = "-p";
+    argv[argc++] = port;
+    argv[argc++] = "-E";
+    argv[argc++] = (char *)engine;
+    argv[argc++] = "-F";
+    argv[argc++] = peer_port;
+    for (int k = 0; peers[k] >= 0; k++) {
+        snprintf(targets[k], sizeof(targets[k]), "%s:%d", SERVER_IP, PEER_PORT + port_base + peers[k]);
+        argv[argc++] = "-P";
+        argv[argc++] = targets[k];
+    }
+    argv[argc] = NULL;
+
+    pids[i] = spawn_broker(argv, -1);
+}
+
+/*
+ * stop_brokers
+ * - Para los brokers que sigan en marcha; también al salir (atexit) si la
+ *   prueba termina antes de tiempo. La siguiente topología no reutiliza sus
+ *   puertos (ver bench_util.h).
+ */
+void stop_brokers(void) {
+    for (int i = 0; i < BROKERS; i++) {
+        if (pids[i] > 0)
+            stop_broker(pids[i]);
+        pids[i] = 0;
+    }
+}
+
+/*
+ * wait_ready
+ * - Publica sondas desde A hasta que los suscriptores de B y C reciben una:
+ *   los enlaces están hechos y el interés ya se propagó.
+ */
+int wait_ready(int pub, const int *subs, int nsubs) {
+    int ready[BROKERS] = { 0 }, pending = nsubs;
+    double deadline = now_s() + READY_TIMEOUT_S;
+    while (pending > 0 && now_s() < deadline) {
+        send_text(pub, "liga/sonda|x");
+        for (int s = 0; s < nsubs; s++) {
+            if (ready[s])
+                continue;
+            if (frame_recv(subs[s], frame_buf, sizeof(frame_buf)) > 0) {
+                ready[s] = 1;
+                pending--;
+            }
+        }
+    }
+    return pending == 0;
+}
+
+/*
+ * collect
+ * - Lee de un suscriptor hasta "liga/fin" y cuenta cuántas veces llegó cada
+ *   "liga/p1|<i>". Devuelve los mensajes que no llegaron exactamente una vez.
+ */
+long collect(int sub, int count, int *seen) {
+    memset(seen, 0, sizeof(int) * count);
+    double deadline = now_s() + READY_TIMEOUT_S;
+    while (now_s() < deadline) {
+        ssize_t n = frame_recv(sub, frame_buf, sizeof(frame_buf) - 1);
+        if (n < 0)
+            continue;
+        frame_buf[n] = '\0';
+        if (strcmp(frame_buf, "liga/fin|") == 0)
+            break;
+        if (strncmp(frame_buf, "liga/p1|", 8) == 0) {
+            int i = atoi(frame_buf + 8);
+            if (i >= 0 && i < count)
+                seen[i]++;
+        }
+    }
+    long wrong = 0;
+    for (int i = 0; i < count; i++)
+        wrong += seen[i] != 1;
+    return wrong;
+}
+
+/* run_topology: una prueba completa; links[i] son los peers a los que se conecta el broker i */
+int run_topology(const char *name, const char *path, const char *engine, int count, const int links[BROKERS][BROKERS]) {
+    char msg[64];
+    int *seen = malloc(sizeof(int) * count);
+
+    for (int i = 0; i < BROKERS; i++)
+        start_broker(path, engine, i, links[i]);
+
+    int subs[2] = { connect_client(1), connect_client(2) };
+    for (int s = 0; s < 2; s++)
+        send_text(subs[s], "SUBSCRIBE liga/#");
+    int pub = connect_client(0);
+    if (!wait_ready(pub, subs, 2)) {
+        fprintf(stderr, "%s: la federación no llegó a formarse\n", name);
+        stop_brokers();
+        return 0;
+    }
+
+    /* Sin interesados: A no debe reenviar nada */
+    unsigned long long out_before = stat_value(pub, "federacion_salida");
+    for (int i = 0; i < count; i++) {
+        snprintf(msg, sizeof(msg), "nadie/t|%d", i);
+        send_text(pub, msg);
+    }
+    unsigned long long unwanted = stat_value(pub, "federacion_salida") - out_before;
+
+    /* Con interesados: cada suscriptor, cada mensaje una vez */
+    unsigned long long dups_before = duplicates();
+    for (int i = 0; i < count; i++) {
+        snprintf(msg, sizeof(msg), "liga/p1|%d", i);
+        send_text(pub, msg);
+    }
+    send_text(pub, "liga/fin|");
+    long wrong_b = collect(subs[0], count, seen);
+    long wrong_c = collect(subs[1], count, seen);
+    unsigned long long dups = duplicates() - dups_before;
+
+    /* Bajas: sin suscriptores, A deja de reenviar */
+    close(subs[0]);
+    close(subs[1]);
+    usleep(500000);
+    out_before = stat_value(pub, "federacion_salida");
+    for (int i = 0; i < count; i++) {
+        snprintf(msg, sizeof(msg), "liga/p1|%d", i);
+        send_text(pub, msg);
+    }
+    unsigned long long after_unsub = stat_value(pub, "federacion_salida") - out_before;
+    close(pub);
+    stop_brokers();
+    free(seen);
+
+    int ok = wrong_b == 0 && wrong_c == 0 && unwanted == 0 && after_unsub == 0;
+    printf("%-8s %10ld %10ld %12llu %14llu %14llu   %s\n", name, wrong_b, wrong_c, dups, unwanted, after_unsub,
+           ok ? "OK" : "FALLO");
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Uso: %s <ruta_broker_tcp> [mensajes] [epoll|uring]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    int count = argc > 2 ? atoi(argv[2]) : 2000;
+    const char *engine = argc > 3 ? argv[3] : "epoll";
+    if (count < 1) {
+        fprintf(stderr, "El número de mensajes debe ser mayor que 0\n");
+        return EXIT_FAILURE;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    atexit(stop_brokers);
+
+    /* Cada enlace se configura en un solo extremo (-P); -1 termina la lista */
+    const int mesh[BROKERS][BROKERS] = { { -1 }, { 0, -1 }, { 0, 1, -1 } };
+    const int line[BROKERS][BROKERS] = { { -1 }, { 0, -1 }, { 1, -1 } };
+
+    printf("%-8s %10s %10s %12s %14s %14s\n", "topologia", "fallos_B", "fallos_C", "duplicados",
+           "sin_interes", "tras_bajas");
+    int ok = run_topology("malla", argv[1], engine, count, mesh);
+    port_base = 10;
+    ok &= run_topology("linea", argv[1], engine, count, line);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
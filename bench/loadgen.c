@@ -0,0 +1,521 @@
+/*
+ * loadgen.c
+ *
+ * Generador de carga y medidor de latencia para los brokers TCP y UDP. A
+ * diferencia de los demás programas de bench/, no arranca el broker: se
+ * conecta a uno que ya esté corriendo, como harían los clientes reales.
+ *
+ * Lanza N publishers (un hilo y un socket cada uno) y M subscribers
+ * repartidos entre K topics ("load/0" ... "load/K-1"; el subscriber j se
+ * suscribe a "load/(j % K)" y cada publisher recorre los topics en turno).
+ * Los publishers publican a una tasa total fija o sin límite, y cada mensaje
+ * lleva la marca de tiempo de envío (CLOCK_MONOTONIC en nanosegundos), así
+ * que el generador y el broker deben correr en la misma máquina. Un hilo
+ * lector recibe en todos los subscribers con epoll y registra la latencia
+ * extremo a extremo de cada entrega en un histograma (common/latency_hist.h).
+ *
+ * Con tasa fija la marca es el instante en que el mensaje *debía* salir, no
+ * cuándo salió: si el publisher se atrasa, ese retraso cuenta como latencia
+ * en lugar de esconderse (omisión coordinada).
+ *
+ * En UDP los subscribers se unen al grupo multicast de su topic si el
+ * broker lo anuncia en el SUBACK (broker_udp -M), y descartan por número de
+ * secuencia lo que les llegue repetido durante el cambio.
+ *
+ * Al terminar informa mensajes enviados, entregas esperadas y recibidas,
+ * pérdidas (en UDP, o en TCP si el broker descarta por cola llena) y los
+ * percentiles p50/p99/p999 de latencia. Con -f csv o -f json la salida es
+ * una sola línea legible por máquina, para comparar entre compilaciones.
+ *
+ * Uso: ./loadgen [-P tcp|udp] [-h ip] [-p puerto] [-n publishers]
+ *                [-m subscribers] [-k topics] [-r msgs/s] [-d segundos]
+ *                [-s bytes] [-f text|csv|json]
+ *   -r 0 (por defecto) publica sin límite.
+ *
+ * Compilar con -pthread.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "../common/frame.h"
+#include "../common/latency_hist.h"
+#include "../UDP/udp_mcast.h"
+#include "../UDP/udp_seq.h"
+
+#define DEFAULT_PORT 8080
+#define SEND_BATCH 64        /* mensajes por write()/sendmmsg() */
+#define UDP_MAX_PAYLOAD (SEQ_MAX_PAYLOAD - MAX_TOPIC - 1) /* "topic|mensaje" cabe en un datagrama */
+#define MAX_TOPIC 32
+#define DRAIN_IDLE_NS 300000000ull /* fin del drenaje tras 300 ms sin recibir nada */
+#define LEASE_RENEW_NS 10000000000ull /* RENEW de los subscribers UDP (lease del broker: 30 s) */
+
+typedef enum { PROTO_TCP, PROTO_UDP } Proto;
+typedef enum { FORMAT_TEXT, FORMAT_CSV, FORMAT_JSON } Format;
+
+/* Configuración (opciones de línea de comandos) */
+Proto proto = PROTO_TCP;
+const char *host = "127.0.0.1";
+int port = DEFAULT_PORT;
+int npubs = 1;
+int nsubs = 1;
+int ntopics = 1;
+double rate = 0;          /* mensajes/s en total; 0 = sin límite */
+double seconds = 5.0;
+size_t payload_size = 64; /* bytes del mensaje, sin contar el topic */
+Format format = FORMAT_TEXT;
+
+struct sockaddr_in broker_addr;
+atomic_int publishing;
+atomic_int reading;
+atomic_ullong last_rx_ns;
+
+/* Estado de un publisher: cuántos mensajes envió a cada topic */
+typedef struct {
+    int id;
+    pthread_t thread;
+    uint64_t *sent_per_topic;
+    uint64_t sent;
+} Publisher;
+
+/*
+ * Estado de un subscriber: su socket y, en TCP, la trama a medio llegar. En
+ * UDP, si el broker pasa su topic a multicast, un segundo socket unido al
+ * grupo; la secuencia descarta lo que llegue por los dos durante el cambio.
+ */
+typedef struct {
+    int fd;
+    FrameBuffer in;
+    int mcast_fd;
+    SeqTracker track;
+} Subscriber;
+
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+void sleep_until_ns(uint64_t t) {
+    struct timespec ts = { .tv_sec = (time_t)(t / 1000000000ull), .tv_nsec = (long)(t % 1000000000ull) };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+int open_socket(void) {
+    int sock = socket(AF_INET, proto == PROTO_TCP ? SOCK_STREAM : SOCK_DGRAM, 0);
+    if (sock < 0) {
+        perror("Error creando socket");
+        exit(EXIT_FAILURE);
+    }
+    if (proto == PROTO_TCP) {
+        int one = 1;
+        if (connect(sock, (struct sockaddr *)&broker_addr, sizeof(broker_addr)) < 0) {
+            perror("Conexión fallida");
+            exit(EXIT_FAILURE);
+        }
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return sock;
+}
+
+/*
+ * format_message
+ * - Escribe "load/<t>|<marca> xxxx..." en 'out' y devuelve su longitud. El
+ *   contenido tras '|' mide exactamente payload_size bytes; la marca va
+ *   seguida de un espacio para que el lector sepa dónde termina.
+ */
+size_t format_message(char *out, int topic, uint64_t stamp) {
+    int n = snprintf(out, MAX_TOPIC + 1, "load/%d|", topic);
+    int m = snprintf(out + n, 24, "%llu ", (unsigned long long)stamp);
+    if ((size_t)m < payload_size)
+        memset(out + n + m, 'x', payload_size - m);
+    return n + (payload_size > (size_t)m ? payload_size : (size_t)m);
+}
+
+/*
+ * publisher_main
+ * - Publica hasta que termine la prueba. Sin límite de tasa envía lotes de
+ *   SEND_BATCH mensajes seguidos; con tasa fija calcula cuántos mensajes
+ *   le tocaban hasta ahora, los envía de una vez y duerme hasta el
+ *   siguiente.
+ */
+void *publisher_main(void *arg) {
+    Publisher *pub = arg;
+    int sock = open_socket();
+    size_t slot = FRAME_HEADER_SIZE + MAX_TOPIC + 24 + payload_size;
+    char *batch = malloc(slot * SEND_BATCH);
+    struct iovec iovs[SEND_BATCH];
+    struct mmsghdr msgs[SEND_BATCH];
+    double pub_rate = rate / npubs;
+    uint64_t start = now_ns();
+    int topic = pub->id % ntopics;
+
+    memset(msgs, 0, sizeof(msgs));
+    while (atomic_load(&publishing)) {
+        size_t count = SEND_BATCH;
+        uint64_t stamp_base = 0;
+        if (pub_rate > 0) {
+            uint64_t due = (uint64_t)((now_ns() - start) * pub_rate / 1e9);
+            if (due <= pub->sent) {
+                sleep_until_ns(start + (uint64_t)((pub->sent + 1) * 1e9 / pub_rate));
+                continue;
+            }
+            if (due - pub->sent < count)
+                count = due - pub->sent;
+            stamp_base = start;
+        }
+
+        size_t off = 0;
+        for (size_t i = 0; i < count; i++) {
+            uint64_t stamp = stamp_base ? stamp_base + (uint64_t)((pub->sent + i) * 1e9 / pub_rate) : now_ns();
+            char *msg = batch + (proto == PROTO_TCP ? off : i * slot);
+            size_t len;
+            if (proto == PROTO_TCP) {
+                len = format_message(msg + FRAME_HEADER_SIZE, topic, stamp);
+                frame_put_header((unsigned char *)msg, (uint32_t)len);
+                off += FRAME_HEADER_SIZE + len;
+            } else {
+                len = format_message(msg, topic, stamp);
+                iovs[i].iov_base = msg;
+                iovs[i].iov_len = len;
+                msgs[i].msg_hdr.msg_name = &broker_addr;
+                msgs[i].msg_hdr.msg_namelen = sizeof(broker_addr);
+                msgs[i].msg_hdr.msg_iov = &iovs[i];
+                msgs[i].msg_hdr.msg_iovlen = 1;
+            }
+            pub->sent_per_topic[topic]++;
+            topic = (topic + 1) % ntopics;
+        }
+
+        if (proto == PROTO_TCP) {
+            struct iovec iov = { .iov_base = batch, .iov_len = off };
+            if (write_all(sock, &iov, 1) < 0)
+                break;
+        } else {
+            size_t done = 0;
+            while (done < count) {
+                int n = sendmmsg(sock, msgs + done, count - done, 0);
+                if (n < 0 && errno != EINTR)
+                    break;
+                done += n > 0 ? (size_t)n : 0;
+            }
+        }
+        pub->sent += count;
+    }
+    free(batch);
+    close(sock);
+    return NULL;
+}
+
+/* Resultados del hilo lector */
+typedef struct {
+    Subscriber *subs;
+    int epfd;
+    LatencyHist hist;
+    uint64_t received;
+    uint64_t bytes;
+} Reader;
+
+/* record_message: extrae la marca de tiempo tras '|' (o al principio en UDP) */
+void record_message(Reader *r, const char *msg, size_t len, uint64_t now) {
+    const char *sep = memchr(msg, '|', len);
+    const char *p = sep ? sep + 1 : msg;
+    const char *end = msg + len;
+    uint64_t stamp = 0;
+    while (p < end && *p >= '0' && *p <= '9')
+        stamp = stamp * 10 + (uint64_t)(*p++ - '0');
+    r->received++;
+    r->bytes += len;
+    hist_record(&r->hist, now > stamp ? now - stamp : 0);
+}
+
+/* read_tcp: vacía un subscriber TCP y procesa todas las tramas completas */
+void read_tcp(Reader *r, Subscriber *sub) {
+    char buffer[65536];
+    while (1) {
+        ssize_t n = read(sub->fd, buffer, sizeof(buffer));
+        if (n <= 0)
+            return;
+        uint64_t now = now_ns();
+        frame_buffer_append(&sub->in, buffer, (size_t)n);
+        size_t off = 0;
+        while (1) {
+            const char *payload;
+            uint32_t len;
+            ssize_t used = frame_next(sub->in.data + off, sub->in.len - off, &payload, &len);
+            if (used <= 0)
+                break;
+            record_message(r, payload, len, now);
+            off += (size_t)used;
+        }
+        frame_buffer_consume(&sub->in, off);
+        atomic_store(&last_rx_ns, now);
+    }
+}
+
+/*
+ * udp_join: atiende un SUBACK. Si anuncia un grupo multicast, une el
+ * subscriber a él y registra el nuevo socket en el epoll del lector.
+ */
+void udp_join(Reader *r, Subscriber *sub, const char *suback, size_t len) {
+    if (sub->mcast_fd < 0) {
+        sub->mcast_fd = mcast_join(suback, len, &broker_addr);
+        if (sub->mcast_fd < 0)
+            return;
+        int rcvbuf = 4 << 20;
+        setsockopt(sub->mcast_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+        fcntl(sub->mcast_fd, F_SETFL, fcntl(sub->mcast_fd, F_GETFL, 0) | O_NONBLOCK);
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLET, .data.ptr = sub };
+        epoll_ctl(r->epfd, EPOLL_CTL_ADD, sub->mcast_fd, &ev);
+    }
+    const char *space = memchr(suback, ' ', len);
+    mcast_send_joined(sub->fd, &broker_addr, suback, space ? (size_t)(space - suback) : len);
+}
+
+/* read_udp: vacía los sockets de un subscriber UDP con recvmmsg() */
+void read_udp(Reader *r, Subscriber *sub) {
+    static char buffers[SEND_BATCH][UDP_MAX_DATAGRAM];
+    struct iovec iovs[SEND_BATCH];
+    struct mmsghdr msgs[SEND_BATCH];
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < SEND_BATCH; i++) {
+        iovs[i].iov_base = buffers[i];
+        iovs[i].iov_len = sizeof(buffers[i]);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    int n;
+    for (int f = 0; f < 2; f++) {
+        int fd = f == 0 ? sub->fd : sub->mcast_fd;
+        while (fd >= 0 && (n = recvmmsg(fd, msgs, SEND_BATCH, MSG_DONTWAIT, NULL)) > 0) {
+            uint64_t now = now_ns();
+            for (int i = 0; i < n; i++) {
+                /* Saltar la cabecera de secuencia; los latidos y duplicados no son entregas */
+                if (msgs[i].msg_len <= SEQ_HEADER_SIZE)
+                    continue;
+                char *content = buffers[i] + SEQ_HEADER_SIZE;
+                size_t len = msgs[i].msg_len - SEQ_HEADER_SIZE;
+                char kind = buffers[i][SEQ_HEADER_SIZE - 1];
+                if (kind == SEQ_SUBACK)
+                    udp_join(r, sub, content, len);
+                else if (seq_track(&sub->track, seq_get((unsigned char *)buffers[i]), kind, now))
+                    record_message(r, content, len, now);
+            }
+            atomic_store(&last_rx_ns, now);
+        }
+    }
+}
+
+void *reader_main(void *arg) {
+    Reader *r = arg;
+    struct epoll_event events[64];
+    uint64_t next_renew = now_ns() + LEASE_RENEW_NS;
+    while (atomic_load(&reading)) {
+        /* En UDP las suscripciones caducan si no se renuevan */
+        if (proto == PROTO_UDP && now_ns() >= next_renew) {
+            for (int j = 0; j < nsubs; j++)
+                sendto(r->subs[j].fd, "RENEW", 5, 0, (struct sockaddr *)&broker_addr, sizeof(broker_addr));
+            next_renew += LEASE_RENEW_NS;
+        }
+        int n = epoll_wait(r->epfd, events, 64, 50);
+        for (int i = 0; i < n; i++) {
+            Subscriber *sub = events[i].data.ptr;
+            if (proto == PROTO_TCP)
+                read_tcp(r, sub);
+            else
+                read_udp(r, sub);
+        }
+    }
+    return NULL;
+}
+
+/* subscribe_all: abre los M subscribers, los suscribe y los registra en epoll */
+Subscriber *subscribe_all(int epfd) {
+    Subscriber *subs = calloc(nsubs, sizeof(Subscriber));
+    if (!subs) {
+        perror("Error reservando memoria");
+        exit(EXIT_FAILURE);
+    }
+    for (int j = 0; j < nsubs; j++) {
+        char cmd[64];
+        int len = snprintf(cmd, sizeof(cmd), "SUBSCRIBE load/%d", j % ntopics);
+        subs[j].fd = open_socket();
+        subs[j].mcast_fd = -1;
+        if (proto == PROTO_TCP) {
+            frame_send(subs[j].fd, cmd, len);
+        } else {
+            int rcvbuf = 4 << 20;
+            setsockopt(subs[j].fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+            sendto(subs[j].fd, cmd, len, 0, (struct sockaddr *)&broker_addr, sizeof(broker_addr));
+        }
+        fcntl(subs[j].fd, F_SETFL, fcntl(subs[j].fd, F_GETFL, 0) | O_NONBLOCK);
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLET, .data.ptr = &subs[j] };
+        epoll_ctl(epfd, EPOLL_CTL_ADD, subs[j].fd, &ev);
+    }
+    return subs;
+}
+
+void usage(const char *prog) {
+    fprintf(stderr, "Uso: %s [-P tcp|udp] [-h ip] [-p puerto] [-n publishers] [-m subscribers]\n"
+                    "       [-k topics] [-r msgs/s] [-d segundos] [-s bytes] [-f text|csv|json]\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    int opt_char;
+    while ((opt_char = getopt(argc, argv, "P:h:p:n:m:k:r:d:s:f:")) != -1) {
+        switch (opt_char) {
+        case 'P':
+            if (strcmp(optarg, "tcp") == 0)
+                proto = PROTO_TCP;
+            else if (strcmp(optarg, "udp") == 0)
+                proto = PROTO_UDP;
+            else
+                usage(argv[0]);
+            break;
+        case 'h': host = optarg; break;
+        case 'p': port = atoi(optarg); break;
+        case 'n': npubs = atoi(optarg); break;
+        case 'm': nsubs = atoi(optarg); break;
+        case 'k': ntopics = atoi(optarg); break;
+        case 'r': rate = atof(optarg); break;
+        case 'd': seconds = atof(optarg); break;
+        case 's': payload_size = strtoul(optarg, NULL, 10); break;
+        case 'f':
+            if (strcmp(optarg, "text") == 0)
+                format = FORMAT_TEXT;
+            else if (strcmp(optarg, "csv") == 0)
+                format = FORMAT_CSV;
+            else if (strcmp(optarg, "json") == 0)
+                format = FORMAT_JSON;
+            else
+                usage(argv[0]);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (npubs < 1 || nsubs < 1 || ntopics < 1 || seconds <= 0 || rate < 0)
+        usage(argv[0]);
+    if (proto == PROTO_UDP && payload_size > UDP_MAX_PAYLOAD) {
+        fprintf(stderr, "En UDP el mensaje no puede superar %d bytes\n", UDP_MAX_PAYLOAD);
+        exit(EXIT_FAILURE);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    broker_addr.sin_family = AF_INET;
+    broker_addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &broker_addr.sin_addr) <= 0) {
+        fprintf(stderr, "Dirección inválida: %s\n", host);
+        exit(EXIT_FAILURE);
+    }
+
+    Reader reader = { .epfd = epoll_create1(0) };
+    hist_reset(&reader.hist);
+    reader.subs = subscribe_all(reader.epfd);
+    usleep(300000); /* que todas las suscripciones queden registradas */
+
+    pthread_t reader_thread;
+    atomic_store(&reading, 1);
+    atomic_store(&publishing, 1);
+    pthread_create(&reader_thread, NULL, reader_main, &reader);
+
+    Publisher *pubs = calloc(npubs, sizeof(Publisher));
+    uint64_t start = now_ns();
+    for (int i = 0; i < npubs; i++) {
+        pubs[i].id = i;
+        pubs[i].sent_per_topic = calloc(ntopics, sizeof(uint64_t));
+        pthread_create(&pubs[i].thread, NULL, publisher_main, &pubs[i]);
+    }
+    sleep_until_ns(start + (uint64_t)(seconds * 1e9));
+    atomic_store(&publishing, 0);
+    for (int i = 0; i < npubs; i++)
+        pthread_join(pubs[i].thread, NULL);
+    double elapsed = (now_ns() - start) / 1e9;
+
+    /* Drenar: esperar a que deje de llegar tráfico antes de contar pérdidas */
+    atomic_store(&last_rx_ns, now_ns());
+    while (now_ns() - atomic_load(&last_rx_ns) < DRAIN_IDLE_NS)
+        usleep(50000);
+    atomic_store(&reading, 0);
+    pthread_join(reader_thread, NULL);
+
+    /* Entregas esperadas: cada envío a un topic llega a todos sus subscribers */
+    uint64_t sent = 0, expected = 0;
+    for (int t = 0; t < ntopics; t++) {
+        uint64_t subs_on_topic = nsubs / ntopics + (t < nsubs % ntopics ? 1 : 0);
+        for (int i = 0; i < npubs; i++) {
+            sent += pubs[i].sent_per_topic[t];
+            expected += pubs[i].sent_per_topic[t] * subs_on_topic;
+        }
+    }
+    uint64_t lost = expected > reader.received ? expected - reader.received : 0;
+    double loss_pct = expected ? 100.0 * lost / expected : 0;
+    double p50 = hist_percentile(&reader.hist, 0.50) / 1e3;
+    double p99 = hist_percentile(&reader.hist, 0.99) / 1e3;
+    double p999 = hist_percentile(&reader.hist, 0.999) / 1e3;
+    double max = reader.hist.total ? reader.hist.max / 1e3 : 0;
+    const char *proto_name = proto == PROTO_TCP ? "tcp" : "udp";
+
+    switch (format) {
+    case FORMAT_CSV:
+        printf("proto,publishers,subscribers,topics,rate,payload,seconds,sent,sent_per_s,expected,"
+               "received,received_per_s,lost,loss_pct,p50_us,p99_us,p999_us,max_us\n");
+        printf("%s,%d,%d,%d,%.0f,%zu,%.3f,%llu,%.0f,%llu,%llu,%.0f,%llu,%.4f,%.1f,%.1f,%.1f,%.1f\n",
+               proto_name, npubs, nsubs, ntopics, rate, payload_size, elapsed,
+               (unsigned long long)sent, sent / elapsed, (unsigned long long)expected,
+               (unsigned long long)reader.received, reader.received / elapsed,
+               (unsigned long long)lost, loss_pct, p50, p99, p999, max);
+        break;
+    case FORMAT_JSON:
+        printf("{\"proto\":\"%s\",\"publishers\":%d,\"subscribers\":%d,\"topics\":%d,\"rate\":%.0f,"
+               "\"payload\":%zu,\"seconds\":%.3f,\"sent\":%llu,\"sent_per_s\":%.0f,\"expected\":%llu,"
+               "\"received\":%llu,\"received_per_s\":%.0f,\"lost\":%llu,\"loss_pct\":%.4f,"
+               "\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_us\":%.1f}\n",
+               proto_name, npubs, nsubs, ntopics, rate, payload_size, elapsed,
+               (unsigned long long)sent, sent / elapsed, (unsigned long long)expected,
+               (unsigned long long)reader.received, reader.received / elapsed,
+               (unsigned long long)lost, loss_pct, p50, p99, p999, max);
+        break;
+    default:
+        printf("%s: %d publishers, %d subscribers, %d topics, mensajes de %zu bytes, ",
+               proto_name, npubs, nsubs, ntopics, payload_size);
+        if (rate > 0)
+            printf("tasa objetivo %.0f msgs/s\n", rate);
+        else
+            printf("sin límite de tasa\n");
+        printf("enviados:   %12llu  (%.0f msgs/s en %.2f s)\n", (unsigned long long)sent, sent / elapsed, elapsed);
+        printf("esperados:  %12llu\n", (unsigned long long)expected);
+        printf("recibidos:  %12llu  (%.0f msgs/s, %.1f MB/s)\n", (unsigned long long)reader.received,
+               reader.received / elapsed, reader.bytes / elapsed / 1e6);
+        printf("perdidos:   %12llu  (%.3f%%)\n", (unsigned long long)lost, loss_pct);
+        printf("latencia (us): p50 %.1f  p99 %.1f  p999 %.1f  max %.1f\n", p50, p99, p999, max);
+    }
+
+    for (int i = 0; i < nsubs; i++) {
+        close(reader.subs[i].fd);
+        if (reader.subs[i].mcast_fd >= 0)
+            close(reader.subs[i].mcast_fd);
+        frame_buffer_free(&reader.subs[i].in);
+    }
+    for (int i = 0; i < npubs; i++)
+        free(pubs[i].sent_per_topic);
+    free(pubs);
+    free(reader.subs);
+    close(reader.epfd);
+    return 0;
+}
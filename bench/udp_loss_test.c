@@ -0,0 +1,201 @@
+/*
+ * udp_loss_test.c
+ *
+ * Prueba de recuperación de pérdidas del broker UDP. Arranca el broker y
+ * coloca entre él y un suscriptor un proxy que descarta al azar un
+ * porcentaje de los datagramas en ambos sentidos (mensajes hacia el
+ * suscriptor y NACKs hacia el broker), lo que simula pérdida en la red sin
+ * necesitar privilegios para configurar la interfaz de loopback.
+ *
+ *     publisher ------------------------> broker
+ *                                          |  ^
+ *                            (pierde X %)  v  |  (pierde X %)
+ *                                         proxy
+ *                                          |  ^
+ *                                          v  |
+ *                                       suscriptor (SeqTracker + NACK)
+ *
+ * Publica N mensajes numerados a ritmo fijo y espera a que el suscriptor se
+ * ponga al día. Informa de cuántos llegaron en vivo, cuántos se recuperaron
+ * con NACK y cuántos se perdieron, y termina con error si falta alguno.
+ * Sólo se recupera lo que el broker llegó a recibir: si el publicador va
+ * más rápido de lo que el broker lee, esas pérdidas no tienen secuencia y
+ * aparecen como perdidas sin NACK.
+ *
+ * Uso: ./udp_loss_test <ruta_broker_udp> [pérdida_%] [mensajes] [mensajes/s]
+ *   Por defecto 5 % de pérdida, 20000 mensajes a 10000 mensajes/s.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "../UDP/udp_seq.h"
+#include "bench_util.h"
+
+#define TEST_PORT 9082
+#define TOPIC "perdidas"
+#define SETTLE_NS 500000000ull  /* silencio sin huecos que da la prueba por terminada */
+#define MAX_WAIT_NS 5000000000ull
+#define TEST_RING "8192"        /* ~0,8 s de historia a 10000 mensajes/s, de sobra para los reintentos */
+
+struct sockaddr_in broker_addr;
+double loss_rate;
+uint64_t proxy_dropped;
+
+int udp_socket(void) {
+    struct sockaddr_in addr = { .sin_family = AF_INET };
+    inet_pton(AF_INET, SERVER_IP, &addr.sin_addr);
+    int rcvbuf = 4 << 20;
+    int sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    if (sock < 0 || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("Error creando socket");
+        exit(EXIT_FAILURE);
+    }
+    return sock;
+}
+
+struct sockaddr_in local_addr(int sock) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    getsockname(sock, (struct sockaddr *)&addr, &len);
+    return addr;
+}
+
+/*
+ * proxy_forward
+ * - Pasa todo lo que haya en 'from' a 'to' por 'out', descartando cada
+ *   datagrama con probabilidad loss_rate. Los SUBSCRIBE no se descartan: la
+ *   prueba mide la recuperación de mensajes, no la de suscripciones.
+ */
+void proxy_forward(int from, int out, const struct sockaddr_in *to) {
+    char buf[2048];
+    ssize_t n;
+    while ((n = recv(from, buf, sizeof(buf), 0)) > 0) {
+        int control = n >= 9 && memcmp(buf, "SUBSCRIBE", 9) == 0;
+        if (!control && (double)rand() / RAND_MAX < loss_rate) {
+            proxy_dropped++;
+            continue;
+        }
+        sendto(out, buf, (size_t)n, 0, (const struct sockaddr *)to, sizeof(*to));
+    }
+}
+
+typedef struct {
+    int sock;
+    struct sockaddr_in proxy;
+} NackTarget;
+
+void send_nack(uint64_t from, uint64_t to, void *arg) {
+    NackTarget *target = arg;
+    char nack[128];
+    int len = snprintf(nack, sizeof(nack), "NACK " TOPIC " %llu %llu", (unsigned long long)from,
+                       (unsigned long long)to);
+    sendto(target->sock, nack, len, 0, (struct sockaddr *)&target->proxy, sizeof(target->proxy));
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Uso: %s <ruta_broker_udp> [pérdida_%%] [mensajes] [mensajes/s]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    loss_rate = (argc > 2 ? atof(argv[2]) : 5.0) / 100.0;
+    uint64_t total = argc > 3 ? strtoull(argv[3], NULL, 10) : 20000;
+    double rate = argc > 4 ? atof(argv[4]) : 10000;
+    srand(1);
+
+    char port_arg[16];
+    snprintf(port_arg, sizeof(port_arg), "%d", TEST_PORT);
+    char *broker_args[] = { argv[1], "-p", port_arg, "-r", TEST_RING, NULL };
+    pid_t pid = spawn_broker(broker_args, -1);
+    usleep(200000); /* esperar a que el broker haga bind() */
+
+    broker_addr.sin_family = AF_INET;
+    broker_addr.sin_port = htons(TEST_PORT);
+    inet_pton(AF_INET, SERVER_IP, &broker_addr.sin_addr);
+
+    int proxy_sub = udp_socket();    /* lado del suscriptor */
+    int proxy_broker = udp_socket(); /* lado del broker (el broker lo ve como suscriptor) */
+    int sub = udp_socket();
+    int pub = udp_socket();
+    struct sockaddr_in sub_addr = local_addr(sub);
+    NackTarget target = { .sock = sub, .proxy = local_addr(proxy_sub) };
+
+    const char *subscribe_msg = "SUBSCRIBE " TOPIC;
+    sendto(sub, subscribe_msg, strlen(subscribe_msg), 0, (struct sockaddr *)&target.proxy, sizeof(target.proxy));
+    usleep(50000);
+    proxy_forward(proxy_sub, proxy_broker, &broker_addr);
+    usleep(100000);
+
+    unsigned char *seen = calloc(total, 1);
+    SeqTracker track = { 0 };
+    uint64_t published = 0, unique = 0, last_event = now_ns();
+    uint64_t start = now_ns(), interval = (uint64_t)(1e9 / rate);
+
+    while (1) {
+        uint64_t now = now_ns();
+        /* Publicar los mensajes que ya tocan según el ritmo */
+        while (published < total && start + published * interval <= now) {
+            char msg[64];
+            int len = snprintf(msg, sizeof(msg), TOPIC "|%llu", (unsigned long long)published);
+            sendto(pub, msg, len, 0, (struct sockaddr *)&broker_addr, sizeof(broker_addr));
+            published++;
+        }
+        if (published == total && track.gap_count == 0 && now - last_event > SETTLE_NS)
+            break;
+        if (now - start > (uint64_t)(total * interval) + MAX_WAIT_NS)
+            break;
+
+        struct pollfd fds[3] = {
+            { .fd = proxy_sub, .events = POLLIN },
+            { .fd = proxy_broker, .events = POLLIN },
+            { .fd = sub, .events = POLLIN },
+        };
+        poll(fds, 3, 1);
+        proxy_forward(proxy_sub, proxy_broker, &broker_addr);
+        proxy_forward(proxy_broker, proxy_sub, &sub_addr);
+
+        char buf[2048];
+        ssize_t n;
+        while ((n = recv(sub, buf, sizeof(buf) - 1, 0)) >= SEQ_HEADER_SIZE) {
+            now = now_ns();
+            last_event = now;
+            char kind = buf[SEQ_HEADER_SIZE - 1];
+            if (!seq_track(&track, seq_get((unsigned char *)buf), kind, now))
+                continue;
+            buf[n] = '\0';
+            char *sep = strchr(buf + SEQ_HEADER_SIZE, '|');
+            uint64_t id = sep ? strtoull(sep + 1, NULL, 10) : total;
+            if (id < total && !seen[id]) {
+                seen[id] = 1;
+                unique++;
+            }
+        }
+        seq_track_nacks(&track, now_ns(), send_nack, &target);
+    }
+
+    stop_broker(pid);
+
+    printf("pérdida inyectada      %.1f %%\n", loss_rate * 100);
+    printf("publicados             %llu\n", (unsigned long long)published);
+    printf("descartados por proxy  %llu\n", (unsigned long long)proxy_dropped);
+    printf("entregados             %llu\n", (unsigned long long)unique);
+    printf("  en vivo              %llu\n", (unsigned long long)(track.delivered - track.recovered));
+    printf("  recuperados con NACK %llu\n", (unsigned long long)track.recovered);
+    printf("duplicados             %llu\n", (unsigned long long)track.duplicates);
+    printf("NACKs enviados         %llu\n", (unsigned long long)track.nacks);
+    printf("perdidos               %llu\n", (unsigned long long)(published - unique));
+    printf("%s\n", unique == published ? "OK: todos los mensajes llegaron" : "FALLO: faltan mensajes");
+    free(seen);
+    return unique == published ? EXIT_SUCCESS : EXIT_FAILURE;
+}
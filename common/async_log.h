@@ -0,0 +1,330 @@
+/*
+ * async_log.h
+ *
+ * Registro de eventos de los brokers fuera del camino caliente. Quien
+ * registra un evento (una conexión, una suscripción, cada publicación) no
+ * formatea ni escribe nada: copia un registro binario de tamaño fijo (un
+ * número de evento, dos enteros y dos cadenas, como mucho ALOG_DATA bytes
+ * entre ambas) en un anillo sin bloqueos de su propio hilo. Un hilo aparte
+ * vacía los anillos, convierte cada registro en una línea con la función de
+ * formato del broker y escribe las líneas por lotes con write().
+ *
+ * Cada hilo del broker tiene su anillo (un productor y un consumidor, como
+ * common/spsc_queue.h), así que registrar es una copia a memoria propia sin
+ * instrucciones atómicas con lock. Si la salida es lenta (una tubería que
+ * nadie lee, un terminal) y el anillo se llena, el registro se descarta y
+ * se cuenta: el broker nunca espera al registro.
+ *
+ * Niveles (se pueden cambiar en marcha, ver alog_command()):
+ *   - off:   nada.
+ *   - info:  conexiones, suscripciones y cambios de estado.
+ *   - debug: además cada publicación, muestreada una de cada 'sample'.
+ *
+ * El hilo de escritura, cuando no encuentra nada durante ALOG_IDLE_ROUNDS
+ * vueltas seguidas, se duerme en un eventfd y deja puesta una marca para
+ * que el siguiente productor lo despierte. Con tráfico nunca llega a
+ * dormirse, de modo que los productores no hacen llamadas al sistema.
+ */
+
+#ifndef ASYNC_LOG_H
+#define ASYNC_LOG_H
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "stats.h"
+
+#define ALOG_CACHE_LINE 64
+#define ALOG_RECORD_SIZE 256   /* bytes de cada registro */
+#define ALOG_DATA (ALOG_RECORD_SIZE - 24) /* bytes para las dos cadenas */
+#define ALOG_RING_RECORDS 4096 /* registros por anillo, potencia de dos */
+#define ALOG_BATCH (64 * 1024) /* bytes de texto por cada write() */
+#define ALOG_LINE_MAX 512      /* una línea formateada no pasa de aquí */
+#define ALOG_POLL_US 1000      /* espera entre vueltas sin nada que escribir */
+#define ALOG_IDLE_ROUNDS 50    /* vueltas vacías antes de dormirse en el eventfd */
+
+enum { ALOG_OFF, ALOG_INFO, ALOG_DEBUG };
+
+typedef struct {
+    uint64_t num[2];
+    uint16_t event;      /* lo define el broker */
+    uint16_t len[2];     /* bytes de cada cadena en 'data', una detrás de otra */
+    uint8_t truncated;   /* alguna cadena no cabía entera */
+    char data[ALOG_DATA];
+} AlogRecord;
+
+typedef struct {
+    _Alignas(ALOG_CACHE_LINE) atomic_size_t head; /* escrito por el hilo de escritura */
+    _Alignas(ALOG_CACHE_LINE) atomic_size_t tail; /* escrito por el productor */
+    size_t cached_head;                            /* copia local del productor */
+    unsigned countdown;                            /* publicaciones hasta la siguiente muestra */
+    uint64_t *dropped;                             /* BrokerStats.log_dropped del dueño, o NULL */
+    AlogRecord *records;
+} AlogRing;
+
+/* Convierte un registro en una línea (sin '\n') de como mucho 'cap' bytes y devuelve su longitud */
+typedef size_t (*alog_format_fn)(char *out, size_t cap, const AlogRecord *rec);
+
+typedef struct {
+    atomic_int level;
+    atomic_uint sample;      /* una de cada 'sample' publicaciones con debug */
+    atomic_int sleeping;     /* el hilo de escritura duerme en 'wake_fd' */
+    int wake_fd;
+    int fd;                  /* donde se escriben las líneas */
+    alog_format_fn format;
+    AlogRing *rings;
+    int ring_count;
+    pthread_t thread;
+} AsyncLog;
+
+static inline const char *alog_level_name(int level) {
+    return level == ALOG_OFF ? "off" : level == ALOG_INFO ? "info" : "debug";
+}
+
+/* alog_level_parse: devuelve 0 y rellena *level si los 'len' bytes de 'name' son un nivel */
+static inline int alog_level_parse(const char *name, size_t len, int *level) {
+    for (int l = ALOG_OFF; l <= ALOG_DEBUG; l++) {
+        if (strlen(alog_level_name(l)) == len && strncasecmp(name, alog_level_name(l), len) == 0) {
+            *level = l;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*
+ * alog_init
+ * - Prepara 'ring_count' anillos (uno por hilo productor) que escribirán en
+ *   'fd' con 'format'. Los contadores de descartes se asignan después con
+ *   alog_ring_counter(); el hilo de escritura arranca con alog_start().
+ */
+static inline void alog_init(AsyncLog *log, int ring_count, int fd, alog_format_fn format, int level,
+                             unsigned sample) {
+    memset(log, 0, sizeof(*log));
+    atomic_init(&log->level, level);
+    atomic_init(&log->sample, sample ? sample : 1);
+    atomic_init(&log->sleeping, 0);
+    log->fd = fd;
+    log->format = format;
+    log->ring_count = ring_count;
+    log->rings = aligned_alloc(ALOG_CACHE_LINE, sizeof(AlogRing) * (size_t)ring_count);
+    log->wake_fd = eventfd(0, 0);
+    if (!log->rings || log->wake_fd < 0) {
+        perror("Error preparando el registro");
+        exit(EXIT_FAILURE);
+    }
+    memset(log->rings, 0, sizeof(AlogRing) * (size_t)ring_count);
+    for (int i = 0; i < ring_count; i++) {
+        AlogRing *r = &log->rings[i];
+        atomic_init(&r->head, 0);
+        atomic_init(&r->tail, 0);
+        r->records = calloc(ALOG_RING_RECORDS, sizeof(AlogRecord));
+        if (!r->records) {
+            perror("Error reservando memoria");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/* alog_ring_counter: contador (del dueño del anillo) donde se suman los registros descartados */
+static inline void alog_ring_counter(AsyncLog *log, int ring, uint64_t *dropped) {
+    log->rings[ring].dropped = dropped;
+}
+
+static inline int alog_enabled(AsyncLog *log, int level) {
+    return atomic_load_explicit(&log->level, memory_order_relaxed) >= level;
+}
+
+/*
+ * alog_write
+ * - Registra un evento desde el hilo dueño de 'ring' si el nivel lo
+ *   permite. Las dos cadenas se copian (recortadas si no caben) y los
+ *   eventos de nivel debug pasan por el muestreo. Nunca bloquea: con el
+ *   anillo lleno el registro se descarta y se cuenta.
+ */
+static inline void alog_write(AsyncLog *log, int ring, int level, int event, const char *s1, size_t n1,
+                              const char *s2, size_t n2, uint64_t a, uint64_t b) {
+    if (!alog_enabled(log, level))
+        return;
+    AlogRing *r = &log->rings[ring];
+    if (level == ALOG_DEBUG) {
+        unsigned sample = atomic_load_explicit(&log->sample, memory_order_relaxed);
+        if (r->countdown > sample)
+            r->countdown = sample; // el muestreo bajó en marcha
+        if (r->countdown > 1) {
+            r->countdown--;
+            return;
+        }
+        r->countdown = sample;
+    }
+
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    if (tail - r->cached_head >= ALOG_RING_RECORDS) {
+        r->cached_head = atomic_load_explicit(&r->head, memory_order_acquire);
+        if (tail - r->cached_head >= ALOG_RING_RECORDS) {
+            if (r->dropped)
+                stat_add(r->dropped, 1);
+            return;
+        }
+    }
+    AlogRecord *rec = &r->records[tail & (ALOG_RING_RECORDS - 1)];
+    size_t c1 = n1 < ALOG_DATA ? n1 : ALOG_DATA;
+    size_t c2 = n2 < ALOG_DATA - c1 ? n2 : ALOG_DATA - c1;
+    rec->event = (uint16_t)event;
+    rec->num[0] = a;
+    rec->num[1] = b;
+    rec->len[0] = (uint16_t)c1;
+    rec->len[1] = (uint16_t)c2;
+    rec->truncated = c1 < n1 || c2 < n2;
+    if (c1)
+        memcpy(rec->data, s1, c1);
+    if (c2)
+        memcpy(rec->data + c1, s2, c2);
+    atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+
+    /* Pareja de la comprobación en alog_main(): o ve este registro o aquí se ve que duerme */
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&log->sleeping, memory_order_relaxed) &&
+        atomic_exchange_explicit(&log->sleeping, 0, memory_order_relaxed)) {
+        uint64_t one = 1;
+        if (write(log->wake_fd, &one, sizeof(one)) < 0)
+            perror("Error en write(eventfd)");
+    }
+}
+
+/* alog_str: cadena 'i' de un registro (ver AlogRecord.len) */
+static inline const char *alog_str(const AlogRecord *rec, int i) {
+    return rec->data + (i == 0 ? 0 : rec->len[0]);
+}
+
+/*
+ * alog_command
+ * - Atiende "LOG <off|info|debug> [muestreo]", el cambio de nivel en marcha
+ *   que reciben los brokers por su protocolo. Devuelve 1 si el comando era
+ *   uno de estos (y lo aplicó) y 0 si no.
+ */
+static inline int alog_command(AsyncLog *log, const char *cmd, size_t len) {
+    if (len < 5 || memcmp(cmd, "LOG ", 4) != 0)
+        return 0;
+    const char *p = cmd + 4, *end = cmd + len;
+    const char *word = p;
+    while (p < end && *p != ' ')
+        p++;
+    int level;
+    if (alog_level_parse(word, (size_t)(p - word), &level) < 0)
+        return 0;
+    unsigned sample = atomic_load_explicit(&log->sample, memory_order_relaxed);
+    if (p < end) {
+        char digits[16];
+        size_t n = (size_t)(end - p - 1);
+        if (n == 0 || n >= sizeof(digits))
+            return 0;
+        memcpy(digits, p + 1, n);
+        digits[n] = '\0';
+        char *stop;
+        unsigned long v = strtoul(digits, &stop, 10);
+        if (*stop != '\0' || v == 0 || v > UINT32_MAX)
+            return 0;
+        sample = (unsigned)v;
+    }
+    atomic_store_explicit(&log->sample, sample, memory_order_relaxed);
+    atomic_store_explicit(&log->level, level, memory_order_relaxed);
+    return 1;
+}
+
+/* alog_flush_text: escribe 'len' bytes enteros en el descriptor del registro */
+static inline void alog_flush_text(AsyncLog *log, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(log->fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return; // sin salida no hay dónde avisar: se pierde el lote
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+}
+
+/*
+ * alog_drain
+ * - Formatea todo lo que hay en los anillos y lo escribe en lotes de
+ *   ALOG_BATCH bytes. Devuelve cuántos registros procesó.
+ */
+static inline size_t alog_drain(AsyncLog *log, char *buf) {
+    size_t off = 0, done = 0;
+    for (int i = 0; i < log->ring_count; i++) {
+        AlogRing *r = &log->rings[i];
+        size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+        size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+        for (; head != tail; head++, done++) {
+            if (ALOG_BATCH - off < ALOG_LINE_MAX + 1) {
+                alog_flush_text(log, buf, off);
+                off = 0;
+            }
+            off += log->format(buf + off, ALOG_LINE_MAX, &r->records[head & (ALOG_RING_RECORDS - 1)]);
+            buf[off++] = '\n';
+            /* Se libera el hueco en cuanto se ha formateado: el productor no espera al write() */
+            atomic_store_explicit(&r->head, head + 1, memory_order_release);
+        }
+    }
+    if (off > 0)
+        alog_flush_text(log, buf, off);
+    return done;
+}
+
+/* alog_main: hilo de escritura (ver el comentario del principio) */
+static inline void *alog_main(void *arg) {
+    AsyncLog *log = arg;
+    static char buf[ALOG_BATCH];
+    int idle = 0;
+    while (1) {
+        if (alog_drain(log, buf) > 0) {
+            idle = 0;
+            continue;
+        }
+        if (++idle < ALOG_IDLE_ROUNDS) {
+            struct timespec pause = { 0, ALOG_POLL_US * 1000 };
+            nanosleep(&pause, NULL);
+            continue;
+        }
+        atomic_store_explicit(&log->sleeping, 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (alog_drain(log, buf) > 0 || !atomic_load_explicit(&log->sleeping, memory_order_relaxed)) {
+            /* Llegó algo mientras se dormía: quien lo vio ya escribió o escribirá en el eventfd */
+            if (!atomic_exchange_explicit(&log->sleeping, 0, memory_order_relaxed)) {
+                uint64_t v;
+                if (read(log->wake_fd, &v, sizeof(v)) < 0 && errno != EINTR)
+                    perror("Error en read(eventfd)");
+            }
+            idle = 0;
+            continue;
+        }
+        uint64_t v;
+        if (read(log->wake_fd, &v, sizeof(v)) < 0 && errno != EINTR)
+            perror("Error en read(eventfd)");
+        idle = 0;
+    }
+    return NULL;
+}
+
+/* alog_start: arranca el hilo de escritura; lo que ya se imprimió con stdio sale antes */
+static inline void alog_start(AsyncLog *log) {
+    fflush(stdout);
+    if (pthread_create(&log->thread, NULL, alog_main, log) != 0) {
+        perror("Error creando hilo");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(log->thread);
+}
+
+#endif /* ASYNC_LOG_H */
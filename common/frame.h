@@ -0,0 +1,186 @@
+/*
+ * frame.h
+ *
+ * Protocolo de tramas para las conexiones TCP. TCP es un flujo de bytes: el
+ * receptor puede recibir varios mensajes en un mismo read() o un mensaje
+ * partido en dos. Por eso cada mensaje viaja precedido de su longitud:
+ *
+ *     +--------------------+---------------------------+
+ *     | longitud (4 bytes, | contenido ("topic|msg",   |
+ *     | big-endian)        | "SUBSCRIBE <topic>", ...) |
+ *     +--------------------+---------------------------+
+ *
+ * El broker reenvía a los suscriptores la trama de publicación tal cual la
+ * recibió, de modo que también ellos reciben "topic|message".
+ *
+ * Contiene utilidades para ambos lados:
+ * - FrameBuffer / frame_next(): reensamblado no bloqueante (broker).
+ * - frame_send() / frame_recv(): envío y recepción bloqueantes (clientes).
+ */
+
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define FRAME_HEADER_SIZE 4
+#define FRAME_MAX_PAYLOAD (1u << 20) /* tramas mayores se consideran corruptas */
+
+static inline void frame_put_header(unsigned char *hdr, uint32_t len) {
+    hdr[0] = (unsigned char)(len >> 24);
+    hdr[1] = (unsigned char)(len >> 16);
+    hdr[2] = (unsigned char)(len >> 8);
+    hdr[3] = (unsigned char)len;
+}
+
+static inline uint32_t frame_get_header(const unsigned char *hdr) {
+    return ((uint32_t)hdr[0] << 24) | ((uint32_t)hdr[1] << 16) |
+           ((uint32_t)hdr[2] << 8) | (uint32_t)hdr[3];
+}
+
+/*
+ * frame_next
+ * - Extrae la primera trama completa de 'data'. Devuelve el número de bytes
+ *   que ocupa (cabecera + contenido) y deja en *payload / *len el contenido;
+ *   devuelve 0 si todavía no ha llegado la trama entera y -1 si la longitud
+ *   anunciada supera FRAME_MAX_PAYLOAD.
+ */
+static inline ssize_t frame_next(const char *data, size_t avail, const char **payload, uint32_t *len) {
+    if (avail < FRAME_HEADER_SIZE)
+        return 0;
+    uint32_t n = frame_get_header((const unsigned char *)data);
+    if (n > FRAME_MAX_PAYLOAD)
+        return -1;
+    if (avail - FRAME_HEADER_SIZE < n)
+        return 0;
+    *payload = data + FRAME_HEADER_SIZE;
+    *len = n;
+    return (ssize_t)(FRAME_HEADER_SIZE + n);
+}
+
+/*
+ * FrameBuffer
+ * - Buffer de reensamblado por conexión. Sólo guarda los bytes de una trama
+ *   incompleta, así que las conexiones inactivas no reservan memoria.
+ */
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} FrameBuffer;
+
+static inline void frame_buffer_append(FrameBuffer *fb, const char *data, size_t n) {
+    if (fb->len + n > fb->cap) {
+        size_t cap = fb->cap ? fb->cap : 256;
+        while (cap < fb->len + n)
+            cap *= 2;
+        char *grown = realloc(fb->data, cap);
+        if (!grown) {
+            perror("Error reservando memoria");
+            exit(EXIT_FAILURE);
+        }
+        fb->data = grown;
+        fb->cap = cap;
+    }
+    memcpy(fb->data + fb->len, data, n);
+    fb->len += n;
+}
+
+/* frame_buffer_consume: descarta los primeros 'n' bytes ya procesados */
+static inline void frame_buffer_consume(FrameBuffer *fb, size_t n) {
+    memmove(fb->data, fb->data + n, fb->len - n);
+    fb->len -= n;
+}
+
+static inline void frame_buffer_free(FrameBuffer *fb) {
+    free(fb->data);
+    fb->data = NULL;
+    fb->len = fb->cap = 0;
+}
+
+/*
+ * write_all
+ * - Escribe todos los bytes de 'iov' reintentando escrituras parciales.
+ *   Pensada para sockets bloqueantes de los clientes.
+ */
+static inline int write_all(int fd, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t n = writev(fd, iov, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+/* frame_send: envía 'payload' como una trama, en una sola llamada writev() */
+static inline int frame_send(int fd, const void *payload, size_t len) {
+    unsigned char hdr[FRAME_HEADER_SIZE];
+    frame_put_header(hdr, (uint32_t)len);
+    struct iovec iov[2] = {
+        { .iov_base = hdr, .iov_len = FRAME_HEADER_SIZE },
+        { .iov_base = (void *)payload, .iov_len = len },
+    };
+    return write_all(fd, iov, 2);
+}
+
+/* read_exact: lee exactamente 'len' bytes. Devuelve 0 si el otro extremo cerró. */
+static inline int read_exact(int fd, void *buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = read(fd, (char *)buf + done, len - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return n == 0 ? 0 : -1;
+        done += n;
+    }
+    return 1;
+}
+
+/*
+ * frame_recv
+ * - Lee una trama completa de un socket bloqueante y la copia en 'buf'
+ *   terminada en nulo. Si no cabe, se trunca a 'cap - 1' bytes y el resto se
+ *   descarta para no desincronizar el flujo. Devuelve la longitud copiada o
+ *   -1 si la conexión se cerró o hubo un error.
+ */
+static inline ssize_t frame_recv(int fd, char *buf, size_t cap) {
+    unsigned char hdr[FRAME_HEADER_SIZE];
+    if (read_exact(fd, hdr, FRAME_HEADER_SIZE) <= 0)
+        return -1;
+
+    uint32_t len = frame_get_header(hdr);
+    size_t keep = len < cap - 1 ? len : cap - 1;
+    if (keep > 0 && read_exact(fd, buf, keep) <= 0)
+        return -1;
+    for (size_t left = len - keep; left > 0;) {
+        char discard[256];
+        size_t chunk = left < sizeof(discard) ? left : sizeof(discard);
+        if (read_exact(fd, discard, chunk) <= 0)
+            return -1;
+        left -= chunk;
+    }
+    buf[keep] = '\0';
+    return (ssize_t)keep;
+}
+
+#endif /* FRAME_H */
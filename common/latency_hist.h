@@ -0,0 +1,117 @@
+/*
+ * latency_hist.h
+ *
+ * Histograma de latencias al estilo HDR: escala logarítmica con
+ * subdivisiones lineales. Cada potencia de dos se parte en
+ * 2^HIST_SUB_BITS cubetas iguales, así que cualquier valor se guarda con un
+ * error relativo menor que 1/2^HIST_SUB_BITS (~3%) y el histograma entero
+ * ocupa un arreglo fijo, sin reservas al registrar.
+ *
+ * Cada histograma tiene un único escritor (el hilo dueño) y registrar es un
+ * incremento sin instrucciones atómicas: las cargas y almacenamientos
+ * "relaxed" compilan a un mov normal. Otros hilos pueden tomar una copia en
+ * cualquier momento con hist_snapshot() sin detener al escritor; como mucho
+ * la copia mezcla un registro a medias, lo que no importa en estadísticas.
+ */
+
+#ifndef LATENCY_HIST_H
+#define LATENCY_HIST_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define HIST_SUB_BITS 5
+#define HIST_SUB_COUNT (1u << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+    uint64_t sum;
+} LatencyHist;
+
+static inline void hist_reset(LatencyHist *h) {
+    memset(h, 0, sizeof(*h));
+    h->min = UINT64_MAX;
+}
+
+/* hist_index: cubeta de un valor (los menores que HIST_SUB_COUNT son exactos) */
+static inline unsigned hist_index(uint64_t v) {
+    if (v < HIST_SUB_COUNT)
+        return (unsigned)v;
+    unsigned msb = 63 - (unsigned)__builtin_clzll(v);
+    unsigned shift = msb - HIST_SUB_BITS;
+    return ((shift + 1) << HIST_SUB_BITS) + (unsigned)((v >> shift) - HIST_SUB_COUNT);
+}
+
+/* hist_value: valor representativo (el centro) de una cubeta */
+static inline uint64_t hist_value(unsigned idx) {
+    if (idx < HIST_SUB_COUNT)
+        return idx;
+    unsigned shift = (idx >> HIST_SUB_BITS) - 1;
+    uint64_t low = (uint64_t)((idx & (HIST_SUB_COUNT - 1)) + HIST_SUB_COUNT) << shift;
+    return low + ((1ull << shift) >> 1);
+}
+
+/* hist_store / hist_load: acceso de un solo escritor legible desde otros hilos */
+static inline void hist_store(uint64_t *p, uint64_t v) {
+    __atomic_store_n(p, v, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t hist_load(const uint64_t *p) {
+    return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+static inline void hist_record(LatencyHist *h, uint64_t v) {
+    uint64_t *c = &h->counts[hist_index(v)];
+    hist_store(c, hist_load(c) + 1);
+    hist_store(&h->total, hist_load(&h->total) + 1);
+    hist_store(&h->sum, hist_load(&h->sum) + v);
+    if (v < hist_load(&h->min))
+        hist_store(&h->min, v);
+    if (v > hist_load(&h->max))
+        hist_store(&h->max, v);
+}
+
+/* hist_snapshot: copia un histograma que otro hilo puede estar escribiendo */
+static inline void hist_snapshot(LatencyHist *dst, const LatencyHist *src) {
+    for (unsigned i = 0; i < HIST_BUCKETS; i++)
+        dst->counts[i] = hist_load(&src->counts[i]);
+    dst->total = hist_load(&src->total);
+    dst->sum = hist_load(&src->sum);
+    dst->min = hist_load(&src->min);
+    dst->max = hist_load(&src->max);
+}
+
+static inline void hist_merge(LatencyHist *dst, const LatencyHist *src) {
+    for (unsigned i = 0; i < HIST_BUCKETS; i++)
+        dst->counts[i] += src->counts[i];
+    dst->total += src->total;
+    dst->sum += src->sum;
+    if (src->min < dst->min)
+        dst->min = src->min;
+    if (src->max > dst->max)
+        dst->max = src->max;
+}
+
+/* hist_percentile: valor por debajo del cual queda la fracción 'p' (0..1) */
+static inline uint64_t hist_percentile(const LatencyHist *h, double p) {
+    if (h->total == 0)
+        return 0;
+    uint64_t rank = (uint64_t)(p * (double)h->total + 0.5);
+    if (rank == 0)
+        rank = 1;
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank) {
+            uint64_t v = hist_value(i);
+            return v > h->max ? h->max : v;
+        }
+    }
+    return h->max;
+}
+
+#endif /* LATENCY_HIST_H */
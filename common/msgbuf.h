@@ -0,0 +1,158 @@
+/*
+ * msgbuf.h
+ *
+ * Mensaje inmutable con contador de referencias. Cada publicación se copia
+ * una única vez desde el buffer de lectura a un MsgBuf que guarda la trama
+ * completa (cabecera + "topic|message") y su longitud. A partir de ahí todas
+ * las colas de salida y todos los shards comparten el mismo MsgBuf: cada uno
+ * toma una referencia y la suelta cuando termina, y el último lo libera.
+ *
+ * El contador es atómico porque un MsgBuf puede cruzar de un hilo a otro a
+ * través de las colas entre shards.
+ *
+ * Un MsgBuf también puede describir un tramo de un fichero en lugar de bytes
+ * propios (msgbuf_new_file): la cola de salida lo envía con sendfile(), sin
+ * pasar los datos por memoria de usuario, y al soltar la última referencia
+ * se avisa al dueño del fichero.
+ *
+ * Los MsgBuf salen de un MsgPool (common/slab.h) con un pool por clase de
+ * tamaño: 256 bytes, 1 KB, 4 KB... hasta 1 MB, cada clase cuatro veces la
+ * anterior. Un mensaje ocupa el objeto de la clase más pequeña en la que
+ * cabe, así que publicar no llama a malloc() una vez que los pools tienen
+ * objetos libres. Lo que no cabe en la clase mayor, y los MsgBuf creados sin
+ * pool, se reservan con malloc(). El MsgBuf recuerda de qué pool salió y la
+ * última referencia lo devuelve a él, aunque se suelte en otro hilo.
+ */
+
+#ifndef MSGBUF_H
+#define MSGBUF_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "slab.h"
+
+#define MSGBUF_NO_OFFSET UINT64_MAX
+#define MSGBUF_CLASSES 7      /* clases de tamaño de 256 B a 1 MB */
+#define MSGBUF_MIN_CLASS 256  /* bytes de la clase más pequeña (MsgBuf incluido) */
+
+typedef struct {
+    atomic_uint refs;
+    uint32_t topic_len;  /* bytes del topic al principio del contenido */
+    uint32_t len;        /* longitud total de la trama en 'data' */
+    uint32_t header_len; /* bytes de cabecera antes del contenido */
+    int32_t stats_topic; /* posición del topic en las estadísticas, -1 si no tiene */
+    uint64_t rx_ns;      /* instante de recepción, para medir el fanout */
+    uint64_t log_offset; /* posición en el log del topic, MSGBUF_NO_OFFSET si no se guardó */
+    int file_fd;         /* >= 0: el contenido es 'len' bytes del fichero desde file_off */
+    uint64_t file_off;
+    void (*release)(void *arg); /* se llama al liberar un MsgBuf de fichero */
+    void *release_arg;
+    SlabPool *pool;      /* pool del que salió, NULL si se reservó con malloc() */
+    char data[];
+} MsgBuf;
+
+typedef struct {
+    SlabPool classes[MSGBUF_CLASSES];
+    uint64_t *heap_allocs; /* contador externo de reservas al sistema, o NULL */
+} MsgPool;
+
+/* msg_pool_init: prepara las clases; el dueño es el hilo que publique primero */
+static inline void msg_pool_init(MsgPool *mp, uint64_t *heap_allocs) {
+    for (int i = 0; i < MSGBUF_CLASSES; i++)
+        slab_pool_init(&mp->classes[i], (size_t)MSGBUF_MIN_CLASS << (2 * i), heap_allocs);
+    mp->heap_allocs = heap_allocs;
+}
+
+/* msgbuf_alloc: objeto de al menos 'size' bytes de la clase adecuada de 'mp' */
+static inline MsgBuf *msgbuf_alloc(MsgPool *mp, size_t size) {
+    for (int i = 0; mp && i < MSGBUF_CLASSES; i++) {
+        if (size <= mp->classes[i].obj_size) {
+            MsgBuf *m = slab_alloc(&mp->classes[i]);
+            m->pool = &mp->classes[i];
+            return m;
+        }
+    }
+    MsgBuf *m = malloc(size);
+    if (!m) {
+        perror("Error reservando memoria");
+        exit(EXIT_FAILURE);
+    }
+    if (mp && mp->heap_allocs)
+        __atomic_store_n(mp->heap_allocs, *mp->heap_allocs + 1, __ATOMIC_RELAXED);
+    m->pool = NULL;
+    return m;
+}
+
+/*
+ * msgbuf_reserve
+ * - MsgBuf nuevo de 'mp' con una referencia y sitio para una trama de 'len'
+ *   bytes, que el llamador rellena. 'header_len' indica dónde empieza el
+ *   contenido "topic|message". Sólo puede llamarlo el hilo dueño del pool.
+ */
+static inline MsgBuf *msgbuf_reserve(MsgPool *mp, size_t len, size_t header_len, size_t topic_len) {
+    MsgBuf *m = msgbuf_alloc(mp, sizeof(MsgBuf) + len);
+    atomic_init(&m->refs, 1);
+    m->topic_len = (uint32_t)topic_len;
+    m->len = (uint32_t)len;
+    m->header_len = (uint32_t)header_len;
+    m->stats_topic = -1;
+    m->rx_ns = 0;
+    m->log_offset = MSGBUF_NO_OFFSET;
+    m->file_fd = -1;
+    m->file_off = 0;
+    m->release = NULL;
+    m->release_arg = NULL;
+    return m;
+}
+
+/* msgbuf_new: copia 'len' bytes de 'frame' en un MsgBuf nuevo (ver msgbuf_reserve()) */
+static inline MsgBuf *msgbuf_new(MsgPool *mp, const char *frame, size_t len, size_t header_len,
+                                 size_t topic_len) {
+    MsgBuf *m = msgbuf_reserve(mp, len, header_len, topic_len);
+    memcpy(m->data, frame, len);
+    return m;
+}
+
+/*
+ * msgbuf_new_file
+ * - Crea un MsgBuf que representa 'len' bytes de 'fd' a partir de 'off'.
+ *   'release(arg)' se llama cuando se suelta la última referencia, para que
+ *   el dueño del fichero sepa que ya nadie lo está enviando.
+ */
+static inline MsgBuf *msgbuf_new_file(MsgPool *mp, int fd, uint64_t off, size_t len, void (*release)(void *),
+                                      void *arg) {
+    MsgBuf *m = msgbuf_new(mp, "", 0, 0, 0);
+    m->len = (uint32_t)len;
+    m->file_fd = fd;
+    m->file_off = off;
+    m->release = release;
+    m->release_arg = arg;
+    return m;
+}
+
+static inline MsgBuf *msgbuf_ref(MsgBuf *m) {
+    atomic_fetch_add_explicit(&m->refs, 1, memory_order_relaxed);
+    return m;
+}
+
+/* msgbuf_unref: suelta una referencia y libera el mensaje si era la última */
+static inline void msgbuf_unref(MsgBuf *m) {
+    if (atomic_fetch_sub_explicit(&m->refs, 1, memory_order_acq_rel) == 1) {
+        if (m->release)
+            m->release(m->release_arg);
+        if (m->pool)
+            slab_free(m->pool, m);
+        else
+            free(m);
+    }
+}
+
+static inline const char *msgbuf_topic(const MsgBuf *m) {
+    return m->data + m->header_len;
+}
+
+#endif /* MSGBUF_H */
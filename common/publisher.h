@@ -0,0 +1,582 @@
+/*
+ * publisher.h
+ *
+ * Biblioteca de publicación para los clientes de los brokers (TCP y UDP).
+ * publisher_publish() nunca bloquea ni hace una llamada al sistema por
+ * mensaje: añade la trama a un buffer y el buffer se envía entero cuando
+ * acumula 'flush_bytes' o cuando su mensaje más antiguo lleva 'flush_ns'
+ * esperando, lo que ocurra antes. Así un productor con mucho tráfico paga
+ * un send() por lote y uno con poco tráfico no espera más que el plazo.
+ *
+ * - TCP: el buffer guarda las tramas con su cabecera (common/frame.h) y se
+ *   envía con un único send(). El socket lleva TCP_NODELAY: el lote ya se
+ *   forma aquí, y con Nagle el final de cada lote podría quedarse esperando
+ *   el ACK del anterior (hasta 40 ms con ACK retardado). No se usa TCP_CORK
+ *   porque cada lote sale en una sola llamada; taponar el socket sólo
+ *   añadiría dos setsockopt() por lote sin juntar nada más.
+ * - UDP: cada mensaje es un datagrama; el lote sale con un sendmmsg() por
+ *   cada PUBLISHER_UDP_BATCH datagramas, desde el mismo buffer (se salta la
+ *   cabecera de longitud, que UDP no necesita).
+ *
+ * Se pueden configurar varios brokers (publisher_add_endpoint()). Si la
+ * conexión falla o se cae, el publicador pasa al siguiente y reintenta con
+ * espera exponencial (con algo de azar para que muchos clientes no
+ * reconecten a la vez). Lo pendiente se conserva hasta 'max_buffer' bytes;
+ * la trama que quedó a medio enviar se reenvía entera, porque el broker
+ * descarta las tramas incompletas al cerrarse la conexión.
+ *
+ * Todo ocurre en el hilo que llama: la aplicación integra el publicador en
+ * su propio bucle con publisher_events() / publisher_timeout_ns() /
+ * publisher_service(), o llama a publisher_poll() si no tiene bucle.
+ * publisher_run_lines() es un bucle así ya hecho, el de los publicadores de
+ * línea de comandos: publica las líneas "tema|mensaje" de un descriptor.
+ *
+ * Usa sendmmsg() y ppoll(), extensiones de Linux: el programa que lo
+ * incluya debe definir _GNU_SOURCE antes de cualquier #include.
+ */
+
+#ifndef PUBLISHER_H
+#define PUBLISHER_H
+
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "frame.h"
+
+#define PUBLISHER_DEFAULT_FLUSH_BYTES (64 * 1024)
+#define PUBLISHER_DEFAULT_FLUSH_US 1000
+#define PUBLISHER_DEFAULT_MAX_BUFFER (4u << 20)
+#define PUBLISHER_BACKOFF_MIN_NS (50 * 1000000ull)
+#define PUBLISHER_BACKOFF_MAX_NS (5 * 1000000000ull)
+#define PUBLISHER_CONNECT_TIMEOUT_NS (2 * 1000000000ull)
+#define PUBLISHER_UDP_BATCH 64
+#define PUBLISHER_UDP_MAX (65507 - 9) /* datagrama IPv4 menos la cabecera de secuencia del broker */
+#define PUBLISHER_LINE_MAX 65536       /* publisher_run_lines(): una línea más larga se parte */
+#define PUBLISHER_DRAIN_TIMEOUT_NS (5 * 1000000000ll) /* publisher_run_lines(): espera máxima al terminar */
+
+typedef enum { PUBLISHER_TCP, PUBLISHER_UDP } PublisherProto;
+
+typedef enum { PUB_DISCONNECTED, PUB_CONNECTING, PUB_CONNECTED } PublisherState;
+
+typedef struct {
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    char name[128]; /* "host:puerto", para los mensajes */
+} PublisherEndpoint;
+
+typedef struct {
+    PublisherProto proto;
+    PublisherEndpoint *endpoints;
+    size_t endpoint_count;
+    size_t current;         /* broker al que se conecta o está conectado */
+
+    int fd;
+    PublisherState state;
+    int blocked;            /* el socket se llenó: esperar POLLOUT */
+
+    /* Tramas pendientes: [head, len) está por enviar y 'sent' marca lo que
+     * ya aceptó el kernel. 'head' siempre es el principio de una trama. */
+    char *buf;
+    size_t head, sent, len, cap;
+    uint64_t oldest_ns;     /* llegada del mensaje pendiente más antiguo, 0 si no hay */
+
+    size_t flush_bytes;     /* enviar al acumular estos bytes */
+    uint64_t flush_ns;      /* o cuando el más antiguo lleve esto esperando */
+    size_t max_buffer;      /* bytes pendientes como máximo */
+
+    uint64_t backoff_ns;    /* espera antes del próximo intento */
+    uint64_t retry_at_ns;   /* DISCONNECTED: cuándo reintentar; CONNECTING: plazo */
+    int connected_once;
+
+    /* Contadores */
+    uint64_t published;     /* mensajes aceptados por publisher_publish() */
+    uint64_t rejected;      /* rechazados por buffer lleno o tamaño */
+    uint64_t batches;       /* llamadas de envío que escribieron algo */
+    uint64_t reconnects;
+} Publisher;
+
+static inline uint64_t publisher_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static inline void publisher_init(Publisher *p, PublisherProto proto) {
+    memset(p, 0, sizeof(*p));
+    p->proto = proto;
+    p->fd = -1;
+    p->state = PUB_DISCONNECTED;
+    p->flush_bytes = PUBLISHER_DEFAULT_FLUSH_BYTES;
+    p->flush_ns = PUBLISHER_DEFAULT_FLUSH_US * 1000ull;
+    p->max_buffer = PUBLISHER_DEFAULT_MAX_BUFFER;
+    p->backoff_ns = PUBLISHER_BACKOFF_MIN_NS;
+}
+
+/*
+ * publisher_add_endpoint
+ * - Añade un broker "host:puerto" (el host puede ser un nombre). Los
+ *   brokers se prueban en el orden en que se añadieron. Devuelve -1 si la
+ *   dirección no se puede resolver.
+ */
+static inline int publisher_add_endpoint(Publisher *p, const char *spec) {
+    char host[128];
+    const char *colon = strrchr(spec, ':');
+    if (!colon || colon == spec || (size_t)(colon - spec) >= sizeof(host)) {
+        fprintf(stderr, "Broker inválido (se espera host:puerto): %s\n", spec);
+        return -1;
+    }
+    memcpy(host, spec, colon - spec);
+    host[colon - spec] = '\0';
+
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_flags = AI_NUMERICSERV,
+                              .ai_socktype = p->proto == PUBLISHER_TCP ? SOCK_STREAM : SOCK_DGRAM };
+    struct addrinfo *res;
+    int rc = getaddrinfo(host, colon + 1, &hints, &res);
+    if (rc != 0) {
+        fprintf(stderr, "No se pudo resolver %s: %s\n", spec, gai_strerror(rc));
+        return -1;
+    }
+
+    PublisherEndpoint *grown = realloc(p->endpoints, (p->endpoint_count + 1) * sizeof(PublisherEndpoint));
+    if (!grown) {
+        perror("Error reservando memoria");
+        exit(EXIT_FAILURE);
+    }
+    p->endpoints = grown;
+    PublisherEndpoint *e = &p->endpoints[p->endpoint_count++];
+    memcpy(&e->addr, res->ai_addr, res->ai_addrlen);
+    e->addr_len = res->ai_addrlen;
+    snprintf(e->name, sizeof(e->name), "%s", spec);
+    freeaddrinfo(res);
+    return 0;
+}
+
+/* publisher_pending: bytes que todavía no aceptó el kernel */
+static inline size_t publisher_pending(const Publisher *p) {
+    return p->len - p->sent;
+}
+
+/*
+ * publisher_fail
+ * - La conexión actual falló: cerrarla, volver al principio de la trama a
+ *   medio enviar y programar el intento con el siguiente broker.
+ */
+static inline void publisher_fail(Publisher *p, const char *why) {
+    if (p->fd >= 0) {
+        fprintf(stderr, "Publisher: %s con %s: %s\n", why, p->endpoints[p->current].name, strerror(errno));
+        close(p->fd);
+        p->fd = -1;
+    }
+    p->state = PUB_DISCONNECTED;
+    p->blocked = 0;
+    p->sent = p->head;
+    p->current = (p->current + 1) % p->endpoint_count;
+
+    uint64_t half = p->backoff_ns / 2;
+    p->retry_at_ns = publisher_now_ns() + half + (uint64_t)rand() % (half + 1);
+    p->backoff_ns = p->backoff_ns * 2 > PUBLISHER_BACKOFF_MAX_NS ? PUBLISHER_BACKOFF_MAX_NS : p->backoff_ns * 2;
+}
+
+static inline void publisher_connected(Publisher *p) {
+    p->state = PUB_CONNECTED;
+    p->backoff_ns = PUBLISHER_BACKOFF_MIN_NS;
+    if (p->connected_once)
+        p->reconnects++;
+    p->connected_once = 1;
+}
+
+/* publisher_connect: inicia una conexión no bloqueante con el broker actual */
+static inline void publisher_connect(Publisher *p) {
+    if (p->endpoint_count == 0)
+        return;
+    const PublisherEndpoint *e = &p->endpoints[p->current];
+    int type = p->proto == PUBLISHER_TCP ? SOCK_STREAM : SOCK_DGRAM;
+    p->fd = socket(e->addr.ss_family, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (p->fd < 0) {
+        publisher_fail(p, "error creando socket");
+        return;
+    }
+    if (p->proto == PUBLISHER_TCP) {
+        int one = 1;
+        setsockopt(p->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    /* En UDP connect() sólo fija el destino: sendmmsg() no necesita direcciones */
+    if (connect(p->fd, (const struct sockaddr *)&e->addr, e->addr_len) == 0) {
+        publisher_connected(p);
+    } else if (errno == EINPROGRESS) {
+        p->state = PUB_CONNECTING;
+        p->retry_at_ns = publisher_now_ns() + PUBLISHER_CONNECT_TIMEOUT_NS;
+    } else {
+        publisher_fail(p, "conexión fallida");
+    }
+}
+
+/* publisher_advance: 'n' bytes más aceptados; avanza 'head' por las tramas completas */
+static inline void publisher_advance(Publisher *p, size_t n) {
+    p->sent += n;
+    while (p->head < p->sent) {
+        size_t frame = FRAME_HEADER_SIZE + frame_get_header((const unsigned char *)p->buf + p->head);
+        if (p->head + frame > p->sent)
+            break;
+        p->head += frame;
+    }
+    if (p->head == p->len) {
+        p->head = p->sent = p->len = 0;
+        p->oldest_ns = 0;
+    }
+}
+
+/* publisher_write_udp: un datagrama por trama, en lotes de sendmmsg() */
+static inline ssize_t publisher_write_udp(Publisher *p) {
+    struct mmsghdr msgs[PUBLISHER_UDP_BATCH];
+    struct iovec iov[PUBLISHER_UDP_BATCH];
+    size_t sizes[PUBLISHER_UDP_BATCH];
+    int count = 0;
+    for (size_t off = p->sent; off < p->len && count < PUBLISHER_UDP_BATCH; count++) {
+        uint32_t len = frame_get_header((const unsigned char *)p->buf + off);
+        iov[count].iov_base = p->buf + off + FRAME_HEADER_SIZE;
+        iov[count].iov_len = len;
+        memset(&msgs[count], 0, sizeof(msgs[count]));
+        msgs[count].msg_hdr.msg_iov = &iov[count];
+        msgs[count].msg_hdr.msg_iovlen = 1;
+        sizes[count] = FRAME_HEADER_SIZE + len;
+        off += sizes[count];
+    }
+    int n = sendmmsg(p->fd, msgs, (unsigned)count, MSG_DONTWAIT);
+    if (n <= 0)
+        return n;
+    size_t bytes = 0;
+    for (int i = 0; i < n; i++)
+        bytes += sizes[i];
+    return (ssize_t)bytes;
+}
+
+/*
+ * publisher_flush
+ * - Envía todo lo pendiente que acepte el socket, sin bloquear. Devuelve 0
+ *   si todo salió o el socket se llenó y -1 si la conexión falló (lo
+ *   pendiente se conserva para el siguiente broker).
+ */
+static inline int publisher_flush(Publisher *p) {
+    if (p->state == PUB_DISCONNECTED && p->endpoint_count > 0 && publisher_now_ns() >= p->retry_at_ns)
+        publisher_connect(p);
+    while (p->state == PUB_CONNECTED && publisher_pending(p) > 0) {
+        ssize_t n;
+        if (p->proto == PUBLISHER_TCP)
+            n = send(p->fd, p->buf + p->sent, publisher_pending(p), MSG_NOSIGNAL | MSG_DONTWAIT);
+        else
+            n = publisher_write_udp(p);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+                p->blocked = 1;
+                return 0;
+            }
+            /* En UDP, ECONNREFUSED es el aviso ICMP de un datagrama anterior */
+            if (p->proto == PUBLISHER_UDP && errno == ECONNREFUSED)
+                continue;
+            publisher_fail(p, "error enviando");
+            return -1;
+        }
+        p->batches++;
+        publisher_advance(p, (size_t)n);
+    }
+    return 0;
+}
+
+/*
+ * publisher_publish
+ * - Encola "topic|payload" para enviarlo en el próximo lote y, si el lote
+ *   ya alcanzó 'flush_bytes', lo envía. No bloquea nunca. Devuelve 0 si el
+ *   mensaje se aceptó y -1 (errno EMSGSIZE o ENOBUFS) si no cabe en una
+ *   trama o el buffer de pendientes está lleno; en ese caso es el llamador
+ *   quien decide si descartarlo o esperar con publisher_poll().
+ */
+static inline int publisher_publish(Publisher *p, const char *topic, size_t topic_len,
+                                    const char *payload, size_t payload_len) {
+    size_t body = topic_len + 1 + payload_len;
+    size_t frame = FRAME_HEADER_SIZE + body;
+    if (body > FRAME_MAX_PAYLOAD || (p->proto == PUBLISHER_UDP && body > PUBLISHER_UDP_MAX)) {
+        p->rejected++;
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if (p->len - p->head + frame > p->max_buffer) {
+        publisher_flush(p);
+        if (p->len - p->head + frame > p->max_buffer) {
+            p->rejected++;
+            errno = ENOBUFS;
+            return -1;
+        }
+    }
+
+    if (p->len + frame > p->cap) {
+        /* Descartar primero las tramas ya enviadas del principio */
+        if (p->head > 0) {
+            memmove(p->buf, p->buf + p->head, p->len - p->head);
+            p->len -= p->head;
+            p->sent -= p->head;
+            p->head = 0;
+        }
+        if (p->len + frame > p->cap) {
+            size_t cap = p->cap ? p->cap : 4096;
+            while (cap < p->len + frame)
+                cap *= 2;
+            char *grown = realloc(p->buf, cap);
+            if (!grown) {
+                perror("Error reservando memoria");
+                exit(EXIT_FAILURE);
+            }
+            p->buf = grown;
+            p->cap = cap;
+        }
+    }
+
+    char *out = p->buf + p->len;
+    frame_put_header((unsigned char *)out, (uint32_t)body);
+    memcpy(out + FRAME_HEADER_SIZE, topic, topic_len);
+    out[FRAME_HEADER_SIZE + topic_len] = '|';
+    memcpy(out + FRAME_HEADER_SIZE + topic_len + 1, payload, payload_len);
+    p->len += frame;
+    if (p->oldest_ns == 0)
+        p->oldest_ns = publisher_now_ns();
+    p->published++;
+
+    if (!p->blocked && publisher_pending(p) >= p->flush_bytes)
+        publisher_flush(p);
+    return 0;
+}
+
+/* publisher_events: eventos de poll() que interesan en el descriptor del publicador */
+static inline short publisher_events(const Publisher *p) {
+    switch (p->state) {
+    case PUB_CONNECTING:
+        return POLLOUT;
+    case PUB_CONNECTED:
+        /* POLLIN en TCP sólo sirve para enterarse de que el broker cerró */
+        return (p->proto == PUBLISHER_TCP ? POLLIN : 0) | (p->blocked ? POLLOUT : 0);
+    default:
+        return 0;
+    }
+}
+
+/*
+ * publisher_timeout_ns
+ * - Cuánto puede dormir el bucle del llamador antes de volver a llamar a
+ *   publisher_service(): hasta el plazo del lote pendiente, el próximo
+ *   reintento de conexión o el plazo de la conexión en curso. -1 si sólo
+ *   hay que esperar eventos del descriptor (o nada).
+ */
+static inline int64_t publisher_timeout_ns(const Publisher *p) {
+    uint64_t at;
+    if (p->state == PUB_CONNECTED) {
+        if (publisher_pending(p) == 0 || p->blocked)
+            return -1;
+        at = p->oldest_ns + p->flush_ns;
+    } else if (p->state == PUB_DISCONNECTED && p->endpoint_count == 0) {
+        return -1;
+    } else {
+        at = p->retry_at_ns;
+    }
+    uint64_t now = publisher_now_ns();
+    return at > now ? (int64_t)(at - now) : 0;
+}
+
+/*
+ * publisher_service
+ * - Avanza el publicador con los eventos 'revents' de su descriptor (0 si
+ *   sólo venció el plazo): completa o reintenta conexiones, detecta que el
+ *   broker cerró y envía el lote cuando toca.
+ */
+static inline void publisher_service(Publisher *p, short revents) {
+    uint64_t now = publisher_now_ns();
+
+    if (p->state == PUB_DISCONNECTED && now >= p->retry_at_ns)
+        publisher_connect(p);
+
+    if (p->state == PUB_CONNECTING) {
+        if (revents & (POLLOUT | POLLERR | POLLHUP)) {
+            int err = 0;
+            socklen_t len = sizeof(err);
+            getsockopt(p->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+            if (err == 0) {
+                publisher_connected(p);
+            } else {
+                errno = err;
+                publisher_fail(p, "conexión fallida");
+            }
+        } else if (now >= p->retry_at_ns) {
+            errno = ETIMEDOUT;
+            publisher_fail(p, "conexión fallida");
+        }
+        revents = 0;
+    }
+
+    if (p->state != PUB_CONNECTED)
+        return;
+    if (p->proto == PUBLISHER_TCP && (revents & (POLLIN | POLLHUP | POLLERR))) {
+        char discard[4096];
+        ssize_t n;
+        while ((n = recv(p->fd, discard, sizeof(discard), MSG_DONTWAIT)) > 0)
+            ;
+        if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            if (n == 0)
+                errno = ECONNRESET;
+            publisher_fail(p, "el broker cerró la conexión");
+            return;
+        }
+    }
+    if (revents & POLLOUT)
+        p->blocked = 0;
+    if (!p->blocked && publisher_pending(p) > 0 &&
+        (publisher_pending(p) >= p->flush_bytes || now >= p->oldest_ns + p->flush_ns))
+        publisher_flush(p);
+}
+
+/*
+ * publisher_poll
+ * - Para aplicaciones sin bucle de eventos propio: espera como mucho
+ *   'timeout_ns' (-1 = sin límite) a que el publicador tenga algo que hacer
+ *   y lo hace.
+ */
+static inline void publisher_poll(Publisher *p, int64_t timeout_ns) {
+    int64_t own = publisher_timeout_ns(p);
+    if (own >= 0 && (timeout_ns < 0 || own < timeout_ns))
+        timeout_ns = own;
+    struct pollfd pfd = { .fd = p->fd, .events = publisher_events(p) };
+    struct timespec ts = { (time_t)(timeout_ns / 1000000000), (long)(timeout_ns % 1000000000) };
+    int n = ppoll(&pfd, 1, timeout_ns >= 0 ? &ts : NULL, NULL);
+    publisher_service(p, n > 0 ? pfd.revents : 0);
+}
+
+/*
+ * publisher_drain
+ * - Espera como mucho 'timeout_ns' a que salga todo lo pendiente (por
+ *   ejemplo, antes de terminar). Devuelve 0 si no quedó nada pendiente.
+ */
+static inline int publisher_drain(Publisher *p, int64_t timeout_ns) {
+    uint64_t deadline = publisher_now_ns() + (uint64_t)timeout_ns;
+    while (1) {
+        if (p->state == PUB_CONNECTED && !p->blocked)
+            publisher_flush(p);
+        if (publisher_pending(p) == 0)
+            return 0;
+        uint64_t now = publisher_now_ns();
+        if (now >= deadline)
+            return -1;
+        publisher_poll(p, (int64_t)(deadline - now));
+    }
+}
+
+/*
+ * publisher_publish_line
+ * - Publica una línea "tema|mensaje". Si el buffer de pendientes está lleno
+ *   espera a que se vacíe: en la línea de comandos es mejor frenar la
+ *   lectura que descartar mensajes.
+ */
+static inline void publisher_publish_line(Publisher *p, const char *line, size_t len) {
+    const char *sep = memchr(line, '|', len);
+    if (!sep) {
+        fprintf(stderr, "Formato: tema|mensaje (ejemplo: partido1|Gol minuto 32)\n");
+        return;
+    }
+    while (publisher_publish(p, line, sep - line, sep + 1, len - (sep - line) - 1) < 0) {
+        if (errno != ENOBUFS) {
+            perror("Mensaje descartado");
+            return;
+        }
+        publisher_poll(p, -1);
+    }
+}
+
+/*
+ * publisher_run_lines
+ * - Publica cada línea que llega por 'fd' hasta el final de la entrada o
+ *   una línea "exit", esperando con un solo ppoll() a la vez la entrada, el
+ *   socket del broker y el plazo del lote. Si 'fd' es un terminal muestra
+ *   "> " antes de cada lectura. Al terminar espera a que salga lo pendiente
+ *   (como mucho PUBLISHER_DRAIN_TIMEOUT_NS); devuelve -1 si algo no salió.
+ */
+static inline int publisher_run_lines(Publisher *p, int fd) {
+    static char line[PUBLISHER_LINE_MAX];
+    size_t line_len = 0;
+    int interactive = isatty(fd), eof = 0, quit = 0;
+    if (interactive) {
+        printf("> ");
+        fflush(stdout);
+    }
+    while (!eof && !quit) {
+        struct pollfd fds[2] = {
+            { .fd = fd, .events = POLLIN },
+            { .fd = p->fd, .events = publisher_events(p) },
+        };
+        int64_t wait = publisher_timeout_ns(p);
+        struct timespec ts = { (time_t)(wait / 1000000000), (long)(wait % 1000000000) };
+        if (ppoll(fds, 2, wait >= 0 ? &ts : NULL, NULL) < 0 && errno != EINTR) {
+            perror("Error en ppoll");
+            break;
+        }
+
+        if (fds[0].revents & (POLLIN | POLLHUP)) {
+            ssize_t n = read(fd, line + line_len, sizeof(line) - line_len);
+            if (n <= 0) {
+                eof = 1;
+                n = 0;
+            }
+            line_len += (size_t)n;
+
+            /* Publicar cada línea completa; una línea que llena el buffer se envía tal cual */
+            size_t start = 0;
+            while (!quit && start < line_len) {
+                char *nl = memchr(line + start, '\n', line_len - start);
+                if (!nl && !(start == 0 && line_len == sizeof(line)))
+                    break;
+                size_t len = nl ? (size_t)(nl - line - start) : line_len;
+                if (len == 4 && memcmp(line + start, "exit", 4) == 0)
+                    quit = 1;
+                else
+                    publisher_publish_line(p, line + start, len);
+                start += len + (nl ? 1 : 0);
+            }
+            memmove(line, line + start, line_len - start);
+            line_len -= start;
+            if (interactive && !eof && !quit) {
+                printf("> ");
+                fflush(stdout);
+            }
+        }
+        publisher_service(p, fds[1].revents);
+    }
+
+    /* Lo que quedara sin terminar en salto de línea también es un mensaje */
+    if (eof && line_len > 0 && !(line_len == 4 && memcmp(line, "exit", 4) == 0))
+        publisher_publish_line(p, line, line_len);
+    if (publisher_drain(p, PUBLISHER_DRAIN_TIMEOUT_NS) < 0) {
+        fprintf(stderr, "No se pudieron enviar %zu bytes pendientes\n", publisher_pending(p));
+        return -1;
+    }
+    return 0;
+}
+
+static inline void publisher_free(Publisher *p) {
+    if (p->fd >= 0)
+        close(p->fd);
+    free(p->buf);
+    free(p->endpoints);
+    memset(p, 0, sizeof(*p));
+    p->fd = -1;
+}
+
+#endif /* PUBLISHER_H */
@@ -0,0 +1,137 @@
+/*
+ * slab.h
+ *
+ * Pools de objetos de tamaño fijo para los registros que los brokers crean y
+ * destruyen sin parar: conexiones, suscripciones, clientes y mensajes. Un
+ * SlabPool pide memoria al sistema en bloques de muchos objetos y guarda los
+ * que se liberan en una lista libre, así que en régimen estable reservar o
+ * liberar un objeto es sacar o meter un puntero en una lista, sin pasar por
+ * malloc()/free() ni por sus locks.
+ *
+ * Cada pool tiene un hilo dueño (el primero que reserva de él), que es el
+ * único que reserva. Liberar puede hacerse desde cualquier hilo: el dueño
+ * usa su lista libre directamente y los demás apilan el objeto en una pila
+ * atómica ('remote', push con CAS) que el dueño recoge entera con un solo
+ * intercambio cuando se le acaba la lista propia. Como el dueño nunca saca
+ * elementos sueltos de la pila, no hay problema ABA.
+ *
+ * Los bloques no se devuelven al sistema: el pool se queda con el máximo de
+ * objetos que llegó a tener vivos a la vez.
+ */
+
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SLAB_BLOCK_BYTES (64 * 1024) /* memoria pedida al sistema de una vez */
+#define SLAB_ALIGN 16
+
+typedef struct SlabFree {
+    struct SlabFree *next;
+} SlabFree;
+
+typedef struct SlabBlock {
+    struct SlabBlock *next; /* sólo para que los bloques sigan localizables */
+    _Alignas(SLAB_ALIGN) char data[];
+} SlabBlock;
+
+typedef struct {
+    size_t obj_size;             /* bytes de cada objeto, múltiplo de SLAB_ALIGN */
+    size_t per_block;            /* objetos por bloque */
+    SlabFree *free;              /* lista libre del dueño */
+    _Atomic(SlabFree *) remote;  /* liberados por otros hilos */
+    const void *owner;           /* marca del hilo dueño (ver slab_thread()) */
+    SlabBlock *blocks;
+    uint64_t *heap_allocs;       /* contador externo de reservas al sistema, o NULL */
+} SlabPool;
+
+/* slab_thread: identifica al hilo actual por la dirección de una variable propia */
+static inline const void *slab_thread(void) {
+    static __thread char tag;
+    return &tag;
+}
+
+/*
+ * slab_pool_init
+ * - Prepara un pool de objetos de 'size' bytes. 'heap_allocs', si no es
+ *   NULL, se incrementa cada vez que el pool pide memoria al sistema (lo
+ *   escribe sólo el dueño, como los contadores de common/stats.h).
+ */
+static inline void slab_pool_init(SlabPool *p, size_t size, uint64_t *heap_allocs) {
+    p->obj_size = (size + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1);
+    p->per_block = SLAB_BLOCK_BYTES / p->obj_size;
+    if (p->per_block == 0)
+        p->per_block = 1;
+    p->free = NULL;
+    atomic_init(&p->remote, NULL);
+    p->owner = NULL;
+    p->blocks = NULL;
+    p->heap_allocs = heap_allocs;
+}
+
+/* slab_grow: pide un bloque nuevo y mete todos sus objetos en la lista libre */
+static inline void slab_grow(SlabPool *p) {
+    SlabBlock *b = malloc(sizeof(SlabBlock) + p->per_block * p->obj_size);
+    if (!b) {
+        perror("Error reservando memoria");
+        exit(EXIT_FAILURE);
+    }
+    b->next = p->blocks;
+    p->blocks = b;
+    for (size_t i = p->per_block; i-- > 0;) {
+        SlabFree *f = (SlabFree *)(b->data + i * p->obj_size);
+        f->next = p->free;
+        p->free = f;
+    }
+    if (p->heap_allocs)
+        __atomic_store_n(p->heap_allocs, *p->heap_allocs + 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * slab_alloc
+ * - Devuelve un objeto sin inicializar. Sólo lo llama el hilo dueño: primero
+ *   la lista propia, después lo que hayan devuelto otros hilos y, sólo si
+ *   ambas están vacías, un bloque nuevo.
+ */
+static inline void *slab_alloc(SlabPool *p) {
+    if (!p->owner)
+        p->owner = slab_thread();
+    if (!p->free) {
+        p->free = atomic_exchange_explicit(&p->remote, NULL, memory_order_acquire);
+        if (!p->free)
+            slab_grow(p);
+    }
+    SlabFree *f = p->free;
+    p->free = f->next;
+    return f;
+}
+
+/* slab_free: devuelve el objeto a su pool desde cualquier hilo */
+static inline void slab_free(SlabPool *p, void *obj) {
+    SlabFree *f = obj;
+    if (p->owner == slab_thread()) {
+        f->next = p->free;
+        p->free = f;
+        return;
+    }
+    SlabFree *head = atomic_load_explicit(&p->remote, memory_order_relaxed);
+    do {
+        f->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&p->remote, &head, f, memory_order_release,
+                                                    memory_order_relaxed));
+}
+
+/* slab_calloc: slab_alloc() con el objeto a cero, como calloc(1, size) */
+static inline void *slab_calloc(SlabPool *p, size_t size) {
+    void *obj = slab_alloc(p);
+    memset(obj, 0, size);
+    return obj;
+}
+
+#endif /* SLAB_H */
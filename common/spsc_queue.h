@@ -0,0 +1,74 @@
+/*
+ * spsc_queue.h
+ *
+ * Cola sin bloqueos de un único productor y un único consumidor. Es el canal
+ * entre dos hilos del broker: el productor sólo escribe 'tail' y el
+ * consumidor sólo escribe 'head', así que basta con cargas/almacenamientos
+ * atómicos con semántica acquire/release, sin mutex ni CAS.
+ *
+ * Cada índice vive en su propia línea de caché y cada lado guarda una copia
+ * del índice contrario para no leer la línea del otro hilo en cada operación.
+ */
+
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define SPSC_CACHE_LINE 64
+
+typedef struct {
+    _Alignas(SPSC_CACHE_LINE) atomic_size_t head; /* escrito por el consumidor */
+    size_t cached_tail;                            /* copia local del consumidor */
+    _Alignas(SPSC_CACHE_LINE) atomic_size_t tail; /* escrito por el productor */
+    size_t cached_head;                            /* copia local del productor */
+    _Alignas(SPSC_CACHE_LINE) size_t mask;
+    void **slots;
+} SpscQueue;
+
+/* spsc_init: 'capacity' se redondea a la siguiente potencia de dos */
+static inline void spsc_init(SpscQueue *q, size_t capacity) {
+    size_t cap = 2;
+    while (cap < capacity)
+        cap *= 2;
+    q->slots = calloc(cap, sizeof(void *));
+    if (!q->slots) {
+        perror("Error reservando memoria");
+        exit(EXIT_FAILURE);
+    }
+    q->mask = cap - 1;
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    q->cached_head = q->cached_tail = 0;
+}
+
+/* spsc_push: sólo el productor. Devuelve -1 si la cola está llena. */
+static inline int spsc_push(SpscQueue *q, void *item) {
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    if (tail - q->cached_head > q->mask) {
+        q->cached_head = atomic_load_explicit(&q->head, memory_order_acquire);
+        if (tail - q->cached_head > q->mask)
+            return -1;
+    }
+    q->slots[tail & q->mask] = item;
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+    return 0;
+}
+
+/* spsc_pop: sólo el consumidor. Devuelve NULL si la cola está vacía. */
+static inline void *spsc_pop(SpscQueue *q) {
+    size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    if (head == q->cached_tail) {
+        q->cached_tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+        if (head == q->cached_tail)
+            return NULL;
+    }
+    void *item = q->slots[head & q->mask];
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+    return item;
+}
+
+#endif /* SPSC_QUEUE_H */
@@ -0,0 +1,243 @@
+/*
+ * stats.h
+ *
+ * Instrumentación siempre activa de los brokers. Cada hilo de eventos tiene
+ * su propio BrokerStats y es el único que lo escribe, así que incrementar un
+ * contador no usa instrucciones atómicas con lock ni comparte líneas de
+ * caché con otros hilos: stat_add() es una carga y un almacenamiento
+ * "relaxed". El comando STATS suma los BrokerStats de todos los hilos
+ * leyéndolos en el momento, sin pedirles nada ni detenerlos.
+ *
+ * Los contadores por topic se indexan con la posición del topic en un
+ * registro global de nombres (StatsTopicTable), de tamaño fijo e insertable
+ * desde cualquier hilo sin locks. Como sus posiciones nunca cambian, cada
+ * hilo guarda sus contadores en arreglos propios del mismo tamaño. Los
+ * topics que no caben en el registro sólo cuentan en los totales.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "latency_hist.h"
+#include "topic_table.h"
+
+#define STATS_MAX_TOPICS 4096 /* potencia de dos; se llena hasta el 75% */
+
+enum { STATS_SLOT_EMPTY, STATS_SLOT_WRITING, STATS_SLOT_READY };
+
+typedef struct {
+    uint32_t state;      /* STATS_SLOT_*, se publica con release */
+    uint32_t hash;
+    size_t len;
+    char *name;
+} StatsTopic;
+
+typedef struct {
+    StatsTopic slots[STATS_MAX_TOPICS];
+    uint32_t count;
+} StatsTopicTable;
+
+typedef struct {
+    uint64_t msgs_in;      /* publicaciones recibidas */
+    uint64_t bytes_in;
+    uint64_t msgs_out;     /* entregas a suscriptores */
+    uint64_t bytes_out;
+    uint64_t drops;        /* mensajes descartados por colas llenas */
+    uint64_t disconnects;  /* suscriptores desconectados por la política de cola */
+    uint64_t conns;        /* conexiones abiertas (indicador, no acumulado) */
+    uint64_t subs;         /* suscripciones activas (indicador) */
+    uint64_t nacks;        /* NACKs recibidos (broker UDP) */
+    uint64_t retransmits;  /* mensajes reenviados por NACK (broker UDP) */
+    uint64_t leases_renewed; /* renovaciones de lease (broker UDP) */
+    uint64_t leases_expired; /* clientes dados de baja por no renovar (broker UDP) */
+    uint64_t subs_rejected;  /* suscripciones rechazadas por registro lleno (broker UDP) */
+    uint64_t mcast_out;      /* envíos a grupos multicast (broker UDP) */
+    uint64_t fed_in;         /* publicaciones recibidas de otros brokers (federación TCP) */
+    uint64_t fed_out;        /* publicaciones reenviadas a otros brokers */
+    uint64_t fed_duplicates; /* publicaciones de otros brokers que ya habían llegado */
+    uint64_t last_values;    /* últimos valores enviados al suscribirse (broker TCP, -V) */
+    uint64_t conflated;      /* tramas pendientes sustituidas por otra más nueva (CONFLATE) */
+    uint64_t read_deferred;  /* turnos en que una conexión agotó su presupuesto de lectura (broker TCP, -b) */
+    uint64_t rate_pauses;    /* pausas de lectura de un publicador por -l/-T (broker TCP) */
+    uint64_t log_dropped;    /* registros descartados con el anillo del registro lleno (common/async_log.h) */
+    uint64_t heap_allocs;    /* memoria pedida al sistema por los pools (common/slab.h) */
+    uint64_t syscalls;       /* llamadas al sistema del camino de datos (E/S y esperas) */
+    uint64_t *topic_in;    /* por posición en StatsTopicTable */
+    uint64_t *topic_out;
+    LatencyHist fanout;    /* ns desde la recepción hasta el último envío */
+} BrokerStats;
+
+static inline uint64_t stats_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static inline void stat_add(uint64_t *c, uint64_t n) {
+    hist_store(c, hist_load(c) + n);
+}
+
+static inline void stat_set(uint64_t *c, uint64_t v) {
+    hist_store(c, v);
+}
+
+static inline void stats_init(BrokerStats *st) {
+    memset(st, 0, sizeof(*st));
+    hist_reset(&st->fanout);
+    st->topic_in = calloc(STATS_MAX_TOPICS, sizeof(uint64_t));
+    st->topic_out = calloc(STATS_MAX_TOPICS, sizeof(uint64_t));
+    if (!st->topic_in || !st->topic_out) {
+        perror("Error reservando memoria");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * stats_topic_index
+ * - Devuelve la posición del topic en el registro, insertándolo si no
+ *   estaba, o -1 si el registro está lleno. Una posición se reclama con un
+ *   CAS de EMPTY a WRITING y se publica como READY cuando el nombre ya está
+ *   copiado; quien encuentra una posición a medio escribir espera a que se
+ *   publique para comparar el nombre.
+ */
+static inline int stats_topic_index(StatsTopicTable *t, const char *name, size_t len) {
+    uint32_t hash = topic_hash(name, len);
+    const uint32_t mask = STATS_MAX_TOPICS - 1;
+    for (uint32_t i = hash & mask, probes = 0; probes < STATS_MAX_TOPICS; i = (i + 1) & mask, probes++) {
+        StatsTopic *s = &t->slots[i];
+        uint32_t state = __atomic_load_n(&s->state, __ATOMIC_ACQUIRE);
+        if (state == STATS_SLOT_EMPTY) {
+            if (__atomic_load_n(&t->count, __ATOMIC_RELAXED) * 4 >= STATS_MAX_TOPICS * 3)
+                return -1;
+            uint32_t expected = STATS_SLOT_EMPTY;
+            if (__atomic_compare_exchange_n(&s->state, &expected, STATS_SLOT_WRITING, 0,
+                                            __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+                s->name = topic_alloc(NULL, len + 1);
+                memcpy(s->name, name, len);
+                s->name[len] = '\0';
+                s->len = len;
+                s->hash = hash;
+                __atomic_fetch_add(&t->count, 1, __ATOMIC_RELAXED);
+                __atomic_store_n(&s->state, STATS_SLOT_READY, __ATOMIC_RELEASE);
+                return (int)i;
+            }
+            state = expected;
+        }
+        while (state == STATS_SLOT_WRITING)
+            state = __atomic_load_n(&s->state, __ATOMIC_ACQUIRE);
+        if (s->hash == hash && s->len == len && memcmp(s->name, name, len) == 0)
+            return (int)i;
+    }
+    return -1;
+}
+
+/* stats_topic_ready: 1 si la posición 'i' del registro tiene un topic publicado */
+static inline int stats_topic_ready(const StatsTopicTable *t, int i) {
+    return __atomic_load_n(&t->slots[i].state, __ATOMIC_ACQUIRE) == STATS_SLOT_READY;
+}
+
+/*
+ * stats_format
+ * - Escribe en 'out' (como mucho 'cap' bytes) la instantánea que se envía en
+ *   respuesta a STATS, sumando los 'n' BrokerStats. Es texto "clave valor",
+ *   una línea por dato, fácil de leer y de procesar con scripts; cada topic
+ *   ocupa una línea "topic <nombre> <entrada> <salida>". Devuelve los bytes
+ *   escritos.
+ */
+static inline size_t stats_format(char *out, size_t cap, BrokerStats *const *stats, int n,
+                                  const StatsTopicTable *topics) {
+    BrokerStats sum = { 0 };
+    static __thread LatencyHist merged, copy;
+    hist_reset(&merged);
+    for (int s = 0; s < n; s++) {
+        const BrokerStats *st = stats[s];
+        sum.msgs_in += hist_load(&st->msgs_in);
+        sum.bytes_in += hist_load(&st->bytes_in);
+        sum.msgs_out += hist_load(&st->msgs_out);
+        sum.bytes_out += hist_load(&st->bytes_out);
+        sum.drops += hist_load(&st->drops);
+        sum.disconnects += hist_load(&st->disconnects);
+        sum.conns += hist_load(&st->conns);
+        sum.subs += hist_load(&st->subs);
+        sum.nacks += hist_load(&st->nacks);
+        sum.retransmits += hist_load(&st->retransmits);
+        sum.leases_renewed += hist_load(&st->leases_renewed);
+        sum.leases_expired += hist_load(&st->leases_expired);
+        sum.subs_rejected += hist_load(&st->subs_rejected);
+        sum.mcast_out += hist_load(&st->mcast_out);
+        sum.fed_in += hist_load(&st->fed_in);
+        sum.fed_out += hist_load(&st->fed_out);
+        sum.fed_duplicates += hist_load(&st->fed_duplicates);
+        sum.last_values += hist_load(&st->last_values);
+        sum.conflated += hist_load(&st->conflated);
+        sum.read_deferred += hist_load(&st->read_deferred);
+        sum.rate_pauses += hist_load(&st->rate_pauses);
+        sum.log_dropped += hist_load(&st->log_dropped);
+        sum.heap_allocs += hist_load(&st->heap_allocs);
+        sum.syscalls += hist_load(&st->syscalls);
+        hist_snapshot(&copy, &st->fanout);
+        hist_merge(&merged, &copy);
+    }
+
+    size_t off = 0;
+#define STATS_APPEND(...)                                                   \
+    do {                                                                    \
+        if (off < cap) {                                                    \
+            int w = snprintf(out + off, cap - off, __VA_ARGS__);            \
+            off += w > 0 ? (size_t)w : 0;                                   \
+        }                                                                   \
+    } while (0)
+
+    STATS_APPEND("hilos %d\n", n);
+    STATS_APPEND("conexiones %llu\n", (unsigned long long)sum.conns);
+    STATS_APPEND("suscripciones %llu\n", (unsigned long long)sum.subs);
+    STATS_APPEND("mensajes_entrada %llu\n", (unsigned long long)sum.msgs_in);
+    STATS_APPEND("bytes_entrada %llu\n", (unsigned long long)sum.bytes_in);
+    STATS_APPEND("mensajes_salida %llu\n", (unsigned long long)sum.msgs_out);
+    STATS_APPEND("bytes_salida %llu\n", (unsigned long long)sum.bytes_out);
+    STATS_APPEND("descartes %llu\n", (unsigned long long)sum.drops);
+    STATS_APPEND("desconexiones_por_cola %llu\n", (unsigned long long)sum.disconnects);
+    STATS_APPEND("nacks %llu\n", (unsigned long long)sum.nacks);
+    STATS_APPEND("retransmisiones %llu\n", (unsigned long long)sum.retransmits);
+    STATS_APPEND("leases_renovados %llu\n", (unsigned long long)sum.leases_renewed);
+    STATS_APPEND("leases_vencidos %llu\n", (unsigned long long)sum.leases_expired);
+    STATS_APPEND("suscripciones_rechazadas %llu\n", (unsigned long long)sum.subs_rejected);
+    STATS_APPEND("envios_multicast %llu\n", (unsigned long long)sum.mcast_out);
+    STATS_APPEND("federacion_entrada %llu\n", (unsigned long long)sum.fed_in);
+    STATS_APPEND("federacion_salida %llu\n", (unsigned long long)sum.fed_out);
+    STATS_APPEND("federacion_duplicados %llu\n", (unsigned long long)sum.fed_duplicates);
+    STATS_APPEND("ultimos_valores_enviados %llu\n", (unsigned long long)sum.last_values);
+    STATS_APPEND("conflaciones %llu\n", (unsigned long long)sum.conflated);
+    STATS_APPEND("lecturas_aplazadas %llu\n", (unsigned long long)sum.read_deferred);
+    STATS_APPEND("pausas_por_ritmo %llu\n", (unsigned long long)sum.rate_pauses);
+    STATS_APPEND("log_descartados %llu\n", (unsigned long long)sum.log_dropped);
+    STATS_APPEND("reservas_heap %llu\n", (unsigned long long)sum.heap_allocs);
+    STATS_APPEND("llamadas_sistema %llu\n", (unsigned long long)sum.syscalls);
+    STATS_APPEND("fanout_muestras %llu\n", (unsigned long long)merged.total);
+    STATS_APPEND("fanout_us_p50 %.1f\n", hist_percentile(&merged, 0.50) / 1e3);
+    STATS_APPEND("fanout_us_p99 %.1f\n", hist_percentile(&merged, 0.99) / 1e3);
+    STATS_APPEND("fanout_us_p999 %.1f\n", hist_percentile(&merged, 0.999) / 1e3);
+    STATS_APPEND("fanout_us_max %.1f\n", merged.total ? merged.max / 1e3 : 0.0);
+
+    for (int i = 0; i < STATS_MAX_TOPICS; i++) {
+        if (!stats_topic_ready(topics, i))
+            continue;
+        uint64_t in = 0, sent = 0;
+        for (int s = 0; s < n; s++) {
+            in += hist_load(&stats[s]->topic_in[i]);
+            sent += hist_load(&stats[s]->topic_out[i]);
+        }
+        STATS_APPEND("topic %s %llu %llu\n", topics->slots[i].name, (unsigned long long)in,
+                     (unsigned long long)sent);
+    }
+#undef STATS_APPEND
+    return off < cap ? off : cap;
+}
+
+#endif /* STATS_H */
@@ -0,0 +1,151 @@
+/*
+ * timer_wheel.h
+ *
+ * Rueda de temporizadores jerárquica. El tiempo avanza en ticks fijos y cada
+ * temporizador cuelga de una lista doblemente enlazada en la ranura del
+ * tick en que vence, así que armarlo, cancelarlo y dispararlo cuesta O(1)
+ * sin importar cuántos haya pendientes: en cada tick sólo se mira una
+ * ranura, no todos los temporizadores.
+ *
+ * Hay TIMER_LEVELS ruedas de TIMER_SLOTS ranuras. El nivel 0 tiene una
+ * ranura por tick; cada ranura del nivel k abarca TIMER_SLOTS^k ticks. Un
+ * temporizador lejano se guarda en el nivel que le corresponde y, cuando la
+ * rueda de abajo da la vuelta, su ranura se "cascadea": sus temporizadores
+ * se vuelven a repartir en los niveles inferiores. Cada temporizador baja
+ * como mucho TIMER_LEVELS - 1 veces, así que el coste amortizado sigue
+ * siendo O(1).
+ *
+ * Los temporizadores son intrusivos: el TimerNode va dentro de la estructura
+ * del usuario, que recupera la suya desde el nodo en la función de disparo.
+ * La rueda no reserva memoria.
+ */
+
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TIMER_SLOTS_BITS 6
+#define TIMER_SLOTS (1u << TIMER_SLOTS_BITS)
+#define TIMER_LEVELS 4   /* con ticks de 50 ms el último nivel llega a ~9 días */
+
+typedef struct TimerNode {
+    struct TimerNode *next, *prev; /* NULL si no está armado */
+    uint64_t expires;              /* tick de vencimiento */
+    void (*fire)(struct TimerNode *node, void *arg);
+} TimerNode;
+
+typedef struct {
+    uint64_t tick_ns;
+    uint64_t now;                               /* último tick procesado */
+    size_t count;                               /* temporizadores armados */
+    TimerNode slots[TIMER_LEVELS][TIMER_SLOTS]; /* cabeceras de lista circular */
+} TimerWheel;
+
+static inline void timer_wheel_init(TimerWheel *w, uint64_t tick_ns, uint64_t now_ns) {
+    w->tick_ns = tick_ns;
+    w->now = now_ns / tick_ns;
+    w->count = 0;
+    for (int l = 0; l < TIMER_LEVELS; l++)
+        for (unsigned s = 0; s < TIMER_SLOTS; s++)
+            w->slots[l][s].next = w->slots[l][s].prev = &w->slots[l][s];
+}
+
+static inline int timer_armed(const TimerNode *n) {
+    return n->next != NULL;
+}
+
+/* timer_link: cuelga el nodo de la ranura que corresponde a su tick */
+static inline void timer_link(TimerWheel *w, TimerNode *n) {
+    uint64_t delta = n->expires - w->now;
+    int level = 0;
+    while (level < TIMER_LEVELS - 1 && delta >= (uint64_t)1 << (TIMER_SLOTS_BITS * (level + 1)))
+        level++;
+    uint64_t tick = n->expires;
+    if (level == TIMER_LEVELS - 1 && delta >> (TIMER_SLOTS_BITS * TIMER_LEVELS))
+        tick = w->now + ((uint64_t)1 << (TIMER_SLOTS_BITS * TIMER_LEVELS)) - 1; /* más allá: al tope */
+    TimerNode *head = &w->slots[level][(tick >> (TIMER_SLOTS_BITS * level)) & (TIMER_SLOTS - 1)];
+    n->prev = head->prev;
+    n->next = head;
+    head->prev->next = n;
+    head->prev = n;
+}
+
+static inline void timer_unlink(TimerNode *n) {
+    n->prev->next = n->next;
+    n->next->prev = n->prev;
+    n->next = n->prev = NULL;
+}
+
+/*
+ * timer_add
+ * - Arma el temporizador para que venza en el primer tick a partir de
+ *   'expires_ns'. Uno ya vencido se dispara en el siguiente tick.
+ */
+static inline void timer_add(TimerWheel *w, TimerNode *n, uint64_t expires_ns) {
+    n->expires = (expires_ns + w->tick_ns - 1) / w->tick_ns;
+    if (n->expires <= w->now)
+        n->expires = w->now + 1;
+    timer_link(w, n);
+    w->count++;
+}
+
+/* timer_del: desarma el temporizador si estaba armado */
+static inline void timer_del(TimerWheel *w, TimerNode *n) {
+    if (!timer_armed(n))
+        return;
+    timer_unlink(n);
+    w->count--;
+}
+
+/* timer_cascade: reparte la ranura actual del nivel 'level' en los de abajo */
+static inline void timer_cascade(TimerWheel *w, int level) {
+    TimerNode *head = &w->slots[level][(w->now >> (TIMER_SLOTS_BITS * level)) & (TIMER_SLOTS - 1)];
+    TimerNode *n = head->next;
+    head->next = head->prev = head;
+    while (n != head) {
+        TimerNode *next = n->next;
+        timer_link(w, n);
+        n = next;
+    }
+}
+
+/*
+ * timer_wheel_advance
+ * - Procesa todos los ticks hasta 'now_ns' y llama a fire(node, arg) por
+ *   cada temporizador vencido, ya desarmado. La función puede volver a
+ *   armarlo o armar otros: los nuevos vencen como pronto en el tick
+ *   siguiente. Devuelve cuántos se dispararon.
+ */
+static inline size_t timer_wheel_advance(TimerWheel *w, uint64_t now_ns, void *arg) {
+    uint64_t target = now_ns / w->tick_ns;
+    size_t fired = 0;
+    while (w->now < target) {
+        w->now++;
+        for (int level = 1; level < TIMER_LEVELS; level++) {
+            if ((w->now & (((uint64_t)1 << (TIMER_SLOTS_BITS * level)) - 1)) != 0)
+                break;
+            timer_cascade(w, level);
+        }
+
+        /* Soltar la ranura entera antes de disparar, por si se rearman */
+        TimerNode *head = &w->slots[0][w->now & (TIMER_SLOTS - 1)];
+        TimerNode pending = { .next = head->next, .prev = head->prev };
+        if (pending.next == head)
+            continue;
+        pending.next->prev = &pending;
+        pending.prev->next = &pending;
+        head->next = head->prev = head;
+        while (pending.next != &pending) {
+            TimerNode *n = pending.next;
+            timer_unlink(n);
+            w->count--;
+            n->fire(n, arg);
+            fired++;
+        }
+    }
+    return fired;
+}
+
+#endif /* TIMER_WHEEL_H */
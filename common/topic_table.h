@@ -0,0 +1,208 @@
+/*
+ * topic_table.h
+ *
+ * Registro de topics compartido por los brokers TCP y UDP. Cada topic se
+ * interna una sola vez: recibe un id numérico estable y guarda el hash de su
+ * nombre, calculado al crearlo. La tabla usa direccionamiento abierto con
+ * sondeo lineal, así que buscar un topic cuesta O(1) en promedio,
+ * independientemente de cuántos topics o suscripciones existan.
+ *
+ * Cada Topic es dueño de su propia lista de suscriptores. El tipo de los
+ * elementos lo decide cada broker (un descriptor en TCP, una sockaddr_in en
+ * UDP), por eso la lista se maneja como un arreglo de bytes con el tamaño de
+ * elemento indicado en cada llamada.
+ *
+ * Es una biblioteca sólo de cabecera: basta con incluirla desde el .c del
+ * broker, sin añadir archivos a la línea de compilación.
+ */
+
+#ifndef TOPIC_TABLE_H
+#define TOPIC_TABLE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TOPIC_TABLE_INITIAL 64 /* potencia de dos */
+
+typedef struct {
+    uint32_t id;         /* id interno, índice en TopicTable.by_id */
+    uint32_t hash;       /* hash del nombre precalculado */
+    size_t len;          /* longitud del nombre sin el nulo */
+    char *name;          /* copia propia del nombre, terminada en nulo */
+    void *subs;          /* arreglo de suscriptores (tipo definido por el broker) */
+    size_t sub_count;
+    size_t sub_capacity;
+} Topic;
+
+typedef struct {
+    Topic **slots;       /* tabla hash, NULL = hueco libre */
+    size_t capacity;     /* siempre potencia de dos */
+    size_t count;
+    Topic **by_id;       /* acceso directo por id interno */
+    size_t id_capacity;
+} TopicTable;
+
+/* topic_alloc: malloc/realloc que terminan el programa si no hay memoria */
+static inline void *topic_alloc(void *ptr, size_t size) {
+    void *p = realloc(ptr, size);
+    if (!p) {
+        perror("Error reservando memoria");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+/* topic_hash: FNV-1a de 32 bits sobre los 'len' bytes del nombre */
+static inline uint32_t topic_hash(const char *name, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/*
+ * topic_find
+ * - Busca un topic con el hash ya calculado. Sólo compara nombres cuando
+ *   coinciden hash y longitud. Devuelve NULL si el topic no existe.
+ */
+static inline Topic *topic_find(const TopicTable *t, const char *name, size_t len, uint32_t hash) {
+    if (t->capacity == 0)
+        return NULL;
+    size_t mask = t->capacity - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        Topic *topic = t->slots[i];
+        if (!topic)
+            return NULL;
+        if (topic->hash == hash && topic->len == len && memcmp(topic->name, name, len) == 0)
+            return topic;
+    }
+}
+
+static inline Topic *topic_lookup(const TopicTable *t, const char *name) {
+    size_t len = strlen(name);
+    return topic_find(t, name, len, topic_hash(name, len));
+}
+
+/* topic_rehash: duplica la tabla cuando supera el 50% de ocupación */
+static inline void topic_rehash(TopicTable *t) {
+    size_t new_capacity = t->capacity ? t->capacity * 2 : TOPIC_TABLE_INITIAL;
+    Topic **slots = calloc(new_capacity, sizeof(Topic *));
+    if (!slots) {
+        perror("Error reservando memoria");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < t->capacity; i++) {
+        Topic *topic = t->slots[i];
+        if (!topic)
+            continue;
+        size_t j = topic->hash & (new_capacity - 1);
+        while (slots[j])
+            j = (j + 1) & (new_capacity - 1);
+        slots[j] = topic;
+    }
+    free(t->slots);
+    t->slots = slots;
+    t->capacity = new_capacity;
+}
+
+/*
+ * topic_intern
+ * - Devuelve el topic con ese nombre, creándolo si no existe. Los ids se
+ *   asignan en orden de creación y nunca se reutilizan.
+ */
+static inline Topic *topic_intern(TopicTable *t, const char *name, size_t len) {
+    uint32_t hash = topic_hash(name, len);
+    Topic *topic = topic_find(t, name, len, hash);
+    if (topic)
+        return topic;
+
+    if ((t->count + 1) * 2 > t->capacity)
+        topic_rehash(t);
+
+    topic = calloc(1, sizeof(Topic));
+    if (!topic) {
+        perror("Error reservando memoria");
+        exit(EXIT_FAILURE);
+    }
+    topic->name = topic_alloc(NULL, len + 1);
+    memcpy(topic->name, name, len);
+    topic->name[len] = '\0';
+    topic->len = len;
+    topic->hash = hash;
+    topic->id = (uint32_t)t->count;
+
+    size_t mask = t->capacity - 1;
+    size_t i = hash & mask;
+    while (t->slots[i])
+        i = (i + 1) & mask;
+    t->slots[i] = topic;
+
+    if (t->count == t->id_capacity) {
+        t->id_capacity = t->id_capacity ? t->id_capacity * 2 : TOPIC_TABLE_INITIAL;
+        t->by_id = topic_alloc(t->by_id, t->id_capacity * sizeof(Topic *));
+    }
+    t->by_id[t->count++] = topic;
+    return topic;
+}
+
+static inline Topic *topic_by_id(const TopicTable *t, uint32_t id) {
+    return id < t->count ? t->by_id[id] : NULL;
+}
+
+/*
+ * topic_parse_command
+ * - Si 'cmd' (de 'len' bytes, sin nulo final) empieza por 'keyword' seguido
+ *   de un topic, deja en *topic / *topic_len el nombre sin copiarlo y
+ *   devuelve 1. El topic termina en el primer espacio o salto de línea, así
+ *   que su longitud sólo está limitada por la del comando.
+ */
+static inline int topic_parse_command(const char *cmd, size_t len, const char *keyword,
+                                      const char **topic, size_t *topic_len) {
+    size_t kw_len = strlen(keyword);
+    if (len <= kw_len || memcmp(cmd, keyword, kw_len) != 0 || (cmd[kw_len] != ' ' && cmd[kw_len] != '\t'))
+        return 0;
+
+    size_t i = kw_len;
+    while (i < len && (cmd[i] == ' ' || cmd[i] == '\t'))
+        i++;
+    size_t start = i;
+    while (i < len && cmd[i] != ' ' && cmd[i] != '\t' && cmd[i] != '\r' && cmd[i] != '\n')
+        i++;
+    if (i == start)
+        return 0;
+    *topic = cmd + start;
+    *topic_len = i - start;
+    return 1;
+}
+
+/*
+ * topic_sub_append
+ * - Añade un suscriptor (copiando 'elem_size' bytes) a la lista del topic y
+ *   devuelve su posición en ella.
+ */
+static inline size_t topic_sub_append(Topic *topic, const void *elem, size_t elem_size) {
+    if (topic->sub_count == topic->sub_capacity) {
+        topic->sub_capacity = topic->sub_capacity ? topic->sub_capacity * 2 : 4;
+        topic->subs = topic_alloc(topic->subs, topic->sub_capacity * elem_size);
+    }
+    memcpy((char *)topic->subs + topic->sub_count * elem_size, elem, elem_size);
+    return topic->sub_count++;
+}
+
+/*
+ * topic_sub_remove
+ * - Quita el suscriptor de la posición 'pos' moviendo el último a su sitio,
+ *   en O(1). Si el movido guarda su posición en otro sitio, el llamador
+ *   debe actualizarla (su nueva posición es 'pos').
+ */
+static inline void topic_sub_remove(Topic *topic, size_t pos, size_t elem_size) {
+    size_t last = --topic->sub_count;
+    if (pos != last)
+        memcpy((char *)topic->subs + pos * elem_size, (char *)topic->subs + last * elem_size, elem_size);
+}
+
+#endif /* TOPIC_TABLE_H */
@@ -0,0 +1,394 @@
+/*
+ * topic_trie.h
+ *
+ * Árbol de suscripciones para topics jerárquicos al estilo MQTT. Un topic
+ * se divide en niveles separados por '/' ("liga/partido1/goles") y cada
+ * suscripción es un filtro que, además de niveles literales, puede usar dos
+ * comodines:
+ *   - '+' ocupa exactamente un nivel    ("liga/+/goles")
+ *   - '#' ocupa cero o más niveles y sólo puede ir al final ("liga/#")
+ *
+ * Cada nivel de un filtro es un nodo del árbol. Los hijos literales de un
+ * nodo están en una pequeña tabla hash (el mismo FNV-1a que topic_table.h) y
+ * los hijos '+' y '#' tienen un puntero propio. Para casar un topic se baja
+ * nivel a nivel siguiendo el hijo literal y el hijo '+', y en cada nodo
+ * visitado se recoge el hijo '#'. El coste depende de la profundidad del
+ * topic y de cuántos comodines coincidan, no del número de suscripciones.
+ *
+ * Los suscriptores de un nodo forman una lista intrusiva: el broker incrusta
+ * un TrieSub al principio de su propia estructura de suscripción, de modo
+ * que darla de alta o de baja es O(1) y no hay arreglos que desplazar. Al
+ * quitar la última suscripción de un nodo sin hijos, el nodo se libera junto
+ * con los ancestros que queden vacíos.
+ */
+
+#ifndef TOPIC_TRIE_H
+#define TOPIC_TRIE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "topic_table.h"
+
+#define TRIE_MAX_LEVELS 32 /* niveles como máximo en un filtro de suscripción */
+
+struct TrieNode;
+
+/* Enlace intrusivo de una suscripción en la lista de su nodo */
+typedef struct TrieSub {
+    struct TrieSub *prev;
+    struct TrieSub *next;
+    struct TrieNode *node;
+} TrieSub;
+
+typedef struct TrieNode {
+    char *level;               /* nombre del nivel (copia propia, con nulo) */
+    size_t level_len;
+    uint32_t hash;             /* hash del nivel precalculado */
+    struct TrieNode *parent;
+    struct TrieNode **children; /* hijos literales, direccionamiento abierto */
+    size_t child_capacity;     /* potencia de dos, 0 si no hay hijos */
+    size_t child_count;
+    struct TrieNode *plus;     /* hijo '+' */
+    struct TrieNode *multi;    /* hijo '#' */
+    TrieSub *subs;             /* suscripciones cuyo filtro termina aquí */
+    size_t sub_count;
+} TrieNode;
+
+typedef struct {
+    TrieNode root;
+    size_t node_count;
+} TopicTrie;
+
+/* trie_visit_fn: se llama una vez por cada nodo cuyo filtro casa con el topic */
+typedef void (*trie_visit_fn)(TrieNode *node, void *ctx);
+
+static inline TrieNode *trie_child(const TrieNode *node, const char *level, size_t len, uint32_t hash) {
+    if (node->child_capacity == 0)
+        return NULL;
+    size_t mask = node->child_capacity - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        TrieNode *c = node->children[i];
+        if (!c)
+            return NULL;
+        if (c->hash == hash && c->level_len == len && memcmp(c->level, level, len) == 0)
+            return c;
+    }
+}
+
+/* trie_rehash_children: duplica la tabla de hijos al superar el 50% */
+static inline void trie_rehash_children(TrieNode *node) {
+    size_t capacity = node->child_capacity ? node->child_capacity * 2 : 4;
+    TrieNode **children = calloc(capacity, sizeof(TrieNode *));
+    if (!children) {
+        perror("Error reservando memoria");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < node->child_capacity; i++) {
+        TrieNode *c = node->children[i];
+        if (!c)
+            continue;
+        size_t j = c->hash & (capacity - 1);
+        while (children[j])
+            j = (j + 1) & (capacity - 1);
+        children[j] = c;
+    }
+    free(node->children);
+    node->children = children;
+    node->child_capacity = capacity;
+}
+
+static inline TrieNode *trie_node_new(TopicTrie *trie, TrieNode *parent, const char *level, size_t len,
+                                      uint32_t hash) {
+    TrieNode *node = calloc(1, sizeof(TrieNode));
+    if (!node) {
+        perror("Error reservando memoria");
+        exit(EXIT_FAILURE);
+    }
+    node->level = topic_alloc(NULL, len + 1);
+    memcpy(node->level, level, len);
+    node->level[len] = '\0';
+    node->level_len = len;
+    node->hash = hash;
+    node->parent = parent;
+    trie->node_count++;
+    return node;
+}
+
+/* trie_add_level: devuelve el hijo de 'node' para un nivel del filtro, creándolo si falta */
+static inline TrieNode *trie_add_level(TopicTrie *trie, TrieNode *node, const char *level, size_t len) {
+    if (len == 1 && level[0] == '+') {
+        if (!node->plus)
+            node->plus = trie_node_new(trie, node, level, len, 0);
+        return node->plus;
+    }
+    if (len == 1 && level[0] == '#') {
+        if (!node->multi)
+            node->multi = trie_node_new(trie, node, level, len, 0);
+        return node->multi;
+    }
+
+    uint32_t hash = topic_hash(level, len);
+    TrieNode *c = trie_child(node, level, len, hash);
+    if (c)
+        return c;
+    if ((node->child_count + 1) * 2 > node->child_capacity)
+        trie_rehash_children(node);
+    c = trie_node_new(trie, node, level, len, hash);
+    size_t mask = node->child_capacity - 1;
+    size_t i = hash & mask;
+    while (node->children[i])
+        i = (i + 1) & mask;
+    node->children[i] = c;
+    node->child_count++;
+    return c;
+}
+
+/*
+ * trie_filter_valid
+ * - Comprueba que un filtro de suscripción esté bien formado: '+' y '#'
+ *   deben ocupar un nivel completo, '#' sólo puede ser el último nivel y no
+ *   puede haber más de TRIE_MAX_LEVELS niveles.
+ */
+static inline int trie_filter_valid(const char *filter, size_t len) {
+    size_t levels = 1, start = 0;
+    for (size_t i = 0; i <= len; i++) {
+        if (i < len && filter[i] != '/')
+            continue;
+        size_t level_len = i - start;
+        for (size_t j = start; j < i; j++) {
+            if ((filter[j] == '+' || filter[j] == '#') && level_len != 1)
+                return 0;
+        }
+        if (level_len == 1 && filter[start] == '#' && i != len)
+            return 0;
+        if (i < len && ++levels > TRIE_MAX_LEVELS)
+            return 0;
+        start = i + 1;
+    }
+    return 1;
+}
+
+/* trie_topic_valid: un topic publicado no puede contener comodines */
+static inline int trie_topic_valid(const char *topic, size_t len) {
+    return !memchr(topic, '+', len) && !memchr(topic, '#', len);
+}
+
+/*
+ * trie_filter_matches
+ * - Dice si un topic casa con un filtro sin pasar por el árbol, con las
+ *   mismas reglas que trie_match(). Sirve para recorrer topics ya conocidos
+ *   cuando aparece un filtro nuevo.
+ */
+static inline int trie_filter_matches(const char *filter, size_t filter_len, const char *topic, size_t topic_len) {
+    const char *f = filter, *f_end = filter + filter_len;
+    const char *t = topic, *t_end = topic + topic_len;
+    while (1) {
+        const char *f_slash = memchr(f, '/', f_end - f);
+        size_t f_len = f_slash ? (size_t)(f_slash - f) : (size_t)(f_end - f);
+        if (f_len == 1 && f[0] == '#')
+            return 1;
+        if (!t)
+            return 0; // el topic se acabó antes que el filtro
+        const char *t_slash = memchr(t, '/', t_end - t);
+        size_t t_len = t_slash ? (size_t)(t_slash - t) : (size_t)(t_end - t);
+        if (!(f_len == 1 && f[0] == '+') && (f_len != t_len || memcmp(f, t, f_len) != 0))
+            return 0;
+        t = t_slash ? t_slash + 1 : NULL;
+        if (!f_slash)
+            return t == NULL;
+        f = f_slash + 1;
+    }
+}
+
+/*
+ * trie_insert
+ * - Devuelve el nodo del filtro (ya validado con trie_filter_valid),
+ *   creando los niveles que falten.
+ */
+static inline TrieNode *trie_insert(TopicTrie *trie, const char *filter, size_t len) {
+    TrieNode *node = &trie->root;
+    const char *p = filter, *end = filter + len;
+    while (1) {
+        const char *slash = memchr(p, '/', end - p);
+        size_t level_len = slash ? (size_t)(slash - p) : (size_t)(end - p);
+        node = trie_add_level(trie, node, p, level_len);
+        if (!slash)
+            return node;
+        p = slash + 1;
+    }
+}
+
+/*
+ * trie_find
+ * - Devuelve el nodo de un filtro tal cual está escrito (los comodines se
+ *   comparan como niveles, no se expanden), o NULL si no existe.
+ */
+static inline TrieNode *trie_find(TopicTrie *trie, const char *filter, size_t len) {
+    TrieNode *node = &trie->root;
+    const char *p = filter, *end = filter + len;
+    while (node) {
+        const char *slash = memchr(p, '/', end - p);
+        size_t level_len = slash ? (size_t)(slash - p) : (size_t)(end - p);
+        if (level_len == 1 && p[0] == '+')
+            node = node->plus;
+        else if (level_len == 1 && p[0] == '#')
+            node = node->multi;
+        else
+            node = trie_child(node, p, level_len, topic_hash(p, level_len));
+        if (!slash)
+            return node;
+        p = slash + 1;
+    }
+    return NULL;
+}
+
+/*
+ * trie_remove_child
+ * - Quita 'c' de la tabla de hijos de su padre. Con sondeo lineal no basta
+ *   con vaciar el hueco: los hijos que vienen detrás en la misma secuencia
+ *   se recolocan para que las búsquedas sigan encontrándolos.
+ */
+static inline void trie_remove_child(TrieNode *parent, TrieNode *c) {
+    if (parent->plus == c) {
+        parent->plus = NULL;
+        return;
+    }
+    if (parent->multi == c) {
+        parent->multi = NULL;
+        return;
+    }
+    size_t mask = parent->child_capacity - 1;
+    size_t i = c->hash & mask;
+    while (parent->children[i] != c)
+        i = (i + 1) & mask;
+    parent->children[i] = NULL;
+    parent->child_count--;
+    for (size_t j = (i + 1) & mask; parent->children[j]; j = (j + 1) & mask) {
+        TrieNode *moved = parent->children[j];
+        parent->children[j] = NULL;
+        size_t k = moved->hash & mask;
+        while (parent->children[k])
+            k = (k + 1) & mask;
+        parent->children[k] = moved;
+    }
+}
+
+/* trie_prune: libera 'node' y sus ancestros mientras queden sin hijos ni suscripciones */
+static inline void trie_prune(TopicTrie *trie, TrieNode *node) {
+    while (node != &trie->root && node->sub_count == 0 && node->child_count == 0 &&
+           !node->plus && !node->multi) {
+        TrieNode *parent = node->parent;
+        trie_remove_child(parent, node);
+        free(node->children);
+        free(node->level);
+        free(node);
+        trie->node_count--;
+        node = parent;
+    }
+}
+
+/*
+ * trie_match_from
+ * - 'level' apunta al siguiente nivel del topic por consumir, o es NULL si
+ *   ya se consumieron todos. '#' también casa con cero niveles, así que
+ *   "liga/#" recibe "liga" además de "liga/partido1".
+ */
+static inline void trie_match_from(TrieNode *node, const char *level, const char *end,
+                                   trie_visit_fn visit, void *ctx) {
+    if (node->multi)
+        visit(node->multi, ctx);
+    if (!level) {
+        visit(node, ctx);
+        return;
+    }
+
+    const char *slash = memchr(level, '/', end - level);
+    size_t len = slash ? (size_t)(slash - level) : (size_t)(end - level);
+    const char *next = slash ? slash + 1 : NULL;
+
+    TrieNode *c = trie_child(node, level, len, topic_hash(level, len));
+    if (c)
+        trie_match_from(c, next, end, visit, ctx);
+    if (node->plus)
+        trie_match_from(node->plus, next, end, visit, ctx);
+}
+
+/*
+ * trie_match
+ * - Llama a 'visit' con cada nodo cuyo filtro casa con 'topic'. Un mismo
+ *   suscriptor puede estar en varios de esos nodos ("liga/+" y "liga/#"):
+ *   evitar entregas repetidas es cosa del llamador.
+ */
+static inline void trie_match(TopicTrie *trie, const char *topic, size_t len, trie_visit_fn visit, void *ctx) {
+    trie_match_from(&trie->root, topic, topic + len, visit, ctx);
+}
+
+/* trie_walk: llama a 'visit' con cada nodo del subárbol de 'node' que tiene suscripciones */
+static inline void trie_walk(TrieNode *node, trie_visit_fn visit, void *ctx) {
+    if (node->subs)
+        visit(node, ctx);
+    for (size_t i = 0; i < node->child_capacity; i++)
+        if (node->children[i])
+            trie_walk(node->children[i], visit, ctx);
+    if (node->plus)
+        trie_walk(node->plus, visit, ctx);
+    if (node->multi)
+        trie_walk(node->multi, visit, ctx);
+}
+
+/*
+ * trie_node_filter
+ * - Escribe en 'buf' el filtro que termina en 'node' ("liga/+/goles"),
+ *   terminado en nulo, si cabe en 'cap' bytes. Como snprintf(), devuelve
+ *   siempre la longitud completa (sin el nulo): con cap 0 sólo la calcula.
+ */
+static inline size_t trie_node_filter(const TrieNode *node, char *buf, size_t cap) {
+    size_t len = 0;
+    for (const TrieNode *n = node; n->parent; n = n->parent)
+        len += n->level_len + (n->parent->parent ? 1 : 0);
+    if (len + 1 > cap)
+        return len;
+    size_t end = len;
+    buf[end] = '\0';
+    for (const TrieNode *n = node; n->parent; n = n->parent) {
+        end -= n->level_len;
+        memcpy(buf + end, n->level, n->level_len);
+        if (n->parent->parent)
+            buf[--end] = '/';
+    }
+    return len;
+}
+
+/* trie_sub_link: enlaza una suscripción al principio de la lista del nodo */
+static inline void trie_sub_link(TrieNode *node, TrieSub *sub) {
+    sub->node = node;
+    sub->prev = NULL;
+    sub->next = node->subs;
+    if (node->subs)
+        node->subs->prev = sub;
+    node->subs = sub;
+    node->sub_count++;
+}
+
+/*
+ * trie_sub_unlink
+ * - Desenlaza una suscripción de su nodo en O(1) y poda las ramas que
+ *   queden vacías. La memoria de 'sub' sigue siendo del llamador.
+ */
+static inline void trie_sub_unlink(TopicTrie *trie, TrieSub *sub) {
+    TrieNode *node = sub->node;
+    if (sub->prev)
+        sub->prev->next = sub->next;
+    else
+        node->subs = sub->next;
+    if (sub->next)
+        sub->next->prev = sub->prev;
+    node->sub_count--;
+    sub->node = NULL;
+    trie_prune(trie, node);
+}
+
+#endif /* TOPIC_TRIE_H */